@@ -1,21 +1,174 @@
 #ifndef BP_WP_H
 #define BP_WP_H
 
+#include "dbg/cond.h"
+#include "dbg/trace.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+// number of usable bvr/bcr pairs on apple silicon
+#define BP_HW_SLOTS 6
+
+// brk #0
+#define BP_BRK_INSN 0xd4200000U
+
+typedef enum {
+  BP_SOFTWARE, // brk written over the original instruction
+  BP_HARDWARE, // bvr/bcr pair, used when the text can't be written
+} bp_kind_t;
+
+// run by the listener on every hit of a hook breakpoint, before any
+// condition, regs are the thread's at the breakpoint, the table isn't
+// locked while it runs
+typedef void (*bp_hook_fn)(uint64_t thread, const target_regs_t *regs);
+
+// breakpoint_t
+// - index     - stable id shown by br list and accepted by br delete, -1
+//               for coverage and hook breakpoints nobody else asked for
+// - addr      - absolute address in the target (slide already applied)
+// - kind      - software or hardware
+// - orig_insn - software only, the instruction the brk replaced
+// - hw_slot   - hardware only, the bvr/bcr index in use
+// - cond      - optional condition, NULL stops on every hit
+// - trace     - tracepoint, record and continue instead of stopping
+// - hits      - times the breakpoint was reached, condition true or not
+// - stops     - times it actually stopped the process
+// - oneshot   - coverage breakpoint, no index, removed on its first hit
+// - hook      - the debugger's own, never stops by itself and outlives a
+//               user breakpoint at the same address
 typedef struct {
- int index;
- uint64_t addr;
+  int index;
+  uint64_t addr;
+  bp_kind_t kind;
+  uint32_t orig_insn;
+  int hw_slot;
+  cond_t *cond;
+  trace_spec_t *trace;
+  uint64_t hits;
+  uint64_t stops;
+  bool oneshot;
+  bp_hook_fn hook;
 } breakpoint_t;
 
-// TODO: watchpoints
-static breakpoint_t *breakpoints = NULL;
-static size_t bp_count = 0;
-static size_t bp_capacity = 0;
+// number of usable wvr/wcr pairs on apple silicon
+#define WP_HW_SLOTS 4
+#define WP_MAX 32
+
+typedef enum {
+  WP_READ = 1,
+  WP_WRITE = 2,
+  WP_RW = 3,
+} wp_access_t;
+
+typedef enum {
+  WP_HARDWARE, // range split over wvr/wcr pairs
+  WP_PAGE,     // too big for the hardware, pages protected instead
+} wp_kind_t;
+
+// one wvr/wcr pair, addr is doubleword aligned, bas picks bytes inside it
+// or mask watches an aligned 2^mask block
+typedef struct {
+  int slot;
+  uint64_t addr;
+  uint32_t bas;
+  uint32_t mask;
+} wp_slot_t;
+
+// watchpoint_t
+// - index     - stable id shown by wp list and accepted by wp delete
+// - addr/len  - watched range, absolute
+// - access    - which accesses are reported
+// - kind      - hardware or page protection
+// - hw        - hardware only, the slots the range was split over
+// - page_prot - page only, original protection of each page in
+//               [page_start, page_end)
+// - hits      - times it stopped the process
+typedef struct {
+  int index;
+  uint64_t addr;
+  uint64_t len;
+  wp_access_t access;
+  wp_kind_t kind;
+  wp_slot_t hw[WP_HW_SLOTS];
+  int nslots;
+  uint64_t page_start;
+  uint64_t page_end;
+  int *page_prot;
+  uint64_t hits;
+} watchpoint_t;
 
 int add_breakpoint(uint64_t addr);
+// install many at once, software breakpoints go out in one write session,
+// addresses are absolute, returns how many were installed
+size_t add_breakpoints(const uint64_t *addrs, size_t count);
+// coverage breakpoints, same batching, hidden from br list, each removes
+// itself on its first hit, remove_oneshot drops whatever is left
+size_t add_oneshot_breakpoints(const uint64_t *addrs, size_t count);
+size_t remove_oneshot_breakpoints(void);
+// hook breakpoints, addr is absolute, hidden from br list, the thread
+// carries on after the hook unless a user breakpoint there says otherwise
+int add_hook_breakpoint(uint64_t addr, bp_hook_fn hook);
+int remove_hook_breakpoint(uint64_t addr);
 int remove_breakpoint_by_addr(uint64_t addr);
 int remove_breakpoint_at_index(size_t idx);
 void list_breakpoints(void);
+size_t breakpoint_count(void);
+
+// O(1) lookup by absolute address, copies the entry into out
+bool find_breakpoint(uint64_t addr, breakpoint_t *out);
+
+// put the original instruction back over every software breakpoint in a
+// buffer read from [addr, addr + size) of the target, so listings and the
+// indexer see the code and not brk #0, addr is absolute
+void breakpoint_mask(uint64_t addr, void *buf, size_t size);
+
+// compile expr and attach it to breakpoint idx, NULL removes the condition
+int set_breakpoint_condition(size_t idx, const char *expr);
+
+// turn breakpoint idx into a tracepoint capturing spec, NULL makes it an
+// ordinary breakpoint again
+int set_breakpoint_trace(size_t idx, const trace_spec_t *spec);
+
+// called by the exception listener when thread traps at addr, counts the
+// hit, evaluates the condition and records tracepoints right there
+// returns -1 if there is no breakpoint at addr, 0 if the thread should just
+// carry on (condition false or traced), 1 if we should stop
+int breakpoint_hit(uint64_t addr, uint64_t thread, const target_regs_t *regs,
+                   breakpoint_t *out);
+
+// watchpoints, addr is slid like add_breakpoint
+int add_watchpoint(uint64_t addr, uint64_t len, wp_access_t access);
+int remove_watchpoint_by_addr(uint64_t addr);
+int remove_watchpoint_at_index(size_t idx);
+void list_watchpoints(void);
+
+// called by the exception listener for a hardware watchpoint trap (hw) or
+// a protection fault at fault_addr, write says whether it was a store
+// returns -1 if no watchpoint explains it, 0 if it was a fault on a
+// protected page outside the watched range and the thread should carry on,
+// 1 if we should stop, either way step_over_begin then steps past it
+int watchpoint_hit(uint64_t thread, uint64_t fault_addr, bool write, bool hw,
+                   watchpoint_t *out);
+
+// stepping over a breakpoint or watchpoint
+// before resuming a thread stopped on a brk, the original instruction is
+// put back (or the hardware slot cleared) and the thread single steps it,
+// the step exception then re-inserts the brk, a thread stopped by a
+// watchpoint has the watchpoint disarmed for that one step instead
+// - begin: called before resume with the stopped thread and its pc,
+//   user_step means the user asked for a step and wants to stop after it,
+//   returns 1 if another thread is mid step over and this one must wait
+// - defer: called by the listener when begin returned 1, parks the thread
+//   until the active step over ends and it is the thread's turn, returns
+//   1 if it already ended and begin should be tried again, -1 if the
+//   thread could not be parked
+// - release: resume every parked thread, on detach
+// - end: called from the exception handler, returns true if the exception
+//   was our re-insert step and should be swallowed without stopping
+int breakpoint_step_over_begin(uint64_t thread, uint64_t pc, bool user_step);
+int breakpoint_step_over_defer(uint64_t thread, uint64_t pc, bool user_step);
+void breakpoint_step_over_release(void);
+bool breakpoint_step_over_end(uint64_t thread);
 
 #endif
@@ -0,0 +1,49 @@
+#ifndef COND_H
+#define COND_H
+
+#include "target/coalesce.h"
+#include "target/target.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// breakpoint conditions
+// an expression like `x0 == 0x41 && [sp+8] > 100` is compiled once into a
+// small stack bytecode, evaluating it on the exception listener is then a
+// tight loop over a few bytes with no allocation and no parsing
+//
+// syntax, with c precedence and unsigned 64 bit arithmetic
+// - numbers: decimal or 0x hex
+// - registers: x0-x30, fp, lr, sp, pc, cpsr
+// - memory: [expr] reads 64 bits from the target
+// - unary: ! ~ -
+// - binary: * + - << >> < <= > >= == != & ^ | && ||
+
+#define COND_MAX_CODE 256
+#define COND_MAX_STACK 32
+#define COND_MAX_SOURCE 128
+
+// register numbering shared with tracepoints, x0-x28 are 0-28 then fp, lr,
+// sp, pc, cpsr
+#define COND_REG_COUNT 34
+
+typedef struct {
+  uint8_t code[COND_MAX_CODE];
+  uint16_t len;
+  char source[COND_MAX_SOURCE];
+} cond_t;
+
+// compile src, on failure returns NULL and writes a message into err
+cond_t *cond_compile(const char *src, char *err, size_t err_len);
+void cond_free(cond_t *cond);
+
+// run the program, memory operands go through read, returns 0 and the
+// result in out, or non-zero if a memory read failed
+int cond_eval(const cond_t *cond, const target_regs_t *regs,
+              range_read_fn read, uint64_t *out);
+
+// register helpers, index returns -1 for an unknown name
+int cond_reg_index(const char *name, size_t len);
+const char *cond_reg_name(int idx);
+uint64_t cond_reg_value(const target_regs_t *regs, int idx);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// coverage
+// a one shot software breakpoint is planted at every function entry (from
+// LC_FUNCTION_STARTS and bl targets) or basic block start (function starts
+// plus every branch target and fall through in __text) of one image, both
+// taken from a code index of the image, each removes itself on its first
+// hit, so once the hot code has been seen the target runs at full speed
+// again
+//
+// hits go into a bitmap over the sorted block list and can be exported in
+// drcov format for lighthouse, bncov and friends
+
+typedef enum {
+  COV_FUNCTIONS,
+  COV_BLOCKS,
+} cov_mode_t;
+
+// image_base 0 means the main executable
+int coverage_start(cov_mode_t mode, uint64_t image_base);
+int coverage_stop(void);
+int coverage_export(const char *path);
+void coverage_print_status(void);
+
+// called by the exception listener when a one shot breakpoint fires
+void coverage_record(uint64_t addr);
+
+#endif
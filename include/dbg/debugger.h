@@ -2,7 +2,9 @@
 #define DEBUGGER_H
 
 #include "bp_wp.h"
+#include "exc/event_queue.h"
 #include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -13,12 +15,45 @@ extern int attached_pid;
 int attach(pid_t pid);
 int interrupt(void);
 int resume(void);
+// non-stop mode, threads are the port numbers stop messages print
+int toggle_nonstop(void);
+int list_threads(void);
+int select_thread(uint64_t thread);
+// every thread's state, scheduler info and first frames, captured in
+// parallel, regs adds the full register file of each
+int print_threads(bool regs);
+int save_threads(const char *path);
+int resume_thread(uint64_t thread);
 int detach(void);
 int print_registers(void);
 int write_registers(const char reg[], uint64_t value);
 int set_breakpoint(uint64_t addr);
 int step(void);
+// next (into false) or step (into true) by source line, the exception
+// listener steps the selected thread until it reaches another line, one
+// instruction without line info
+int step_line(bool into);
+// the source line an address belongs to, and the images with line tables
+int print_line(uint64_t addr);
+void print_line_images(void);
 int disasm(uintptr_t addr, size_t size);
+// function and block index of a whole __text, an image in the target by
+// base (NULL for the main executable) or a mach-o file by path
+int index_image(const char *what);
+// a number, or a symbol name turned into what the user would have typed
+// (unslid while the slide is on), 0 on success
+int parse_address(const char *s, uint64_t *out);
+// address to symbol+offset or symbol to address
+int lookup_symbol(const char *what);
+int index_lookup(uint64_t addr);
+void index_print_status(void);
+// the images dyld has loaded, and the image and segment an address is in
+int print_images(void);
+int image_lookup(uint64_t addr);
+// the files reads are served from instead of the target, and whether they
+// are
+int print_image_files(void);
+void set_file_reads(bool enabled);
 
 int print_debug_registers(void);
 
@@ -32,9 +67,16 @@ int write32(uintptr_t addr, uint32_t bytes);
 // aslr
 // - this will toggle if we are using the aslr slide when we r/w to memory
 int toggle_slide(void);
+int toggle_exception_state(void);
 int print_slide(void);
 
 // utils
 uintptr_t pc(void);
 
+// stops queued by the exception listener
+int print_stop_event(const exc_event_t *ev);
+
+// stats
+int print_cache_stats(bool reset);
+
 #endif
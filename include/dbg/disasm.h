@@ -0,0 +1,42 @@
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stdint.h>
+
+// disassembler
+// one capstone handle and one cs_insn for the life of the process, in
+// front of a direct mapped cache of decoded instructions keyed by address
+// and checked against the instruction word, so a loop being stepped is
+// decoded once and a patched or unmapped-and-reloaded address decodes again
+//
+// shell thread only
+
+#define DISASM_CACHE_SLOTS 1024
+#define DISASM_MNEMONIC_LEN 32
+#define DISASM_OP_STR_LEN 160
+
+typedef struct {
+  uint64_t addr;
+  uint32_t word;
+  char mnemonic[DISASM_MNEMONIC_LEN];
+  char op_str[DISASM_OP_STR_LEN];
+} disasm_insn_t;
+
+// - hits    - served from the cache
+// - decodes - went through capstone, misses plus stale entries
+// - stale   - address cached but the word changed (breakpoint, patch)
+typedef struct {
+  uint64_t hits;
+  uint64_t decodes;
+  uint64_t stale;
+} disasm_stats_t;
+
+// the decoded form of word at addr, points into the cache and is only
+// good until the next call, NULL if capstone can't be opened, words that
+// don't decode come back as .word
+const disasm_insn_t *disasm_insn(uint64_t addr, uint32_t word);
+
+void disasm_get_stats(disasm_stats_t *out);
+void disasm_reset_stats(void);
+
+#endif
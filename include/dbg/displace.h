@@ -0,0 +1,41 @@
+#ifndef DISPLACE_H
+#define DISPLACE_H
+
+#include "target/target.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// displaced stepping
+// a thread that only passes a breakpoint (condition false, a tracepoint,
+// a hook) is moved past it without the original instruction ever going
+// back into the text, so every other thread keeps trapping there
+// - branches, calls, returns, adr, adrp and literal loads are emulated on
+//   the registers by the a64 decoder, the thread resumes after them
+// - anything that doesn't care where it runs is executed out of line, a
+//   copy sits in a scratch page near the breakpoint followed by a branch
+//   back to the next instruction, the thread resumes on the copy
+// - the rest (brk, SIMD literal loads, a literal that can't be read, or
+//   no room for a scratch page within branch range) is left to the old
+//   step over, which puts the original back for one single step
+//
+// scratch pages are allocated in the target on first use and never freed,
+// a thread can still be on a copy when the debugger detaches
+
+typedef enum {
+  DISPLACE_FAILED = -1, // step it over the old way
+  DISPLACE_EMULATED,    // regs hold the state after the instruction
+  DISPLACE_RESUMED,     // the thread runs the instruction at regs->pc
+} displace_t;
+
+// move a thread that trapped on the breakpoint at regs->pc past it, a
+// breakpoint that is gone meanwhile leaves regs as they are
+displace_t displace_breakpoint(target_regs_t *regs);
+
+// a thread single stepping a copy traps on its branch back at pc, *out is
+// where that is in the original code
+bool displace_return(uint64_t pc, uint64_t *out);
+
+// forget every scratch page, they belong to the previous task
+void displace_reset(void);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef LINES_H
+#define LINES_H
+
+#include "target/line_table.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// source lines
+// the line table of an image is opened the first time an address inside
+// it is looked up, from the dSYM next to the image or one of the bundles
+// it sits in, or from the image itself if it kept its DWARF, a file is
+// only used when its LC_UUID is the loaded image's
+//
+// images without a usable file are remembered so they are tried once,
+// called from the shell and from the exception listener while a line step
+// runs, so everything here takes a lock
+
+// the row covering addr, -1 if its image has no line table or no row for it
+// file stays valid until lines_reset
+int lines_lookup(uint64_t addr, line_entry_t *out);
+
+// " at file:line" for addr, or "" when nothing covers it, into buf
+const char *lines_format(uint64_t addr, char *buf, size_t len);
+
+// print line of file with context lines either side, marking line itself
+int lines_print_source(const char *file, uint32_t line, uint32_t context);
+
+// forget every table, on attach and detach
+void lines_reset(void);
+
+// the images with a line table open and how much of it is decoded
+void lines_print_images(void);
+
+#endif
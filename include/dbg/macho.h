@@ -0,0 +1,55 @@
+#ifndef MACHO_H
+#define MACHO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// mach-o images
+// the bits of a 64 bit arm64 image the debugger needs, read either out of
+// the target at its load address or from a file on disk (the arm64 slice
+// of a universal binary), so callers don't care which
+//
+// addresses are unslid in the layout, add slide for where they live in the
+// target, a file has slide 0
+
+// what we need from the image's load commands
+typedef struct {
+  uint64_t slide;
+  uint64_t text_vmaddr;
+  uint64_t text_vmsize;
+  uint64_t sect_addr;
+  uint64_t sect_size;
+  uint32_t sect_offset; // file offset of __text
+  uint64_t linkedit_vmaddr;
+  uint64_t linkedit_fileoff;
+  uint32_t fstarts_off;
+  uint32_t fstarts_size;
+} macho_layout_t;
+
+// - fd        - open file, -1 for an image in the target
+// - slice_off - where the arm64 slice starts in a universal file
+// - base      - load address of the mach header in the target
+typedef struct {
+  int fd;
+  uint64_t slice_off;
+  uint64_t base;
+  macho_layout_t layout;
+} macho_image_t;
+
+int macho_open_task(macho_image_t *img, uint64_t base);
+int macho_open_file(macho_image_t *img, const char *path);
+void macho_close(macho_image_t *img);
+
+// size bytes at file offset off of __LINKEDIT
+int macho_read_linkedit(const macho_image_t *img, uint64_t off, void *out,
+                        size_t size);
+// all of __TEXT,__text, *out is malloc'd and freed by the caller
+int macho_read_text(const macho_image_t *img, uint32_t **out);
+
+// LC_FUNCTION_STARTS as slid addresses, *out is malloc'd, an image without
+// the load command gives 0 starts
+int macho_function_starts(const macho_image_t *img, uint64_t **out,
+                          size_t *count);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef STEPPER_H
+#define STEPPER_H
+
+#include "target/line_table.h"
+#include "target/target.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// source line stepping
+// next and step run in the exception listener, the shell starts a plan
+// with the row the thread is stopped in and single steps it, from then on
+// every step exception of that thread comes here and is answered without
+// the task stopping until the thread reaches the start of another line
+//
+// - inside the row's range the thread keeps stepping, under next a call is
+//   not stepped into, a hidden breakpoint goes on the return address and
+//   the thread runs the callee at full speed
+// - arriving in a function with no line info (a stub, a system library)
+//   steps out of it the same way, under step a callee with lines stops
+// - jumping into the middle of a row, or to a row of the same line, keeps
+//   stepping with that row's range, coming back to the start of the
+//   original row (a loop on one line) stops
+//
+// one plan at a time, any other stop, resume or detach drops it
+
+typedef enum {
+  STEPPER_PASS,     // not ours, handle it like any other exception
+  STEPPER_CONTINUE, // answered, the thread carries on
+  STEPPER_STOP,     // the line step is done, report it
+} stepper_action_t;
+
+// start stepping thread out of row, into steps into calls with lines
+int stepper_begin(uint64_t thread, const line_entry_t *row, bool into);
+
+// drop the plan, only if it belongs to thread unless thread is 0, the
+// return breakpoint goes and the thread's step bit is cleared
+void stepper_cancel(uint64_t thread);
+
+// thread is single stepping for a plan, so stepping it over a breakpoint
+// has to keep its step bit
+bool stepper_stepping(uint64_t thread);
+
+// called by the listener for every EXC_BREAKPOINT, *steps is how many
+// exceptions the plan took when it returns STEPPER_STOP
+stepper_action_t stepper_handle(uint64_t thread, const target_regs_t *regs,
+                                uint32_t *steps);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// symbols
+// the symbol tables of the images we know about, every image in the image
+// table is loaded the first time anything asks, others with symbols_load,
+// shell thread only, an image with no file on disk (the shared cache's
+// system libraries) is read from its __LINKEDIT in the target
+//
+// each table is cached on disk by the image's LC_UUID, a later attach to
+// the same binary maps the cache file instead of parsing the mach-o, an
+// entry built from a file of another size is rebuilt
+
+int symbols_load(const char *path, uint64_t base);
+// every image in the image table not loaded yet, prints how long it took
+// and how many came from the cache
+int symbols_load_all(void);
+// forget every image, on attach and detach
+void symbols_reset(void);
+
+// name of the closest symbol at or below addr, C names without their
+// leading underscore, NULL if no loaded image covers addr
+const char *symbols_lookup(uint64_t addr, uint64_t *off);
+// 0 on success
+int symbols_resolve(const char *name, uint64_t *addr);
+
+// " <name+0x10>" for addr, or "" when nothing covers it, into buf
+const char *symbols_format(uint64_t addr, char *buf, size_t len);
+
+void symbols_print_images(void);
+
+// the cache directory is $PHANTOM_SYMCACHE or
+// ~/Library/Caches/phantom/symbols, off only skips it for loads from now on
+void symbols_set_cache(bool enabled);
+// files and size of the cache, clear deletes every entry
+int symbols_cache_print(bool clear);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "target/target.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// tracepoints
+// a tracepoint is a breakpoint that records a few registers and optionally
+// a window of memory, then lets the thread carry on, the task is never
+// suspended and nothing is printed
+//
+// the exception listener is the only producer, it copies each record into
+// a preallocated single producer single consumer ring with no locks and no
+// allocation, a drain thread is the consumer and appends the records to a
+// binary log that `trace decode` prints afterwards
+
+#define TRACE_MAX_REGS 8
+#define TRACE_MAX_MEM 64
+// slots in the ring, power of two
+#define TRACE_RING_SIZE 4096
+
+#define TRACE_MAGIC "PHNTRACE"
+#define TRACE_VERSION 1
+
+// what to capture at a tracepoint
+// - regs/nregs - register numbers as in cond.h
+// - mem_reg    - base register of the memory window, -1 for none
+// - mem_off    - signed offset added to the base
+// - mem_len    - bytes to copy, at most TRACE_MAX_MEM
+typedef struct {
+  uint8_t regs[TRACE_MAX_REGS];
+  uint8_t nregs;
+  int mem_reg;
+  int64_t mem_off;
+  uint16_t mem_len;
+} trace_spec_t;
+
+// one hit, fixed size so ring slots can be copied blindly
+// mem_len is 0 if the window could not be read
+typedef struct {
+  uint64_t time;
+  uint64_t thread;
+  uint64_t pc;
+  uint64_t mem_addr;
+  uint32_t bp_index;
+  uint8_t nregs;
+  uint16_t mem_len;
+  uint8_t reg_ids[TRACE_MAX_REGS];
+  uint64_t regs[TRACE_MAX_REGS];
+  uint8_t mem[TRACE_MAX_MEM];
+} trace_record_t;
+
+typedef struct {
+  uint64_t captured;
+  uint64_t dropped; // ring was full
+  uint64_t written;
+  uint64_t blind; // windows with the original back in the text, hits of
+                  // other threads during one are not recorded
+} trace_stats_t;
+
+// parse "x0,x1,lr" and an optional window like "sp+16:32" into spec
+int trace_spec_parse(const char *regs, const char *window, trace_spec_t *spec);
+
+// producer side, called on the exception listener, never blocks
+void trace_capture(const trace_spec_t *spec, int bp_index, uint64_t thread,
+                   const target_regs_t *regs);
+
+// consumer side, start opens path and spawns the drain thread, stop
+// flushes whatever is left and closes the file
+int trace_start(const char *path);
+int trace_stop(void);
+bool trace_running(void);
+void trace_get_stats(trace_stats_t *out);
+// a tracepoint is stepped over with its original instruction put back
+void trace_note_blind(void);
+
+// print a log written by the drain thread
+int trace_decode(const char *path);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// stop events
+// the exception listener only decides whether a thread stops, parks the
+// task and pushes one of these, the shell thread pops them and does the
+// printing and disassembly, so neither the terminal nor capstone sit on
+// the path between an exception and its reply
+//
+// single producer (the listener) single consumer (the shell), lock free,
+// a pipe becomes readable when the queue goes from empty to non empty so
+// the shell can poll it next to stdin
+
+#define EVENT_QUEUE_SIZE 256
+
+typedef enum {
+  EV_BREAKPOINT,
+  EV_WATCHPOINT,
+  EV_EXCEPTION,
+  EV_STEP, // a next or step by line finished
+} exc_event_kind_t;
+
+// exc_event_t
+// - index - breakpoint or watchpoint index
+// - addr  - watchpoint only, the address that was accessed
+// - steps - line step only, exceptions the listener answered on the way
+// - time  - mach_absolute_time when the listener saw the exception
+typedef struct {
+  exc_event_kind_t kind;
+  uint64_t thread;
+  int exception;
+  uint64_t code[2];
+  uint64_t pc;
+  int index;
+  uint64_t addr;
+  uint32_t steps;
+  uint64_t time;
+} exc_event_t;
+
+typedef struct {
+  uint64_t pushed;
+  uint64_t popped;
+  uint64_t dropped; // queue was full
+  uint64_t depth;
+  uint64_t max_depth;
+} event_queue_stats_t;
+
+// producer, returns false and counts a drop when full, the consumer is
+// woken either way
+bool event_queue_push(const exc_event_t *ev);
+// consumer, returns false when empty
+bool event_queue_pop(exc_event_t *out);
+// consumer, stops dropped since the last call, *thread (may be NULL) gets
+// the thread of the latest, their threads stay parked with no event
+uint64_t event_queue_take_lost(uint64_t *thread);
+// readable while events are pending, -1 if the pipe could not be made
+int event_queue_fd(void);
+void event_queue_get_stats(event_queue_stats_t *out);
+
+#endif
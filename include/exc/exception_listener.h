@@ -1,6 +1,50 @@
 #ifndef EXCEPTION_LISTENER_H
 #define EXCEPTION_LISTENER_H
 
+#include "exc/event_queue.h"
+#include <mach/arm/thread_status.h>
+#include <mach/exception_types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// most messages handled per wakeup, the listener blocks for the first one
+// and takes up to this many more that are already queued, 1 gives back the
+// old one receive, one dispatch, one reply loop
+#define EXC_BATCH_MAX 32
+
+// - messages  - exception messages handled
+// - batches   - wakeups, messages / batches is the average batch
+// - max_batch - largest batch drained in one wakeup
+// - busy_ns   - time from the first receive of a batch to its last reply,
+//               messages / busy_ns is the listener's events per second
+typedef struct {
+  uint64_t messages;
+  uint64_t batches;
+  uint64_t max_batch;
+  uint64_t busy_ns;
+} exception_listener_stats_t;
+
 void *exception_listener(void *arg);
+const char *exception_name(exception_type_t type);
+
+// called by the handlers for an exception that should stop the process,
+// once the batch is dispatched the task is suspended once and every stop
+// is queued for the shell, before any reply is sent, state is the
+// thread's registers as the handler saw them and seeds the register cache
+void exception_batch_stop(const exc_event_t *ev,
+                          const arm_thread_state64_t *state);
+
+// send the held state identity replies of thread, or of every stopped
+// thread if it is MACH_PORT_NULL, each with the registers the register
+// cache holds for its thread, called right before the thread may run
+void exception_release_replies(thread_act_t thread);
+
+void exception_listener_get_stats(exception_listener_stats_t *out);
+
+// p50/p99/p999 per exception type of two spans, both starting when the
+// listener received the message
+// - dispatch   - until the handler returned
+// - round trip - until the reply was sent and the thread could run again
+void exception_listener_print_latency(bool reset);
 
 #endif
@@ -0,0 +1,37 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// latency histograms
+// log linear like hdr histogram: values below 2^LAT_SUB_BITS get a bucket
+// each, above that every power of two is split into 2^LAT_SUB_BITS equal
+// buckets, so any value is off by at most ~3% and recording is a clz and
+// an add, no floating point and no allocation on the exception path
+//
+// one writer (the exception listener), counters are atomic so the shell
+// can read percentiles while it records
+
+#define LAT_SUB_BITS 5
+#define LAT_SUB_COUNT (1 << LAT_SUB_BITS)
+// largest power of two tracked, 2^40 ns is about 18 minutes, larger values
+// land in the last bucket
+#define LAT_MAX_MAG 40
+#define LAT_BUCKETS ((LAT_MAX_MAG - LAT_SUB_BITS + 2) * LAT_SUB_COUNT)
+
+typedef struct {
+  _Atomic uint64_t counts[LAT_BUCKETS];
+  _Atomic uint64_t total;
+  _Atomic uint64_t sum;
+  _Atomic uint64_t max;
+} lat_hist_t;
+
+void lat_hist_record(lat_hist_t *h, uint64_t ns);
+// smallest value v such that at least p (0-1) of the samples are <= v,
+// reported as the top of its bucket, 0 for an empty histogram
+uint64_t lat_hist_percentile(lat_hist_t *h, double p);
+void lat_hist_reset(lat_hist_t *h);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef FILE_BACKING_H
+#define FILE_BACKING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// file backed reads
+// most of what gets disassembled and symbolicated is code of system
+// libraries that nobody has touched, the same bytes are in a file we can
+// map ourselves, so reads of it don't have to cross into the task
+//
+// two kinds of files back target memory
+// - the shared cache, its main file and every subcache beside it, each
+//   checked against the uuid dyld reports and against the header the task
+//   has mapped
+// - images loaded from disk, the arm64 slice of the file their path names
+//   when its LC_UUID is the one the loaded header carries, images inside
+//   the shared cache are left to the cache
+//
+// only bytes that can't have changed since they were mapped are served,
+// segments and mappings with VM_PROT_WRITE in neither their initial nor
+// their maximum protection, and only the part the file has bytes for,
+// every page we write to or make writable ourselves is read from the task
+// from then on
+//
+// a target can patch its own code too, each rebuild asks the task about
+// every range and drops regions that are writable now or hold pages copied
+// out of the file, a patch made between rebuilds (no image loaded or
+// unloaded since) is not seen, reads of it get the file's bytes until the
+// next one
+//
+// the ranges follow the image table, they are rebuilt the first read after
+// its generation moves on, files stay mapped until their image goes away
+
+typedef struct {
+  uint64_t reads;       // reads served from a file
+  uint64_t bytes;       // bytes they returned
+  uint64_t patched;     // reads sent to the task because of a patched page
+  uint64_t rebuilds;    // times the ranges followed the image table
+  size_t files;         // files mapped
+  size_t ranges;        // address ranges they back
+  size_t dirty_pages;   // pages that always go to the task
+} file_backing_stats_t;
+
+// all of [addr, addr + size) from mapped files, non-zero if any byte of it
+// has no clean file behind it, nothing is read from the task
+int file_backing_read(uint64_t addr, void *out, size_t size);
+
+// [addr, addr + size) may differ from the file from now on
+void file_backing_mark_dirty(uint64_t addr, size_t size);
+
+// unmap every file and forget patched pages, on detach
+void file_backing_reset(void);
+
+void file_backing_set_enabled(bool enabled);
+bool file_backing_enabled(void);
+
+// the mapped files with how much of the task each backs
+void file_backing_print(void);
+
+void file_backing_get_stats(file_backing_stats_t *out);
+void file_backing_reset_stats(void);
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef IMAGE_TABLE_H
+#define IMAGE_TABLE_H
+
+#include <mach/kern_return.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// loaded images
+// every image dyld has mapped into the task, dyld itself included, read
+// out of dyld_all_image_infos in a few batched reads (the info array, then
+// every mach header, every set of load commands and every path at once)
+//
+// the segments of all images are kept as sorted, non overlapping
+// intervals, so an address maps to its image and offset by binary search,
+// a second set keyed by the addresses the files asked for maps what the
+// user typed to the slide of the image it belongs to
+//
+// dyld calls its notifier with every batch of images it adds or removes,
+// a hidden breakpoint there feeds image_table_update and the table never
+// has to be read again while attached
+//
+// the listener updates while the shell looks up, both go through a
+// read/write lock, reads go straight to vm_read_overwrite
+
+#define IMAGE_MAX_SEGMENTS 16
+#define IMAGE_PATH_LEN 1024
+
+// what dyld passes its notifier in x0
+typedef enum {
+  IMAGE_ADDING = 0,
+  IMAGE_REMOVING = 1,
+} image_mode_t;
+
+// one LC_SEGMENT_64, __PAGEZERO and __LINKEDIT aside (the shared cache
+// maps one __LINKEDIT for every image in it)
+// - vmaddr   - where the file asked for it, add the image's slide
+// - fileoff  - offset of its bytes in the file, filesize of them
+// - initprot - VM_PROT_* it is mapped with, maxprot the most it can get
+typedef struct {
+  char name[16];
+  uint64_t vmaddr;
+  uint64_t vmsize;
+  uint64_t fileoff;
+  uint64_t filesize;
+  int32_t initprot;
+  int32_t maxprot;
+} image_segment_t;
+
+// loaded_image_t
+// - base     - mach header in the target
+// - slide    - base minus the __TEXT vmaddr the file asked for
+// - filetype - MH_EXECUTE for the main executable, MH_DYLIB, ...
+// - flags    - of the mach header, MH_DYLIB_IN_CACHE for shared cache images
+// - uuid     - LC_UUID, zero if the image has none
+// - path     - where dyld loaded it from, system libraries name files that
+//              only exist inside the shared cache
+typedef struct {
+  uint64_t base;
+  uint64_t slide;
+  uint32_t filetype;
+  uint32_t flags;
+  uint8_t uuid[16];
+  uint32_t nsegments;
+  image_segment_t segments[IMAGE_MAX_SEGMENTS];
+  char path[IMAGE_PATH_LEN];
+} loaded_image_t;
+
+// throw away whatever we had and read every image dyld lists
+kern_return_t image_table_refresh(void);
+void image_table_clear(void);
+
+// what dyld's notifier was called with, info is the target address of
+// count dyld_image_info entries, only those images are read
+kern_return_t image_table_update(image_mode_t mode, uint64_t info,
+                                 uint32_t count);
+
+// address of dyld's notifier, where the table's breakpoint goes, 0 if
+// dyld didn't give us one
+uint64_t image_table_notifier(void);
+
+// the image with a segment loaded over addr, *off is addr minus its base
+bool image_table_lookup(uint64_t addr, loaded_image_t *out, uint64_t *off);
+// the main executable
+bool image_table_main(loaded_image_t *out);
+
+// just the slide, cheap enough for every read and write
+// - loaded - of the image with a segment loaded over addr
+// - unslid - of the image whose file asked for addr, where files overlap
+//            (dylibs linked at 0) the image that claimed it first keeps it
+bool image_table_slide_loaded(uint64_t addr, uint64_t *slide);
+bool image_table_slide_unslid(uint64_t addr, uint64_t *slide);
+
+// bumped by every change to the table, a copy of it is stale once this
+// moves on
+uint64_t image_table_generation(void);
+
+// slide and uuid of the shared cache the task maps, false if it maps none
+bool image_table_shared_cache(uint64_t *slide, uint8_t uuid[16]);
+
+// how many images there are, copies up to max of them into out in load
+// address order, out may be NULL
+size_t image_table_images(loaded_image_t *out, size_t max);
+
+#endif
@@ -13,11 +13,18 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include "target/coalesce.h"
 
 // very important
 kern_return_t get_task_port(pid_t pid, task_t *task_out);
 // important for catching exceptions on the target_task
 kern_return_t setup_exception_port(pid_t pid);
+// opt in to EXCEPTION_STATE_IDENTITY, each exception message then carries
+// the thread's ARM_THREAD_STATE64 and the reply carries it back, so
+// handlers need no thread_get_state/thread_set_state of their own, can be
+// switched while attached
+kern_return_t mach_set_exception_state_mode(bool state_identity);
+bool mach_exception_state_mode(void);
 
 // general purpose functionality on mach task
 kern_return_t mach_resume(void);
@@ -28,12 +35,65 @@ kern_return_t mach_register_write(const char reg[], uint64_t value);
 kern_return_t mach_register_debug_print(void);
 kern_return_t mach_set_breakpoint(int index, uint64_t addr);
 kern_return_t mach_remove_breakpoint(int idx);
+kern_return_t mach_set_watchpoint(int index, uint64_t addr, uint32_t bas,
+                                  uint32_t mask, bool load, bool store);
+kern_return_t mach_remove_watchpoint(int idx);
+kern_return_t mach_thread_get_fault(thread_act_t thread, uint64_t *far,
+                                    bool *write);
 kern_return_t mach_step(void);
+kern_return_t mach_thread_begin_step_over(thread_act_t thread, int bp_slot,
+                                          const int *wp_slots, int nwp);
+kern_return_t mach_thread_end_step_over(thread_act_t thread, bool keep_step);
+// hardware breakpoint and watchpoint edits are staged while the task is
+// stopped and pushed to every thread by this, mach_resume calls it
+kern_return_t mach_debug_state_flush(void);
 kern_return_t mach_register_exception_print(void);
 
 // vmrw - reads or writes 64 or 32 bytes to whatever address we want
 // TODO: test r/w on __TEXT segment, iirc this errors out, but can be fixed with permissions?
 kern_return_t mach_read(uintptr_t addr, void *out, size_t size, bool aslr);
+// many small reads at once, merged into as few vm reads as possible,
+// addresses are absolute and iov[i].status says which entries failed
+kern_return_t mach_read_vectored(target_iovec_t *iov, size_t count);
+void mach_get_read_stats(coalesce_stats_t *out);
+kern_return_t mach_write(uintptr_t addr, void *bytes, size_t size);
+
+// page protections, used by page granular watchpoints
+kern_return_t mach_get_protection(uintptr_t addr, vm_prot_t *prot);
+kern_return_t mach_protect(uintptr_t addr, size_t size, vm_prot_t prot);
+// fresh zeroed pages in the target within range bytes of near, either
+// side, for code the debugger places there itself, size is page aligned
+kern_return_t mach_allocate_near(uint64_t near, uint64_t range, size_t size,
+                                 uint64_t *out);
+
+// write sessions - batch many writes so each page has its protection
+// flipped at most once and contiguous writes go out as one vm_write,
+// addresses are absolute, commit empties the session for reuse
+typedef struct {
+  uintptr_t addr;
+  size_t size;
+  size_t offset; // into the session's byte pool
+} pending_write_t;
+
+typedef struct {
+  pending_write_t *writes;
+  size_t count;
+  size_t capacity;
+  uint8_t *pool;
+  size_t pool_len;
+  size_t pool_cap;
+} write_session_t;
+
+void mach_write_session_init(write_session_t *ws);
+kern_return_t mach_write_session_add(write_session_t *ws, uintptr_t addr,
+                                     const void *bytes, size_t size);
+kern_return_t mach_write_session_commit(write_session_t *ws);
+// same, status[i] says whether the i-th write added landed, a write fails
+// with the run it was merged into, so a failed commit can still have put
+// some of its bytes in the target
+kern_return_t mach_write_session_commit_status(write_session_t *ws,
+                                               kern_return_t *status);
+void mach_write_session_free(write_session_t *ws);
 
 kern_return_t mach_read64(uintptr_t addr, uint64_t *out);
 kern_return_t mach_read32(uintptr_t addr, uint32_t *out);
@@ -46,13 +106,82 @@ extern mach_vm_address_t slide;
 extern bool slide_enabled;
 
 // this should auto slide, every read and write should be to addr + slide
+// of the image the address belongs to, addresses outside every image get
+// the main executable's
 kern_return_t mach_set_auto_slide_enabled(bool enabled);
 // we can also set the slide to whatever value we want
 kern_return_t mach_set_slide_value(mach_vm_address_t slide);
-// returns the aslr slide into &out_slide
+// returns the main executable's aslr slide into &out_slide
 kern_return_t mach_get_aslr_slide(mach_vm_address_t *out_slide);
+// what the user typed to where it is in the task and back, unchanged
+// while the slide is off
+uint64_t mach_slide_address(uint64_t addr);
+uint64_t mach_unslide_address(uint64_t addr);
 
 // utils
 kern_return_t mach_get_pc(uintptr_t *pc);
+kern_return_t mach_get_main_image(uint64_t *base, char *path, size_t path_len);
+struct dyld_all_image_infos;
+kern_return_t
+mach_get_all_image_infos(struct dyld_all_image_infos *image_infos);
+kern_return_t mach_thread_get_pc(thread_act_t thread, uint64_t *pc);
+// a thread's registers, from the register cache while it can't run
+kern_return_t mach_thread_get_state(thread_act_t thread,
+                                    arm_thread_state64_t *out);
+// hand the cache a state we already have, ignored unless the thread is
+// stopped, the listener calls it with the state the handler saw
+void mach_thread_seed_state(thread_act_t thread,
+                            const arm_thread_state64_t *state);
+// same, but a thread missing from the cache is read from the kernel and
+// not added, for walking every thread at once
+kern_return_t mach_thread_read_state(thread_act_t thread,
+                                     arm_thread_state64_t *out);
+// set a thread's registers, into the register cache while it can't run
+kern_return_t mach_thread_set_state(thread_act_t thread,
+                                    const arm_thread_state64_t *in);
+// convert between the kernel's thread state and the backend's registers
+void mach_regs_from_state(const arm_thread_state64_t *state,
+                          target_regs_t *out);
+void mach_regs_to_state(const target_regs_t *in, arm_thread_state64_t *state);
+
+// the thread (and its pc) the task is currently stopped on, if any, in
+// non-stop mode the held thread the shell has selected
+void mach_set_stopped_thread(thread_act_t thread, uint64_t pc);
+thread_act_t mach_get_stopped_thread(uint64_t *pc);
+bool mach_task_is_stopped(void);
+// the attached task's port, for code that talks to the kernel directly
+task_t mach_get_task(void);
+
+// non-stop mode, a stop holds only the thread that raised it and the rest
+// of the task keeps running, can't be switched while threads are held
+// - hold    - thread_suspend the thread and remember where it stopped
+// - release - forget it and thread_resume it
+// - held    - returns how many threads are held and copies up to max of
+//             them into out, out may be NULL
+// - select  - make a held thread the stopped thread the shell works on
+typedef struct {
+  thread_act_t thread;
+  uint64_t pc;
+} held_thread_t;
+
+kern_return_t mach_set_nonstop(bool enabled);
+bool mach_nonstop_mode(void);
+kern_return_t mach_thread_hold(thread_act_t thread, uint64_t pc);
+kern_return_t mach_thread_release(thread_act_t thread);
+size_t mach_held_threads(held_thread_t *out, size_t max);
+kern_return_t mach_select_thread(thread_act_t thread);
+
+// all-stop, every thread that stopped in the batch the task is stopped on,
+// the stopped thread among them, each has to be moved past its stop when
+// the task resumes or it traps on the same instruction again, the list is
+// cleared by mach_resume, same out/max contract as mach_held_threads
+void mach_add_stopped_thread(thread_act_t thread, uint64_t pc);
+size_t mach_stopped_threads(held_thread_t *out, size_t max);
+
+// park a thread the listener makes wait for something of ours, a
+// thread_suspend that is not a stop, the shell never sees it, unpark
+// resumes it
+kern_return_t mach_thread_park(thread_act_t thread);
+kern_return_t mach_thread_unpark(thread_act_t thread);
 
 #endif
@@ -0,0 +1,42 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// page cache
+// a small direct mapped cache of target pages in front of mach_read, the
+// contents are only trusted for one stop epoch, so anything that lets the
+// target run again (resume, step) must call page_cache_invalidate
+//
+// the cache never talks to the kernel itself, on a miss it calls the fill
+// function it was handed with a page aligned address
+
+// 16k, the arm64 macOS page size
+#define PAGE_CACHE_PAGE_SIZE 0x4000ULL
+#define PAGE_CACHE_SLOTS 64
+
+// fill a whole page at page_addr, returns 0 on success
+typedef int (*page_fill_fn)(uintptr_t page_addr, void *out, size_t size);
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t fills_failed;
+  uint64_t invalidations;
+} page_cache_stats_t;
+
+// read size bytes at addr, served from cached pages where possible,
+// returns non-zero if a page could not be filled
+int page_cache_read(uintptr_t addr, void *out, size_t size, page_fill_fn fill);
+
+// update any cached copy of [addr, addr + size) after a successful write
+void page_cache_write_through(uintptr_t addr, const void *in, size_t size);
+
+// start a new stop epoch, every cached page becomes invalid
+void page_cache_invalidate(void);
+
+void page_cache_get_stats(page_cache_stats_t *out);
+void page_cache_reset_stats(void);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef REG_CACHE_H
+#define REG_CACHE_H
+
+#include <mach/arm/thread_status.h>
+#include <mach/kern_return.h>
+#include <mach/mach_types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// register cache
+// ARM_THREAD_STATE64 of the threads touched during one stop epoch, filled
+// on first access and trusted until the target runs again, writes only
+// mark the entry dirty and reach the thread in one thread_set_state when
+// reg_cache_flush runs right before the resume
+//
+// like the page cache it never talks to the kernel itself, it calls the
+// fill and store functions it is handed
+
+#define REG_CACHE_SLOTS 32
+
+typedef kern_return_t (*reg_fill_fn)(thread_act_t thread,
+                                     arm_thread_state64_t *out);
+typedef kern_return_t (*reg_store_fn)(thread_act_t thread,
+                                      const arm_thread_state64_t *in);
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t write_backs; // thread_set_state calls made by flushes
+  uint64_t invalidations;
+} reg_cache_stats_t;
+
+kern_return_t reg_cache_get(thread_act_t thread, arm_thread_state64_t *out,
+                            reg_fill_fn fill);
+// the cached state if there is one, never fills, for bulk readers that
+// would only churn the slots
+bool reg_cache_peek(thread_act_t thread, arm_thread_state64_t *out);
+// replace the cached state and mark it dirty, store is only used if every
+// slot is dirty and one has to be written back to make room
+kern_return_t reg_cache_put(thread_act_t thread, const arm_thread_state64_t *in,
+                            reg_store_fn store);
+// a state we already hold, the exception message or the handler's read
+void reg_cache_seed(thread_act_t thread, const arm_thread_state64_t *in);
+
+// write back every dirty thread, or just one and forget it (a non-stop
+// thread about to run on its own)
+kern_return_t reg_cache_flush(reg_store_fn store);
+kern_return_t reg_cache_flush_thread(thread_act_t thread, reg_store_fn store);
+
+// start a new stop epoch, flush first, dirty entries are dropped
+void reg_cache_invalidate(void);
+
+void reg_cache_get_stats(reg_cache_stats_t *out);
+void reg_cache_reset_stats(void);
+
+#endif
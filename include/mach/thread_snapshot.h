@@ -0,0 +1,59 @@
+#ifndef THREAD_SNAPSHOT_H
+#define THREAD_SNAPSHOT_H
+
+#include "target/target.h"
+#include <mach/kern_return.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// thread snapshots
+// registers, scheduler info and the first few frames of every thread in
+// the task, captured by a small pool of workers that each take the next
+// thread off a shared counter, so thousands of threads cost milliseconds
+// rather than one serial round of kernel calls after another
+//
+// records are fixed size and land in one array, so a snapshot goes to
+// disk as a header and a single fwrite
+
+#define SNAP_MAX_FRAMES 8
+#define SNAP_NAME_LEN 64
+#define SNAP_MAX_WORKERS 8
+
+#define SNAP_MAGIC "PHNTHRDS"
+#define SNAP_VERSION 1
+
+// thread_snapshot_t
+// - port          - thread port in our space, what stop messages print
+// - thread_id     - system wide id (THREAD_IDENTIFIER_INFO)
+// - status        - kern_return_t of the register fetch, regs and frames
+//                   are zero unless it is 0
+// - run_state     - TH_STATE_*
+// - user_us/system_us - cpu time
+// - cpu_usage     - scaled by TH_USAGE_SCALE
+// - frames        - pc first, then return addresses from the frame chain
+typedef struct {
+  uint64_t port;
+  uint64_t thread_id;
+  target_regs_t regs;
+  uint64_t user_us;
+  uint64_t system_us;
+  int32_t status;
+  int32_t run_state;
+  int32_t flags;
+  int32_t cpu_usage;
+  int32_t suspend_count;
+  uint32_t nframes;
+  uint64_t frames[SNAP_MAX_FRAMES];
+  char name[SNAP_NAME_LEN];
+} thread_snapshot_t;
+
+// captures every thread, *out is malloc'd and freed by the caller
+kern_return_t thread_snapshot_capture(thread_snapshot_t **out, size_t *count);
+
+// file header then count records as they sit in memory
+int thread_snapshot_write(const char *path, const thread_snapshot_t *snaps,
+                          size_t count);
+
+const char *thread_run_state_name(int run_state);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef A64_H
+#define A64_H
+
+#include "target/coalesce.h"
+#include "target/target.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// a64 control flow decoder
+// classifies the instructions that change control flow or read the pc
+// and works out where they go, table driven and allocation free so the
+// step paths can call it on every instruction instead of capstone
+//
+// plain c with no os dependencies, it builds into the target library and
+// runs on linux as well
+
+typedef enum {
+  A64_SEQ,         // falls through to pc + 4
+  A64_BRANCH,      // b
+  A64_COND_BRANCH, // b.cond, cbz, cbnz, tbz, tbnz
+  A64_CALL,        // bl
+  A64_BRANCH_REG,  // br, braa, brab, braaz, brabz
+  A64_CALL_REG,    // blr, blraa, blrab, blraaz, blrabz
+  A64_RET,         // ret, retaa, retab
+  A64_PCREL,       // adr, adrp, ldr/ldrsw/prfm literal, no control flow
+  A64_EXCEPTION,   // svc, brk
+} a64_kind_t;
+
+// what an A64_COND_BRANCH tests
+typedef enum {
+  A64_TEST_NONE,
+  A64_TEST_FLAGS, // b.cond
+  A64_TEST_ZERO,  // cbz, cbnz
+  A64_TEST_BIT,   // tbz, tbnz
+} a64_test_t;
+
+// a64_insn_t
+// - target - pc relative branch target or address an A64_PCREL instruction
+//            computes, 0 for the register forms
+// - reg    - rn of register branches, rt of cbz/tbz and A64_PCREL
+// - cond   - b.cond condition, for cbz/tbz 0 is the zero form and 1 the
+//            non zero one
+// - bit    - bit tested by tbz/tbnz, operand width (32 or 64) of cbz/cbnz
+typedef struct {
+  a64_kind_t kind;
+  a64_test_t test;
+  uint64_t target;
+  uint8_t reg;
+  uint8_t cond;
+  uint8_t bit;
+} a64_insn_t;
+
+// decode insn at pc, returns false for A64_SEQ
+bool a64_decode(uint32_t insn, uint64_t pc, a64_insn_t *out);
+
+static inline bool a64_is_branch(a64_kind_t kind) {
+  return kind >= A64_BRANCH && kind <= A64_RET;
+}
+
+static inline bool a64_is_call(a64_kind_t kind) {
+  return kind == A64_CALL || kind == A64_CALL_REG;
+}
+
+// true if b.cond's condition holds for the nzcv bits of cpsr
+bool a64_cond_holds(uint8_t cond, uint32_t cpsr);
+
+// where the thread goes after executing the decoded instruction at pc,
+// with conditions and register targets evaluated against regs and pointer
+// authentication bits stripped, A64_EXCEPTION continues at pc + 4
+uint64_t a64_next_pc(const a64_insn_t *d, uint64_t pc,
+                     const target_regs_t *regs);
+
+// carry out the decoded instruction at pc on regs without executing it,
+// for the forms that depend on where they sit, branches, calls, returns,
+// adr, adrp and the general register literal loads, read fetches the
+// literal, false (regs untouched) for everything else, a SIMD literal
+// load included, or a literal that can't be read
+bool a64_emulate(uint32_t insn, uint64_t pc, target_regs_t *regs,
+                 range_read_fn read);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include "target/target.h"
+
+// coalesced scatter/gather reads
+// sorts a batch of small reads by address, merges the ones that touch the
+// same or neighbouring pages into single contiguous ranges, reads each
+// range once through read_range and scatters the bytes back into the
+// callers buffers
+//
+// read_range is the only thing that talks to the target, so this can be
+// driven by a backend or by an in-memory fake
+
+// read size bytes at addr into out, returns 0 on success
+typedef int (*range_read_fn)(uint64_t addr, void *out, size_t size);
+
+typedef struct {
+  size_t entries; // iovecs requested
+  size_t ranges;  // read_range calls issued for merged ranges
+  size_t retries; // per-entry reads after a merged range failed
+} coalesce_stats_t;
+
+// fills iov[i].status for every entry and returns non-zero if any failed,
+// stats may be NULL and is added to without a lock, concurrent callers
+// each pass their own
+int target_read_coalesced(target_iovec_t *iov, size_t count,
+                          uint64_t page_size, range_read_fn read_range,
+                          coalesce_stats_t *stats);
+
+#endif
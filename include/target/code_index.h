@@ -0,0 +1,48 @@
+#ifndef CODE_INDEX_H
+#define CODE_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// code index
+// function starts and basic block boundaries of one a64 text section,
+// found by a pass over every instruction split across a pool of workers
+// in page aligned chunks, then kept as two sorted arrays that coverage,
+// stepping and symbolication can binary search
+//
+// works on a buffer of instruction words it is handed and never talks to
+// the target, so it builds into the target library and can be timed on
+// linux against any arm64 binary
+
+#define CODE_INDEX_MAX_WORKERS 16
+
+// - funcs  - sorted function starts, the known ones handed to the build,
+//            the section start and every bl target inside the section
+// - blocks - sorted block starts, every function start plus the target
+//            and fall through of each branch, a block runs to the next one
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+  uint64_t *funcs;
+  size_t nfuncs;
+  uint64_t *blocks;
+  size_t nblocks;
+  size_t insns;
+} code_index_t;
+
+// index size bytes of code loaded at addr, known_funcs (may be NULL) are
+// function starts from elsewhere, LC_FUNCTION_STARTS or symbols, workers 0
+// picks one per online cpu, returns 0 on success
+int code_index_build(code_index_t *idx, const uint32_t *text, size_t size,
+                     uint64_t addr, const uint64_t *known_funcs,
+                     size_t nknown, unsigned workers);
+void code_index_free(code_index_t *idx);
+
+// start of the function or block containing addr, 0 if addr is outside
+// the section, *end (may be NULL) gets the next start or the section end
+uint64_t code_index_function(const code_index_t *idx, uint64_t addr,
+                             uint64_t *end);
+uint64_t code_index_block(const code_index_t *idx, uint64_t addr,
+                          uint64_t *end);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef LINE_TABLE_H
+#define LINE_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// dwarf line tables
+// address to file:line out of the __DWARF,__debug_line section of a
+// mach-o, a dSYM's DWARF file or a binary that kept its debug info,
+// versions 2 to 5
+//
+// opening a file only walks each unit's line program far enough to know
+// which addresses it covers, the rows of a unit are decoded the first time
+// a lookup lands in it and merged into one flat array sorted by address,
+// rows that don't change the file or line are dropped, so a row covers
+// everything up to the next one
+//
+// no mach headers are needed, so it builds into the target library and
+// runs on linux against any arm64 mach-o, the caller does the locking
+
+// a row covers [addr, next row's addr)
+// - file - index into files, LINE_FILE_END for the end of a sequence, the
+//          addresses after it belong to no unit until the next row
+// - line - 0 for code no source line is attributed to
+typedef struct {
+  uint64_t addr;
+  uint32_t file;
+  uint32_t line;
+} line_row_t;
+
+#define LINE_FILE_END UINT32_MAX
+
+// one unit's line program
+// - lo, hi  - unslid span of its sequences
+// - offset  - of its header in __debug_line
+typedef struct {
+  uint64_t lo;
+  uint64_t hi;
+  uint64_t offset;
+  bool decoded;
+} line_unit_t;
+
+typedef struct {
+  // the file, mapped for as long as units are left to decode
+  void *map;
+  size_t map_size;
+  const uint8_t *line;
+  size_t line_size;
+  const uint8_t *line_str;
+  size_t line_str_size;
+  const uint8_t *str;
+  size_t str_size;
+  // LC_UUID of the file, zero if it has none
+  uint8_t uuid[16];
+  // added to every address on the way out
+  uint64_t slide;
+  // sorted by lo, max_hi[i] is the largest hi of units[0..i]
+  line_unit_t *units;
+  uint64_t *max_hi;
+  size_t nunits;
+  size_t decoded;
+  line_row_t *rows;
+  size_t nrows;
+  size_t rows_cap;
+  // "dir/name" of every file any decoded unit names
+  char **files;
+  size_t nfiles;
+  size_t files_cap;
+} line_table_t;
+
+// what a lookup found
+// - start, end - slid range of the row covering the address
+typedef struct {
+  const char *file;
+  uint32_t line;
+  uint64_t start;
+  uint64_t end;
+} line_entry_t;
+
+// maps path and finds its units, universal files use their arm64 slice,
+// fails if it has no __debug_line
+int line_table_open(line_table_t *lt, const char *path, uint64_t slide);
+void line_table_free(line_table_t *lt);
+
+// the row covering addr (slid), decoding the units that may hold it first,
+// -1 if no unit has a row for it, file stays valid until the table is
+// freed
+int line_table_lookup(line_table_t *lt, uint64_t addr, line_entry_t *out);
+
+#endif
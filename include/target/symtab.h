@@ -0,0 +1,95 @@
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+#include "target/coalesce.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// mach-o symbol tables
+// the defined symbols of one 64 bit image, from LC_SYMTAB (narrowed to
+// locals and external definitions by LC_DYSYMTAB) plus whatever the
+// export trie adds, kept two ways
+// - a sorted array of addresses with a parallel array of names, for
+//   address to symbol by binary search
+// - an open addressed hash of names, for name to address
+//
+// addresses are the ones the file asked for and names are offsets into
+// one string pool, so a built table is a single position independent
+// block, written out as is it becomes a cache file keyed by the image's
+// LC_UUID that a later load maps and uses without parsing anything
+//
+// no mach headers are needed, so it builds into the target library and
+// runs on linux against any arm64 mach-o
+
+#define SYMTAB_CACHE_MAGIC "PHNSYMS"
+#define SYMTAB_CACHE_VERSION 1
+
+// C names carry a leading underscore, lookups by name ignore one on both
+// sides, so "malloc" and "_malloc" both find _malloc
+// - name - offset into the pool, 0 is an empty slot
+typedef struct {
+  uint64_t addr;
+  uint32_t name;
+  uint32_t reserved;
+} symtab_slot_t;
+
+typedef struct {
+  // the block, malloc'd by a build or mapped from a cache file
+  void *data;
+  size_t size;
+  bool mapped;
+  // LC_UUID (zero if there is none) and size of the file it came from,
+  // what a cache file is checked against
+  uint8_t uuid[16];
+  uint64_t file_size;
+  // where the file's __TEXT landed minus where it asked to, and the
+  // loaded [start, end) of its segments, __LINKEDIT aside
+  uint64_t slide;
+  uint64_t start;
+  uint64_t end;
+  // sorted, unslid
+  const uint64_t *addrs;
+  const uint32_t *names;
+  size_t count;
+  // every name, aliases included, size is a power of two
+  const symtab_slot_t *hash;
+  size_t hash_size;
+  const char *pool;
+  size_t pool_size;
+} symtab_t;
+
+// base is where the image's mach header sits in the target, 0 keeps the
+// file's own addresses, universal files use their arm64 slice
+int symtab_load_file(symtab_t *st, const char *path, uint64_t base);
+// same over a mach-o in memory, data is only read while building
+int symtab_load_buffer(symtab_t *st, const void *data, size_t size,
+                       uint64_t base);
+// same over an image mapped in a target, read through read, base is its
+// mach header, the symbols and trie are found through __LINKEDIT where it
+// was loaded, for images with no file of their own like the shared
+// cache's, file_size is 0
+int symtab_load_image(symtab_t *st, range_read_fn read, uint64_t base);
+void symtab_free(symtab_t *st);
+
+// LC_UUID and size of a mach-o file, only the load commands are read,
+// fails if it has no uuid
+int symtab_file_identity(const char *path, uint8_t uuid[16],
+                         uint64_t *file_size);
+
+// the cache file of st goes to path, written beside it and renamed over
+// it so a reader never maps half a file
+int symtab_save_cache(const symtab_t *st, const char *path);
+// a single mmap of a cache file, fails if it is damaged or was built from
+// a file with a different uuid or size, the caller rebuilds it then
+int symtab_load_cache(symtab_t *st, const char *path, const uint8_t uuid[16],
+                      uint64_t file_size, uint64_t base);
+
+// the closest symbol at or below addr inside the image, NULL if none,
+// *off gets addr minus the symbol's address
+const char *symtab_lookup_addr(const symtab_t *st, uint64_t addr,
+                               uint64_t *off);
+// 0 if the name isn't defined here
+uint64_t symtab_lookup_name(const symtab_t *st, const char *name);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef TARGET_H
+#define TARGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// target backends
+// everything the debugger core needs from the operating system, pulled
+// out into a table of function pointers so the same logic can drive a
+// mach task on macOS or a ptrace'd process on linux
+//
+// all ops return 0 on success and non-zero on failure, on mach the value
+// is the kern_return_t, on linux it is -1 with errno set
+
+#ifndef TARGET_DEBUG_REG_MAX
+#define TARGET_DEBUG_REG_MAX 16
+#endif
+
+// an opaque thread handle, a thread port on mach, a tid on linux
+typedef uint64_t target_thread_t;
+
+// arm64 general purpose registers, same layout on both backends
+typedef struct {
+  uint64_t x[29];
+  uint64_t fp;
+  uint64_t lr;
+  uint64_t sp;
+  uint64_t pc;
+  uint32_t cpsr;
+} target_regs_t;
+
+// arm64 debug registers (breakpoint/watchpoint value and control pairs)
+typedef struct {
+  uint64_t bvr[TARGET_DEBUG_REG_MAX];
+  uint64_t bcr[TARGET_DEBUG_REG_MAX];
+  uint64_t wvr[TARGET_DEBUG_REG_MAX];
+  uint64_t wcr[TARGET_DEBUG_REG_MAX];
+  uint64_t mdscr_el1;
+} target_debug_state_t;
+
+// one piece of a scatter/gather memory request
+// - addr   - address in the target
+// - buf    - local buffer to fill (read) or copy from (write)
+// - size   - number of bytes
+// - status - set per entry by the backend, 0 if the whole range was copied
+typedef struct {
+  uint64_t addr;
+  void *buf;
+  size_t size;
+  int status;
+} target_iovec_t;
+
+typedef enum {
+  TARGET_EVENT_NONE = 0,
+  TARGET_EVENT_BREAKPOINT, // brk or hardware breakpoint hit
+  TARGET_EVENT_STEP,       // single step completed
+  TARGET_EVENT_SIGNAL,     // any other stop, see signo
+  TARGET_EVENT_EXITED,     // process went away, see status
+} target_event_kind_t;
+
+typedef struct {
+  target_event_kind_t kind;
+  target_thread_t thread;
+  uint64_t pc;
+  int signo;
+  int status;
+} target_event_t;
+
+// target_backend_t
+// the vtable, a backend that cannot support an op leaves it NULL
+// - read_vectored fills every entry it can and returns non-zero if any
+//   entry failed, the caller checks iov[i].status for which
+// - threads hands back a malloc'd array the caller frees
+// - wait_event blocks for at most timeout_ms (-1 forever) and returns
+//   non-zero on timeout or error
+typedef struct {
+  const char *name;
+
+  int (*attach)(pid_t pid);
+  int (*detach)(void);
+  int (*suspend)(void);
+  int (*resume)(void);
+
+  int (*read)(uint64_t addr, void *out, size_t size);
+  int (*read_vectored)(target_iovec_t *iov, size_t count);
+  int (*write)(uint64_t addr, const void *in, size_t size);
+
+  int (*threads)(target_thread_t **out, size_t *count);
+  int (*get_regs)(target_thread_t thread, target_regs_t *out);
+  int (*set_regs)(target_thread_t thread, const target_regs_t *in);
+  int (*get_debug_regs)(target_thread_t thread, target_debug_state_t *out);
+  int (*set_debug_regs)(target_thread_t thread,
+                        const target_debug_state_t *in);
+
+  int (*wait_event)(target_event_t *out, int timeout_ms);
+} target_backend_t;
+
+#ifdef __APPLE__
+extern const target_backend_t mach_backend;
+#endif
+#ifdef __linux__
+extern const target_backend_t linux_backend;
+#endif
+
+// the backend for the platform we were built on
+const target_backend_t *target_default_backend(void);
+
+// the backend the debugger core reads, writes and runs the target through,
+// the default one unless another was set, tests and benchmarks set theirs,
+// NULL puts the default back
+const target_backend_t *target_backend(void);
+void target_set_backend(const target_backend_t *backend);
+
+#endif
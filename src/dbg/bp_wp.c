@@ -1,101 +1,1544 @@
 #include "dbg/bp_wp.h"
+#include "dbg/coverage.h"
+#include "dbg/symbols.h"
 #include <mach/kern_return.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 #include "mach/mach_process.h"
+#include "target/target.h"
 
-static int ensure_capacity(size_t min_capacity) {
-  if(bp_capacity >= min_capacity) {
+// breakpoints live in an open addressing hash table keyed by address, so
+// the exception listener can resolve a hit in O(1) no matter how many are
+// installed, linear probing, power of two capacity, kept at most half full
+typedef enum {
+  SLOT_EMPTY = 0,
+  SLOT_USED,
+  SLOT_TOMBSTONE,
+} slot_state_t;
+
+typedef struct {
+  slot_state_t state;
+  breakpoint_t bp;
+} bp_slot_t;
+
+static bp_slot_t *table = NULL;
+static size_t table_capacity = 0;
+static size_t bp_count = 0;
+static size_t oneshot_count = 0;
+static size_t hook_count = 0; // hooks with no user breakpoint on them
+static size_t tombstones = 0;
+static int next_index = 0;
+
+static bool hw_slot_used[BP_HW_SLOTS];
+
+// watchpoints are few, a flat array scanned linearly is plenty
+static watchpoint_t watchpoints[WP_MAX];
+static bool wp_used[WP_MAX];
+static int next_wp_index = 0;
+static bool wp_slot_used[WP_HW_SLOTS];
+
+// a single pending step over, the thread that is executing the original
+// instruction of the breakpoint at addr, or the access that tripped
+// watchpoint wp_index (page is the page to re-protect for page watches)
+//
+// the listener moves threads past a false condition, tracepoint or hook
+// with dbg/displace.h and never gets here for them, this is for resuming
+// a stopped thread, watchpoints, and whatever can't be displaced, the
+// text is written twice, original then brk, and while the original is in
+// place every other thread runs through addr without trapping
+static struct {
+  bool active;
+  uint64_t thread;
+  uint64_t addr;
+  bool user_step;
+  int wp_index;
+  uint64_t page;
+} step_over;
+
+// threads the listener found on a false breakpoint or watch fault while
+// another thread had the step over, parked until it is their turn instead
+// of trapping on the brk over and over, watch says the thread is waiting
+// on a watchpoint fault rather than the breakpoint at pc
+typedef struct {
+  uint64_t thread;
+  uint64_t pc;
+  bool user_step;
+  bool watch;
+} step_waiter_t;
+
+static step_waiter_t *waiters = NULL;
+static size_t waiter_count = 0;
+static size_t waiter_cap = 0;
+
+// the thread a watchpoint last trapped, consumed by step_over_begin
+static struct {
+  bool valid;
+  uint64_t thread;
+  int wp_index;
+  uint64_t page;
+} watch_stop;
+
+// the shell adds and removes while the listener looks up
+static pthread_mutex_t bp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t _hash(uint64_t addr) {
+  // instructions are 4 byte aligned, fibonacci hash the rest
+  return (size_t)(((addr >> 2) * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+// returns the slot holding addr, or NULL
+static bp_slot_t *_lookup(uint64_t addr) {
+  if (!table)
+    return NULL;
+  size_t mask = table_capacity - 1;
+  for (size_t i = _hash(addr) & mask;; i = (i + 1) & mask) {
+    if (table[i].state == SLOT_EMPTY)
+      return NULL;
+    if (table[i].state == SLOT_USED && table[i].bp.addr == addr)
+      return &table[i];
+  }
+}
+
+// linear scan by user facing index, the caller holds bp_lock
+static bp_slot_t *_lookup_index(size_t idx) {
+  for (size_t i = 0; i < table_capacity; i++) {
+    if (table[i].state == SLOT_USED && table[i].bp.index == (int)idx)
+      return &table[i];
+  }
+  return NULL;
+}
+
+// first free slot on addr's probe chain, the table must have room
+static bp_slot_t *_insert_slot(uint64_t addr) {
+  size_t mask = table_capacity - 1;
+  for (size_t i = _hash(addr) & mask;; i = (i + 1) & mask) {
+    if (table[i].state != SLOT_USED) {
+      if (table[i].state == SLOT_TOMBSTONE)
+        tombstones--;
+      return &table[i];
+    }
+  }
+}
+
+static int _rehash(size_t new_cap) {
+  bp_slot_t *old = table;
+  size_t old_cap = table_capacity;
+
+  bp_slot_t *tmp = calloc(new_cap, sizeof(*tmp));
+  if (!tmp) {
+    // allocation failed, leave old table intact
+    return -1;
+  }
+
+  table = tmp;
+  table_capacity = new_cap;
+  tombstones = 0;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i].state == SLOT_USED)
+      *_insert_slot(old[i].bp.addr) = old[i];
+  }
+  free(old);
+  return 0;
+}
+
+static int ensure_capacity(size_t min_count) {
+  // keep used + tombstones under half so probe chains stay short
+  if (table && (min_count + tombstones) * 2 <= table_capacity) {
     // already big enough
     return 0;
   }
 
-  // compute the new capacity
-  size_t new_cap = bp_capacity ? bp_capacity * 2 : 4;
-  if(new_cap < min_capacity) new_cap = min_capacity;
+  size_t new_cap = table_capacity ? table_capacity : 64;
+  while (min_count * 2 > new_cap)
+    new_cap *= 2;
 
-  // resize
-  breakpoint_t *tmp = realloc(breakpoints, new_cap + sizeof(*breakpoints));
-  if(!tmp) {
-    // allocation failed, leave old pointers/capacity intact
-    return -1;
+  return _rehash(new_cap);
+}
+
+static int _alloc_hw_slot(void) {
+  for (int i = 0; i < BP_HW_SLOTS; i++) {
+    if (!hw_slot_used[i]) {
+      hw_slot_used[i] = true;
+      return i;
+    }
   }
+  return -1;
+}
+
+static kern_return_t _write_insn(uint64_t addr, uint32_t insn) {
+  write_session_t ws;
+  mach_write_session_init(&ws);
+  kern_return_t kr = mach_write_session_add(&ws, addr, &insn, sizeof(insn));
+  if (kr == KERN_SUCCESS)
+    kr = mach_write_session_commit(&ws);
+  mach_write_session_free(&ws);
+  return kr;
+}
+
+// kernel work is decided under bp_lock and issued once it is dropped, the
+// listener takes bp_lock on every exception and shouldn't sit behind a
+// vm_write or a thread_set_state made on someone else's behalf
+// - ops_lock is taken before bp_lock is let go, so batches reach the
+//   kernel in the order their table changes were made, a hardware slot
+//   freed by one batch is cleared before a later one sets it again
+// - a chained op only runs if the one before it went through
+// - a step over whose begin fails is taken down again by _issue, undo is
+//   what puts the brk or the page protection back
+typedef enum {
+  OP_NONE,
+  OP_TEXT,       // value written over the instruction at addr
+  OP_PROTECT,    // the page at addr gets protection value
+  OP_HW_SET,     // hardware breakpoint slot on addr
+  OP_HW_CLEAR,   // hardware breakpoint slot
+  OP_WP_CLEAR,   // watchpoint slot
+  OP_STEP_BEGIN, // single step thread with slot and wp_slots cleared on it
+  OP_STEP_END,   // thread's debug state back, keep_step keeps the step bit
+  OP_PARK,
+  OP_UNPARK,
+} bp_op_kind_t;
+
+typedef struct {
+  bp_op_kind_t kind;
+  uint64_t thread;
+  uint64_t addr;
+  uint32_t value;
+  int slot;
+  int wp_slots[WP_HW_SLOTS];
+  int nwp;
+  bool keep_step;
+  bool chained;
+  bool report; // part of a removal, a failure is the caller's to print
+  bp_op_kind_t undo;
+  uint64_t undo_addr;
+  uint32_t undo_value;
+  kern_return_t kr;
+} bp_op_t;
+
+// what one change stages fits the local ops, only removals and wakes of
+// many waiters go to the heap
+#define BP_OPS_LOCAL 8
 
-  breakpoints = tmp;
-  bp_capacity = new_cap;
+typedef struct {
+  bp_op_t *ops;
+  size_t count;
+  size_t cap;
+  bp_op_t local[BP_OPS_LOCAL];
+} bp_ops_t;
 
+static pthread_mutex_t ops_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void _ops_init(bp_ops_t *ops) {
+  ops->ops = ops->local;
+  ops->count = 0;
+  ops->cap = BP_OPS_LOCAL;
+}
+
+static void _ops_free(bp_ops_t *ops) {
+  if (ops->ops != ops->local)
+    free(ops->ops);
+  _ops_init(ops);
+}
+
+// room for n more, so a change never stops halfway for want of memory
+static int _ops_reserve(bp_ops_t *ops, size_t n) {
+  if (ops->count + n <= ops->cap)
+    return 0;
+  size_t cap = ops->cap * 2;
+  while (cap < ops->count + n)
+    cap *= 2;
+  bp_op_t *grown = malloc(cap * sizeof(*grown));
+  if (!grown)
+    return -1; // allocation err
+  memcpy(grown, ops->ops, ops->count * sizeof(*grown));
+  if (ops->ops != ops->local)
+    free(ops->ops);
+  ops->ops = grown;
+  ops->cap = cap;
   return 0;
 }
 
+// the caller reserved room
+static bp_op_t *_stage(bp_ops_t *ops, bp_op_kind_t kind, uint64_t thread,
+                       uint64_t addr) {
+  bp_op_t *op = &ops->ops[ops->count++];
+  *op = (bp_op_t){.kind = kind, .thread = thread, .addr = addr, .slot = -1};
+  return op;
+}
+
+static kern_return_t _run_op(const bp_op_t *op) {
+  thread_act_t thread = (thread_act_t)op->thread;
+  switch (op->kind) {
+  case OP_TEXT:
+    return _write_insn(op->addr, op->value);
+  case OP_PROTECT:
+    return mach_protect(op->addr, vm_page_size, (vm_prot_t)op->value);
+  case OP_HW_SET:
+    return mach_set_breakpoint(op->slot, op->addr);
+  case OP_HW_CLEAR:
+    return mach_remove_breakpoint(op->slot);
+  case OP_WP_CLEAR:
+    return mach_remove_watchpoint(op->slot);
+  case OP_STEP_BEGIN:
+    return mach_thread_begin_step_over(thread, op->slot, op->wp_slots,
+                                       op->nwp);
+  case OP_STEP_END:
+    return mach_thread_end_step_over(thread, op->keep_step);
+  case OP_PARK:
+    return mach_thread_park(thread);
+  case OP_UNPARK:
+    return mach_thread_unpark(thread);
+  default:
+    return KERN_SUCCESS;
+  }
+}
+
+// the caller holds bp_lock, it is dropped here
+static void _run(bp_ops_t *ops) {
+  if (!ops->count) {
+    pthread_mutex_unlock(&bp_lock);
+    return;
+  }
+  pthread_mutex_lock(&ops_lock);
+  pthread_mutex_unlock(&bp_lock);
+  for (size_t i = 0; i < ops->count; i++) {
+    bp_op_t *op = &ops->ops[i];
+    if (op->chained && i && ops->ops[i - 1].kr != KERN_SUCCESS)
+      op->kr = KERN_ABORTED;
+    else
+      op->kr = _run_op(op);
+  }
+  pthread_mutex_unlock(&ops_lock);
+}
+
+static void _wake_waiter(bp_ops_t *ops);
+
+// the caller holds bp_lock, the ops run with it dropped, a step over
+// whose begin failed never started, it is taken down again and the next
+// waiter gets its turn, returns -1 if that happened to thread's
+static int _issue(bp_ops_t *ops, uint64_t thread) {
+  int ret = 0;
+  _run(ops);
+
+  bp_ops_t rounds[2];
+  bp_ops_t *cur = ops;
+  for (int r = 0;; r ^= 1) {
+    bool failed = false;
+    for (size_t i = 0; i < cur->count; i++)
+      failed |= cur->ops[i].kind == OP_STEP_BEGIN &&
+                cur->ops[i].kr != KERN_SUCCESS;
+    if (!failed)
+      break;
+
+    bp_ops_t *next = &rounds[r];
+    _ops_init(next);
+    pthread_mutex_lock(&bp_lock);
+    for (size_t i = 0; i < cur->count; i++) {
+      const bp_op_t *op = &cur->ops[i];
+      if (op->kind != OP_STEP_BEGIN || op->kr == KERN_SUCCESS)
+        continue;
+      if (op->thread == thread)
+        ret = -1;
+      // gone meanwhile, whoever removed it put things back
+      if (!step_over.active || step_over.thread != op->thread)
+        continue;
+      step_over.active = false;
+      // or every other thread runs past it unchecked
+      if (op->undo != OP_NONE && cur->ops[i - 1].kr == KERN_SUCCESS &&
+          _ops_reserve(next, 1) == 0)
+        _stage(next, op->undo, 0, op->undo_addr)->value = op->undo_value;
+      _wake_waiter(next);
+    }
+    _run(next);
+    if (cur != ops)
+      _ops_free(cur);
+    cur = next;
+  }
+  if (cur != ops)
+    _ops_free(cur);
+  return ret;
+}
+
+// the caller holds bp_lock, runs what a removal staged with it dropped,
+// ret becomes -1 if the kernel refused any of it
+static int _issue_removal(bp_ops_t *ops, int ret, const char *what) {
+  _issue(ops, 0);
+  for (size_t i = 0; ret == 0 && i < ops->count; i++) {
+    if (ops->ops[i].report && ops->ops[i].kr != KERN_SUCCESS) {
+      printf("removing %s failed\n", what);
+      ret = -1;
+    }
+  }
+  _ops_free(ops);
+  return ret;
+}
+
+// hardware fallback for a breakpoint whose brk could not be written, the
+// slot is set once bp_lock is dropped and the caller checks it took
+static bool _stage_hardware(bp_ops_t *ops, breakpoint_t *bp) {
+  if (_ops_reserve(ops, 1) != 0)
+    return false;
+  int slot = _alloc_hw_slot();
+  if (slot < 0) {
+    fprintf(stderr,
+            "[-] no hardware breakpoint slots left for 0x%016" PRIx64 "\n",
+            bp->addr);
+    return false;
+  }
+  bp->kind = BP_HARDWARE;
+  bp->hw_slot = slot;
+  _stage(ops, OP_HW_SET, 0, bp->addr)->slot = slot;
+  return true;
+}
+
+// the caller holds bp_lock, undoes what counting an entry in did, its
+// condition and trace go with it
+static void _tombstone(bp_slot_t *slot) {
+  if (slot->bp.oneshot)
+    oneshot_count--;
+  else if (slot->bp.index < 0 && slot->bp.hook)
+    hook_count--;
+  cond_free(slot->bp.cond);
+  slot->bp.cond = NULL;
+  free(slot->bp.trace);
+  slot->bp.trace = NULL;
+  slot->bp.hook = NULL;
+  bp_count--;
+  slot->state = SLOT_TOMBSTONE;
+  tombstones++;
+}
+
 // some steps to consider
-// - check for duplicate breakpoints, we dont want a breakpoint installed at the same addr twice
-// - we need to make room, so we call ensure_capacity
-// - append a new entry at the end
-// - increment bp_count
-int add_breakpoint(uint64_t addr) {
-  // check duplicates
-  for(size_t i = 0; i < bp_count; i++) {
-    if(breakpoints[i].addr == addr) {
-      // already have this addr
-      return -1;
+// - check for duplicate breakpoints, we dont want a breakpoint installed at
+//   the same addr twice, the table itself catches those
+// - read every original instruction in one vectored read
+// - write every brk in one write session, so each text page has its
+//   protection flipped once no matter how many land in it
+// - anything we couldn't read or write falls back to a hardware slot,
+//   except one shot breakpoints which are not worth a slot
+//
+// bp_lock is not held across the read or the write session, the listener
+// takes it on every exception and would sit behind the kernel calls, so
+// - the originals are read first, an address that already has a brk reads
+//   back brk and keeps the entry it has
+// - the new entries go in, a thread reaching one before its brk lands just
+//   doesn't trap
+// - the session says which brks landed, entries whose brk didn't are
+//   looked up again by address and fall back or go, a brk whose entry was
+//   removed meanwhile gets its original back
+// - hardware fallbacks are set the same way and checked after
+static size_t _add_breakpoints(const uint64_t *addrs, size_t count,
+                               bool oneshot, bp_hook_fn hook) {
+  if (count == 0)
+    return 0;
+
+  uint32_t *orig = calloc(count, sizeof(*orig));
+  target_iovec_t *iov = calloc(count, sizeof(*iov));
+  kern_return_t *status = calloc(count, sizeof(*status));
+  kern_return_t *landed = calloc(count, sizeof(*landed));
+  size_t *seq = calloc(count, sizeof(*seq));
+  bool *fresh = calloc(count, sizeof(*fresh));
+  size_t installed = 0;
+  if (!orig || !iov || !status || !landed || !seq || !fresh)
+    goto out; // allocation err
+
+  for (size_t i = 0; i < count; i++)
+    iov[i] = (target_iovec_t){.addr = addrs[i], .buf = &orig[i], .size = 4};
+  target_backend()->read_vectored(iov, count);
+
+  pthread_mutex_lock(&bp_lock);
+  // grow once up front
+  if (ensure_capacity(bp_count + count) != 0) {
+    pthread_mutex_unlock(&bp_lock);
+    goto out;
+  }
+  for (size_t i = 0; i < count; i++) {
+    bp_slot_t *existing = _lookup(addrs[i]);
+    if (existing && hook) {
+      // the hook rides on whatever is there, a coverage breakpoint stays
+      if (existing->bp.oneshot) {
+        existing->bp.oneshot = false;
+        oneshot_count--;
+      }
+      if (existing->bp.index < 0 && !existing->bp.hook)
+        hook_count++;
+      existing->bp.hook = hook;
+      installed++;
+      continue;
     }
+    if (existing && existing->bp.index < 0 && !oneshot) {
+      // a user breakpoint on a coverage or hook address takes it over
+      if (existing->bp.oneshot) {
+        existing->bp.oneshot = false;
+        oneshot_count--;
+      } else {
+        hook_count--;
+      }
+      existing->bp.index = next_index++;
+      installed++;
+      continue;
+    }
+    if (existing)
+      continue;
+
+    // counted now so a hit right after the write is already a real one
+    fresh[i] = true;
+    bp_slot_t *slot = _insert_slot(addrs[i]);
+    slot->state = SLOT_USED;
+    slot->bp = (breakpoint_t){.index = -1,
+                              .addr = addrs[i],
+                              .kind = BP_SOFTWARE,
+                              .orig_insn = orig[i],
+                              .hw_slot = -1,
+                              .oneshot = oneshot,
+                              .hook = hook};
+    if (oneshot)
+      oneshot_count++;
+    else if (hook)
+      hook_count++;
+    else
+      slot->bp.index = next_index++;
+    bp_count++;
   }
+  pthread_mutex_unlock(&bp_lock);
 
-  // grow array if needed
-  if(ensure_capacity(bp_count + 1) != 0) {
-    return -1; // allocation err
+  // status follows addrs, the session only sees the readable ones and
+  // seq maps its writes back
+  write_session_t ws;
+  mach_write_session_init(&ws);
+  const uint32_t brk = BP_BRK_INSN;
+  size_t nwrites = 0;
+  for (size_t i = 0; i < count; i++) {
+    status[i] = KERN_FAILURE;
+    if (fresh[i] && iov[i].status == KERN_SUCCESS &&
+        mach_write_session_add(&ws, addrs[i], &brk, sizeof(brk)) ==
+            KERN_SUCCESS)
+      seq[nwrites++] = i;
   }
+  mach_write_session_commit_status(&ws, landed);
+  mach_write_session_free(&ws);
+  for (size_t k = 0; k < nwrites; k++)
+    status[seq[k]] = landed[k];
+
+  write_session_t undo;
+  mach_write_session_init(&undo);
+  bp_ops_t ops;
+  _ops_init(&ops);
+  pthread_mutex_lock(&bp_lock);
+  for (size_t i = 0; i < count; i++) {
+    if (!fresh[i])
+      continue;
+    bp_slot_t *slot = _lookup(addrs[i]);
+    if (status[i] == KERN_SUCCESS) {
+      if (slot)
+        installed++;
+      else
+        mach_write_session_add(&undo, addrs[i], &orig[i], sizeof(orig[i]));
+      continue;
+    }
+    if (!slot)
+      continue;
+    if (oneshot || !_stage_hardware(&ops, &slot->bp)) {
+      _tombstone(slot);
+      continue;
+    }
+    installed++;
+  }
+  _issue(&ops, 0);
+  mach_write_session_commit(&undo);
+  mach_write_session_free(&undo);
+
+  // a slot the kernel refused takes its entry with it, unless that was
+  // removed meanwhile
+  pthread_mutex_lock(&bp_lock);
+  for (size_t i = 0; i < ops.count; i++) {
+    bp_op_t *op = &ops.ops[i];
+    if (op->kr == KERN_SUCCESS)
+      continue;
+    bp_slot_t *slot = _lookup(op->addr);
+    if (slot && slot->bp.kind == BP_HARDWARE && slot->bp.hw_slot == op->slot) {
+      hw_slot_used[op->slot] = false;
+      _tombstone(slot);
+    }
+    installed--;
+  }
+  pthread_mutex_unlock(&bp_lock);
+  _ops_free(&ops);
+
+out:
+  free(orig);
+  free(iov);
+  free(status);
+  free(landed);
+  free(seq);
+  free(fresh);
+  return installed;
+}
+
+size_t add_breakpoints(const uint64_t *addrs, size_t count) {
+  return _add_breakpoints(addrs, count, false, NULL);
+}
+
+size_t add_oneshot_breakpoints(const uint64_t *addrs, size_t count) {
+  return _add_breakpoints(addrs, count, true, NULL);
+}
+
+int add_hook_breakpoint(uint64_t addr, bp_hook_fn hook) {
+  if (!hook)
+    return -1;
+  return _add_breakpoints(&addr, 1, false, hook) == 1 ? 0 : -1;
+}
+
+int add_breakpoint(uint64_t addr) {
+  addr = mach_slide_address(addr);
 
-  // append new entry
-  breakpoints[bp_count].index = (int)bp_count;
-  breakpoints[bp_count].addr = addr;
-  kern_return_t kr = mach_set_breakpoint((int)bp_count, addr);
-  if(kr != KERN_SUCCESS) {
-    printf("dunno what to tell you man\n");
+  breakpoint_t bp;
+  if (find_breakpoint(addr, &bp) && bp.index >= 0) {
+    // already have this addr
     return -1;
   }
 
-  return (int)(bp_count++);
+  if (add_breakpoints(&addr, 1) != 1) {
+    printf("[-] failed to set breakpoint at 0x%016" PRIx64 "\n", addr);
+    return -1;
+  }
+
+  find_breakpoint(addr, &bp);
+  char sym[256];
+  printf("[+] %s breakpoint %d at 0x%016" PRIx64 "%s\n",
+         bp.kind == BP_SOFTWARE ? "software" : "hardware", bp.index, addr,
+         symbols_format(addr, sym, sizeof(sym)));
+  return bp.index;
+}
+
+// the caller holds bp_lock, the original goes back or the hardware slot
+// is cleared once it is dropped, _issue_removal says how that went
+static int _remove_slot(bp_ops_t *ops, bp_slot_t *slot) {
+  breakpoint_t *bp = &slot->bp;
+  if (_ops_reserve(ops, 2) != 0)
+    return -1; // allocation err
+
+  // a thread mid step over already has the original in place, put its
+  // debug state back and let it run on
+  bool stepping = step_over.active && step_over.wp_index < 0 &&
+                  step_over.addr == bp->addr;
+  if (stepping) {
+    step_over.active = false;
+    _stage(ops, OP_STEP_END, step_over.thread, 0)->keep_step =
+        step_over.user_step;
+  }
+
+  bp_op_t *op = NULL;
+  if (bp->kind == BP_HARDWARE) {
+    op = _stage(ops, OP_HW_CLEAR, 0, bp->addr);
+    op->slot = bp->hw_slot;
+    hw_slot_used[bp->hw_slot] = false;
+  } else if (!stepping) {
+    op = _stage(ops, OP_TEXT, 0, bp->addr);
+    op->value = bp->orig_insn;
+  }
+  if (op)
+    op->report = true;
+
+  _tombstone(slot);
+  _wake_waiter(ops);
+  return 0;
+}
+
+// what the user deletes, a hook there stays behind as a hidden breakpoint,
+// the caller holds bp_lock
+static int _remove_user_slot(bp_ops_t *ops, bp_slot_t *slot) {
+  breakpoint_t *bp = &slot->bp;
+  if (!bp->hook)
+    return _remove_slot(ops, slot);
+  if (bp->index < 0)
+    return -1; // not the user's
+
+  cond_free(bp->cond);
+  bp->cond = NULL;
+  free(bp->trace);
+  bp->trace = NULL;
+  bp->index = -1;
+  hook_count++;
+  return 0;
 }
 
-// slide everything after idx down
 int remove_breakpoint_at_index(size_t idx) {
-  if(idx >= bp_count) {
-    return -1;
+  int ret = -1;
+  bp_ops_t ops;
+  _ops_init(&ops);
+  pthread_mutex_lock(&bp_lock);
+  bp_slot_t *slot = _lookup_index(idx);
+  if (slot)
+    ret = _remove_user_slot(&ops, slot);
+  return _issue_removal(&ops, ret, "breakpoint");
+}
+
+int remove_hook_breakpoint(uint64_t addr) {
+  int ret = -1;
+  bp_ops_t ops;
+  _ops_init(&ops);
+  pthread_mutex_lock(&bp_lock);
+  bp_slot_t *slot = _lookup(addr);
+  if (slot && slot->bp.hook) {
+    if (slot->bp.index >= 0) {
+      // the user's breakpoint stays
+      slot->bp.hook = NULL;
+      ret = 0;
+    } else {
+      ret = _remove_slot(&ops, slot);
+    }
   }
-  for(size_t j = idx + 1; j < bp_count; j++) {
-    breakpoints[j - 1] = breakpoints[j];
-    breakpoints[j - 1].index = (int)(j - 1);
+  return _issue_removal(&ops, ret, "breakpoint");
+}
+
+int remove_breakpoint_by_addr(uint64_t addr) {
+  addr = mach_slide_address(addr);
+
+  int ret = -1;
+  bp_ops_t ops;
+  _ops_init(&ops);
+  pthread_mutex_lock(&bp_lock);
+  bp_slot_t *slot = _lookup(addr);
+  if (slot) {
+    // found
+    ret = _remove_user_slot(&ops, slot);
+  }
+  return _issue_removal(&ops, ret, "breakpoint");
+}
+
+bool find_breakpoint(uint64_t addr, breakpoint_t *out) {
+  pthread_mutex_lock(&bp_lock);
+  bp_slot_t *slot = _lookup(addr);
+  if (slot && out)
+    *out = slot->bp;
+  pthread_mutex_unlock(&bp_lock);
+  return slot != NULL;
+}
+
+// the caller holds bp_lock
+static void _mask_one(const breakpoint_t *bp, uint64_t addr, uint8_t *buf,
+                      size_t size) {
+  if (bp->kind != BP_SOFTWARE || bp->addr + 4 <= addr ||
+      bp->addr >= addr + size)
+    return;
+  const uint8_t *insn = (const uint8_t *)&bp->orig_insn;
+  for (size_t k = 0; k < 4; k++) {
+    uint64_t a = bp->addr + k;
+    if (a >= addr && a < addr + size)
+      buf[a - addr] = insn[k];
+  }
+}
+
+void breakpoint_mask(uint64_t addr, void *buf, size_t size) {
+  pthread_mutex_lock(&bp_lock);
+  if (bp_count) {
+    uint64_t first = addr & ~(uint64_t)3;
+    size_t words = (size_t)((addr + size - first + 3) / 4);
+    // a whole __text has far more words than the table has slots
+    if (words > table_capacity) {
+      for (size_t i = 0; i < table_capacity; i++) {
+        if (table[i].state == SLOT_USED)
+          _mask_one(&table[i].bp, addr, buf, size);
+      }
+    } else {
+      for (size_t i = 0; i < words; i++) {
+        bp_slot_t *slot = _lookup(first + i * 4);
+        if (slot)
+          _mask_one(&slot->bp, addr, buf, size);
+      }
+    }
+  }
+  pthread_mutex_unlock(&bp_lock);
+}
+
+size_t breakpoint_count(void) {
+  return bp_count - oneshot_count - hook_count;
+}
+
+size_t remove_oneshot_breakpoints(void) {
+  pthread_mutex_lock(&bp_lock);
+
+  // restore every original instruction in one session
+  write_session_t ws;
+  mach_write_session_init(&ws);
+  size_t removed = 0;
+  for (size_t i = 0; i < table_capacity && oneshot_count; i++) {
+    breakpoint_t *bp = &table[i].bp;
+    if (table[i].state != SLOT_USED || !bp->oneshot)
+      continue;
+    mach_write_session_add(&ws, bp->addr, &bp->orig_insn,
+                           sizeof(bp->orig_insn));
+    table[i].state = SLOT_TOMBSTONE;
+    tombstones++;
+    bp_count--;
+    oneshot_count--;
+    removed++;
   }
-  bp_count--;
 
-  kern_return_t kr = mach_remove_breakpoint((int)idx);
-  if(kr != KERN_SUCCESS) {
-    printf("removing breakpoint failed\n");
+  // committed with bp_lock dropped, behind whatever was staged before
+  pthread_mutex_lock(&ops_lock);
+  pthread_mutex_unlock(&bp_lock);
+  if (mach_write_session_commit(&ws) != KERN_SUCCESS)
+    fprintf(stderr, "[-] failed to restore some one shot breakpoints\n");
+  pthread_mutex_unlock(&ops_lock);
+  mach_write_session_free(&ws);
+  return removed;
+}
+
+int set_breakpoint_condition(size_t idx, const char *expr) {
+  cond_t *cond = NULL;
+  if (expr) {
+    char err[96];
+    cond = cond_compile(expr, err, sizeof(err));
+    if (!cond) {
+      printf("[-] bad condition: %s\n", err);
+      return -1;
+    }
+  }
+
+  pthread_mutex_lock(&bp_lock);
+  bp_slot_t *slot = _lookup_index(idx);
+  if (slot) {
+    cond_free(slot->bp.cond);
+    slot->bp.cond = cond;
+  }
+  pthread_mutex_unlock(&bp_lock);
+
+  if (!slot) {
+    cond_free(cond);
+    printf("[-] no breakpoint with index %zu\n", idx);
     return -1;
   }
+  return 0;
+}
+
+int set_breakpoint_trace(size_t idx, const trace_spec_t *spec) {
+  trace_spec_t *copy = NULL;
+  if (spec) {
+    copy = malloc(sizeof(*copy));
+    if (!copy)
+      return -1; // allocation err
+    *copy = *spec;
+  }
 
+  pthread_mutex_lock(&bp_lock);
+  bp_slot_t *slot = _lookup_index(idx);
+  if (slot) {
+    free(slot->bp.trace);
+    slot->bp.trace = copy;
+  }
+  pthread_mutex_unlock(&bp_lock);
+
+  if (!slot) {
+    free(copy);
+    printf("[-] no breakpoint with index %zu\n", idx);
+    return -1;
+  }
   return 0;
 }
 
-int remove_breakpoint_by_addr(uint64_t addr) {
-  for(size_t i = 0; i < bp_count; i++) {
-    if(breakpoints[i].addr == addr) {
-      // found
-      return remove_breakpoint_at_index(i);
+// memory operands in conditions, addresses are absolute
+static int _cond_read(uint64_t addr, void *out, size_t size) {
+  target_iovec_t iov = {.addr = addr, .buf = out, .size = size};
+  return target_backend()->read_vectored(&iov, 1);
+}
+
+int breakpoint_hit(uint64_t addr, uint64_t thread, const target_regs_t *regs,
+                   breakpoint_t *out) {
+  pthread_mutex_lock(&bp_lock);
+  bp_slot_t *slot = _lookup(addr);
+  if (!slot) {
+    pthread_mutex_unlock(&bp_lock);
+    return -1;
+  }
+
+  if (slot->bp.oneshot) {
+    // seen once, that is all coverage wants, the original goes back and
+    // the thread runs it without a step over
+    breakpoint_t bp = slot->bp;
+    bp_ops_t ops;
+    _ops_init(&ops);
+    _issue_removal(&ops, _remove_slot(&ops, slot), "breakpoint");
+    coverage_record(addr);
+    if (out)
+      *out = bp;
+    return 0;
+  }
+
+  // the hook, the condition and the trace run with bp_lock dropped, on
+  // copies, br delete and br cond free the originals under it
+  if (slot->bp.index >= 0)
+    slot->bp.hits++;
+  breakpoint_t bp = slot->bp;
+  cond_t cond;
+  trace_spec_t trace;
+  if (bp.cond)
+    cond = *bp.cond;
+  if (bp.trace)
+    trace = *bp.trace;
+  pthread_mutex_unlock(&bp_lock);
+
+  if (bp.hook) {
+    bp.hook(thread, regs);
+    if (bp.index < 0) {
+      if (out)
+        *out = bp;
+      return 0;
     }
   }
-  return -1;
+
+  int ret = 1;
+  if (bp.cond) {
+    uint64_t result;
+    if (cond_eval(&cond, regs, _cond_read, &result) != 0) {
+      // can't tell, better to stop than to silently skip
+      fprintf(stderr, "[!] condition of breakpoint %d could not be read\n",
+              bp.index);
+    } else if (result == 0) {
+      ret = 0;
+    }
+  }
+  if (ret && bp.trace) {
+    trace_capture(&trace, bp.index, thread, regs);
+    ret = 0;
+  }
+  if (ret) {
+    bp.stops++;
+    pthread_mutex_lock(&bp_lock);
+    slot = _lookup(addr);
+    if (slot && slot->bp.index == bp.index)
+      slot->bp.stops++;
+    pthread_mutex_unlock(&bp_lock);
+  }
+  if (out)
+    *out = bp;
+  return ret;
+}
+
+static int _cmp_by_index(const void *a, const void *b) {
+  return ((const breakpoint_t *)a)->index - ((const breakpoint_t *)b)->index;
 }
 
 void list_breakpoints(void) {
-  printf("[i] currently %zu breakpoints:\n", bp_count);
-  for(size_t i = 0; i < bp_count; i++) {
+  pthread_mutex_lock(&bp_lock);
+  breakpoint_t *sorted = malloc((bp_count ? bp_count : 1) * sizeof(*sorted));
+  size_t n = 0;
+  for (size_t i = 0; sorted && i < table_capacity; i++) {
+    if (table[i].state == SLOT_USED && table[i].bp.index >= 0)
+      sorted[n++] = table[i].bp;
+  }
+  pthread_mutex_unlock(&bp_lock);
+
+  if (!sorted)
+    return;
+  qsort(sorted, n, sizeof(*sorted), _cmp_by_index);
+
+  printf("[i] currently %zu breakpoints:\n", n);
+  for (size_t i = 0; i < n; i++) {
     // thx gpt i dont like formatting
-    printf("  [%2d] @ 0x%016" PRIx64 "\n",
-               breakpoints[i].index,
-               breakpoints[i].addr);
+    printf("  [%2d] @ 0x%016" PRIx64 " %s  hits %" PRIu64 " stops %" PRIu64,
+           sorted[i].index, sorted[i].addr,
+           sorted[i].kind == BP_SOFTWARE ? "sw" : "hw", sorted[i].hits,
+           sorted[i].stops);
+    if (sorted[i].trace)
+      printf("  trace");
+    if (sorted[i].cond)
+      printf("  if %s", sorted[i].cond->source);
+    char sym[256];
+    printf("%s\n", symbols_format(sorted[i].addr, sym, sizeof(sym)));
   }
+  free(sorted);
   return;
 }
+
+// watchpoints
+
+static const char *_access_str(wp_access_t access) {
+  switch (access) {
+  case WP_READ:
+    return "r";
+  case WP_WRITE:
+    return "w";
+  default:
+    return "rw";
+  }
+}
+
+// the caller holds bp_lock
+static watchpoint_t *_wp_lookup_index(int idx) {
+  for (int i = 0; i < WP_MAX; i++) {
+    if (wp_used[i] && watchpoints[i].index == idx)
+      return &watchpoints[i];
+  }
+  return NULL;
+}
+
+// cover [addr, addr + len) with as few wvr/wcr pairs as possible
+// - aligned runs of at least 16 bytes use the largest aligned power of two
+//   block that fits, watched with mask
+// - everything else gets one doubleword per slot with the covered bytes
+//   selected in bas
+// returns the number of slots needed, or -1 if more than max
+static int _split_range(uint64_t addr, uint64_t len, wp_slot_t *out,
+                        int max) {
+  uint64_t end = addr + len;
+  int n = 0;
+  while (addr < end) {
+    if (n == max)
+      return -1;
+
+    uint64_t dword = addr & ~7ULL;
+    if (addr == dword && end - addr >= 16) {
+      uint32_t mask = 3;
+      while (mask < 31 && (addr & ((2ULL << mask) - 1)) == 0 &&
+             (2ULL << mask) <= end - addr)
+        mask++;
+      out[n++] = (wp_slot_t){.addr = addr, .bas = 0xff, .mask = mask};
+      addr += 1ULL << mask;
+      continue;
+    }
+
+    uint64_t stop = end < dword + 8 ? end : dword + 8;
+    uint32_t bas = 0;
+    for (uint64_t b = addr; b < stop; b++)
+      bas |= 1U << (b - dword);
+    out[n++] = (wp_slot_t){.addr = dword, .bas = bas, .mask = 0};
+    addr = stop;
+  }
+  return n;
+}
+
+static int _page_watch_prot(const watchpoint_t *wp, int orig) {
+  // reads can only be caught by taking every access away
+  if (wp->access & WP_READ)
+    return VM_PROT_NONE;
+  return orig & ~VM_PROT_WRITE;
+}
+
+// the protection a page of a page watch had before it was watched
+static int _page_orig_prot(const watchpoint_t *wp, uint64_t page) {
+  return wp->page_prot[(page - wp->page_start) / vm_page_size];
+}
+
+// arm or disarm a new watchpoint, the caller holds bp_lock, a step over
+// or a removal stages its page and slot changes instead
+static kern_return_t _wp_arm(watchpoint_t *wp) {
+  kern_return_t kr = KERN_SUCCESS;
+  if (wp->kind == WP_HARDWARE) {
+    bool load = wp->access & WP_READ, store = wp->access & WP_WRITE;
+    for (int i = 0; i < wp->nslots && kr == KERN_SUCCESS; i++) {
+      wp_slot_t *s = &wp->hw[i];
+      kr = mach_set_watchpoint(s->slot, s->addr, s->bas, s->mask, load, store);
+    }
+    return kr;
+  }
+
+  for (uint64_t p = wp->page_start; p < wp->page_end; p += vm_page_size) {
+    if (mach_protect(p, vm_page_size,
+                     _page_watch_prot(wp, _page_orig_prot(wp, p))) !=
+        KERN_SUCCESS)
+      kr = KERN_FAILURE;
+  }
+  return kr;
+}
+
+static kern_return_t _wp_disarm(watchpoint_t *wp) {
+  kern_return_t kr = KERN_SUCCESS;
+  if (wp->kind == WP_HARDWARE) {
+    for (int i = 0; i < wp->nslots; i++) {
+      if (mach_remove_watchpoint(wp->hw[i].slot) != KERN_SUCCESS)
+        kr = KERN_FAILURE;
+    }
+    return kr;
+  }
+
+  for (uint64_t p = wp->page_start; p < wp->page_end; p += vm_page_size) {
+    if (mach_protect(p, vm_page_size, _page_orig_prot(wp, p)) != KERN_SUCCESS)
+      kr = KERN_FAILURE;
+  }
+  return kr;
+}
+
+// the caller holds bp_lock, staged like the breakpoint's step over
+static int _watch_step_begin(bp_ops_t *ops, uint64_t thread, bool user_step) {
+  watch_stop.valid = false;
+  watchpoint_t *wp = _wp_lookup_index(watch_stop.wp_index);
+  if (!wp)
+    return 0; // deleted while stopped, nothing to step over
+  if (_ops_reserve(ops, 2) != 0)
+    return -1; // allocation err
+
+  // hardware slots are only disabled on the stepping thread, a page watch
+  // has to give its page back to everyone for the one step
+  bp_op_t *op;
+  if (wp->kind == WP_HARDWARE) {
+    op = _stage(ops, OP_STEP_BEGIN, thread, 0);
+    for (int i = 0; i < wp->nslots; i++)
+      op->wp_slots[i] = wp->hw[i].slot;
+    op->nwp = wp->nslots;
+  } else {
+    int orig = _page_orig_prot(wp, watch_stop.page);
+    _stage(ops, OP_PROTECT, 0, watch_stop.page)->value = orig;
+    op = _stage(ops, OP_STEP_BEGIN, thread, 0);
+    op->chained = true;
+    op->undo = OP_PROTECT;
+    op->undo_addr = watch_stop.page;
+    op->undo_value = _page_watch_prot(wp, orig);
+  }
+
+  step_over.active = true;
+  step_over.thread = thread;
+  step_over.addr = 0;
+  step_over.user_step = user_step;
+  step_over.wp_index = wp->index;
+  step_over.page = watch_stop.page;
+  return 0;
+}
+
+static int _setup_page_watch(watchpoint_t *wp) {
+  uint64_t mask = vm_page_size - 1;
+  wp->kind = WP_PAGE;
+  wp->page_start = wp->addr & ~mask;
+  wp->page_end = (wp->addr + wp->len + mask) & ~mask;
+
+  // a page can only carry one set of reduced protections
+  for (int i = 0; i < WP_MAX; i++) {
+    watchpoint_t *o = &watchpoints[i];
+    if (wp_used[i] && o->kind == WP_PAGE && o->page_start < wp->page_end &&
+        wp->page_start < o->page_end) {
+      printf("[-] range shares pages with watchpoint %d\n", o->index);
+      return -1;
+    }
+  }
+
+  size_t npages = (wp->page_end - wp->page_start) / vm_page_size;
+  wp->page_prot = calloc(npages, sizeof(*wp->page_prot));
+  if (!wp->page_prot)
+    return -1; // allocation err
+
+  for (size_t i = 0; i < npages; i++) {
+    vm_prot_t prot;
+    if (mach_get_protection(wp->page_start + i * vm_page_size, &prot) !=
+        KERN_SUCCESS) {
+      free(wp->page_prot);
+      wp->page_prot = NULL;
+      return -1;
+    }
+    wp->page_prot[i] = prot;
+  }
+  return 0;
+}
+
+int add_watchpoint(uint64_t addr, uint64_t len, wp_access_t access) {
+  addr = mach_slide_address(addr);
+  if (len == 0) {
+    printf("[-] watchpoint length must be non zero\n");
+    return -1;
+  }
+
+  pthread_mutex_lock(&bp_lock);
+
+  int free_idx = -1;
+  for (int i = 0; i < WP_MAX; i++) {
+    if (!wp_used[i]) {
+      free_idx = i;
+      break;
+    }
+  }
+  if (free_idx < 0) {
+    pthread_mutex_unlock(&bp_lock);
+    printf("[-] too many watchpoints\n");
+    return -1;
+  }
+
+  watchpoint_t *wp = &watchpoints[free_idx];
+  *wp = (watchpoint_t){.addr = addr, .len = len, .access = access};
+
+  int free_slots = 0;
+  for (int i = 0; i < WP_HW_SLOTS; i++)
+    free_slots += !wp_slot_used[i];
+
+  int n = _split_range(addr, len, wp->hw, free_slots);
+  if (n > 0) {
+    wp->kind = WP_HARDWARE;
+    wp->nslots = n;
+    for (int i = 0, s = 0; i < n; i++, s++) {
+      while (wp_slot_used[s])
+        s++;
+      wp->hw[i].slot = s;
+    }
+  } else if (_setup_page_watch(wp) != 0) {
+    pthread_mutex_unlock(&bp_lock);
+    return -1;
+  }
+
+  if (_wp_arm(wp) != KERN_SUCCESS) {
+    _wp_disarm(wp);
+    free(wp->page_prot);
+    pthread_mutex_unlock(&bp_lock);
+    printf("[-] failed to set watchpoint at 0x%016" PRIx64 "\n", addr);
+    return -1;
+  }
+
+  for (int i = 0; wp->kind == WP_HARDWARE && i < wp->nslots; i++)
+    wp_slot_used[wp->hw[i].slot] = true;
+  wp->index = next_wp_index++;
+  wp_used[free_idx] = true;
+  int idx = wp->index;
+  wp_kind_t kind = wp->kind;
+  int nslots = wp->nslots;
+
+  pthread_mutex_unlock(&bp_lock);
+
+  if (kind == WP_HARDWARE)
+    printf("[+] watchpoint %d at 0x%016" PRIx64 " len %" PRIu64
+           " %s on %d hardware slot%s\n",
+           idx, addr, len, _access_str(access), nslots, nslots == 1 ? "" : "s");
+  else
+    printf("[+] watchpoint %d at 0x%016" PRIx64 " len %" PRIu64
+           " %s using page protection\n",
+           idx, addr, len, _access_str(access));
+  return idx;
+}
+
+// the caller holds bp_lock, disarmed once it is dropped like a breakpoint
+static int _remove_watch(bp_ops_t *ops, int i) {
+  watchpoint_t *wp = &watchpoints[i];
+  size_t nops = wp->kind == WP_HARDWARE
+                    ? (size_t)wp->nslots
+                    : (wp->page_end - wp->page_start) / vm_page_size;
+  if (_ops_reserve(ops, nops + 1) != 0)
+    return -1; // allocation err
+
+  // same as breakpoints, a thread mid step over gets its state back
+  bool stepping = step_over.active && step_over.wp_index == wp->index;
+  if (stepping) {
+    step_over.active = false;
+    _stage(ops, OP_STEP_END, step_over.thread, 0)->keep_step =
+        step_over.user_step;
+  }
+  if (watch_stop.valid && watch_stop.wp_index == wp->index)
+    watch_stop.valid = false;
+
+  // disarming the whole thing again is harmless if one page is already
+  // restored by a step over
+  bp_op_t *op;
+  for (int s = 0; wp->kind == WP_HARDWARE && s < wp->nslots; s++) {
+    op = _stage(ops, OP_WP_CLEAR, 0, 0);
+    op->slot = wp->hw[s].slot;
+    op->report = true;
+    wp_slot_used[wp->hw[s].slot] = false;
+  }
+  for (uint64_t p = wp->page_start; wp->kind == WP_PAGE && p < wp->page_end;
+       p += vm_page_size) {
+    op = _stage(ops, OP_PROTECT, 0, p);
+    op->value = _page_orig_prot(wp, p);
+    op->report = true;
+  }
+  free(wp->page_prot);
+  wp->page_prot = NULL;
+  wp_used[i] = false;
+  _wake_waiter(ops);
+  return 0;
+}
+
+int remove_watchpoint_at_index(size_t idx) {
+  int ret = -1;
+  bp_ops_t ops;
+  _ops_init(&ops);
+  pthread_mutex_lock(&bp_lock);
+  for (int i = 0; i < WP_MAX; i++) {
+    if (wp_used[i] && watchpoints[i].index == (int)idx) {
+      ret = _remove_watch(&ops, i);
+      break;
+    }
+  }
+  return _issue_removal(&ops, ret, "watchpoint");
+}
+
+int remove_watchpoint_by_addr(uint64_t addr) {
+  addr = mach_slide_address(addr);
+
+  int ret = -1;
+  bp_ops_t ops;
+  _ops_init(&ops);
+  pthread_mutex_lock(&bp_lock);
+  for (int i = 0; i < WP_MAX; i++) {
+    if (wp_used[i] && watchpoints[i].addr == addr) {
+      ret = _remove_watch(&ops, i);
+      break;
+    }
+  }
+  return _issue_removal(&ops, ret, "watchpoint");
+}
+
+// does a hardware trap at addr belong to wp, the reported address can be
+// anywhere in the access so compare against what the slots really cover
+static bool _hw_covers(const watchpoint_t *wp, uint64_t addr) {
+  for (int i = 0; i < wp->nslots; i++) {
+    const wp_slot_t *s = &wp->hw[i];
+    uint64_t size = s->mask ? 1ULL << s->mask : 8;
+    if (addr >= s->addr && addr < s->addr + size)
+      return true;
+  }
+  return false;
+}
+
+int watchpoint_hit(uint64_t thread, uint64_t fault_addr, bool write, bool hw,
+                   watchpoint_t *out) {
+  int ret = -1;
+  pthread_mutex_lock(&bp_lock);
+
+  for (int i = 0; i < WP_MAX; i++) {
+    watchpoint_t *wp = &watchpoints[i];
+    if (!wp_used[i] || (wp->kind == WP_HARDWARE) != hw)
+      continue;
+
+    if (hw) {
+      if (!_hw_covers(wp, fault_addr))
+        continue;
+      ret = 1;
+    } else {
+      if (fault_addr < wp->page_start || fault_addr >= wp->page_end)
+        continue;
+      // the whole page faults, only report what the user asked for
+      bool in_range =
+          fault_addr >= wp->addr && fault_addr < wp->addr + wp->len;
+      bool wanted = wp->access & (write ? WP_WRITE : WP_READ);
+      ret = in_range && wanted ? 1 : 0;
+    }
+
+    watch_stop.valid = true;
+    watch_stop.thread = thread;
+    watch_stop.wp_index = wp->index;
+    watch_stop.page = hw ? 0 : fault_addr & ~((uint64_t)vm_page_size - 1);
+    if (ret == 1)
+      wp->hits++;
+    if (out)
+      *out = *wp;
+    break;
+  }
+
+  pthread_mutex_unlock(&bp_lock);
+  return ret;
+}
+
+void list_watchpoints(void) {
+  pthread_mutex_lock(&bp_lock);
+  size_t n = 0;
+  for (int i = 0; i < WP_MAX; i++)
+    n += wp_used[i];
+  printf("[i] currently %zu watchpoints:\n", n);
+
+  // indexes only grow, print in the order they were set
+  for (int idx = 0; idx < next_wp_index; idx++) {
+    watchpoint_t *wp = _wp_lookup_index(idx);
+    if (!wp)
+      continue;
+    printf("  [%2d] @ 0x%016" PRIx64 " len %-6" PRIu64 " %-2s ", wp->index,
+           wp->addr, wp->len, _access_str(wp->access));
+    if (wp->kind == WP_HARDWARE)
+      printf("hw x%d", wp->nslots);
+    else
+      printf("page");
+    printf("  hits %" PRIu64 "\n", wp->hits);
+  }
+  pthread_mutex_unlock(&bp_lock);
+}
+
+// put the original back under the brk at slot, or clear its hardware
+// slot, and single step thread over it, the caller holds bp_lock and no
+// step over is active, the step over is taken before the kernel has seen
+// any of it, _issue takes it down again if the begin fails
+static int _bp_step_begin(bp_ops_t *ops, uint64_t thread, bp_slot_t *slot,
+                          bool user_step) {
+  if (_ops_reserve(ops, 2) != 0)
+    return -1; // allocation err
+
+  // hardware breakpoints fire before the instruction too, so they get the
+  // same treatment with the slot cleared on this thread instead of the
+  // text restored, a failed begin puts the brk back or every thread would
+  // run past it unchecked
+  bool software = slot->bp.kind == BP_SOFTWARE;
+  if (software) {
+    _stage(ops, OP_TEXT, 0, slot->bp.addr)->value = slot->bp.orig_insn;
+    // other threads pass a tracepoint unrecorded until the brk is back
+    if (slot->bp.trace)
+      trace_note_blind();
+  }
+  bp_op_t *op = _stage(ops, OP_STEP_BEGIN, thread, 0);
+  if (software) {
+    op->chained = true;
+    op->undo = OP_TEXT;
+    op->undo_addr = slot->bp.addr;
+    op->undo_value = BP_BRK_INSN;
+  } else {
+    op->slot = slot->bp.hw_slot;
+  }
+
+  step_over.active = true;
+  step_over.thread = thread;
+  step_over.addr = slot->bp.addr;
+  step_over.user_step = user_step;
+  step_over.wp_index = -1;
+  return 0;
+}
+
+// the step over is free again, the longest waiting thread gets it, the
+// caller holds bp_lock
+//
+// a thread parked on a breakpoint that is still there is stepped over
+// right away, resumed to trap again it would count the hit and run the
+// condition and trace a second time, one whose breakpoint is gone just
+// runs on, and a watch waiter re-faults and asks for itself, step over
+// state for a page watch is only kept for the thread that trapped last
+static void _wake_waiter(bp_ops_t *ops) {
+  while (waiter_count && !step_over.active) {
+    // allocation err, they wait for the next step over to end
+    if (_ops_reserve(ops, 3) != 0)
+      return;
+    step_waiter_t w = waiters[0];
+    memmove(&waiters[0], &waiters[1], (waiter_count - 1) * sizeof(*waiters));
+    waiter_count--;
+
+    bp_slot_t *slot = w.watch ? NULL : _lookup(w.pc);
+    // failing that it traps on the brk again and the listener reports it
+    if (slot)
+      _bp_step_begin(ops, w.thread, slot, w.user_step);
+    _stage(ops, OP_UNPARK, w.thread, 0);
+  }
+}
+
+int breakpoint_step_over_begin(uint64_t thread, uint64_t pc, bool user_step) {
+  int ret = 0;
+  bp_ops_t ops;
+  _ops_init(&ops);
+  pthread_mutex_lock(&bp_lock);
+
+  // one step over at a time, a thread that needs one waits its turn
+  if (step_over.active) {
+    bool needs = (watch_stop.valid && watch_stop.thread == thread) ||
+                 _lookup(pc) != NULL;
+    ret = needs && step_over.thread != thread ? 1 : 0;
+    goto out;
+  }
+
+  if (watch_stop.valid && watch_stop.thread == thread) {
+    ret = _watch_step_begin(&ops, thread, user_step);
+    goto out;
+  }
+
+  bp_slot_t *slot = _lookup(pc);
+  if (slot)
+    ret = _bp_step_begin(&ops, thread, slot, user_step);
+
+out:
+  if (_issue(&ops, thread) != 0)
+    ret = -1;
+  _ops_free(&ops);
+  return ret;
+}
+
+int breakpoint_step_over_defer(uint64_t thread, uint64_t pc, bool user_step) {
+  int ret = 0;
+  bp_ops_t ops;
+  _ops_init(&ops);
+  pthread_mutex_lock(&bp_lock);
+  // it ended while the listener was on its way here
+  if (!step_over.active) {
+    ret = 1;
+    goto out;
+  }
+
+  if (waiter_count == waiter_cap) {
+    size_t cap = waiter_cap ? waiter_cap * 2 : 8;
+    step_waiter_t *grown = realloc(waiters, cap * sizeof(*waiters));
+    if (!grown) {
+      ret = -1; // allocation err
+      goto out;
+    }
+    waiters = grown;
+    waiter_cap = cap;
+  }
+  // parked once bp_lock is dropped, the unpark of whoever wakes it is
+  // staged after this and reaches the kernel after the park
+  _stage(&ops, OP_PARK, thread, 0);
+  bool watch = watch_stop.valid && watch_stop.thread == thread;
+  if (watch)
+    watch_stop.valid = false;
+  waiters[waiter_count++] = (step_waiter_t){
+      .thread = thread, .pc = pc, .user_step = user_step, .watch = watch};
+
+out:
+  _issue(&ops, thread);
+  if (ret == 0 && ops.ops[0].kr != KERN_SUCCESS) {
+    // not parked, it stops instead if it is still in line, if it got its
+    // turn meanwhile the step over it was given is the way on
+    pthread_mutex_lock(&bp_lock);
+    for (size_t i = 0; i < waiter_count; i++) {
+      if (waiters[i].thread != thread)
+        continue;
+      memmove(&waiters[i], &waiters[i + 1],
+              (waiter_count - i - 1) * sizeof(*waiters));
+      waiter_count--;
+      ret = -1;
+      break;
+    }
+    pthread_mutex_unlock(&bp_lock);
+  }
+  _ops_free(&ops);
+  return ret;
+}
+
+void breakpoint_step_over_release(void) {
+  bp_ops_t ops;
+  _ops_init(&ops);
+  pthread_mutex_lock(&bp_lock);
+  if (_ops_reserve(&ops, waiter_count) != 0) {
+    // allocation err, unparked right here
+    for (size_t i = 0; i < waiter_count; i++)
+      mach_thread_unpark((thread_act_t)waiters[i].thread);
+  } else {
+    for (size_t i = 0; i < waiter_count; i++)
+      _stage(&ops, OP_UNPARK, waiters[i].thread, 0);
+  }
+  waiter_count = 0;
+  _issue(&ops, 0);
+  _ops_free(&ops);
+}
+
+bool breakpoint_step_over_end(uint64_t thread) {
+  bp_ops_t ops;
+  _ops_init(&ops);
+  pthread_mutex_lock(&bp_lock);
+  if (!step_over.active || step_over.thread != thread) {
+    pthread_mutex_unlock(&bp_lock);
+    return false;
+  }
+
+  // the local ops hold these two
+  _ops_reserve(&ops, 2);
+  step_over.active = false;
+  // hardware slots come back with the thread's debug state below
+  if (step_over.wp_index >= 0) {
+    watchpoint_t *wp = _wp_lookup_index(step_over.wp_index);
+    if (wp && wp->kind == WP_PAGE)
+      _stage(&ops, OP_PROTECT, 0, step_over.page)->value =
+          _page_watch_prot(wp, _page_orig_prot(wp, step_over.page));
+  } else {
+    bp_slot_t *slot = _lookup(step_over.addr);
+    if (slot && slot->bp.kind == BP_SOFTWARE)
+      _stage(&ops, OP_TEXT, 0, step_over.addr)->value = BP_BRK_INSN;
+  }
+
+  bool swallow = !step_over.user_step;
+  _stage(&ops, OP_STEP_END, thread, 0)->keep_step = !swallow;
+  _wake_waiter(&ops);
+
+  _issue(&ops, 0);
+  _ops_free(&ops);
+  return swallow;
+}
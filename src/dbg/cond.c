@@ -0,0 +1,426 @@
+#include "dbg/cond.h"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// one byte opcodes, OP_IMM is followed by 8 little endian bytes, OP_IMM8
+// and OP_REG by one
+enum {
+  OP_END = 0,
+  OP_IMM,
+  OP_IMM8,
+  OP_REG,
+  OP_LOAD,
+  OP_NOT,
+  OP_BNOT,
+  OP_NEG,
+  OP_MUL,
+  OP_ADD,
+  OP_SUB,
+  OP_SHL,
+  OP_SHR,
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE,
+  OP_EQ,
+  OP_NE,
+  OP_AND,
+  OP_XOR,
+  OP_OR,
+  OP_LAND,
+  OP_LOR,
+};
+
+// register operand numbering, x0-x28 map straight through
+enum {
+  REG_FP = 29,
+  REG_LR = 30,
+  REG_SP = 31,
+  REG_PC = 32,
+  REG_CPSR = 33,
+};
+
+typedef struct {
+  const char *tok;
+  uint8_t op;
+} binop_t;
+
+// binary operators, lowest precedence first, longer spellings before
+// their prefixes
+static const binop_t lvl_lor[] = {{"||", OP_LOR}, {NULL, 0}};
+static const binop_t lvl_land[] = {{"&&", OP_LAND}, {NULL, 0}};
+static const binop_t lvl_or[] = {{"|", OP_OR}, {NULL, 0}};
+static const binop_t lvl_xor[] = {{"^", OP_XOR}, {NULL, 0}};
+static const binop_t lvl_and[] = {{"&", OP_AND}, {NULL, 0}};
+static const binop_t lvl_eq[] = {{"==", OP_EQ}, {"!=", OP_NE}, {NULL, 0}};
+static const binop_t lvl_rel[] = {
+    {"<=", OP_LE}, {">=", OP_GE}, {"<", OP_LT}, {">", OP_GT}, {NULL, 0}};
+static const binop_t lvl_shift[] = {{"<<", OP_SHL}, {">>", OP_SHR}, {NULL, 0}};
+static const binop_t lvl_add[] = {{"+", OP_ADD}, {"-", OP_SUB}, {NULL, 0}};
+static const binop_t lvl_mul[] = {{"*", OP_MUL}, {NULL, 0}};
+
+static const binop_t *const levels[] = {
+    lvl_lor, lvl_land, lvl_or,    lvl_xor, lvl_and,
+    lvl_eq,  lvl_rel,  lvl_shift, lvl_add, lvl_mul,
+};
+#define LEVEL_COUNT (sizeof(levels) / sizeof(levels[0]))
+
+typedef struct {
+  const char *p;
+  cond_t *cond;
+  int depth;
+  bool failed;
+  char *err;
+  size_t err_len;
+} parser_t;
+
+static void _fail(parser_t *ps, const char *msg) {
+  if (ps->failed)
+    return;
+  ps->failed = true;
+  snprintf(ps->err, ps->err_len, "%s at '%.16s'", msg, ps->p);
+}
+
+static void _skip_space(parser_t *ps) {
+  while (isspace((unsigned char)*ps->p))
+    ps->p++;
+}
+
+// stack_delta is how the op changes the evaluation stack depth
+static void _emit(parser_t *ps, const uint8_t *bytes, size_t n,
+                  int stack_delta) {
+  if (ps->failed)
+    return;
+  if (ps->cond->len + n >= COND_MAX_CODE) {
+    _fail(ps, "condition too long");
+    return;
+  }
+  memcpy(ps->cond->code + ps->cond->len, bytes, n);
+  ps->cond->len += (uint16_t)n;
+
+  ps->depth += stack_delta;
+  if (ps->depth > COND_MAX_STACK)
+    _fail(ps, "condition nests too deeply");
+}
+
+static void _emit_op(parser_t *ps, uint8_t op, int stack_delta) {
+  _emit(ps, &op, 1, stack_delta);
+}
+
+static void _emit_imm(parser_t *ps, uint64_t value) {
+  uint8_t buf[9];
+  if (value <= 0xff) {
+    buf[0] = OP_IMM8;
+    buf[1] = (uint8_t)value;
+    _emit(ps, buf, 2, 1);
+    return;
+  }
+  buf[0] = OP_IMM;
+  for (int i = 0; i < 8; i++)
+    buf[1 + i] = (uint8_t)(value >> (8 * i));
+  _emit(ps, buf, 9, 1);
+}
+
+// match one of the level's operators, a single character operator must
+// not be the start of a longer one (& vs &&, < vs << or <=)
+static const binop_t *_match_op(parser_t *ps, const binop_t *ops) {
+  _skip_space(ps);
+  for (const binop_t *op = ops; op->tok; op++) {
+    size_t n = strlen(op->tok);
+    if (strncmp(ps->p, op->tok, n) != 0)
+      continue;
+    if (n == 1) {
+      char next = ps->p[1];
+      if (strchr("|&<>", op->tok[0]) && next == op->tok[0])
+        continue;
+      if (strchr("<>", op->tok[0]) && next == '=')
+        continue;
+    }
+    ps->p += n;
+    return op;
+  }
+  return NULL;
+}
+
+int cond_reg_index(const char *name, size_t len) {
+  static const struct {
+    const char *name;
+    int idx;
+  } named[] = {
+      {"fp", REG_FP}, {"lr", REG_LR},     {"sp", REG_SP},
+      {"pc", REG_PC}, {"cpsr", REG_CPSR},
+  };
+  for (size_t i = 0; i < sizeof(named) / sizeof(named[0]); i++) {
+    if (strlen(named[i].name) == len &&
+        strncasecmp(name, named[i].name, len) == 0)
+      return named[i].idx;
+  }
+
+  if ((name[0] == 'x' || name[0] == 'X') && len >= 2 && len <= 3) {
+    int idx = 0;
+    for (size_t i = 1; i < len; i++) {
+      if (!isdigit((unsigned char)name[i]))
+        return -1;
+      idx = idx * 10 + (name[i] - '0');
+    }
+    // x29 and x30 are fp and lr
+    return idx <= 30 ? idx : -1;
+  }
+  return -1;
+}
+
+static void _parse_level(parser_t *ps, size_t level);
+
+static void _parse_primary(parser_t *ps) {
+  _skip_space(ps);
+  const char *p = ps->p;
+
+  if (*p == '(') {
+    ps->p++;
+    _parse_level(ps, 0);
+    _skip_space(ps);
+    if (*ps->p != ')') {
+      _fail(ps, "expected ')'");
+      return;
+    }
+    ps->p++;
+    return;
+  }
+
+  if (*p == '[') {
+    ps->p++;
+    _parse_level(ps, 0);
+    _skip_space(ps);
+    if (*ps->p != ']') {
+      _fail(ps, "expected ']'");
+      return;
+    }
+    ps->p++;
+    _emit_op(ps, OP_LOAD, 0);
+    return;
+  }
+
+  if (isdigit((unsigned char)*p)) {
+    char *end;
+    uint64_t value = strtoull(p, &end, 0);
+    ps->p = end;
+    _emit_imm(ps, value);
+    return;
+  }
+
+  if (isalpha((unsigned char)*p)) {
+    size_t len = 0;
+    while (isalnum((unsigned char)p[len]))
+      len++;
+    int idx = cond_reg_index(p, len);
+    if (idx < 0) {
+      _fail(ps, "unknown register");
+      return;
+    }
+    ps->p += len;
+    uint8_t buf[2] = {OP_REG, (uint8_t)idx};
+    _emit(ps, buf, 2, 1);
+    return;
+  }
+
+  _fail(ps, "expected a number, register, ( or [");
+}
+
+static void _parse_unary(parser_t *ps) {
+  _skip_space(ps);
+  uint8_t op;
+  switch (*ps->p) {
+  case '!':
+    op = OP_NOT;
+    break;
+  case '~':
+    op = OP_BNOT;
+    break;
+  case '-':
+    op = OP_NEG;
+    break;
+  default:
+    _parse_primary(ps);
+    return;
+  }
+  ps->p++;
+  _parse_unary(ps);
+  _emit_op(ps, op, 0);
+}
+
+static void _parse_level(parser_t *ps, size_t level) {
+  if (level == LEVEL_COUNT) {
+    _parse_unary(ps);
+    return;
+  }
+
+  _parse_level(ps, level + 1);
+  while (!ps->failed) {
+    const binop_t *op = _match_op(ps, levels[level]);
+    if (!op)
+      return;
+    _parse_level(ps, level + 1);
+    _emit_op(ps, op->op, -1);
+  }
+}
+
+cond_t *cond_compile(const char *src, char *err, size_t err_len) {
+  cond_t *cond = calloc(1, sizeof(*cond));
+  if (!cond) {
+    snprintf(err, err_len, "out of memory");
+    return NULL;
+  }
+  snprintf(cond->source, sizeof(cond->source), "%s", src);
+
+  parser_t ps = {.p = src, .cond = cond, .err = err, .err_len = err_len};
+  _parse_level(&ps, 0);
+  _skip_space(&ps);
+  if (!ps.failed && *ps.p != '\0')
+    _fail(&ps, "unexpected input");
+  _emit_op(&ps, OP_END, 0);
+
+  if (ps.failed) {
+    free(cond);
+    return NULL;
+  }
+  return cond;
+}
+
+void cond_free(cond_t *cond) { free(cond); }
+
+const char *cond_reg_name(int idx) {
+  static const char *const names[] = {
+      "x0",  "x1",  "x2",  "x3",  "x4",  "x5",  "x6",  "x7",  "x8",
+      "x9",  "x10", "x11", "x12", "x13", "x14", "x15", "x16", "x17",
+      "x18", "x19", "x20", "x21", "x22", "x23", "x24", "x25", "x26",
+      "x27", "x28", "fp",  "lr",  "sp",  "pc",  "cpsr",
+  };
+  if (idx < 0 || idx >= COND_REG_COUNT)
+    return "?";
+  return names[idx];
+}
+
+uint64_t cond_reg_value(const target_regs_t *regs, int idx) {
+  switch (idx) {
+  case REG_FP:
+    return regs->fp;
+  case REG_LR:
+    return regs->lr;
+  case REG_SP:
+    return regs->sp;
+  case REG_PC:
+    return regs->pc;
+  case REG_CPSR:
+    return regs->cpsr;
+  default:
+    return regs->x[idx];
+  }
+}
+
+int cond_eval(const cond_t *cond, const target_regs_t *regs,
+              range_read_fn read, uint64_t *out) {
+  uint64_t stack[COND_MAX_STACK];
+  size_t sp = 0;
+  const uint8_t *ip = cond->code;
+
+// a and b are the top two entries, b on top
+#define BINARY(expr)                                                           \
+  do {                                                                         \
+    uint64_t b = stack[--sp];                                                  \
+    uint64_t a = stack[sp - 1];                                                \
+    stack[sp - 1] = (expr);                                                    \
+  } while (0)
+
+  for (;;) {
+    switch (*ip++) {
+    case OP_END:
+      *out = sp ? stack[0] : 0;
+      return 0;
+    case OP_IMM: {
+      uint64_t v = 0;
+      for (int i = 0; i < 8; i++)
+        v |= (uint64_t)ip[i] << (8 * i);
+      ip += 8;
+      stack[sp++] = v;
+      break;
+    }
+    case OP_IMM8:
+      stack[sp++] = *ip++;
+      break;
+    case OP_REG:
+      stack[sp++] = cond_reg_value(regs, *ip++);
+      break;
+    case OP_LOAD: {
+      uint64_t v;
+      if (read(stack[sp - 1], &v, sizeof(v)) != 0)
+        return 1;
+      stack[sp - 1] = v;
+      break;
+    }
+    case OP_NOT:
+      stack[sp - 1] = !stack[sp - 1];
+      break;
+    case OP_BNOT:
+      stack[sp - 1] = ~stack[sp - 1];
+      break;
+    case OP_NEG:
+      stack[sp - 1] = -stack[sp - 1];
+      break;
+    case OP_MUL:
+      BINARY(a * b);
+      break;
+    case OP_ADD:
+      BINARY(a + b);
+      break;
+    case OP_SUB:
+      BINARY(a - b);
+      break;
+    case OP_SHL:
+      BINARY(b < 64 ? a << b : 0);
+      break;
+    case OP_SHR:
+      BINARY(b < 64 ? a >> b : 0);
+      break;
+    case OP_LT:
+      BINARY(a < b);
+      break;
+    case OP_LE:
+      BINARY(a <= b);
+      break;
+    case OP_GT:
+      BINARY(a > b);
+      break;
+    case OP_GE:
+      BINARY(a >= b);
+      break;
+    case OP_EQ:
+      BINARY(a == b);
+      break;
+    case OP_NE:
+      BINARY(a != b);
+      break;
+    case OP_AND:
+      BINARY(a & b);
+      break;
+    case OP_XOR:
+      BINARY(a ^ b);
+      break;
+    case OP_OR:
+      BINARY(a | b);
+      break;
+    case OP_LAND:
+      BINARY(a && b);
+      break;
+    case OP_LOR:
+      BINARY(a || b);
+      break;
+    default:
+      return 1;
+    }
+  }
+#undef BINARY
+}
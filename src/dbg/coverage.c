@@ -0,0 +1,232 @@
+#include "dbg/coverage.h"
+#include "dbg/bp_wp.h"
+#include "dbg/macho.h"
+#include "mach/mach_process.h"
+#include "target/code_index.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// drcov stores block sizes as 16 bits
+#define DRCOV_MAX_BLOCK 0xffff
+
+// the image being covered
+// - base/end  - load address and end of __TEXT
+// - blocks    - sorted absolute block starts, sizes run to the next start
+// - hit_bits  - one bit per block
+static struct {
+  bool active;
+  cov_mode_t mode;
+  uint64_t base;
+  uint64_t end;
+  char path[1024];
+  uint64_t *blocks;
+  uint32_t *sizes;
+  size_t count;
+  uint8_t *hit_bits;
+  size_t hits;
+  size_t planted;
+} cov;
+
+// the listener records while the shell starts, stops and exports
+static pthread_mutex_t cov_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the image's function or block starts, sorted, plus where __text ends
+static int _starts(cov_mode_t mode, uint64_t image_base, uint64_t **out,
+                   size_t *count, uint64_t *text_end, uint64_t *image_end) {
+  macho_image_t img;
+  if (macho_open_task(&img, image_base) != 0)
+    return -1;
+
+  uint64_t *fstarts = NULL;
+  size_t nfstarts = 0;
+  uint32_t *text = NULL;
+  int err = macho_function_starts(&img, &fstarts, &nfstarts);
+  if (err == 0)
+    err = macho_read_text(&img, &text);
+  macho_close(&img);
+
+  const macho_layout_t *l = &img.layout;
+  code_index_t idx;
+  if (err == 0)
+    err = code_index_build(&idx, text, l->sect_size, l->sect_addr + l->slide,
+                           fstarts, nfstarts, 0);
+  free(fstarts);
+  free(text);
+  if (err != 0)
+    return -1;
+
+  // keep the half we plant on
+  if (mode == COV_FUNCTIONS) {
+    *out = idx.funcs;
+    *count = idx.nfuncs;
+    free(idx.blocks);
+  } else {
+    *out = idx.blocks;
+    *count = idx.nblocks;
+    free(idx.funcs);
+  }
+  *text_end = idx.end;
+  *image_end = l->text_vmaddr + l->slide + l->text_vmsize;
+  return 0;
+}
+
+static int _cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void _reset(void) {
+  free(cov.blocks);
+  free(cov.sizes);
+  free(cov.hit_bits);
+  memset(&cov, 0, sizeof(cov));
+}
+
+int coverage_start(cov_mode_t mode, uint64_t image_base) {
+  if (cov.active) {
+    printf("[-] coverage already running, coverage stop first\n");
+    return -1;
+  }
+
+  char path[sizeof(cov.path)] = "";
+  if (image_base == 0 &&
+      mach_get_main_image(&image_base, path, sizeof(path)) != KERN_SUCCESS) {
+    printf("[-] could not find the main image\n");
+    return -1;
+  }
+
+  uint64_t *starts = NULL, text_end = 0, image_end = 0;
+  size_t count = 0;
+  if (_starts(mode, image_base, &starts, &count, &text_end, &image_end) !=
+          0 ||
+      count == 0) {
+    free(starts);
+    printf("[-] nothing to cover\n");
+    return -1;
+  }
+
+  pthread_mutex_lock(&cov_lock);
+  _reset();
+  cov.mode = mode;
+  cov.base = image_base;
+  cov.end = image_end;
+  snprintf(cov.path, sizeof(cov.path), "%s", path[0] ? path : "unknown");
+  cov.blocks = starts;
+  cov.count = count;
+  cov.sizes = calloc(count, sizeof(*cov.sizes));
+  cov.hit_bits = calloc((count + 7) / 8, 1);
+  if (!cov.sizes || !cov.hit_bits) {
+    _reset();
+    pthread_mutex_unlock(&cov_lock);
+    return -1; // allocation err
+  }
+  for (size_t i = 0; i < cov.count; i++) {
+    uint64_t next = i + 1 < cov.count ? cov.blocks[i + 1] : text_end;
+    uint64_t size = next - cov.blocks[i];
+    cov.sizes[i] = size > DRCOV_MAX_BLOCK ? DRCOV_MAX_BLOCK : (uint32_t)size;
+  }
+  cov.active = true;
+  pthread_mutex_unlock(&cov_lock);
+
+  // planted after the lock is dropped, a hit can land while we plant
+  cov.planted = add_oneshot_breakpoints(cov.blocks, cov.count);
+  printf("[+] coverage of %s: %zu of %zu %s planted\n", cov.path, cov.planted,
+         cov.count, mode == COV_FUNCTIONS ? "functions" : "blocks");
+  return 0;
+}
+
+int coverage_stop(void) {
+  if (!cov.active) {
+    printf("[-] coverage is not running\n");
+    return -1;
+  }
+
+  size_t removed = remove_oneshot_breakpoints();
+  pthread_mutex_lock(&cov_lock);
+  cov.active = false;
+  pthread_mutex_unlock(&cov_lock);
+
+  printf("[+] coverage stopped, %zu hit, %zu never reached\n", cov.hits,
+         removed);
+  return 0;
+}
+
+void coverage_record(uint64_t addr) {
+  pthread_mutex_lock(&cov_lock);
+  if (!cov.active) {
+    pthread_mutex_unlock(&cov_lock);
+    return;
+  }
+
+  uint64_t *found =
+      bsearch(&addr, cov.blocks, cov.count, sizeof(*cov.blocks), _cmp_u64);
+  if (found) {
+    size_t i = (size_t)(found - cov.blocks);
+    if (!(cov.hit_bits[i / 8] & (1U << (i % 8)))) {
+      cov.hit_bits[i / 8] |= (uint8_t)(1U << (i % 8));
+      cov.hits++;
+    }
+  }
+  pthread_mutex_unlock(&cov_lock);
+}
+
+// drcov version 2, a text header with the module table followed by a
+// binary table of {u32 start offset, u16 size, u16 module id}
+int coverage_export(const char *path) {
+  pthread_mutex_lock(&cov_lock);
+  if (!cov.blocks) {
+    pthread_mutex_unlock(&cov_lock);
+    printf("[-] no coverage recorded\n");
+    return -1;
+  }
+
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    pthread_mutex_unlock(&cov_lock);
+    perror("[-] fopen");
+    return -1;
+  }
+
+  fprintf(f, "DRCOV VERSION: 2\n");
+  fprintf(f, "DRCOV FLAVOR: phantom\n");
+  fprintf(f, "Module Table: version 2, count 1\n");
+  fprintf(f, "Columns: id, base, end, entry, checksum, timestamp, path\n");
+  fprintf(f,
+          " 0, 0x%016" PRIx64 ", 0x%016" PRIx64
+          ", 0x0000000000000000, 0x00000000, 0x00000000, %s\n",
+          cov.base, cov.end, cov.path);
+  fprintf(f, "BB Table: %zu bbs\n", cov.hits);
+
+  for (size_t i = 0; i < cov.count; i++) {
+    if (!(cov.hit_bits[i / 8] & (1U << (i % 8))))
+      continue;
+    struct {
+      uint32_t start;
+      uint16_t size;
+      uint16_t mod_id;
+    } entry = {(uint32_t)(cov.blocks[i] - cov.base), (uint16_t)cov.sizes[i],
+               0};
+    fwrite(&entry, sizeof(entry), 1, f);
+  }
+
+  size_t hits = cov.hits;
+  pthread_mutex_unlock(&cov_lock);
+  fclose(f);
+  printf("[+] wrote %zu blocks to %s\n", hits, path);
+  return 0;
+}
+
+void coverage_print_status(void) {
+  pthread_mutex_lock(&cov_lock);
+  if (!cov.blocks) {
+    printf("[i] coverage not started\n");
+  } else {
+    printf("[i] coverage %s: %s, %zu/%zu %s hit, %zu planted\n",
+           cov.active ? "running" : "stopped", cov.path, cov.hits, cov.count,
+           cov.mode == COV_FUNCTIONS ? "functions" : "blocks", cov.planted);
+  }
+  pthread_mutex_unlock(&cov_lock);
+}
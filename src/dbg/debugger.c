@@ -1,9 +1,54 @@
 #include "dbg/debugger.h"
+#include "dbg/disasm.h"
+#include "dbg/displace.h"
+#include "dbg/lines.h"
+#include "dbg/macho.h"
+#include "dbg/stepper.h"
+#include "dbg/symbols.h"
+#include "exc/exception_listener.h"
+#include "mach/file_backing.h"
+#include "mach/image_table.h"
 #include "mach/mach_process.h"
-#include <capstone/capstone.h>
+#include "mach/page_cache.h"
+#include "mach/reg_cache.h"
+#include "mach/thread_snapshot.h"
+#include "target/code_index.h"
+#include "target/target.h"
 #include <inttypes.h>
 #include <mach/kern_return.h>
+#include <mach-o/loader.h>
+#include <mach/mach_time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// dyld calls its notifier with the mode in x0, then the count and the
+// target address of the dyld_image_info array of the images it just
+// mapped or is about to unmap, runs on the listener thread
+static void _on_dyld_notify(uint64_t thread, const target_regs_t *regs) {
+  (void)thread;
+  kern_return_t kr = image_table_update((image_mode_t)regs->x[0], regs->x[2],
+                                        (uint32_t)regs->x[1]);
+  if (kr != KERN_SUCCESS)
+    fprintf(stderr, "[!] could not follow dyld's image list: %s\n",
+            mach_error_string(kr));
+}
+
+// every loaded image now, then whatever dyld tells its notifier
+static void _track_images(void) {
+  kern_return_t kr = image_table_refresh();
+  if (kr != KERN_SUCCESS) {
+    fprintf(stderr, "[-] image_table_refresh failed: %s (0x%x)\n",
+            mach_error_string(kr), kr);
+    return;
+  }
+  printf("[+] %zu images loaded\n", image_table_images(NULL, 0));
+
+  uint64_t notifier = image_table_notifier();
+  if (!notifier || add_hook_breakpoint(notifier, _on_dyld_notify) != 0)
+    printf("[!] dyld's notifier is not hooked, images loaded from now on "
+           "are not tracked\n");
+}
 
 int attach(pid_t pid) {
   kern_return_t kr = setup_exception_port(pid);
@@ -14,11 +59,63 @@ int attach(pid_t pid) {
   }
   printf("[+] Exception port setup configured successfully for: %d\n", pid);
   attached_pid = pid;
+  symbols_reset();
+  lines_reset();
+  file_backing_reset();
+  _track_images();
   return pid;
 }
 
-int resume(void) {
-  kern_return_t kr = mach_resume();
+// move a thread sitting on a breakpoint past it without the text
+// changing, false if it isn't on one or has to be stepped over the old way
+static bool _displace(thread_act_t thread) {
+  target_regs_t regs;
+  if (target_backend()->get_regs(thread, &regs) != 0 ||
+      !find_breakpoint(regs.pc, NULL))
+    return false;
+  if (displace_breakpoint(&regs) == DISPLACE_FAILED)
+    return false;
+  return target_backend()->set_regs(thread, &regs) == 0;
+}
+
+// move one thread of a stop past whatever stopped it, a single step has
+// to end in a step exception so it always takes the step over, a thread
+// that finds the step over taken by another one is parked until its turn
+static void _pass_stop(thread_act_t thread, uint64_t pc, bool user_step) {
+  if (!user_step && _displace(thread))
+    return;
+  int r = breakpoint_step_over_begin(thread, pc, user_step);
+  while (r == 1) {
+    r = breakpoint_step_over_defer(thread, pc, user_step);
+    if (r == 1)
+      r = breakpoint_step_over_begin(thread, pc, user_step);
+  }
+  if (r < 0)
+    fprintf(stderr, "[-] failed to step over breakpoint at 0x%" PRIx64 "\n",
+            pc);
+}
+
+// every thread that stopped with the task is moved past its breakpoint
+// first, otherwise it would trap on the same instruction again and count
+// and print the hit twice, only the stopped thread takes a user step
+static int _resume(bool user_step) {
+  uint64_t stop_pc;
+  thread_act_t thread = mach_get_stopped_thread(&stop_pc);
+  if (thread != MACH_PORT_NULL)
+    _pass_stop(thread, stop_pc, user_step);
+
+  size_t n = mach_stopped_threads(NULL, 0);
+  held_thread_t *others = calloc(n ? n : 1, sizeof(*others));
+  if (others) {
+    n = mach_stopped_threads(others, n);
+    for (size_t i = 0; i < n; i++) {
+      if (others[i].thread != thread)
+        _pass_stop(others[i].thread, others[i].pc, false);
+    }
+    free(others);
+  }
+
+  kern_return_t kr = target_backend()->resume();
   if (kr != KERN_SUCCESS) {
     fprintf(stderr, "[-] task_resume failed: %s (0x%x)\n",
             mach_error_string(kr), kr);
@@ -28,17 +125,268 @@ int resume(void) {
   return 0;
 }
 
+// how long a held thread waits for another thread's step over to finish
+#define STEP_OVER_WAIT_TRIES 100
+#define STEP_OVER_WAIT_US 1000
+
+// non-stop, let one held thread go, stepping it over whatever it stopped on
+static int _resume_thread(thread_act_t thread, uint64_t pc, bool user_step) {
+  // drop a step bit left over from an earlier step, back on the shared
+  // debug registers
+  mach_thread_end_step_over(thread, false);
+
+  int r = !user_step && _displace(thread)
+              ? 0
+              : breakpoint_step_over_begin(thread, pc, user_step);
+  for (int i = 0; r == 1 && i < STEP_OVER_WAIT_TRIES; i++) {
+    usleep(STEP_OVER_WAIT_US);
+    r = breakpoint_step_over_begin(thread, pc, user_step);
+  }
+  if (r == 1) {
+    printf("[-] another thread is still stepping over a breakpoint, "
+           "try again\n");
+    return 1;
+  }
+  if (r < 0)
+    fprintf(stderr, "[-] failed to step over breakpoint at 0x%" PRIx64 "\n",
+            pc);
+  if (user_step)
+    mach_thread_begin_step_over(thread, -1, NULL, 0);
+
+  kern_return_t kr = mach_thread_release(thread);
+  if (kr != KERN_SUCCESS) {
+    fprintf(stderr, "[-] thread_resume(0x%x) failed: %s (0x%x)\n", thread,
+            mach_error_string(kr), kr);
+    return 1;
+  }
+  printf("[+] thread 0x%x resumed\n", thread);
+  return 0;
+}
+
+// non-stop, continue or step the selected thread, and the task too if it
+// was suspended as a whole
+static int _resume_nonstop(bool user_step) {
+  uint64_t pc;
+  thread_act_t thread = mach_get_stopped_thread(&pc);
+  int ret = 0;
+  if (thread != MACH_PORT_NULL)
+    ret = _resume_thread(thread, pc, user_step);
+
+  if (mach_task_is_stopped()) {
+    kern_return_t kr = target_backend()->resume();
+    if (kr != KERN_SUCCESS) {
+      fprintf(stderr, "[-] task_resume failed: %s (0x%x)\n",
+              mach_error_string(kr), kr);
+      return 1;
+    }
+    printf("[+] task resumed successfully\n");
+  } else if (thread == MACH_PORT_NULL) {
+    printf("[-] no thread is stopped\n");
+    return 1;
+  }
+  return ret;
+}
+
+int resume(void) {
+  stepper_cancel(0);
+  if (mach_nonstop_mode())
+    return _resume_nonstop(false);
+  return _resume(false);
+}
+
+// thread 0 releases every held thread
+int resume_thread(uint64_t thread) {
+  size_t n = mach_held_threads(NULL, 0);
+  held_thread_t *all = calloc(n ? n : 1, sizeof(*all));
+  if (!all)
+    return 1;
+  n = mach_held_threads(all, n);
+
+  int ret = 0;
+  bool found = false;
+  for (size_t i = 0; i < n; i++) {
+    if (thread != 0 && all[i].thread != thread)
+      continue;
+    found = true;
+    stepper_cancel(all[i].thread);
+    ret |= _resume_thread(all[i].thread, all[i].pc, false);
+  }
+  free(all);
+
+  if (!found) {
+    printf("[-] thread 0x%" PRIx64 " is not held\n", thread);
+    return 1;
+  }
+  return ret;
+}
+
+int list_threads(void) {
+  size_t n = mach_held_threads(NULL, 0);
+  printf("[i] %s mode, %zu threads held\n",
+         mach_nonstop_mode() ? "non-stop" : "all-stop", n);
+  if (n == 0)
+    return 0;
+
+  held_thread_t *all = calloc(n, sizeof(*all));
+  if (!all)
+    return 1;
+  n = mach_held_threads(all, n);
+
+  thread_act_t selected = mach_get_stopped_thread(NULL);
+  for (size_t i = 0; i < n; i++)
+    printf("  %c thread 0x%x @ 0x%016" PRIx64 "\n",
+           all[i].thread == selected ? '*' : ' ', all[i].thread, all[i].pc);
+  free(all);
+  return 0;
+}
+
+static void _print_snapshot_regs(const target_regs_t *r) {
+  for (int i = 0; i < 29; i++)
+    printf("    X%-2d 0x%016" PRIx64 "%s", i, r->x[i], i % 4 == 3 ? "\n" : "");
+  printf("    FP  0x%016" PRIx64 "\n", r->fp);
+  printf("    LR  0x%016" PRIx64 "    SP  0x%016" PRIx64
+         "    PC  0x%016" PRIx64 "    CPSR 0x%08x\n",
+         r->lr, r->sp, r->pc, r->cpsr);
+}
+
+// capture every thread and optionally keep the raw records on disk
+static int _snapshot_threads(thread_snapshot_t **snaps, size_t *n,
+                             double *ms) {
+  uint64_t start = mach_absolute_time();
+  kern_return_t kr = thread_snapshot_capture(snaps, n);
+  if (kr != KERN_SUCCESS) {
+    fprintf(stderr, "[-] thread_snapshot_capture failed: %s (0x%x)\n",
+            mach_error_string(kr), kr);
+    return 1;
+  }
+
+  mach_timebase_info_data_t tb;
+  mach_timebase_info(&tb);
+  *ms = (double)(mach_absolute_time() - start) * tb.numer / tb.denom / 1e6;
+  return 0;
+}
+
+int print_threads(bool regs) {
+  thread_snapshot_t *snaps;
+  size_t n;
+  double ms;
+  if (_snapshot_threads(&snaps, &n, &ms))
+    return 1;
+
+  if (!mach_task_is_stopped())
+    printf("[i] task is running, states may be mid-update\n");
+  thread_act_t selected = mach_get_stopped_thread(NULL);
+  for (size_t i = 0; i < n; i++) {
+    const thread_snapshot_t *s = &snaps[i];
+    printf("%c thread 0x%" PRIx64 " tid %" PRIu64 " %-8s cpu %5.1f%% "
+           "user %" PRIu64 "us sys %" PRIu64 "us%s%s\n",
+           s->port == selected ? '*' : ' ', s->port, s->thread_id,
+           thread_run_state_name(s->run_state),
+           s->cpu_usage * 100.0 / TH_USAGE_SCALE, s->user_us, s->system_us,
+           s->name[0] ? " " : "", s->name);
+    if (s->status != KERN_SUCCESS) {
+      printf("    registers unavailable: %s\n", mach_error_string(s->status));
+      continue;
+    }
+    if (regs)
+      _print_snapshot_regs(&s->regs);
+    for (uint32_t f = 0; f < s->nframes; f++)
+      printf("    #%u 0x%016" PRIx64 "\n", f, s->frames[f]);
+  }
+  printf("[i] %zu threads captured in %.3f ms\n", n, ms);
+  free(snaps);
+  return 0;
+}
+
+int save_threads(const char *path) {
+  thread_snapshot_t *snaps;
+  size_t n;
+  double ms;
+  if (_snapshot_threads(&snaps, &n, &ms))
+    return 1;
+
+  int ret = thread_snapshot_write(path, snaps, n);
+  if (ret == 0)
+    printf("[+] %zu threads captured in %.3f ms, saved to %s\n", n, ms, path);
+  free(snaps);
+  return ret ? 1 : 0;
+}
+
+int select_thread(uint64_t thread) {
+  if (mach_select_thread((thread_act_t)thread) != KERN_SUCCESS) {
+    printf("[-] thread 0x%" PRIx64 " is not held\n", thread);
+    return 1;
+  }
+  printf("[+] selected thread 0x%" PRIx64 "\n", thread);
+  return 0;
+}
+
+int toggle_nonstop(void) {
+  if (mach_set_nonstop(!mach_nonstop_mode()) != KERN_SUCCESS)
+    return 1;
+  printf("[+] non-stop mode: %s\n", mach_nonstop_mode() ? "true" : "false");
+  return 0;
+}
+
 int interrupt(void) {
-  kern_return_t kr = mach_suspend();
+  kern_return_t kr = target_backend()->suspend();
   if (kr != KERN_SUCCESS) {
     fprintf(stderr, "[-] task_suspend failed: %s (0x%x)\n",
             mach_error_string(kr), kr);
     return 1;
   }
+  printf("[+] Task [%d] suspended\n", attached_pid);
+  return 0;
+}
+
+// render a stop the exception listener queued, runs on the shell thread
+int print_stop_event(const exc_event_t *ev) {
+  char sym[256], line[256];
+  symbols_format(ev->pc, sym, sizeof(sym));
+  lines_format(ev->pc, line, sizeof(line));
+  switch (ev->kind) {
+  case EV_BREAKPOINT:
+    printf("\n[!] Breakpoint %d hit on thread 0x%" PRIx64 " at 0x%016" PRIx64
+           "%s%s\n",
+           ev->index, ev->thread, ev->pc, sym, line);
+    break;
+  case EV_WATCHPOINT:
+    printf("\n[!] Watchpoint %d hit on thread 0x%" PRIx64
+           ", access to 0x%016" PRIx64 " at 0x%016" PRIx64 "%s%s\n",
+           ev->index, ev->thread, ev->addr, ev->pc, sym, line);
+    break;
+  case EV_STEP: {
+    printf("\n[!] Stepped to 0x%016" PRIx64 "%s%s on thread 0x%" PRIx64
+           " in %u exceptions\n",
+           ev->pc, sym, line, ev->thread, ev->steps);
+    // the source line says more than the disassembly
+    line_entry_t e;
+    if (lines_lookup(ev->pc, &e) == 0 && e.line &&
+        lines_print_source(e.file, e.line, 0) == 0)
+      return 0;
+    break;
+  }
+  default:
+    printf("\n[!] Caught exception %s on thread 0x%" PRIx64
+           ", code=0x%" PRIx64 " at 0x%016" PRIx64 "%s%s\n",
+           exception_name(ev->exception), ev->thread, ev->code[0], ev->pc,
+           sym, line);
+    break;
+  }
+  //  mach_register_exception_print();
+  disasm(ev->pc, 0x16);
   return 0;
 }
 
 int detach(void) {
+  // a brk left in dyld would kill the process on its next dlopen, one
+  // left on a return address by a line step on its next return
+  stepper_cancel(0);
+  breakpoint_step_over_release();
+  uint64_t notifier = image_table_notifier();
+  if (notifier)
+    remove_hook_breakpoint(notifier);
+
   kern_return_t kr = mach_detach();
   if (kr != KERN_SUCCESS) {
     fprintf(stderr, "[-] mach_detach failed: %s (0x%x)\n",
@@ -48,6 +396,11 @@ int detach(void) {
   }
 
   printf("[+] detached from %d\n", attached_pid);
+  symbols_reset();
+  lines_reset();
+  image_table_clear();
+  file_backing_reset();
+  displace_reset();
   return 0;
 }
 
@@ -111,23 +464,26 @@ static void _hex_dump(const void *data, size_t size) {
 static int _read(uintptr_t addr, void *out, size_t size) {
   // round down to the nearest 4byte boundary
   uintptr_t aligned_addr = addr & ~(uintptr_t)(0x3);
-  kern_return_t kr = mach_read(aligned_addr, out, size, false);
+  kern_return_t kr = target_backend()->read(aligned_addr, out, size);
   if (kr != KERN_SUCCESS) {
     fprintf(stderr, "[-] mach_read failed: %s (0x%x)\n", mach_error_string(kr),
             kr);
     return 1;
   }
+  breakpoint_mask(aligned_addr, out, size);
   return 0;
 }
 
 int read64(uintptr_t addr) {
   uint64_t out;
-  kern_return_t kr = mach_read64(addr, &out);
+  addr = mach_slide_address(addr);
+  kern_return_t kr = target_backend()->read(addr, &out, sizeof(out));
   if (kr != KERN_SUCCESS) {
     fprintf(stderr, "[-] mach_read64 failed: %s (0x%x)\n",
             mach_error_string(kr), kr);
     return 1;
   }
+  breakpoint_mask(addr, &out, sizeof(out));
 
   _hex_dump(&out, sizeof(uint64_t));
 
@@ -136,12 +492,14 @@ int read64(uintptr_t addr) {
 
 int read32(uintptr_t addr) {
   uint32_t out;
-  kern_return_t kr = mach_read32(addr, &out);
+  addr = mach_slide_address(addr);
+  kern_return_t kr = target_backend()->read(addr, &out, sizeof(out));
   if (kr != KERN_SUCCESS) {
     fprintf(stderr, "[-] mach_read32 failed: %s (0x%x)\n",
             mach_error_string(kr), kr);
     return 1;
   }
+  breakpoint_mask(addr, &out, sizeof(out));
 
   _hex_dump(&out, sizeof(uint32_t));
 
@@ -149,7 +507,8 @@ int read32(uintptr_t addr) {
 }
 
 int write64(uintptr_t addr, uint64_t bytes) {
-  kern_return_t kr = mach_write64(addr, bytes);
+  kern_return_t kr =
+      target_backend()->write(mach_slide_address(addr), &bytes, sizeof(bytes));
   if (kr != KERN_SUCCESS) {
     fprintf(stderr, "[-] mach_write64 failed: %s (0x%x)\n",
             mach_error_string(kr), kr);
@@ -163,7 +522,8 @@ int write64(uintptr_t addr, uint64_t bytes) {
 }
 
 int write32(uintptr_t addr, uint32_t bytes) {
-  kern_return_t kr = mach_write32(addr, bytes);
+  kern_return_t kr =
+      target_backend()->write(mach_slide_address(addr), &bytes, sizeof(bytes));
   if (kr != KERN_SUCCESS) {
     fprintf(stderr, "[-] mach_write32 failed: %s (0x%x)\n",
             mach_error_string(kr), kr);
@@ -212,70 +572,377 @@ int print_slide(void) {
 }
 
 int step(void) {
+  stepper_cancel(0);
+  // only the selected thread steps, the others never stopped
+  if (mach_nonstop_mode())
+    return _resume_nonstop(true);
+
   kern_return_t kr = mach_step();
   if (kr != KERN_SUCCESS) {
     fprintf(stderr, "[-] mach_step failed: %s (0x%x)\n",
             mach_error_string(kr), kr);
     return 1;
   }
-  resume();
+  _resume(true);
   return 0;
 }
 
-int disasm(uintptr_t addr, size_t size) {
-  csh handle;
-  cs_insn *insn = NULL;
-  void *code = NULL;
-  int ret = 1;
-
-  // init capstone
-  cs_err err = cs_open(CS_ARCH_ARM64, CS_MODE_ARM, &handle);
-  if (err != CS_ERR_OK) {
-    fprintf(stderr, "capstone error: %s\n", cs_strerror(err));
+int step_line(bool into) {
+  uint64_t stop_pc;
+  thread_act_t thread = mach_get_stopped_thread(&stop_pc);
+  if (thread == MACH_PORT_NULL) {
+    printf("[-] no thread is stopped\n");
     return 1;
   }
+  line_entry_t row;
+  if (lines_lookup(stop_pc, &row) != 0 || row.line == 0) {
+    printf("[i] no line info at 0x%016" PRIx64 ", stepping one instruction\n",
+           stop_pc);
+    return step();
+  }
+
+  stepper_cancel(0);
+  stepper_begin(thread, &row, into);
+  if (mach_nonstop_mode())
+    return _resume_nonstop(true);
 
-  // allocate some memory for our code/bytes
-  code = malloc(size);
-  if (code == NULL) {
-    fprintf(stderr, "Error: Failed to allocate %zu bytes for code buffer.\n",
-            size);
-    goto cleanup_capstone;
+  // the thread steps alone, the rest of the task runs while it does
+  kern_return_t kr = mach_thread_begin_step_over(thread, -1, NULL, 0);
+  if (kr != KERN_SUCCESS) {
+    stepper_cancel(thread);
+    fprintf(stderr, "[-] could not single step thread 0x%x: %s (0x%x)\n",
+            thread, mach_error_string(kr), kr);
+    return 1;
   }
+  return _resume(true);
+}
 
-  // read it
-  if (_read(addr, code, size) != 0) {
-    fprintf(stderr,
-            "disasm: _read: failed to read memory at 0x%" PRIxPTR
-            " (size %zu)\n",
-            addr, size);
-    goto cleanup_code_buffer;
+int print_line(uint64_t addr) {
+  line_entry_t e;
+  if (lines_lookup(addr, &e) != 0) {
+    printf("[-] no line info for 0x%016" PRIx64 "\n", addr);
+    return 1;
   }
+  printf("[i] 0x%016" PRIx64 " = %s:%u [0x%016" PRIx64 ", 0x%016" PRIx64
+         ")\n",
+         addr, e.file, e.line, e.start, e.end);
+  if (e.line)
+    lines_print_source(e.file, e.line, 3);
+  return 0;
+}
+
+void print_line_images(void) { lines_print_images(); }
+
+// words read from the target per round, listings longer than this are
+// read and printed a chunk at a time
+#define DISASM_CHUNK_WORDS 64
+
+int disasm(uintptr_t addr, size_t size) {
+  uint32_t code[DISASM_CHUNK_WORDS];
+  // _read rounds down to a word, so does the listing
+  addr &= ~(uintptr_t)0x3;
+  size_t words = size / sizeof(uint32_t);
+  bool first = true;
+
+  while (words > 0) {
+    size_t n = words < DISASM_CHUNK_WORDS ? words : DISASM_CHUNK_WORDS;
+    if (_read(addr, code, n * sizeof(uint32_t)) != 0) {
+      fprintf(stderr,
+              "disasm: _read: failed to read memory at 0x%" PRIxPTR
+              " (size %zu)\n",
+              addr, n * sizeof(uint32_t));
+      return 1;
+    }
 
-  // disasm
-  size_t count = cs_disasm(handle, code, size, addr, 0, &insn);
-  if (count > 0) {
-    // for each ins
-    for (size_t j = 0; j < count; j++) {
-      // print asm
-      printf("0x%" PRIx64 ":\t%s\t\t%s\n", insn[j].address, insn[j].mnemonic,
-             insn[j].op_str);
+    for (size_t j = 0; j < n; j++) {
+      const disasm_insn_t *insn = disasm_insn(addr, code[j]);
+      if (!insn)
+        return 1;
+      // a label at each symbol, and where the listing starts mid function
+      uint64_t off;
+      const char *name = symbols_lookup(addr, &off);
+      if (name && off == 0)
+        printf("%s:\n", name);
+      else if (name && first)
+        printf("%s+0x%" PRIx64 ":\n", name, off);
+      first = false;
+      printf("0x%" PRIx64 ":\t%s\t\t%s\n", insn->addr, insn->mnemonic,
+             insn->op_str);
+      addr += sizeof(uint32_t);
     }
-    cs_free(insn, count);
-    ret = 0;
+    words -= n;
+  }
+  return 0;
+}
+
+// the last image indexed with index build
+static code_index_t code_index;
+static char code_index_name[1024];
+
+int index_image(const char *what) {
+  macho_image_t img;
+  uint64_t base = 0;
+  char name[sizeof(code_index_name)] = "";
+  char *end = NULL;
+  if (what)
+    base = strtoull(what, &end, 0);
+
+  if (what && (end == what || *end != '\0')) {
+    // not a number, a file on disk
+    if (macho_open_file(&img, what) != 0)
+      return 1;
+    snprintf(name, sizeof(name), "%s", what);
   } else {
-    cs_err err = cs_errno(handle);
-    fprintf(stderr,
-            "ERROR: Failed to disassemble given code at 0x%" PRIxPTR
-            ". Capstone error: %s\n",
-            addr, cs_strerror(err));
+    if (!attached_pid) {
+      printf("[-] not attached, index a file instead\n");
+      return 1;
+    }
+    if (base == 0 &&
+        mach_get_main_image(&base, name, sizeof(name)) != KERN_SUCCESS) {
+      printf("[-] could not find the main image\n");
+      return 1;
+    }
+    if (!name[0])
+      snprintf(name, sizeof(name), "0x%016" PRIx64, base);
+    if (macho_open_task(&img, base) != 0)
+      return 1;
   }
 
-cleanup_code_buffer:
-  free(code);
-cleanup_capstone:
-  cs_close(&handle);
-  return ret;
+  uint64_t start = mach_absolute_time();
+  uint64_t *fstarts = NULL;
+  size_t nfstarts = 0;
+  uint32_t *text = NULL;
+  int err = macho_function_starts(&img, &fstarts, &nfstarts);
+  if (err == 0)
+    err = macho_read_text(&img, &text);
+  macho_close(&img);
+  uint64_t read_done = mach_absolute_time();
+
+  const macho_layout_t *l = &img.layout;
+  code_index_t idx;
+  if (err == 0)
+    err = code_index_build(&idx, text, l->sect_size, l->sect_addr + l->slide,
+                           fstarts, nfstarts, 0);
+  uint64_t done = mach_absolute_time();
+  free(fstarts);
+  free(text);
+  if (err != 0) {
+    printf("[-] could not index %s\n", name);
+    return 1;
+  }
+
+  code_index_free(&code_index);
+  code_index = idx;
+  snprintf(code_index_name, sizeof(code_index_name), "%s", name);
+
+  mach_timebase_info_data_t tb;
+  mach_timebase_info(&tb);
+  printf("[+] indexed %s: %zu instructions, %zu functions, %zu blocks\n",
+         name, idx.insns, idx.nfuncs, idx.nblocks);
+  printf("    read %.3f ms, index %.3f ms\n",
+         (double)(read_done - start) * tb.numer / tb.denom / 1e6,
+         (double)(done - read_done) * tb.numer / tb.denom / 1e6);
+  return 0;
+}
+
+int index_lookup(uint64_t addr) {
+  if (!code_index.nblocks) {
+    printf("[-] nothing indexed, index build first\n");
+    return 1;
+  }
+
+  uint64_t func_end, block_end;
+  uint64_t func = code_index_function(&code_index, addr, &func_end);
+  uint64_t block = code_index_block(&code_index, addr, &block_end);
+  if (!func || !block) {
+    printf("[-] 0x%016" PRIx64 " is outside __text of %s\n", addr,
+           code_index_name);
+    return 1;
+  }
+  printf("[i] 0x%016" PRIx64 " in function 0x%016" PRIx64 "+0x%" PRIx64
+         " [0x%016" PRIx64 ", 0x%016" PRIx64 ")\n",
+         addr, func, addr - func, func, func_end);
+  printf("    block [0x%016" PRIx64 ", 0x%016" PRIx64 ")\n", block,
+         block_end);
+  return 0;
+}
+
+void index_print_status(void) {
+  if (!code_index.nblocks) {
+    printf("[i] nothing indexed\n");
+    return;
+  }
+  printf("[i] %s: __text [0x%016" PRIx64 ", 0x%016" PRIx64
+         "), %zu functions, %zu blocks\n",
+         code_index_name, code_index.start, code_index.end, code_index.nfuncs,
+         code_index.nblocks);
+}
+
+int parse_address(const char *s, uint64_t *out) {
+  char *end = NULL;
+  uint64_t v = strtoull(s, &end, 0);
+  if (end != s && *end == '\0') {
+    *out = v;
+    return 0;
+  }
+
+  if (symbols_resolve(s, &v) != 0) {
+    printf("[-] no symbol named %s\n", s);
+    return -1;
+  }
+  // symbols are absolute, callers add the slide to what the user typed
+  *out = mach_unslide_address(v);
+  return 0;
+}
+
+int lookup_symbol(const char *what) {
+  char *end = NULL;
+  uint64_t addr = strtoull(what, &end, 0);
+  if (end != what && *end == '\0') {
+    uint64_t off;
+    const char *name = symbols_lookup(addr, &off);
+    if (!name) {
+      printf("[-] no symbol covers 0x%016" PRIx64 "\n", addr);
+      return 1;
+    }
+    printf("[i] 0x%016" PRIx64 " = %s+0x%" PRIx64 "\n", addr, name, off);
+    return 0;
+  }
+
+  if (symbols_resolve(what, &addr) != 0) {
+    printf("[-] no symbol named %s\n", what);
+    return 1;
+  }
+  printf("[i] %s = 0x%016" PRIx64 "\n", what, addr);
+  return 0;
+}
+
+static const char *_filetype_name(uint32_t filetype) {
+  switch (filetype) {
+  case MH_EXECUTE:
+    return "exec";
+  case MH_DYLIB:
+    return "dylib";
+  case MH_DYLINKER:
+    return "dyld";
+  case MH_BUNDLE:
+    return "bundle";
+  default:
+    return "other";
+  }
+}
+
+int print_images(void) {
+  size_t n = image_table_images(NULL, 0);
+  loaded_image_t *all = malloc((n ? n : 1) * sizeof(*all));
+  if (!all)
+    return 1; // allocation err
+  n = image_table_images(all, n);
+
+  printf("[i] %zu images\n", n);
+  for (size_t i = 0; i < n; i++)
+    printf("  0x%016" PRIx64 " slide 0x%09" PRIx64 " %-6s %s\n", all[i].base,
+           all[i].slide, _filetype_name(all[i].filetype), all[i].path);
+  free(all);
+  return 0;
+}
+
+int image_lookup(uint64_t addr) {
+  loaded_image_t *img = malloc(sizeof(*img));
+  if (!img)
+    return 1; // allocation err
+
+  uint64_t off;
+  if (!image_table_lookup(addr, img, &off)) {
+    printf("[-] no image is loaded at 0x%016" PRIx64 "\n", addr);
+    free(img);
+    return 1;
+  }
+
+  const image_segment_t *seg = NULL;
+  for (uint32_t i = 0; i < img->nsegments && !seg; i++) {
+    uint64_t start = img->segments[i].vmaddr + img->slide;
+    if (addr >= start && addr - start < img->segments[i].vmsize)
+      seg = &img->segments[i];
+  }
+  printf("[i] 0x%016" PRIx64 " = %s+0x%" PRIx64, addr, img->path, off);
+  if (seg)
+    printf(" (%.16s+0x%" PRIx64 ")", seg->name,
+           addr - (seg->vmaddr + img->slide));
+  printf("\n    base 0x%016" PRIx64 " slide 0x%" PRIx64 "\n", img->base,
+         img->slide);
+  free(img);
+  return 0;
+}
+
+int print_image_files(void) {
+  file_backing_print();
+  return 0;
+}
+
+void set_file_reads(bool enabled) {
+  file_backing_set_enabled(enabled);
+  // pages cached this epoch came from wherever they came from
+  page_cache_invalidate();
+}
+
+int toggle_exception_state(void) {
+  kern_return_t kr =
+      mach_set_exception_state_mode(!mach_exception_state_mode());
+  if (kr != KERN_SUCCESS) {
+    fprintf(stderr, "[-] mach_set_exception_state_mode failed: %s (0x%x)\n",
+            mach_error_string(kr), kr);
+    return 1;
+  }
+
+  printf("[+] thread state in exception messages: %s\n",
+         mach_exception_state_mode() ? "true" : "false");
+  return 0;
+}
+
+int print_cache_stats(bool reset) {
+  page_cache_stats_t st;
+  page_cache_get_stats(&st);
+
+  uint64_t lookups = st.hits + st.misses;
+  printf("[i] page cache: %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit)\n",
+         st.hits, st.misses, lookups ? 100.0 * st.hits / lookups : 0.0);
+  printf("    failed fills: %" PRIu64 ", stop epochs: %" PRIu64 "\n",
+         st.fills_failed, st.invalidations);
+
+  coalesce_stats_t rs;
+  mach_get_read_stats(&rs);
+  printf("[i] reads: %zu requests in %zu merged ranges, %zu retried alone\n",
+         rs.entries, rs.ranges, rs.retries);
+
+  file_backing_stats_t fb;
+  file_backing_get_stats(&fb);
+  printf("[i] reads from files: %" PRIu64 " reads, %" PRIu64
+         " KiB, %" PRIu64 " sent to the target for patched pages\n",
+         fb.reads, fb.bytes / 1024, fb.patched);
+  printf("    %zu files back %zu ranges, %zu patched pages, %" PRIu64
+         " rebuilds\n",
+         fb.files, fb.ranges, fb.dirty_pages, fb.rebuilds);
+
+  reg_cache_stats_t rc;
+  reg_cache_get_stats(&rc);
+  printf("[i] register cache: %" PRIu64 " hits, %" PRIu64
+         " misses, %" PRIu64 " write backs, stop epochs: %" PRIu64 "\n",
+         rc.hits, rc.misses, rc.write_backs, rc.invalidations);
+
+  disasm_stats_t ds;
+  disasm_get_stats(&ds);
+  printf("[i] disassembly cache: %" PRIu64 " hits, %" PRIu64
+         " decodes, %" PRIu64 " stale\n",
+         ds.hits, ds.decodes, ds.stale);
+
+  if (reset) {
+    page_cache_reset_stats();
+    file_backing_reset_stats();
+    reg_cache_reset_stats();
+    disasm_reset_stats();
+  }
+  return 0;
 }
 
 uintptr_t pc(void) {
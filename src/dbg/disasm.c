@@ -0,0 +1,77 @@
+#include "dbg/disasm.h"
+#include <capstone/capstone.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+  bool valid;
+  disasm_insn_t insn;
+} disasm_slot_t;
+
+static csh handle;
+static cs_insn *scratch;
+static bool opened;
+
+static disasm_slot_t slots[DISASM_CACHE_SLOTS];
+static disasm_stats_t stats;
+
+// opened on first use and never closed, the process exit takes it down
+static bool _open(void) {
+  if (opened)
+    return true;
+
+  cs_err err = cs_open(CS_ARCH_ARM64, CS_MODE_ARM, &handle);
+  if (err != CS_ERR_OK) {
+    fprintf(stderr, "capstone error: %s\n", cs_strerror(err));
+    return false;
+  }
+  // the one cs_insn every decode goes through
+  scratch = cs_malloc(handle);
+  if (!scratch) {
+    fprintf(stderr, "capstone error: %s\n", cs_strerror(cs_errno(handle)));
+    cs_close(&handle);
+    return false;
+  }
+  opened = true;
+  return true;
+}
+
+static void _decode(uint64_t addr, uint32_t word, disasm_insn_t *out) {
+  const uint8_t *code = (const uint8_t *)&word;
+  size_t size = sizeof(word);
+  uint64_t address = addr;
+
+  out->addr = addr;
+  out->word = word;
+  if (cs_disasm_iter(handle, &code, &size, &address, scratch)) {
+    snprintf(out->mnemonic, sizeof(out->mnemonic), "%s", scratch->mnemonic);
+    snprintf(out->op_str, sizeof(out->op_str), "%s", scratch->op_str);
+  } else {
+    snprintf(out->mnemonic, sizeof(out->mnemonic), ".word");
+    snprintf(out->op_str, sizeof(out->op_str), "0x%08x", word);
+  }
+}
+
+const disasm_insn_t *disasm_insn(uint64_t addr, uint32_t word) {
+  if (!_open())
+    return NULL;
+
+  disasm_slot_t *s = &slots[(addr >> 2) % DISASM_CACHE_SLOTS];
+  if (s->valid && s->insn.addr == addr) {
+    if (s->insn.word == word) {
+      stats.hits++;
+      return &s->insn;
+    }
+    stats.stale++;
+  }
+
+  stats.decodes++;
+  _decode(addr, word, &s->insn);
+  s->valid = true;
+  return &s->insn;
+}
+
+void disasm_get_stats(disasm_stats_t *out) { *out = stats; }
+
+void disasm_reset_stats(void) { stats = (disasm_stats_t){0}; }
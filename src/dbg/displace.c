@@ -0,0 +1,222 @@
+#include "dbg/displace.h"
+#include "dbg/bp_wp.h"
+#include "mach/mach_process.h"
+#include "target/a64.h"
+#include "target/target.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+// b reaches 128MB either way, scratch pages stay a megabyte inside that
+#define SCRATCH_RANGE ((128ULL << 20) - (1ULL << 20))
+// the copy and the branch back
+#define SLOT_SIZE 8
+
+// a scratch page, slots are handed out in order and never reused, origin
+// is the address of the displaced instruction of each slot and insn the
+// instruction itself, a breakpoint moved to new code gets a new slot
+typedef struct {
+  uint64_t base;
+  uint64_t *origin;
+  uint32_t *insn;
+  size_t used;
+} scratch_page_t;
+
+static scratch_page_t *pages = NULL;
+static size_t page_count = 0;
+static size_t page_cap = 0;
+
+// 128MB windows (addr >> 27) with no room for a scratch page, so a
+// breakpoint there doesn't walk the address space on every hit
+static uint64_t *no_room = NULL;
+static size_t no_room_count = 0;
+static size_t no_room_cap = 0;
+
+// the listener displaces, the shell resets on attach
+static pthread_mutex_t displace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t _slots_per_page(void) { return vm_page_size / SLOT_SIZE; }
+
+static bool _in_range(uint64_t a, uint64_t b) {
+  return (a > b ? a - b : b - a) < SCRATCH_RANGE;
+}
+
+// the caller holds displace_lock
+static bool _no_room(uint64_t addr) {
+  for (size_t i = 0; i < no_room_count; i++) {
+    if (no_room[i] == addr >> 27)
+      return true;
+  }
+  return false;
+}
+
+static void _mark_no_room(uint64_t addr) {
+  if (no_room_count == no_room_cap) {
+    size_t cap = no_room_cap ? no_room_cap * 2 : 8;
+    uint64_t *grown = realloc(no_room, cap * sizeof(*no_room));
+    if (!grown)
+      return; // allocation err, it is only a shortcut
+    no_room = grown;
+    no_room_cap = cap;
+  }
+  no_room[no_room_count++] = addr >> 27;
+}
+
+// a page in branch range of addr with a free slot, allocated in the
+// target if there is none, the caller holds displace_lock
+static scratch_page_t *_page_near(uint64_t addr) {
+  for (size_t i = 0; i < page_count; i++) {
+    if (pages[i].used < _slots_per_page() && _in_range(pages[i].base, addr) &&
+        _in_range(pages[i].base + vm_page_size, addr))
+      return &pages[i];
+  }
+  if (_no_room(addr))
+    return NULL;
+
+  if (page_count == page_cap) {
+    size_t cap = page_cap ? page_cap * 2 : 4;
+    scratch_page_t *grown = realloc(pages, cap * sizeof(*pages));
+    if (!grown)
+      return NULL; // allocation err
+    pages = grown;
+    page_cap = cap;
+  }
+  scratch_page_t p = {0};
+  p.origin = calloc(_slots_per_page(), sizeof(*p.origin));
+  p.insn = calloc(_slots_per_page(), sizeof(*p.insn));
+  if (!p.origin || !p.insn) {
+    free(p.origin);
+    free(p.insn);
+    return NULL; // allocation err
+  }
+  // the copies only ever run, the write sessions flip the page for the
+  // duration of each write like they do for the text
+  if (mach_allocate_near(addr, SCRATCH_RANGE - vm_page_size, vm_page_size,
+                         &p.base) != KERN_SUCCESS ||
+      mach_protect(p.base, vm_page_size, VM_PROT_READ | VM_PROT_EXECUTE) !=
+          KERN_SUCCESS) {
+    free(p.origin);
+    free(p.insn);
+    _mark_no_room(addr);
+    return NULL;
+  }
+  pages[page_count] = p;
+  return &pages[page_count++];
+}
+
+// the slot holding a copy of insn from addr, written on first use, 0 if
+// there is no room within branch range
+static uint64_t _slot(uint64_t addr, uint32_t insn) {
+  uint64_t ret = 0;
+  pthread_mutex_lock(&displace_lock);
+  for (size_t i = 0; i < page_count && !ret; i++) {
+    scratch_page_t *p = &pages[i];
+    for (size_t s = 0; s < p->used; s++) {
+      if (p->origin[s] == addr && p->insn[s] == insn) {
+        ret = p->base + s * SLOT_SIZE;
+        break;
+      }
+    }
+  }
+  if (ret)
+    goto out;
+
+  scratch_page_t *p = _page_near(addr);
+  if (!p)
+    goto out;
+  uint64_t slot = p->base + p->used * SLOT_SIZE;
+  int64_t off = (int64_t)(addr + 4) - (int64_t)(slot + 4);
+  uint32_t code[2] = {insn, 0x14000000 | ((uint32_t)(off >> 2) & 0x3ffffff)};
+
+  write_session_t ws;
+  mach_write_session_init(&ws);
+  kern_return_t kr = mach_write_session_add(&ws, slot, code, sizeof(code));
+  if (kr == KERN_SUCCESS)
+    kr = mach_write_session_commit(&ws);
+  mach_write_session_free(&ws);
+  if (kr != KERN_SUCCESS)
+    goto out;
+
+  p->origin[p->used] = addr;
+  p->insn[p->used] = insn;
+  p->used++;
+  ret = slot;
+
+out:
+  pthread_mutex_unlock(&displace_lock);
+  return ret;
+}
+
+// literal loads see the program's data, not our brks
+static int _literal_read(uint64_t addr, void *out, size_t size) {
+  target_iovec_t iov = {.addr = addr, .buf = out, .size = size};
+  if (target_backend()->read_vectored(&iov, 1) != 0)
+    return -1;
+  breakpoint_mask(addr, out, size);
+  return 0;
+}
+
+displace_t displace_breakpoint(target_regs_t *regs) {
+  uint64_t addr = regs->pc;
+  breakpoint_t bp;
+  if (!find_breakpoint(addr, &bp))
+    return DISPLACE_RESUMED; // the original is back already
+
+  // a hardware breakpoint leaves the text alone, its instruction is
+  // read from there
+  uint32_t insn = bp.orig_insn;
+  if (bp.kind == BP_HARDWARE) {
+    target_iovec_t iov = {.addr = addr, .buf = &insn, .size = sizeof(insn)};
+    if (target_backend()->read_vectored(&iov, 1) != 0)
+      return DISPLACE_FAILED;
+  }
+
+  if (a64_emulate(insn, addr, regs, _literal_read))
+    return DISPLACE_EMULATED;
+
+  // out of line only for what doesn't care where it runs, svc returns to
+  // the next instruction like anything else, brk would report the
+  // scratch page
+  a64_insn_t d;
+  bool svc = (insn & 0xffe0001f) == 0xd4000001;
+  if (a64_decode(insn, addr, &d) && !svc)
+    return DISPLACE_FAILED;
+
+  uint64_t slot = _slot(addr, insn);
+  if (!slot)
+    return DISPLACE_FAILED;
+  regs->pc = slot;
+  return DISPLACE_RESUMED;
+}
+
+bool displace_return(uint64_t pc, uint64_t *out) {
+  bool found = false;
+  pthread_mutex_lock(&displace_lock);
+  for (size_t i = 0; i < page_count && !found; i++) {
+    scratch_page_t *p = &pages[i];
+    if (pc < p->base || pc >= p->base + p->used * SLOT_SIZE)
+      continue;
+    uint64_t off = pc - p->base;
+    if (off % SLOT_SIZE == 4) {
+      *out = p->origin[off / SLOT_SIZE] + 4;
+      found = true;
+    }
+    break;
+  }
+  pthread_mutex_unlock(&displace_lock);
+  return found;
+}
+
+void displace_reset(void) {
+  pthread_mutex_lock(&displace_lock);
+  for (size_t i = 0; i < page_count; i++) {
+    free(pages[i].origin);
+    free(pages[i].insn);
+  }
+  free(pages);
+  pages = NULL;
+  page_count = page_cap = 0;
+  free(no_room);
+  no_room = NULL;
+  no_room_count = no_room_cap = 0;
+  pthread_mutex_unlock(&displace_lock);
+}
@@ -0,0 +1,158 @@
+#include "dbg/lines.h"
+#include "mach/image_table.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ok is false for images that have no usable line table, so the files are
+// only looked for once
+typedef struct {
+  uint64_t base;
+  bool ok;
+  line_table_t lt;
+  char path[1024];
+} line_image_t;
+
+static line_image_t *images;
+static size_t nimages;
+static pthread_mutex_t lines_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// too big for the listener's stack, only touched under lines_lock
+static loaded_image_t lookup_img;
+
+static int _try(line_image_t *li, const char *path, const loaded_image_t *img) {
+  static const uint8_t zero[16];
+  if (line_table_open(&li->lt, path, img->slide) != 0)
+    return -1;
+  // a dSYM of another build would put every line in the wrong place
+  if (memcmp(img->uuid, zero, sizeof(zero)) != 0 &&
+      memcmp(li->lt.uuid, img->uuid, sizeof(zero)) != 0) {
+    line_table_free(&li->lt);
+    return -1;
+  }
+  snprintf(li->path, sizeof(li->path), "%s", path);
+  return 0;
+}
+
+// the dSYM xcode leaves next to the image or to any bundle around it,
+// /a/Foo.app/Contents/MacOS/Foo looks in Foo.dSYM beside the binary first
+// and then in /a/Foo.app.dSYM, last the image itself
+static int _open(line_image_t *li, const loaded_image_t *img) {
+  const char *base = strrchr(img->path, '/');
+  base = base ? base + 1 : img->path;
+
+  char path[sizeof(li->path)];
+  size_t len = strlen(img->path);
+  for (size_t end = len; end > 0; end--) {
+    if (end != len && img->path[end] != '/')
+      continue;
+    // only bundles (Foo.app, Foo.framework) above the image itself
+    size_t start = end;
+    while (start > 0 && img->path[start - 1] != '/')
+      start--;
+    if (end != len && !memchr(img->path + start, '.', end - start))
+      continue;
+    int n = snprintf(path, sizeof(path),
+                     "%.*s.dSYM/Contents/Resources/DWARF/%s", (int)end,
+                     img->path, base);
+    if (n > 0 && (size_t)n < sizeof(path) && _try(li, path, img) == 0)
+      return 0;
+  }
+  return _try(li, img->path, img);
+}
+
+// the caller holds lines_lock
+static line_image_t *_image(uint64_t addr) {
+  uint64_t off;
+  if (!image_table_lookup(addr, &lookup_img, &off))
+    return NULL;
+  for (size_t i = 0; i < nimages; i++) {
+    if (images[i].base == lookup_img.base)
+      return images[i].ok ? &images[i] : NULL;
+  }
+
+  line_image_t *tmp = realloc(images, (nimages + 1) * sizeof(*images));
+  if (!tmp)
+    return NULL; // allocation err
+  images = tmp;
+  line_image_t *li = &images[nimages++];
+  memset(li, 0, sizeof(*li));
+  li->base = lookup_img.base;
+  li->ok = lookup_img.path[0] && _open(li, &lookup_img) == 0;
+  return li->ok ? li : NULL;
+}
+
+int lines_lookup(uint64_t addr, line_entry_t *out) {
+  pthread_mutex_lock(&lines_lock);
+  line_image_t *li = _image(addr);
+  int ret = li ? line_table_lookup(&li->lt, addr, out) : -1;
+  pthread_mutex_unlock(&lines_lock);
+  return ret;
+}
+
+const char *lines_format(uint64_t addr, char *buf, size_t len) {
+  line_entry_t e;
+  if (lines_lookup(addr, &e) != 0 || e.line == 0) {
+    snprintf(buf, len, "%s", "");
+    return buf;
+  }
+  const char *name = strrchr(e.file, '/');
+  snprintf(buf, len, " at %s:%u", name ? name + 1 : e.file, e.line);
+  return buf;
+}
+
+int lines_print_source(const char *file, uint32_t line, uint32_t context) {
+  FILE *f = fopen(file, "r");
+  if (!f) {
+    printf("    %s:%u (source not found)\n", file, line);
+    return -1;
+  }
+
+  uint32_t first = line > context ? line - context : 1;
+  uint32_t last = line + context;
+  char *buf = NULL;
+  size_t cap = 0;
+  ssize_t n;
+  for (uint32_t no = 1; no <= last && (n = getline(&buf, &cap, f)) >= 0;
+       no++) {
+    if (no < first)
+      continue;
+    if (n > 0 && buf[n - 1] == '\n')
+      buf[n - 1] = '\0';
+    printf("%s %5u  %s\n", no == line ? "->" : "  ", no, buf);
+  }
+  free(buf);
+  fclose(f);
+  return 0;
+}
+
+void lines_reset(void) {
+  pthread_mutex_lock(&lines_lock);
+  for (size_t i = 0; i < nimages; i++) {
+    if (images[i].ok)
+      line_table_free(&images[i].lt);
+  }
+  free(images);
+  images = NULL;
+  nimages = 0;
+  pthread_mutex_unlock(&lines_lock);
+}
+
+void lines_print_images(void) {
+  pthread_mutex_lock(&lines_lock);
+  size_t ok = 0;
+  for (size_t i = 0; i < nimages; i++)
+    ok += images[i].ok;
+  printf("[i] %zu of %zu images looked at have line tables\n", ok, nimages);
+  for (size_t i = 0; i < nimages; i++) {
+    const line_table_t *lt = &images[i].lt;
+    if (!images[i].ok)
+      continue;
+    printf("  0x%016" PRIx64 " %zu of %zu units decoded, %zu rows  %s\n",
+           images[i].base, lt->decoded, lt->nunits, lt->nrows,
+           images[i].path);
+  }
+  pthread_mutex_unlock(&lines_lock);
+}
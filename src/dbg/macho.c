@@ -0,0 +1,207 @@
+#include "dbg/macho.h"
+#include "dbg/bp_wp.h"
+#include "mach/mach_process.h"
+#include "target/target.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libkern/OSByteOrder.h>
+#include <mach-o/fat.h>
+#include <mach-o/loader.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// size bytes at off from the mach header, in the target or the file
+static int _read(const macho_image_t *img, uint64_t off, void *out,
+                 size_t size) {
+  if (img->fd < 0) {
+    target_iovec_t iov = {.addr = img->base + off, .buf = out, .size = size};
+    return target_backend()->read_vectored(&iov, 1) == 0 ? 0 : -1;
+  }
+
+  ssize_t got = pread(img->fd, out, size, (off_t)(img->slice_off + off));
+  return got == (ssize_t)size ? 0 : -1;
+}
+
+// a universal file holds one image per architecture, find the arm64 one
+static int _find_slice(macho_image_t *img) {
+  struct fat_header fh;
+  if (pread(img->fd, &fh, sizeof(fh), 0) != sizeof(fh))
+    return -1;
+  if (OSSwapBigToHostInt32(fh.magic) != FAT_MAGIC)
+    return 0; // thin
+
+  uint32_t n = OSSwapBigToHostInt32(fh.nfat_arch);
+  for (uint32_t i = 0; i < n; i++) {
+    struct fat_arch fa;
+    if (pread(img->fd, &fa, sizeof(fa), sizeof(fh) + i * sizeof(fa)) !=
+        sizeof(fa))
+      return -1;
+    if ((cpu_type_t)OSSwapBigToHostInt32(fa.cputype) == CPU_TYPE_ARM64) {
+      img->slice_off = OSSwapBigToHostInt32(fa.offset);
+      return 0;
+    }
+  }
+  printf("[-] universal binary has no arm64 slice\n");
+  return -1;
+}
+
+static int _parse(macho_image_t *img) {
+  macho_layout_t *out = &img->layout;
+  struct mach_header_64 mh;
+  if (_read(img, 0, &mh, sizeof(mh)) != 0 || mh.magic != MH_MAGIC_64) {
+    printf("[-] no 64 bit mach-o header\n");
+    return -1;
+  }
+
+  uint8_t *cmds = malloc(mh.sizeofcmds);
+  if (!cmds)
+    return -1; // allocation err
+  if (_read(img, sizeof(mh), cmds, mh.sizeofcmds) != 0) {
+    free(cmds);
+    return -1;
+  }
+
+  memset(out, 0, sizeof(*out));
+  uint32_t off = 0;
+  for (uint32_t i = 0; i < mh.ncmds && off + sizeof(struct load_command) <=
+                                           mh.sizeofcmds;
+       i++) {
+    struct load_command *lc = (struct load_command *)(cmds + off);
+    if (lc->cmdsize == 0 || off + lc->cmdsize > mh.sizeofcmds)
+      break;
+
+    if (lc->cmd == LC_SEGMENT_64) {
+      struct segment_command_64 *seg = (struct segment_command_64 *)lc;
+      if (strncmp(seg->segname, SEG_TEXT, 16) == 0) {
+        out->text_vmaddr = seg->vmaddr;
+        out->text_vmsize = seg->vmsize;
+        struct section_64 *sect = (struct section_64 *)(seg + 1);
+        for (uint32_t s = 0; s < seg->nsects; s++) {
+          if (strncmp(sect[s].sectname, "__text", 16) == 0) {
+            out->sect_addr = sect[s].addr;
+            out->sect_size = sect[s].size;
+            out->sect_offset = sect[s].offset;
+          }
+        }
+      } else if (strncmp(seg->segname, SEG_LINKEDIT, 16) == 0) {
+        out->linkedit_vmaddr = seg->vmaddr;
+        out->linkedit_fileoff = seg->fileoff;
+      }
+    } else if (lc->cmd == LC_FUNCTION_STARTS) {
+      struct linkedit_data_command *ld = (struct linkedit_data_command *)lc;
+      out->fstarts_off = ld->dataoff;
+      out->fstarts_size = ld->datasize;
+    }
+    off += lc->cmdsize;
+  }
+  free(cmds);
+
+  if (!out->sect_size) {
+    printf("[-] image has no __TEXT,__text\n");
+    return -1;
+  }
+  out->slide = img->fd < 0 ? img->base - out->text_vmaddr : 0;
+  return 0;
+}
+
+int macho_open_task(macho_image_t *img, uint64_t base) {
+  *img = (macho_image_t){.fd = -1, .base = base};
+  if (_parse(img) != 0) {
+    printf("[-] could not parse the image at 0x%016" PRIx64 "\n", base);
+    return -1;
+  }
+  return 0;
+}
+
+int macho_open_file(macho_image_t *img, const char *path) {
+  *img = (macho_image_t){.fd = open(path, O_RDONLY)};
+  if (img->fd < 0) {
+    perror("[-] open");
+    return -1;
+  }
+  if (_find_slice(img) != 0 || _parse(img) != 0) {
+    printf("[-] could not parse %s\n", path);
+    macho_close(img);
+    return -1;
+  }
+  return 0;
+}
+
+void macho_close(macho_image_t *img) {
+  if (img->fd >= 0)
+    close(img->fd);
+  img->fd = -1;
+}
+
+int macho_read_linkedit(const macho_image_t *img, uint64_t off, void *out,
+                        size_t size) {
+  // in the target __LINKEDIT sits at its vmaddr, not its file offset
+  if (img->fd < 0) {
+    const macho_layout_t *l = &img->layout;
+    off = l->linkedit_vmaddr + (off - l->linkedit_fileoff) - l->text_vmaddr;
+  }
+  return _read(img, off, out, size);
+}
+
+int macho_read_text(const macho_image_t *img, uint32_t **out) {
+  const macho_layout_t *l = &img->layout;
+  *out = malloc(l->sect_size);
+  if (!*out)
+    return -1; // allocation err
+
+  uint64_t off =
+      img->fd < 0 ? l->sect_addr - l->text_vmaddr : (uint64_t)l->sect_offset;
+  if (_read(img, off, *out, l->sect_size) != 0) {
+    free(*out);
+    *out = NULL;
+    return -1;
+  }
+  // the indexer decodes what the image holds, not our brks
+  if (img->fd < 0)
+    breakpoint_mask(img->base + off, *out, l->sect_size);
+  return 0;
+}
+
+// LC_FUNCTION_STARTS is a run of uleb128 deltas, the first from the start
+// of __TEXT, terminated by a zero
+int macho_function_starts(const macho_image_t *img, uint64_t **out,
+                          size_t *count) {
+  const macho_layout_t *l = &img->layout;
+  *out = NULL;
+  *count = 0;
+  if (!l->fstarts_size)
+    return 0;
+
+  uint8_t *data = malloc(l->fstarts_size);
+  // every delta is at least one byte
+  uint64_t *funcs = malloc(l->fstarts_size * sizeof(*funcs));
+  if (!data || !funcs ||
+      macho_read_linkedit(img, l->fstarts_off, data, l->fstarts_size) != 0) {
+    free(data);
+    free(funcs);
+    return -1;
+  }
+
+  uint64_t func = l->text_vmaddr + l->slide;
+  size_t n = 0;
+  const uint8_t *p = data, *end = data + l->fstarts_size;
+  while (p < end) {
+    uint64_t delta = 0;
+    int shift = 0;
+    do {
+      delta |= (uint64_t)(*p & 0x7f) << shift;
+      shift += 7;
+    } while (*p++ & 0x80 && p < end);
+    if (delta == 0)
+      break;
+    func += delta;
+    funcs[n++] = func;
+  }
+
+  free(data);
+  *out = funcs;
+  *count = n;
+  return 0;
+}
@@ -0,0 +1,189 @@
+#include "dbg/stepper.h"
+#include "dbg/bp_wp.h"
+#include "dbg/lines.h"
+#include "mach/mach_process.h"
+#include "target/a64.h"
+#include "target/target.h"
+#include <pthread.h>
+#include <string.h>
+
+// the plan
+// - start, end   - range of the row being stepped, moves when the thread
+//                  lands in the middle of another row
+// - line_start   - where the row the step began in starts
+// - file, line   - what the step began on, file belongs to the line table
+// - stepping     - the thread has its step bit, false while it runs a
+//                  callee to return_bp
+// - last_pc      - where the previous exception was, a thread that just
+//                  called something has lr == last_pc + 4
+// - return_sp    - sp at the call, a deeper recursion hitting return_bp
+//                  has a lower one
+static struct {
+  bool active;
+  uint64_t thread;
+  bool into;
+  bool stepping;
+  uint64_t start;
+  uint64_t end;
+  uint64_t line_start;
+  const char *file;
+  uint32_t line;
+  uint64_t last_pc;
+  uint64_t return_bp;
+  uint64_t return_sp;
+  uint32_t steps;
+} plan;
+
+// the shell starts and cancels, the listener steps
+static pthread_mutex_t step_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// other threads running into the return breakpoint just carry on
+static void _on_return(uint64_t thread, const target_regs_t *regs) {
+  (void)thread;
+  (void)regs;
+}
+
+// the caller holds step_lock, bp_lock is only ever taken inside it
+static void _set_step(bool on) {
+  if (on == plan.stepping)
+    return;
+  plan.stepping = on;
+  if (on)
+    mach_thread_begin_step_over((thread_act_t)plan.thread, -1, NULL, 0);
+  else
+    mach_thread_end_step_over((thread_act_t)plan.thread, false);
+}
+
+static void _drop_return(void) {
+  if (!plan.return_bp)
+    return;
+  remove_hook_breakpoint(plan.return_bp);
+  plan.return_bp = 0;
+}
+
+// run the callee at full speed until it comes back to addr, false if
+// something else already sits there and stepping has to go on instead
+static bool _run_to_return(uint64_t addr, uint64_t sp) {
+  if (find_breakpoint(addr, NULL) || add_hook_breakpoint(addr, _on_return))
+    return false;
+  plan.return_bp = addr;
+  plan.return_sp = sp;
+  _set_step(false);
+  return true;
+}
+
+static bool _is_call(uint64_t pc) {
+  uint32_t insn;
+  target_iovec_t iov = {.addr = pc, .buf = &insn, .size = sizeof(insn)};
+  a64_insn_t d;
+  return target_backend()->read_vectored(&iov, 1) == 0 &&
+         a64_decode(insn, pc, &d) && a64_is_call(d.kind);
+}
+
+static stepper_action_t _finish(uint32_t *steps) {
+  _drop_return();
+  _set_step(false);
+  plan.active = false;
+  *steps = plan.steps;
+  return STEPPER_STOP;
+}
+
+// where the thread is now decides, on_bp says a breakpoint sits at pc,
+// it gets the exception unless the line step ends right here, the caller
+// holds step_lock
+static stepper_action_t _decide(const target_regs_t *regs, bool on_bp,
+                                uint32_t *steps) {
+  uint64_t pc = regs->pc;
+  if (pc < plan.start || pc >= plan.end) {
+    line_entry_t e;
+    bool lines = lines_lookup(pc, &e) == 0 && e.line != 0;
+    // the previous exception was on the call, this is the callee's first
+    // instruction, lr stays put while a breakpoint here is stepped over
+    bool called = plan.last_pc && regs->lr == plan.last_pc + 4;
+    if (called && !(plan.into && lines)) {
+      if (on_bp)
+        return STEPPER_PASS;
+      return _run_to_return(regs->lr, regs->sp) ? STEPPER_CONTINUE
+                                                : _finish(steps);
+    }
+    if (called || !lines)
+      return _finish(steps);
+
+    bool new_line = e.line != plan.line || strcmp(e.file, plan.file) != 0;
+    if ((pc == e.start && new_line) || pc == plan.line_start)
+      return _finish(steps);
+    // code the compiler gave no line, or the middle of a row, step on
+    // with its range
+    plan.start = e.start;
+    plan.end = e.end;
+  }
+
+  plan.last_pc = pc;
+  if (on_bp) {
+    _set_step(true);
+    return STEPPER_PASS;
+  }
+  if (!plan.into && _is_call(pc) && _run_to_return(pc + 4, regs->sp))
+    plan.last_pc = 0;
+  _set_step(plan.return_bp == 0);
+  return STEPPER_CONTINUE;
+}
+
+int stepper_begin(uint64_t thread, const line_entry_t *row, bool into) {
+  pthread_mutex_lock(&step_lock);
+  memset(&plan, 0, sizeof(plan));
+  plan.active = true;
+  plan.thread = thread;
+  plan.into = into;
+  // the shell sets the step bit itself along with the resume
+  plan.stepping = true;
+  plan.start = row->start;
+  plan.end = row->end;
+  plan.line_start = row->start;
+  plan.file = row->file;
+  plan.line = row->line;
+  pthread_mutex_unlock(&step_lock);
+  return 0;
+}
+
+void stepper_cancel(uint64_t thread) {
+  pthread_mutex_lock(&step_lock);
+  if (plan.active && (thread == 0 || plan.thread == thread)) {
+    _drop_return();
+    _set_step(false);
+    plan.active = false;
+  }
+  pthread_mutex_unlock(&step_lock);
+}
+
+bool stepper_stepping(uint64_t thread) {
+  pthread_mutex_lock(&step_lock);
+  bool ret = plan.active && plan.thread == thread && plan.stepping;
+  pthread_mutex_unlock(&step_lock);
+  return ret;
+}
+
+stepper_action_t stepper_handle(uint64_t thread, const target_regs_t *regs,
+                                uint32_t *steps) {
+  stepper_action_t ret = STEPPER_PASS;
+  pthread_mutex_lock(&step_lock);
+  if (!plan.active || plan.thread != thread)
+    goto out;
+
+  plan.steps++;
+  if (plan.return_bp && regs->pc == plan.return_bp) {
+    // a deeper call of the same function, it steps over our brk like
+    // any other thread
+    if (regs->sp < plan.return_sp)
+      goto out;
+    _drop_return();
+    plan.last_pc = 0;
+  }
+  // a hidden or false breakpoint is stepped over with the step bit kept,
+  // a user breakpoint stops and that drops the plan
+  ret = _decide(regs, find_breakpoint(regs->pc, NULL), steps);
+
+out:
+  pthread_mutex_unlock(&step_lock);
+  return ret;
+}
@@ -0,0 +1,335 @@
+#include "dbg/symbols.h"
+#include "dbg/debugger.h"
+#include "mach/image_table.h"
+#include "mach/mach_process.h"
+#include "target/symtab.h"
+#include "target/target.h"
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <mach/mach_time.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// - memory - read out of the target, it has no file of its own
+typedef struct {
+  symtab_t st;
+  uint64_t base;
+  bool memory;
+  char path[1024];
+} sym_image_t;
+
+static sym_image_t *images;
+static size_t nimages;
+static bool images_tried;
+static bool cache_disabled;
+
+// $PHANTOM_SYMCACHE, or the per user cache directory, created on first use
+static int _cache_dir(char *out, size_t len) {
+  const char *env = getenv("PHANTOM_SYMCACHE");
+  const char *home = getenv("HOME");
+  int n;
+  if (env && env[0])
+    n = snprintf(out, len, "%s", env);
+  else if (home && home[0])
+    n = snprintf(out, len, "%s/Library/Caches/phantom/symbols", home);
+  else
+    return -1;
+  if (n < 0 || (size_t)n >= len)
+    return -1;
+
+  // mkdir -p
+  for (char *p = out + 1; *p; p++) {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    int err = mkdir(out, 0755) != 0 && errno != EEXIST;
+    *p = '/';
+    if (err)
+      return -1;
+  }
+  if (mkdir(out, 0755) != 0 && errno != EEXIST)
+    return -1;
+  return 0;
+}
+
+static int _cache_path(const uint8_t uuid[16], char *out, size_t len) {
+  char dir[900];
+  if (_cache_dir(dir, sizeof(dir)) != 0)
+    return -1;
+  char hex[33];
+  for (int i = 0; i < 16; i++)
+    snprintf(hex + i * 2, 3, "%02X", uuid[i]);
+  int n = snprintf(out, len, "%s/%s.sym", dir, hex);
+  return n < 0 || (size_t)n >= len ? -1 : 0;
+}
+
+static int _read_target(uint64_t addr, void *out, size_t size) {
+  target_iovec_t iov = {.addr = addr, .buf = out, .size = size};
+  return target_backend()->read_vectored(&iov, 1);
+}
+
+// an image whose path names no file, every system library lives only in
+// the shared cache, its table is built from its __LINKEDIT in the target,
+// reads that file_backing serves out of the cache file it mapped, and is
+// cached by uuid alone
+static int _load_memory(uint64_t base, const uint8_t uuid[16],
+                        sym_image_t *img, bool *cached) {
+  char cache[1024];
+  bool use_cache =
+      !cache_disabled && _cache_path(uuid, cache, sizeof(cache)) == 0;
+  if (use_cache && symtab_load_cache(&img->st, cache, uuid, 0, base) == 0) {
+    *cached = true;
+    return 0;
+  }
+  if (symtab_load_image(&img->st, _read_target, base) != 0)
+    return -1;
+  if (use_cache && memcmp(img->st.uuid, uuid, 16) == 0 &&
+      symtab_save_cache(&img->st, cache) != 0)
+    fprintf(stderr, "[!] could not write symbol cache %s\n", cache);
+  return 0;
+}
+
+// the table of one image, from its cache file when there is a good one,
+// parsed from the file otherwise and then cached, uuid is the one the
+// target reported or NULL to read it from the file
+static int _load(const char *path, uint64_t base, const uint8_t *uuid,
+                 sym_image_t *img, bool *cached) {
+  *cached = false;
+  struct stat sb;
+  img->memory = uuid && stat(path, &sb) != 0;
+  if (img->memory) {
+    if (_load_memory(base, uuid, img, cached) != 0)
+      return -1;
+    img->base = base;
+    snprintf(img->path, sizeof(img->path), "%s", path);
+    return 0;
+  }
+
+  uint8_t id[16];
+  uint64_t file_size = 0;
+  char cache[1024];
+  bool use_cache = !cache_disabled;
+
+  if (use_cache) {
+    if (uuid) {
+      memcpy(id, uuid, sizeof(id));
+      use_cache = stat(path, &sb) == 0;
+      file_size = (uint64_t)sb.st_size;
+    } else {
+      use_cache = symtab_file_identity(path, id, &file_size) == 0;
+    }
+  }
+  if (use_cache)
+    use_cache = _cache_path(id, cache, sizeof(cache)) == 0;
+
+  if (use_cache &&
+      symtab_load_cache(&img->st, cache, id, file_size, base) == 0) {
+    *cached = true;
+  } else {
+    if (symtab_load_file(&img->st, path, base) != 0)
+      return -1;
+    // a stale entry for this uuid is replaced here
+    if (use_cache && memcmp(img->st.uuid, id, sizeof(id)) == 0 &&
+        img->st.file_size == file_size &&
+        symtab_save_cache(&img->st, cache) != 0)
+      fprintf(stderr, "[!] could not write symbol cache %s\n", cache);
+  }
+
+  img->base = base;
+  snprintf(img->path, sizeof(img->path), "%s", path);
+  return 0;
+}
+
+static sym_image_t *_next_slot(void) {
+  sym_image_t *tmp = realloc(images, (nimages + 1) * sizeof(*images));
+  if (!tmp)
+    return NULL; // allocation err
+  images = tmp;
+  return &images[nimages];
+}
+
+static bool _have_base(uint64_t base) {
+  for (size_t i = 0; i < nimages; i++) {
+    if (images[i].base == base)
+      return true;
+  }
+  return false;
+}
+
+int symbols_load(const char *path, uint64_t base) {
+  sym_image_t *img = _next_slot();
+  if (!img)
+    return -1;
+
+  bool cached;
+  if (_load(path, base, NULL, img, &cached) != 0) {
+    printf("[-] could not load symbols from %s\n", path);
+    return -1;
+  }
+  nimages++;
+  printf("[+] %zu symbols from %s%s\n", img->st.count, path,
+         cached ? " (cached)" : "");
+  return 0;
+}
+
+int symbols_load_all(void) {
+  size_t n = image_table_images(NULL, 0);
+  loaded_image_t *all = malloc((n ? n : 1) * sizeof(*all));
+  if (!all)
+    return -1; // allocation err
+  n = image_table_images(all, n);
+
+  uint64_t start = mach_absolute_time();
+  size_t from_cache = 0, parsed = 0, memory = 0, failed = 0, loaded = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!all[i].path[0] || _have_base(all[i].base))
+      continue;
+    sym_image_t *img = _next_slot();
+    if (!img)
+      break;
+
+    static const uint8_t zero[16];
+    bool has_uuid = memcmp(all[i].uuid, zero, sizeof(zero)) != 0;
+    bool cached;
+    if (_load(all[i].path, all[i].base, has_uuid ? all[i].uuid : NULL, img,
+              &cached) != 0) {
+      failed++;
+      continue;
+    }
+    nimages++;
+    loaded++;
+    if (cached)
+      from_cache++;
+    else
+      parsed++;
+    if (img->memory)
+      memory++;
+  }
+
+  mach_timebase_info_data_t tb;
+  mach_timebase_info(&tb);
+  double ms = (double)(mach_absolute_time() - start) * tb.numer / tb.denom /
+              1e6;
+  printf("[+] symbols for %zu of %zu images in %.2f ms, %zu from the cache, "
+         "%zu parsed, %zu read from the target, %zu failed\n",
+         loaded, n, ms, from_cache, parsed, memory, failed);
+  free(all);
+  return 0;
+}
+
+// every image in the image table, or the main executable if the table
+// couldn't be read, once per attach
+static void _ensure_images(void) {
+  if (images_tried || !attached_pid)
+    return;
+  images_tried = true;
+
+  if (image_table_images(NULL, 0)) {
+    symbols_load_all();
+    return;
+  }
+
+  uint64_t base;
+  char path[sizeof(images->path)] = "";
+  if (mach_get_main_image(&base, path, sizeof(path)) != KERN_SUCCESS ||
+      !path[0])
+    return;
+  symbols_load(path, base);
+}
+
+void symbols_reset(void) {
+  for (size_t i = 0; i < nimages; i++)
+    symtab_free(&images[i].st);
+  free(images);
+  images = NULL;
+  nimages = 0;
+  images_tried = false;
+}
+
+const char *symbols_lookup(uint64_t addr, uint64_t *off) {
+  _ensure_images();
+  for (size_t i = 0; i < nimages; i++) {
+    const char *name = symtab_lookup_addr(&images[i].st, addr, off);
+    if (name)
+      return name[0] == '_' ? name + 1 : name;
+  }
+  return NULL;
+}
+
+int symbols_resolve(const char *name, uint64_t *addr) {
+  _ensure_images();
+  for (size_t i = 0; i < nimages; i++) {
+    uint64_t a = symtab_lookup_name(&images[i].st, name);
+    if (a) {
+      *addr = a;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *symbols_format(uint64_t addr, char *buf, size_t len) {
+  uint64_t off;
+  const char *name = symbols_lookup(addr, &off);
+  if (!name)
+    snprintf(buf, len, "%s", "");
+  else if (off)
+    snprintf(buf, len, " <%s+0x%" PRIx64 ">", name, off);
+  else
+    snprintf(buf, len, " <%s>", name);
+  return buf;
+}
+
+void symbols_print_images(void) {
+  _ensure_images();
+  printf("[i] %zu images with symbols\n", nimages);
+  for (size_t i = 0; i < nimages; i++)
+    printf("  [0x%016" PRIx64 ", 0x%016" PRIx64 ") %zu symbols%s%s  %s\n",
+           images[i].st.start, images[i].st.end, images[i].st.count,
+           images[i].st.mapped ? " (cached)" : "",
+           images[i].memory ? " (memory)" : "", images[i].path);
+}
+
+void symbols_set_cache(bool enabled) { cache_disabled = !enabled; }
+
+int symbols_cache_print(bool clear) {
+  char dir[900];
+  if (_cache_dir(dir, sizeof(dir)) != 0) {
+    printf("[-] no symbol cache directory\n");
+    return 1;
+  }
+  DIR *d = opendir(dir);
+  if (!d) {
+    perror("[-] opendir");
+    return 1;
+  }
+
+  size_t files = 0;
+  uint64_t bytes = 0;
+  struct dirent *e;
+  while ((e = readdir(d))) {
+    size_t len = strlen(e->d_name);
+    if (len < 4 || strcmp(e->d_name + len - 4, ".sym") != 0)
+      continue;
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+    struct stat sb;
+    if (stat(path, &sb) != 0)
+      continue;
+    if (clear && unlink(path) != 0)
+      continue;
+    files++;
+    bytes += (uint64_t)sb.st_size;
+  }
+  closedir(d);
+
+  printf("[i] symbol cache %s: %zu files, %" PRIu64 " KiB%s%s\n", dir, files,
+         bytes / 1024, clear ? " removed" : "",
+         cache_disabled ? " (off)" : "");
+  return 0;
+}
@@ -0,0 +1,328 @@
+#include "dbg/trace.h"
+#include "dbg/cond.h"
+#include "mach/mach_process.h"
+#include "target/target.h"
+#include <inttypes.h>
+#include <mach/mach_time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RING_MASK (TRACE_RING_SIZE - 1)
+
+// how long the drain thread naps when the ring is empty
+#define DRAIN_IDLE_US 1000
+
+// the ring, head is only written by the producer and tail by the consumer
+static trace_record_t ring[TRACE_RING_SIZE];
+static _Atomic uint64_t ring_head = 0;
+static _Atomic uint64_t ring_tail = 0;
+
+static _Atomic uint64_t stat_captured = 0;
+static _Atomic uint64_t stat_dropped = 0;
+static _Atomic uint64_t stat_written = 0;
+static _Atomic uint64_t stat_blind = 0;
+
+static FILE *log_file = NULL;
+static pthread_t drain_thread;
+static atomic_bool draining = false;
+
+// file header, followed by one variable length record per hit
+// - magic/version - TRACE_MAGIC and TRACE_VERSION
+// - numer/denom   - mach timebase of the recording host, times are ticks
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t numer;
+  uint32_t denom;
+  uint32_t reserved;
+} trace_file_header_t;
+
+static int _parse_reg(const char *s, size_t len) {
+  int idx = cond_reg_index(s, len);
+  if (idx < 0)
+    printf("[-] unknown register '%.*s'\n", (int)len, s);
+  return idx;
+}
+
+int trace_spec_parse(const char *regs, const char *window, trace_spec_t *spec) {
+  memset(spec, 0, sizeof(*spec));
+  spec->mem_reg = -1;
+
+  const char *p = regs;
+  while (*p) {
+    size_t len = strcspn(p, ",");
+    if (spec->nregs == TRACE_MAX_REGS) {
+      printf("[-] at most %d registers per tracepoint\n", TRACE_MAX_REGS);
+      return -1;
+    }
+    int idx = _parse_reg(p, len);
+    if (idx < 0)
+      return -1;
+    spec->regs[spec->nregs++] = (uint8_t)idx;
+    p += len;
+    if (*p == ',')
+      p++;
+  }
+
+  if (!window)
+    return 0;
+
+  // <reg>[+|-off]:<len>
+  size_t len = strcspn(window, "+-:");
+  int idx = _parse_reg(window, len);
+  if (idx < 0)
+    return -1;
+  char *end = (char *)window + len;
+  int64_t off = 0;
+  if (*end == '+' || *end == '-') {
+    bool neg = *end == '-';
+    off = (int64_t)strtoull(end + 1, &end, 0);
+    if (neg)
+      off = -off;
+  }
+  if (*end != ':') {
+    printf("[-] memory window should look like sp+16:32\n");
+    return -1;
+  }
+  uint64_t size = strtoull(end + 1, NULL, 0);
+  if (size == 0 || size > TRACE_MAX_MEM) {
+    printf("[-] memory window must be 1-%d bytes\n", TRACE_MAX_MEM);
+    return -1;
+  }
+
+  spec->mem_reg = idx;
+  spec->mem_off = off;
+  spec->mem_len = (uint16_t)size;
+  return 0;
+}
+
+void trace_capture(const trace_spec_t *spec, int bp_index, uint64_t thread,
+                   const target_regs_t *regs) {
+  uint64_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+  if (head - tail == TRACE_RING_SIZE) {
+    // consumer is behind, drop rather than stall the target
+    atomic_fetch_add_explicit(&stat_dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  trace_record_t *rec = &ring[head & RING_MASK];
+  rec->time = mach_absolute_time();
+  rec->thread = thread;
+  rec->pc = regs->pc;
+  rec->bp_index = (uint32_t)bp_index;
+  rec->nregs = spec->nregs;
+  for (uint8_t i = 0; i < spec->nregs; i++) {
+    rec->reg_ids[i] = spec->regs[i];
+    rec->regs[i] = cond_reg_value(regs, spec->regs[i]);
+  }
+
+  rec->mem_len = 0;
+  rec->mem_addr = 0;
+  if (spec->mem_reg >= 0) {
+    rec->mem_addr = cond_reg_value(regs, spec->mem_reg) + spec->mem_off;
+    target_iovec_t iov = {
+        .addr = rec->mem_addr, .buf = rec->mem, .size = spec->mem_len};
+    if (target_backend()->read_vectored(&iov, 1) == 0)
+      rec->mem_len = spec->mem_len;
+  }
+
+  atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+  atomic_fetch_add_explicit(&stat_captured, 1, memory_order_relaxed);
+}
+
+// records on disk only carry what was captured
+static size_t _serialize(const trace_record_t *rec, uint8_t *buf) {
+  size_t n = 0;
+#define PUT(src, size)                                                         \
+  do {                                                                         \
+    memcpy(buf + n, (src), (size));                                            \
+    n += (size);                                                               \
+  } while (0)
+
+  PUT(&rec->time, 8);
+  PUT(&rec->thread, 8);
+  PUT(&rec->pc, 8);
+  PUT(&rec->bp_index, 4);
+  PUT(&rec->nregs, 1);
+  PUT(&rec->mem_len, 2);
+  PUT(rec->reg_ids, rec->nregs);
+  PUT(rec->regs, rec->nregs * 8u);
+  if (rec->mem_len) {
+    PUT(&rec->mem_addr, 8);
+    PUT(rec->mem, rec->mem_len);
+  }
+#undef PUT
+  return n;
+}
+
+static void _drain(void) {
+  uint8_t buf[sizeof(trace_record_t)];
+  uint64_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+
+  for (; tail != head; tail++) {
+    size_t n = _serialize(&ring[tail & RING_MASK], buf);
+    fwrite(buf, 1, n, log_file);
+    atomic_fetch_add_explicit(&stat_written, 1, memory_order_relaxed);
+  }
+  atomic_store_explicit(&ring_tail, tail, memory_order_release);
+}
+
+static void *_drain_loop(void *arg) {
+  (void)arg;
+  while (atomic_load(&draining)) {
+    uint64_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    if (head == atomic_load_explicit(&ring_tail, memory_order_relaxed)) {
+      usleep(DRAIN_IDLE_US);
+      continue;
+    }
+    _drain();
+  }
+  return NULL;
+}
+
+int trace_start(const char *path) {
+  if (log_file) {
+    printf("[-] already tracing, trace stop first\n");
+    return -1;
+  }
+
+  log_file = fopen(path, "wb");
+  if (!log_file) {
+    perror("[-] fopen");
+    return -1;
+  }
+
+  mach_timebase_info_data_t tb;
+  mach_timebase_info(&tb);
+  trace_file_header_t hdr = {.version = TRACE_VERSION,
+                             .numer = tb.numer,
+                             .denom = tb.denom};
+  memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+  fwrite(&hdr, sizeof(hdr), 1, log_file);
+
+  atomic_store(&draining, true);
+  if (pthread_create(&drain_thread, NULL, _drain_loop, NULL) != 0) {
+    fprintf(stderr, "[-] failed to start the trace drain thread\n");
+    atomic_store(&draining, false);
+    fclose(log_file);
+    log_file = NULL;
+    return -1;
+  }
+
+  printf("[+] tracing to %s\n", path);
+  return 0;
+}
+
+int trace_stop(void) {
+  if (!log_file) {
+    printf("[-] not tracing\n");
+    return -1;
+  }
+
+  atomic_store(&draining, false);
+  pthread_join(drain_thread, NULL);
+  // whatever landed after the thread's last pass
+  _drain();
+  fclose(log_file);
+  log_file = NULL;
+
+  trace_stats_t stats;
+  trace_get_stats(&stats);
+  printf("[+] trace stopped, %" PRIu64 " written, %" PRIu64 " dropped\n",
+         stats.written, stats.dropped);
+  return 0;
+}
+
+bool trace_running(void) { return log_file != NULL; }
+
+void trace_get_stats(trace_stats_t *out) {
+  out->captured = atomic_load_explicit(&stat_captured, memory_order_relaxed);
+  out->dropped = atomic_load_explicit(&stat_dropped, memory_order_relaxed);
+  out->written = atomic_load_explicit(&stat_written, memory_order_relaxed);
+  out->blind = atomic_load_explicit(&stat_blind, memory_order_relaxed);
+}
+
+void trace_note_blind(void) {
+  atomic_fetch_add_explicit(&stat_blind, 1, memory_order_relaxed);
+}
+
+static bool _read_record(FILE *f, trace_record_t *rec) {
+  memset(rec, 0, sizeof(*rec));
+#define GET(dst, size)                                                         \
+  do {                                                                         \
+    size_t sz = (size);                                                        \
+    if (sz && fread((dst), sz, 1, f) != 1)                                     \
+      return false;                                                            \
+  } while (0)
+
+  GET(&rec->time, 8);
+  GET(&rec->thread, 8);
+  GET(&rec->pc, 8);
+  GET(&rec->bp_index, 4);
+  GET(&rec->nregs, 1);
+  GET(&rec->mem_len, 2);
+  if (rec->nregs > TRACE_MAX_REGS || rec->mem_len > TRACE_MAX_MEM)
+    return false;
+  GET(rec->reg_ids, rec->nregs);
+  GET(rec->regs, rec->nregs * 8u);
+  if (rec->mem_len) {
+    GET(&rec->mem_addr, 8);
+    GET(rec->mem, rec->mem_len);
+  }
+#undef GET
+  return true;
+}
+
+int trace_decode(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror("[-] fopen");
+    return -1;
+  }
+
+  trace_file_header_t hdr;
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.version != TRACE_VERSION || hdr.denom == 0) {
+    printf("[-] %s is not a phantom trace\n", path);
+    fclose(f);
+    return -1;
+  }
+
+  trace_record_t rec;
+  uint64_t first = 0;
+  size_t count = 0;
+  while (_read_record(f, &rec)) {
+    if (count++ == 0)
+      first = rec.time;
+    uint64_t ns = (rec.time - first) * hdr.numer / hdr.denom;
+
+    printf("+%" PRIu64 ".%06" PRIu64 " [%2u] thread 0x%" PRIx64
+           " pc 0x%016" PRIx64,
+           ns / 1000000000, (ns / 1000) % 1000000, rec.bp_index, rec.thread,
+           rec.pc);
+    for (uint8_t i = 0; i < rec.nregs; i++)
+      printf(" %s=0x%" PRIx64, cond_reg_name(rec.reg_ids[i]), rec.regs[i]);
+    printf("\n");
+
+    if (rec.mem_len) {
+      printf("    0x%016" PRIx64 ":", rec.mem_addr);
+      for (uint16_t i = 0; i < rec.mem_len; i++) {
+        if (i && i % 16 == 0)
+          printf("\n    %19s", "");
+        printf(" %02x", rec.mem[i]);
+      }
+      printf("\n");
+    }
+  }
+
+  printf("[i] %zu records\n", count);
+  fclose(f);
+  return 0;
+}
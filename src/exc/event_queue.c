@@ -0,0 +1,108 @@
+#include "exc/event_queue.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define QUEUE_MASK (EVENT_QUEUE_SIZE - 1)
+
+static exc_event_t queue[EVENT_QUEUE_SIZE];
+static _Atomic uint64_t head = 0; // written by the producer
+static _Atomic uint64_t tail = 0; // written by the consumer
+
+static _Atomic uint64_t stat_dropped = 0;
+static _Atomic uint64_t stat_max_depth = 0;
+
+// drops the shell hasn't reported yet and the thread of the latest one
+static _Atomic uint64_t lost = 0;
+static _Atomic uint64_t lost_thread = 0;
+
+static int notify_pipe[2] = {-1, -1};
+static pthread_once_t pipe_once = PTHREAD_ONCE_INIT;
+
+static void _make_pipe(void) {
+  if (pipe(notify_pipe) != 0) {
+    perror("[-] event_queue: pipe");
+    notify_pipe[0] = notify_pipe[1] = -1;
+    return;
+  }
+  // neither side may ever block the listener or the shell
+  for (int i = 0; i < 2; i++)
+    fcntl(notify_pipe[i], F_SETFL, fcntl(notify_pipe[i], F_GETFL) | O_NONBLOCK);
+}
+
+int event_queue_fd(void) {
+  pthread_once(&pipe_once, _make_pipe);
+  return notify_pipe[0];
+}
+
+bool event_queue_push(const exc_event_t *ev) {
+  pthread_once(&pipe_once, _make_pipe);
+
+  uint64_t h = atomic_load_explicit(&head, memory_order_relaxed);
+  uint64_t t = atomic_load_explicit(&tail, memory_order_acquire);
+  if (h - t == EVENT_QUEUE_SIZE) {
+    atomic_fetch_add_explicit(&stat_dropped, 1, memory_order_relaxed);
+    // the thread stays parked, the shell has to hear about it even if
+    // nothing else is ever queued
+    atomic_store_explicit(&lost_thread, ev->thread, memory_order_relaxed);
+    atomic_fetch_add(&lost, 1);
+    if (notify_pipe[1] >= 0) {
+      char b = 1;
+      (void)!write(notify_pipe[1], &b, 1);
+    }
+    return false;
+  }
+
+  queue[h & QUEUE_MASK] = *ev;
+  atomic_store(&head, h + 1);
+
+  uint64_t depth = h + 1 - t;
+  if (depth > atomic_load_explicit(&stat_max_depth, memory_order_relaxed))
+    atomic_store_explicit(&stat_max_depth, depth, memory_order_relaxed);
+
+  // only an event the consumer may have gone to sleep without seeing needs
+  // a wake up, it drains everything once it is awake, head and tail are
+  // seq_cst so either this sees its final tail or it sees our head
+  if (atomic_load(&tail) == h && notify_pipe[1] >= 0) {
+    char b = 1;
+    (void)!write(notify_pipe[1], &b, 1);
+  }
+  return true;
+}
+
+bool event_queue_pop(exc_event_t *out) {
+  uint64_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+  uint64_t h = atomic_load_explicit(&head, memory_order_acquire);
+  if (t == h) {
+    // empty, clear the wake up before the producer can need a new one
+    char buf[64];
+    while (notify_pipe[0] >= 0 && read(notify_pipe[0], buf, sizeof(buf)) > 0)
+      ;
+    // an event may have landed between the check and the drain
+    if (atomic_load(&head) == t)
+      return false;
+  }
+
+  *out = queue[t & QUEUE_MASK];
+  atomic_store(&tail, t + 1);
+  return true;
+}
+
+uint64_t event_queue_take_lost(uint64_t *thread) {
+  uint64_t n = atomic_exchange(&lost, 0);
+  if (n && thread)
+    *thread = atomic_load_explicit(&lost_thread, memory_order_relaxed);
+  return n;
+}
+
+void event_queue_get_stats(event_queue_stats_t *out) {
+  uint64_t h = atomic_load_explicit(&head, memory_order_acquire);
+  uint64_t t = atomic_load_explicit(&tail, memory_order_acquire);
+  out->pushed = h;
+  out->popped = t;
+  out->depth = h - t;
+  out->dropped = atomic_load_explicit(&stat_dropped, memory_order_relaxed);
+  out->max_depth = atomic_load_explicit(&stat_max_depth, memory_order_relaxed);
+}
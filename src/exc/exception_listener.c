@@ -1,29 +1,216 @@
 #include "exc/exception_listener.h"
+#include "exc/event_queue.h"
+#include "exc/latency.h"
 #include "gen/mach_exc.h"
+#include "mach/mach_process.h"
+#include <inttypes.h>
 #include <mach/mach_error.h>
+#include <mach/mach_time.h>
 #include <mach/message.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "interface/shell.h"
 
 extern kern_return_t mach_exc_server(mach_msg_header_t *InHeadP,
                                      mach_msg_header_t *OutHeadP);
 
-// enough size for any exception message
-#define EXC_MSG_BUF_SIZE (sizeof(mach_msg_header_t) + 1024)
+// one slot per message in a batch, big enough for any request or reply,
+// static since a batch of state identity messages is a few hundred kb
+static union __RequestUnion__mach_exc_subsystem in_msgs[EXC_BATCH_MAX];
+static union __ReplyUnion__mach_exc_subsystem out_msgs[EXC_BATCH_MAX];
 
-// thread entry: each msg comes in on exc_port, we dispatch it
+// stops the handlers asked for while dispatching the current batch, and
+// the register state each handler saw
+static exc_event_t batch_stops[EXC_BATCH_MAX];
+static arm_thread_state64_t batch_states[EXC_BATCH_MAX];
+static size_t batch_msgs[EXC_BATCH_MAX]; // message each stop came from
+static size_t batch_nstops = 0;
+// the message being dispatched, and per message the stopped thread whose
+// reply is held, MACH_PORT_NULL for a reply that goes out now
+static size_t dispatching = 0;
+static thread_act_t hold_for[EXC_BATCH_MAX];
+
+// a state identity reply sets the thread's registers when the thread
+// runs again, after any reg write made while it was stopped, so the
+// replies of stopped threads are held until they are resumed and go out
+// with what the register cache holds for them then
+typedef struct {
+  thread_act_t thread;
+  __Reply__mach_exception_raise_state_identity_t *msg;
+} held_reply_t;
+
+static held_reply_t *held_replies = NULL;
+static size_t held_reply_count = 0;
+static size_t held_reply_cap = 0;
+// the listener holds, the shell releases on resume
+static pthread_mutex_t reply_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Atomic uint64_t stat_messages = 0;
+static _Atomic uint64_t stat_batches = 0;
+static _Atomic uint64_t stat_max_batch = 0;
+static _Atomic uint64_t stat_busy_ticks = 0;
+
+// per exception type, indexed by exception_type_t, 0 collects anything
+// out of range
+// - dispatch   - receive to the handler returning
+// - round_trip - receive to the reply being sent, how long the thread sat
+//                blocked as far as we can see it
+static lat_hist_t dispatch_lat[EXC_TYPES_COUNT];
+static lat_hist_t round_trip_lat[EXC_TYPES_COUNT];
+
+static mach_timebase_info_data_t timebase;
+
+static uint64_t _ns(uint64_t ticks) {
+  return ticks * timebase.numer / timebase.denom;
+}
+
+// every request in the subsystem carries the exception type, only where it
+// sits differs
+static exception_type_t _request_exception(mach_msg_header_t *msg) {
+  union __RequestUnion__mach_exc_subsystem *req = (void *)msg;
+  switch (msg->msgh_id) {
+  case 2405:
+    return req->Request_mach_exception_raise.exception;
+  case 2406:
+    return req->Request_mach_exception_raise_state.exception;
+  case 2407:
+    return req->Request_mach_exception_raise_state_identity.exception;
+  default:
+    return 0;
+  }
+}
+
+void exception_batch_stop(const exc_event_t *ev,
+                          const arm_thread_state64_t *state) {
+  if (batch_nstops < EXC_BATCH_MAX) {
+    batch_states[batch_nstops] = *state;
+    batch_msgs[batch_nstops] = dispatching;
+    batch_stops[batch_nstops++] = *ev;
+  }
+}
+
+// only replies that carry a state need holding
+static bool _holds_state(size_t msg) {
+  mach_msg_header_t *reply = (mach_msg_header_t *)&out_msgs[msg];
+  __Reply__mach_exception_raise_state_identity_t *r = (void *)reply;
+  return reply->msgh_id == 2507 && r->RetCode == KERN_SUCCESS &&
+         r->flavor == ARM_THREAD_STATE64;
+}
+
+// keep a copy of the reply to message msg, false if it has to go out now
+static bool _hold(size_t msg, thread_act_t thread) {
+  mach_msg_header_t *reply = (mach_msg_header_t *)&out_msgs[msg];
+  void *copy = malloc(reply->msgh_size);
+  if (!copy)
+    return false; // allocation err
+  memcpy(copy, reply, reply->msgh_size);
+
+  pthread_mutex_lock(&reply_lock);
+  if (held_reply_count == held_reply_cap) {
+    size_t cap = held_reply_cap ? held_reply_cap * 2 : 8;
+    held_reply_t *grown = realloc(held_replies, cap * sizeof(*held_replies));
+    if (!grown) {
+      pthread_mutex_unlock(&reply_lock);
+      free(copy);
+      return false;
+    }
+    held_replies = grown;
+    held_reply_cap = cap;
+  }
+  held_replies[held_reply_count++] =
+      (held_reply_t){.thread = thread, .msg = copy};
+  pthread_mutex_unlock(&reply_lock);
+  return true;
+}
+
+void exception_release_replies(thread_act_t thread) {
+  pthread_mutex_lock(&reply_lock);
+  size_t kept = 0;
+  for (size_t i = 0; i < held_reply_count; i++) {
+    held_reply_t *h = &held_replies[i];
+    if (thread != MACH_PORT_NULL && h->thread != thread) {
+      held_replies[kept++] = *h;
+      continue;
+    }
+    arm_thread_state64_t state;
+    if (mach_thread_get_state(h->thread, &state) == KERN_SUCCESS)
+      memcpy(h->msg->new_state, &state, sizeof(state));
+    kern_return_t kr =
+        mach_msg(&h->msg->Head, MACH_SEND_MSG, h->msg->Head.msgh_size, 0,
+                 MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+    if (kr != KERN_SUCCESS)
+      fprintf(stderr, "[-] exception_listener: mach_msg send failed: %s\n",
+              mach_error_string(kr));
+    free(h->msg);
+  }
+  held_reply_count = kept;
+  pthread_mutex_unlock(&reply_lock);
+}
+
+// the task is parked once for the whole batch, before any reply goes out,
+// so no thread from this batch runs on past its stop, in non-stop mode
+// only the threads that stopped are held and everything else runs on
+static void _flush_stops(void) {
+  if (batch_nstops == 0)
+    return;
+
+  if (mach_nonstop_mode()) {
+    for (size_t i = 0; i < batch_nstops; i++) {
+      thread_act_t thread = (thread_act_t)batch_stops[i].thread;
+      if (mach_thread_hold(thread, batch_stops[i].pc) != KERN_SUCCESS)
+        continue;
+      if (_holds_state(batch_msgs[i]))
+        hold_for[batch_msgs[i]] = thread;
+      mach_thread_seed_state(thread, &batch_states[i]);
+      event_queue_push(&batch_stops[i]);
+    }
+    batch_nstops = 0;
+    return;
+  }
+
+  mach_suspend();
+  mach_set_stopped_thread((thread_act_t)batch_stops[0].thread,
+                          batch_stops[0].pc);
+  for (size_t i = 0; i < batch_nstops; i++) {
+    mach_add_stopped_thread((thread_act_t)batch_stops[i].thread,
+                            batch_stops[i].pc);
+    if (_holds_state(batch_msgs[i]))
+      hold_for[batch_msgs[i]] = (thread_act_t)batch_stops[i].thread;
+    mach_thread_seed_state((thread_act_t)batch_stops[i].thread,
+                           &batch_states[i]);
+    event_queue_push(&batch_stops[i]);
+  }
+  batch_nstops = 0;
+}
+
+// blocking when timeout is MACH_MSG_TIMEOUT_NONE, otherwise only takes a
+// message that is already queued
+static kern_return_t _receive(mach_port_t exc_port, mach_msg_header_t *msg,
+                              mach_msg_timeout_t timeout) {
+  mach_msg_option_t opts = MACH_RCV_MSG | MACH_RCV_LARGE;
+  if (timeout != MACH_MSG_TIMEOUT_NONE)
+    opts |= MACH_RCV_TIMEOUT;
+  return mach_msg(msg, opts, 0, sizeof(in_msgs[0]), exc_port, timeout,
+                  MACH_PORT_NULL);
+}
+
+// thread entry: block for one message, then take whatever else is already
+// queued on exc_port, dispatch the lot and reply to all of them
 void *exception_listener(void *arg) {
   mach_port_t exc_port = *(mach_port_t *)arg;
+  mach_timebase_info(&timebase);
 
-  union __RequestUnion__mach_exc_subsystem in_msg; // holds largest request
-  union __ReplyUnion__mach_exc_subsystem out_msg;
+  uint64_t received[EXC_BATCH_MAX];
+  exception_type_t types[EXC_BATCH_MAX];
 
   for (;;) {
-    // 1) receive an exception request
-    kern_return_t kr = mach_msg(
-        (mach_msg_header_t *)&in_msg, MACH_RCV_MSG | MACH_RCV_LARGE, 0,
-        sizeof(in_msg), exc_port, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+    // 1) receive an exception request, waiting as long as it takes
+    kern_return_t kr = _receive(exc_port, (mach_msg_header_t *)&in_msgs[0],
+                                MACH_MSG_TIMEOUT_NONE);
+    received[0] = mach_absolute_time();
 
     if (kr == MACH_RCV_INVALID_NAME || kr == MACH_RCV_PORT_CHANGED) {
       fprintf(
@@ -40,24 +227,113 @@ void *exception_listener(void *arg) {
       continue;
     }
 
-    // 2) dispatch to handlers
-    boolean_t handled = mach_exc_server((mach_msg_header_t *)&in_msg,
-                                        (mach_msg_header_t *)&out_msg);
-    if (!handled) {
-      fprintf(stderr, "[-] exception_listener: dispatch failed\n");
-      print_prompt();
-      continue;
+    // 2) drain the rest of a storm without blocking
+    size_t count = 1;
+    while (count < EXC_BATCH_MAX &&
+           _receive(exc_port, (mach_msg_header_t *)&in_msgs[count], 0) ==
+               KERN_SUCCESS)
+      received[count++] = mach_absolute_time();
+
+    // 3) dispatch to handlers, stops are collected rather than acted on
+    bool replies[EXC_BATCH_MAX];
+    for (size_t i = 0; i < count; i++) {
+      exception_type_t type =
+          _request_exception((mach_msg_header_t *)&in_msgs[i]);
+      types[i] = type > 0 && type < EXC_TYPES_COUNT ? type : 0;
+
+      dispatching = i;
+      hold_for[i] = MACH_PORT_NULL;
+      replies[i] = mach_exc_server((mach_msg_header_t *)&in_msgs[i],
+                                   (mach_msg_header_t *)&out_msgs[i]);
+      lat_hist_record(&dispatch_lat[types[i]],
+                      _ns(mach_absolute_time() - received[i]));
+      if (!replies[i])
+        fprintf(stderr, "[-] exception_listener: dispatch failed\n");
     }
+    _flush_stops();
 
-    // 3) send the reply back to the kernel/faulting thread
-    kr = mach_msg((mach_msg_header_t *)&out_msg, MACH_SEND_MSG,
-                  out_msg.Reply_mach_exception_raise.Head.msgh_size, 0,
-                  MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
-    if (kr != KERN_SUCCESS) {
-      fprintf(stderr, "[-] exception_listener: mach_msg send failed: %s\n",
-              mach_error_string(kr));
+    // 4) send the replies back to the kernel/faulting threads, those of
+    // stopped threads carrying a state wait for the resume
+    for (size_t i = 0; i < count; i++) {
+      if (!replies[i])
+        continue;
+      mach_msg_header_t *reply = (mach_msg_header_t *)&out_msgs[i];
+      if (hold_for[i] != MACH_PORT_NULL && _hold(i, hold_for[i]))
+        continue;
+      kr = mach_msg(reply, MACH_SEND_MSG, reply->msgh_size, 0, MACH_PORT_NULL,
+                    MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+      if (kr != KERN_SUCCESS) {
+        fprintf(stderr, "[-] exception_listener: mach_msg send failed: %s\n",
+                mach_error_string(kr));
+        continue;
+      }
+      lat_hist_record(&round_trip_lat[types[i]],
+                      _ns(mach_absolute_time() - received[i]));
     }
+
+    atomic_fetch_add_explicit(&stat_messages, count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_batches, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_busy_ticks,
+                              mach_absolute_time() - received[0],
+                              memory_order_relaxed);
+    if (count > atomic_load_explicit(&stat_max_batch, memory_order_relaxed))
+      atomic_store_explicit(&stat_max_batch, count, memory_order_relaxed);
   }
 
   return NULL;
 }
+
+void exception_listener_get_stats(exception_listener_stats_t *out) {
+  out->messages = atomic_load_explicit(&stat_messages, memory_order_relaxed);
+  out->batches = atomic_load_explicit(&stat_batches, memory_order_relaxed);
+  out->max_batch = atomic_load_explicit(&stat_max_batch, memory_order_relaxed);
+
+  mach_timebase_info_data_t tb;
+  mach_timebase_info(&tb);
+  uint64_t ticks = atomic_load_explicit(&stat_busy_ticks, memory_order_relaxed);
+  out->busy_ns = tb.denom ? ticks * tb.numer / tb.denom : ticks;
+}
+
+// ns as a short human readable duration
+static void _fmt_ns(char *buf, size_t len, uint64_t ns) {
+  if (ns < 1000)
+    snprintf(buf, len, "%" PRIu64 "ns", ns);
+  else if (ns < 1000000)
+    snprintf(buf, len, "%.1fus", ns / 1e3);
+  else if (ns < 1000000000)
+    snprintf(buf, len, "%.1fms", ns / 1e6);
+  else
+    snprintf(buf, len, "%.2fs", ns / 1e9);
+}
+
+static void _print_hist(const char *what, lat_hist_t *h) {
+  char p50[16], p99[16], p999[16], max[16];
+  _fmt_ns(p50, sizeof(p50), lat_hist_percentile(h, 0.50));
+  _fmt_ns(p99, sizeof(p99), lat_hist_percentile(h, 0.99));
+  _fmt_ns(p999, sizeof(p999), lat_hist_percentile(h, 0.999));
+  _fmt_ns(max, sizeof(max), atomic_load(&h->max));
+  printf("    %-10s p50 %8s  p99 %8s  p999 %8s  max %8s\n", what, p50, p99,
+         p999, max);
+}
+
+void exception_listener_print_latency(bool reset) {
+  bool any = false;
+  for (int t = 0; t < EXC_TYPES_COUNT; t++) {
+    uint64_t n = atomic_load(&round_trip_lat[t].total);
+    if (n == 0 && atomic_load(&dispatch_lat[t].total) == 0)
+      continue;
+    any = true;
+    printf("[i] %s: %" PRIu64 " replies\n", exception_name(t), n);
+    _print_hist("dispatch", &dispatch_lat[t]);
+    _print_hist("round trip", &round_trip_lat[t]);
+  }
+  if (!any)
+    printf("[i] no exceptions handled yet\n");
+
+  if (reset) {
+    for (int t = 0; t < EXC_TYPES_COUNT; t++) {
+      lat_hist_reset(&dispatch_lat[t]);
+      lat_hist_reset(&round_trip_lat[t]);
+    }
+  }
+}
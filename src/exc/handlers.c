@@ -1,12 +1,19 @@
 #include "dbg/debugger.h"
+#include "dbg/displace.h"
+#include "dbg/stepper.h"
+#include "exc/event_queue.h"
+#include "exc/exception_listener.h"
 #include "gen/mach_exc.h"
 #include "mach/mach_process.h"
-#include "interface/shell.h"
+#include "target/target.h"
 #include <_stdio.h>
+#include <inttypes.h>
 #include <mach/exc.h>
 #include <mach/exception_types.h>
 #include <mach/mach_error.h>
+#include <mach/mach_time.h>
 #include <stdio.h>
+#include <string.h>
 
 const char *exception_name(exception_type_t type) {
   switch (type) {
@@ -41,6 +48,149 @@ const char *exception_name(exception_type_t type) {
   }
 }
 
+// a thread stepping through breakpoints it only passes has each displaced
+// instruction emulated in turn, this many before it just runs on
+#define DISPLACE_ROUNDS 16
+
+// hand the thread back changed registers, in state identity mode the
+// reply carries them, otherwise they are set here
+static void _apply_regs(mach_port_t thread, const target_regs_t *regs,
+                        arm_thread_state64_t *state) {
+  mach_regs_to_state(regs, state);
+  if (!mach_exception_state_mode())
+    mach_thread_set_state(thread, state);
+}
+
+// shared by both behaviors, state holds the thread's registers on entry,
+// whatever the handler leaves in it is what the thread resumes with when
+// the state came in the message
+static kern_return_t _handle_exception(mach_port_t thread,
+                                       exception_type_t exception,
+                                       mach_exception_data_t code,
+                                       mach_msg_type_number_t codeCnt,
+                                       arm_thread_state64_t *state) {
+  target_regs_t regs;
+  mach_regs_from_state(state, &regs);
+
+  // hardware watchpoints arrive as EXC_BREAKPOINT with the data address
+  // in code[1], page watchpoints as protection faults
+  bool hw_watch = exception == EXC_BREAKPOINT && codeCnt > 1 &&
+                  code[0] == EXC_ARM_DA_DEBUG;
+  bool page_fault = exception == EXC_BAD_ACCESS && codeCnt > 1 &&
+                    code[0] == KERN_PROTECTION_FAILURE;
+
+  // a thread single stepping the out of line copy of an instruction traps
+  // on the branch back, it really is at the next original instruction
+  uint64_t back;
+  if (exception == EXC_BREAKPOINT && !hw_watch &&
+      displace_return(regs.pc, &back)) {
+    regs.pc = back;
+    _apply_regs(thread, &regs, state);
+  }
+
+  uint64_t thread_pc;
+  uint32_t steps = 0;
+  stepper_action_t step;
+  breakpoint_t bp;
+  watchpoint_t wp;
+  int hit, watch_hit;
+  bool moved = false;
+  for (int round = 0;; round++) {
+    thread_pc = regs.pc;
+
+    // a line step answers every step exception of its thread itself
+    step = STEPPER_PASS;
+    if (exception == EXC_BREAKPOINT && !hw_watch)
+      step = stepper_handle(thread, &regs, &steps);
+    if (step == STEPPER_CONTINUE) {
+      if (moved)
+        _apply_regs(thread, &regs, state);
+      return KERN_SUCCESS;
+    }
+
+    hit = -1;
+    watch_hit = -1;
+    // a finished line step stops as it is, a breakpoint at pc is stepped
+    // over by the next resume
+    bool lookup = step == STEPPER_PASS;
+    if (lookup && (hw_watch || page_fault)) {
+      uint64_t far = code[1];
+      bool write = false;
+      if (page_fault)
+        mach_thread_get_fault(thread, &far, &write);
+      watch_hit = watchpoint_hit(thread, far, write, hw_watch, &wp);
+    } else if (lookup && exception == EXC_BREAKPOINT) {
+      hit = breakpoint_hit(thread_pc, thread, &regs, &bp);
+    }
+    // a one shot breakpoint has its original back, the thread runs it
+    if (hit != 0 || bp.oneshot)
+      break;
+
+    // condition false, a tracepoint or a hook, the thread is moved past
+    // the breakpoint without the text changing, an emulated instruction
+    // is a step done for a thread in the middle of a line step, the
+    // stepper sees where it landed next round
+    displace_t d = displace_breakpoint(&regs);
+    if (d == DISPLACE_FAILED)
+      break;
+    if (d == DISPLACE_RESUMED || !stepper_stepping(thread) ||
+        round + 1 == DISPLACE_ROUNDS) {
+      _apply_regs(thread, &regs, state);
+      return KERN_SUCCESS;
+    }
+    moved = true;
+  }
+  if (moved)
+    _apply_regs(thread, &regs, state);
+
+  if (hit == 0 || watch_hit == 0) {
+    // a watch fault outside the watched range, or a breakpoint that can't
+    // be displaced, step this thread past it with the original put back
+    // and let it carry on, the rest of the task never stops and nothing
+    // prints, a thread in the middle of a line step keeps its step bit,
+    // while another thread is stepping over it is parked until its turn
+    bool user_step = stepper_stepping(thread);
+    int r = breakpoint_step_over_begin(thread, thread_pc, user_step);
+    while (r == 1) {
+      r = breakpoint_step_over_defer(thread, thread_pc, user_step);
+      if (r == 1)
+        r = breakpoint_step_over_begin(thread, thread_pc, user_step);
+    }
+    // a thread that can't be stepped over would trap here forever, it
+    // stops like any other exception instead
+    if (r == 0)
+      return KERN_SUCCESS;
+  }
+
+  exc_event_t ev = {.kind = EV_EXCEPTION,
+                    .thread = thread,
+                    .exception = exception,
+                    .code = {code[0], codeCnt > 1 ? code[1] : 0},
+                    .pc = thread_pc,
+                    .index = -1,
+                    .time = mach_absolute_time()};
+  if (step == STEPPER_STOP) {
+    ev.kind = EV_STEP;
+    ev.steps = steps;
+  } else if (hit == 1) {
+    ev.kind = EV_BREAKPOINT;
+    ev.index = bp.index;
+  } else if (watch_hit == 1) {
+    ev.kind = EV_WATCHPOINT;
+    ev.index = wp.index;
+    ev.addr = code[1];
+  }
+  // any other stop ends a line step, of this thread alone in non-stop
+  if (step != STEPPER_STOP)
+    stepper_cancel(mach_nonstop_mode() ? thread : 0);
+
+  // the listener parks the task once the whole batch is dispatched and
+  // hands the stop to the shell, printing and disassembling happen there,
+  // the state we already hold seeds the register cache for the stop
+  exception_batch_stop(&ev, state);
+  return KERN_SUCCESS;
+}
+
 kern_return_t catch_mach_exception_raise(mach_port_t exception_port,
                                          mach_port_t thread, mach_port_t task,
                                          exception_type_t exception,
@@ -48,15 +198,16 @@ kern_return_t catch_mach_exception_raise(mach_port_t exception_port,
                                          mach_msg_type_number_t codeCnt) {
   (void)exception_port;
   (void)task;
-  (void)codeCnt;
 
-  printf("\n[!] Caught exception %s on thread 0x%x, code=0x%llx\n",
-         exception_name(exception), thread, code[0]);
-  mach_suspend();
-  //  mach_register_exception_print();
-  disasm(pc(), 0x16);
-  print_prompt();
-  return KERN_SUCCESS;
+  // our own step over a breakpoint finished, the brk is back in place,
+  // only the exception codes come with the message so this is checked
+  // before paying for a thread_get_state
+  if (exception == EXC_BREAKPOINT && breakpoint_step_over_end(thread))
+    return KERN_SUCCESS;
+
+  arm_thread_state64_t state = {0};
+  mach_thread_get_state(thread, &state);
+  return _handle_exception(thread, exception, code, codeCnt, &state);
 }
 
 kern_return_t catch_mach_exception_raise_state(
@@ -80,6 +231,10 @@ kern_return_t catch_mach_exception_raise_state(
   return KERN_FAILURE;
 }
 
+// EXCEPTION_STATE_IDENTITY, see mach_set_exception_state_mode
+// the registers arrive in old_state and the thread resumes with whatever
+// goes back in new_state, so a conditional breakpoint or tracepoint is
+// handled without a single thread_get_state or thread_set_state
 kern_return_t catch_mach_exception_raise_state_identity(
     mach_port_t exception_port, mach_port_t thread, mach_port_t task,
     exception_type_t exception, mach_exception_data_t code,
@@ -88,17 +243,20 @@ kern_return_t catch_mach_exception_raise_state_identity(
     mach_msg_type_number_t *new_stateCnt) {
 
   (void)exception_port;
-  (void)thread;
   (void)task;
-  (void)exception;
-  (void)code;
-  (void)codeCnt;
-  (void)flavor;
-  (void)old_state;
-  (void)old_stateCnt;
-  (void)new_state;
-  (void)new_stateCnt;
 
-  printf("testing raise state identity\n");
-  return KERN_FAILURE;
+  if (*flavor != ARM_THREAD_STATE64 ||
+      old_stateCnt < ARM_THREAD_STATE64_COUNT ||
+      *new_stateCnt < old_stateCnt)
+    return KERN_FAILURE;
+
+  // the reply always sets the state, so it starts as an exact copy
+  memcpy(new_state, old_state, old_stateCnt * sizeof(natural_t));
+  *new_stateCnt = old_stateCnt;
+
+  if (exception == EXC_BREAKPOINT && breakpoint_step_over_end(thread))
+    return KERN_SUCCESS;
+
+  return _handle_exception(thread, exception, code, codeCnt,
+                           (arm_thread_state64_t *)new_state);
 }
@@ -0,0 +1,63 @@
+#include "exc/latency.h"
+
+static size_t _bucket(uint64_t v) {
+  if (v < LAT_SUB_COUNT)
+    return (size_t)v;
+
+  int mag = 63 - __builtin_clzll(v);
+  if (mag > LAT_MAX_MAG)
+    return LAT_BUCKETS - 1;
+  // top LAT_SUB_BITS + 1 bits of v, in [LAT_SUB_COUNT, 2 * LAT_SUB_COUNT)
+  uint64_t top = v >> (mag - LAT_SUB_BITS);
+  return (size_t)(mag - LAT_SUB_BITS + 1) * LAT_SUB_COUNT +
+         (size_t)(top - LAT_SUB_COUNT);
+}
+
+// largest value that lands in bucket i
+static uint64_t _bucket_top(size_t i) {
+  if (i < LAT_SUB_COUNT)
+    return i;
+
+  int mag = (int)(i / LAT_SUB_COUNT) - 1 + LAT_SUB_BITS;
+  uint64_t top = i % LAT_SUB_COUNT + LAT_SUB_COUNT;
+  return ((top + 1) << (mag - LAT_SUB_BITS)) - 1;
+}
+
+void lat_hist_record(lat_hist_t *h, uint64_t ns) {
+  atomic_fetch_add_explicit(&h->counts[_bucket(ns)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+  if (ns > atomic_load_explicit(&h->max, memory_order_relaxed))
+    atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+}
+
+uint64_t lat_hist_percentile(lat_hist_t *h, double p) {
+  uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+  if (total == 0)
+    return 0;
+
+  uint64_t want = (uint64_t)(p * (double)total + 0.5);
+  if (want == 0)
+    want = 1;
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < LAT_BUCKETS; i++) {
+    seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+    if (seen >= want) {
+      // never claim more than was actually recorded
+      uint64_t top = _bucket_top(i);
+      uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+      return top < max ? top : max;
+    }
+  }
+  // counts still catching up with total
+  return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+void lat_hist_reset(lat_hist_t *h) {
+  for (size_t i = 0; i < LAT_BUCKETS; i++)
+    atomic_store_explicit(&h->counts[i], 0, memory_order_relaxed);
+  atomic_store_explicit(&h->total, 0, memory_order_relaxed);
+  atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+  atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+}
@@ -1,8 +1,13 @@
 #include "interface/shell.h"
 #include "dbg/bp_wp.h"
+#include "dbg/coverage.h"
 #include "dbg/debugger.h"
+#include "dbg/symbols.h"
+#include "exc/exception_listener.h"
 #include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -162,6 +167,49 @@ static int cmd_interrupt(int argc, char **argv) {
   return 0;
 }
 
+static int cmd_nonstop(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  return toggle_nonstop();
+}
+
+static int cmd_thread(int argc, char **argv) {
+  const char *usage = "Usage: thread list | thread select <thread> | "
+                      "thread continue [thread|all]\n";
+  if (require_attached())
+    return 1;
+  if (argc < 2) {
+    printf("%s", usage);
+    return 1;
+  }
+
+  if (strcmp(argv[1], "list") == 0 && argc == 2) {
+    return list_threads();
+  } else if (strcmp(argv[1], "select") == 0 && argc == 3) {
+    return select_thread(strtoull(argv[2], NULL, 0));
+  } else if (strcmp(argv[1], "continue") == 0 && argc <= 3) {
+    // no argument continues the selected thread, like c
+    if (argc == 2)
+      return resume();
+    if (strcmp(argv[2], "all") == 0)
+      return resume_thread(0);
+    return resume_thread(strtoull(argv[2], NULL, 0));
+  }
+  printf("%s", usage);
+  return 1;
+}
+
+static int cmd_threads(int argc, char **argv) {
+  if (require_attached())
+    return 1;
+  if (argc == 1)
+    return print_threads(false);
+  if (argc == 3 && strcmp(argv[1], "save") == 0)
+    return save_threads(argv[2]);
+  printf("Usage: threads [save <file>]\n");
+  return 1;
+}
+
 static int cmd_detach(int argc, char **argv) {
   (void)argc;
   (void)argv;
@@ -185,6 +233,8 @@ static int cmd_reg(int argc, char **argv) {
     return 1;
   }
   if (strcmp(argv[1], "read") == 0) {
+    if (argc == 3 && strcmp(argv[2], "--all") == 0)
+      return print_threads(true);
     print_registers();
   } else if (strcmp(argv[1], "write") == 0) {
     if (argc != 4) {
@@ -209,11 +259,24 @@ static int cmd_reg_dbg(int argc, char **argv) {
   return 0;
 }
 
+// join argv[from..] back into one string, conditions get split on spaces
+static char *join_args(int argc, char **argv, int from, char *buf,
+                       size_t len) {
+  buf[0] = '\0';
+  for (int i = from; i < argc; i++) {
+    if (i > from)
+      strncat(buf, " ", len - strlen(buf) - 1);
+    strncat(buf, argv[i], len - strlen(buf) - 1);
+  }
+  return buf;
+}
+
 static int cmd_br(int argc, char **argv) {
   if (require_attached())
     return 1;
   if (argc < 2) {
-    printf("Usage: br set <address> | br delete <address> | br list\n");
+    printf("Usage: br set <address|symbol> [if <cond>] | "
+           "br cond <index> [cond] | br delete <address|symbol> | br list\n");
     return 1;
   }
   const char *arg = argv[1];
@@ -221,25 +284,222 @@ static int cmd_br(int argc, char **argv) {
     list_breakpoints();
     return 0;
   } else if (strcmp(arg, "set") == 0 && argc == 3) {
-    add_breakpoint(strtoull(argv[2], NULL, 0));
+    uint64_t addr;
+    if (parse_address(argv[2], &addr) != 0)
+      return 1;
+    add_breakpoint(addr);
+    return 0;
+  } else if (strcmp(arg, "set") == 0 && argc > 4 &&
+             strcmp(argv[3], "if") == 0) {
+    char expr[COND_MAX_SOURCE];
+    join_args(argc, argv, 4, expr, sizeof(expr));
+    uint64_t addr;
+    if (parse_address(argv[2], &addr) != 0)
+      return 1;
+    int idx = add_breakpoint(addr);
+    if (idx >= 0 && set_breakpoint_condition(idx, expr) != 0) {
+      // keep the set atomic from the user's point of view
+      remove_breakpoint_at_index(idx);
+      return 1;
+    }
     return 0;
+  } else if (strcmp(arg, "cond") == 0 && argc >= 3) {
+    char expr[COND_MAX_SOURCE];
+    join_args(argc, argv, 3, expr, sizeof(expr));
+    // no expression clears the condition
+    return set_breakpoint_condition(atoi(argv[2]),
+                                    argc > 3 ? expr : NULL) != 0;
   } else if (strcmp(arg, "delete") == 0 && argc == 3) {
     const char *param = argv[2];
     if (strspn(param, "0123456789") == strlen(param)) {
       remove_breakpoint_at_index(atoi(param));
     } else {
-      remove_breakpoint_by_addr(strtoull(param, NULL, 0));
+      uint64_t addr;
+      if (parse_address(param, &addr) != 0)
+        return 1;
+      remove_breakpoint_by_addr(addr);
+    }
+    return 0;
+  }
+  printf("Usage: br set <address|symbol> [if <cond>] | "
+         "br cond <index> [cond] | br delete <address|symbol> | br list\n");
+  return 1;
+}
+
+static int cmd_trace(int argc, char **argv) {
+  const char *usage =
+      "Usage: trace set <address> <reg,...> [<reg>+<off>:<len>] | "
+      "trace start <file> | trace stop | trace decode <file>\n";
+  if (argc < 2) {
+    printf("%s", usage);
+    return 1;
+  }
+
+  const char *arg = argv[1];
+  if (strcmp(arg, "decode") == 0 && argc == 3) {
+    // works on old logs, no process needed
+    return trace_decode(argv[2]) != 0;
+  }
+  if (require_attached())
+    return 1;
+
+  if (strcmp(arg, "set") == 0 && (argc == 4 || argc == 5)) {
+    trace_spec_t spec;
+    uint64_t addr;
+    if (trace_spec_parse(argv[3], argc == 5 ? argv[4] : NULL, &spec) != 0 ||
+        parse_address(argv[2], &addr) != 0)
+      return 1;
+    int idx = add_breakpoint(addr);
+    if (idx < 0)
+      return 1;
+    return set_breakpoint_trace(idx, &spec) != 0;
+  } else if (strcmp(arg, "start") == 0 && argc == 3) {
+    return trace_start(argv[2]) != 0;
+  } else if (strcmp(arg, "stop") == 0 && argc == 2) {
+    return trace_stop() != 0;
+  }
+
+  printf("%s", usage);
+  return 1;
+}
+
+static int cmd_coverage(int argc, char **argv) {
+  const char *usage = "Usage: coverage start <func|bb> [image base] | "
+                      "coverage stop | coverage export <file> | coverage\n";
+  if (require_attached())
+    return 1;
+  if (argc == 1) {
+    coverage_print_status();
+    return 0;
+  }
+
+  const char *arg = argv[1];
+  if (strcmp(arg, "start") == 0 && (argc == 3 || argc == 4)) {
+    cov_mode_t mode;
+    if (strcmp(argv[2], "func") == 0)
+      mode = COV_FUNCTIONS;
+    else if (strcmp(argv[2], "bb") == 0)
+      mode = COV_BLOCKS;
+    else {
+      printf("%s", usage);
+      return 1;
     }
+    uint64_t base = argc == 4 ? strtoull(argv[3], NULL, 0) : 0;
+    return coverage_start(mode, base) != 0;
+  } else if (strcmp(arg, "stop") == 0 && argc == 2) {
+    return coverage_stop() != 0;
+  } else if (strcmp(arg, "export") == 0 && argc == 3) {
+    return coverage_export(argv[2]) != 0;
+  }
+
+  printf("%s", usage);
+  return 1;
+}
+
+static int cmd_index(int argc, char **argv) {
+  const char *usage = "Usage: index build [image base|file] | "
+                      "index lookup <address> | index\n";
+  if (argc == 1) {
+    index_print_status();
     return 0;
   }
-  printf("Usage: br set <address> | br delete <address> | br list\n");
+
+  if (strcmp(argv[1], "build") == 0 && argc <= 3)
+    return index_image(argc == 3 ? argv[2] : NULL);
+  if (strcmp(argv[1], "lookup") == 0 && argc == 3)
+    return index_lookup(strtoull(argv[2], NULL, 0));
+
+  printf("%s", usage);
+  return 1;
+}
+
+static int cmd_images(int argc, char **argv) {
+  if (require_attached())
+    return 1;
+  if (argc == 1)
+    return print_images();
+  if ((argc == 2 || argc == 3) && strcmp(argv[1], "files") == 0) {
+    const char *op = argc == 3 ? argv[2] : "";
+    bool on = strcmp(op, "on") == 0, off = strcmp(op, "off") == 0;
+    if (on || off)
+      set_file_reads(on);
+    if (!op[0] || on || off)
+      return print_image_files();
+  } else if (argc == 2) {
+    return image_lookup(strtoull(argv[1], NULL, 0));
+  }
+  printf("Usage: images [address] | images files [on|off]\n");
+  return 1;
+}
+
+static int cmd_sym(int argc, char **argv) {
+  const char *usage = "Usage: sym <address|name> | sym load <file|all> [base] "
+                      "| sym list | sym cache [clear|on|off]\n";
+  if (argc == 2 && strcmp(argv[1], "list") == 0) {
+    symbols_print_images();
+    return 0;
+  } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "cache") == 0) {
+    const char *op = argc == 3 ? argv[2] : "";
+    bool on = strcmp(op, "on") == 0, off = strcmp(op, "off") == 0;
+    bool clear = strcmp(op, "clear") == 0;
+    if (on || off)
+      symbols_set_cache(on);
+    if (!op[0] || on || off || clear)
+      return symbols_cache_print(clear);
+  } else if (argc == 3 && strcmp(argv[1], "load") == 0 &&
+             strcmp(argv[2], "all") == 0) {
+    if (require_attached())
+      return 1;
+    return symbols_load_all() != 0;
+  } else if (argc == 2) {
+    return lookup_symbol(argv[1]);
+  } else if ((argc == 3 || argc == 4) && strcmp(argv[1], "load") == 0) {
+    uint64_t base = argc == 4 ? strtoull(argv[3], NULL, 0) : 0;
+    return symbols_load(argv[2], base) != 0;
+  }
+  printf("%s", usage);
   return 1;
 }
 
 static int cmd_wp(int argc, char **argv) {
-  (void)argc;
-  (void)argv;
-  return 0;
+  if (require_attached())
+    return 1;
+  if (argc < 2) {
+    printf("Usage: wp set <address> <len> [r|w|rw] | wp delete <address> | "
+           "wp list\n");
+    return 1;
+  }
+  const char *arg = argv[1];
+  if (strcmp(arg, "list") == 0 && argc == 2) {
+    list_watchpoints();
+    return 0;
+  } else if (strcmp(arg, "set") == 0 && (argc == 4 || argc == 5)) {
+    wp_access_t access = WP_WRITE;
+    if (argc == 5) {
+      if (strcmp(argv[4], "r") == 0)
+        access = WP_READ;
+      else if (strcmp(argv[4], "rw") == 0)
+        access = WP_RW;
+      else if (strcmp(argv[4], "w") != 0) {
+        printf("[-] access must be r, w or rw\n");
+        return 1;
+      }
+    }
+    add_watchpoint(strtoull(argv[2], NULL, 0), strtoull(argv[3], NULL, 0),
+                   access);
+    return 0;
+  } else if (strcmp(arg, "delete") == 0 && argc == 3) {
+    const char *param = argv[2];
+    if (strspn(param, "0123456789") == strlen(param)) {
+      remove_watchpoint_at_index(atoi(param));
+    } else {
+      remove_watchpoint_by_addr(strtoull(param, NULL, 0));
+    }
+    return 0;
+  }
+  printf("Usage: wp set <address> <len> [r|w|rw] | wp delete <address> | "
+         "wp list\n");
+  return 1;
 }
 
 static int cmd_r64(int argc, char **argv) {
@@ -328,18 +588,55 @@ int cmd_autoslide(int argc, char **argv) {
   return 0;
 }
 
+int cmd_excstate(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  return toggle_exception_state();
+}
+
 int cmd_step(int argc, char **argv) {
   if(require_attached())
     return 1;
 
-  (void)argc;
-  (void)argv;
+  if (argc == 2 && strcmp(argv[1], "line") == 0)
+    return step_line(true);
+  if (argc != 1) {
+    printf("Usage: step [line]\n");
+    return 1;
+  }
 
   step();
 
   return 0;
 }
 
+static int cmd_next(int argc, char **argv) {
+  (void)argv;
+  if (require_attached())
+    return 1;
+  if (argc != 1) {
+    printf("Usage: next\n");
+    return 1;
+  }
+  return step_line(false);
+}
+
+static int cmd_line(int argc, char **argv) {
+  if (require_attached())
+    return 1;
+  if (argc == 1)
+    return print_line(pc());
+  if (argc == 2 && strcmp(argv[1], "list") == 0) {
+    print_line_images();
+    return 0;
+  }
+  if (argc == 2)
+    return print_line(strtoull(argv[1], NULL, 0));
+  printf("Usage: line [address] | line list\n");
+  return 1;
+}
+
 int cmd_disasm(int argc, char **argv) {
   if(require_attached())
     return 1;
@@ -359,6 +656,54 @@ int cmd_disasm(int argc, char **argv) {
   return 0;
 }
 
+int cmd_stats(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: stats cache [reset] | stats trace | stats events | "
+           "stats listener | stats exc [reset]\n");
+    return 1;
+  }
+
+  bool reset = argc > 2 && strcmp(argv[2], "reset") == 0;
+  if (strcmp(argv[1], "cache") == 0) {
+    print_cache_stats(reset);
+    return 0;
+  } else if (strcmp(argv[1], "trace") == 0) {
+    trace_stats_t stats;
+    trace_get_stats(&stats);
+    printf("[i] trace: %" PRIu64 " captured, %" PRIu64 " written, %" PRIu64
+           " dropped, %" PRIu64 " blind windows%s\n",
+           stats.captured, stats.written, stats.dropped, stats.blind,
+           trace_running() ? "" : " (not logging)");
+    return 0;
+  } else if (strcmp(argv[1], "events") == 0) {
+    event_queue_stats_t stats;
+    event_queue_get_stats(&stats);
+    printf("[i] events: %" PRIu64 " queued, %" PRIu64 " rendered, %" PRIu64
+           " dropped, depth %" PRIu64 " (max %" PRIu64 " of %d)\n",
+           stats.pushed, stats.popped, stats.dropped, stats.depth,
+           stats.max_depth, EVENT_QUEUE_SIZE);
+    return 0;
+  } else if (strcmp(argv[1], "listener") == 0) {
+    exception_listener_stats_t stats;
+    exception_listener_get_stats(&stats);
+    double avg = stats.batches ? (double)stats.messages / stats.batches : 0;
+    double rate =
+        stats.busy_ns ? stats.messages * 1e9 / (double)stats.busy_ns : 0;
+    printf("[i] listener: %" PRIu64 " messages in %" PRIu64
+           " batches (avg %.1f, max %" PRIu64 " of %d), %.0f events/sec\n",
+           stats.messages, stats.batches, avg, stats.max_batch, EXC_BATCH_MAX,
+           rate);
+    return 0;
+  } else if (strcmp(argv[1], "exc") == 0) {
+    exception_listener_print_latency(reset);
+    return 0;
+  }
+
+  printf("Usage: stats cache [reset] | stats trace | stats events | "
+         "stats listener | stats exc [reset]\n");
+  return 1;
+}
+
 // array of builtin commands, each entry has a
 // - name - word that you type
 // - func - the function to call
@@ -367,20 +712,61 @@ const builtin_cmd_t builtins[] = {
 
     {"attach", cmd_attach, "attach to a process by pid or name"},
     {"suspend", cmd_interrupt, "suspend attached process execution"},
-    {"c", cmd_continue, "continue attached process execution"},
+    {"c", cmd_continue,
+     "continue attached process execution, in non-stop mode only the "
+     "selected thread"},
+    {"nonstop", cmd_nonstop,
+     "toggle non-stop mode, a stop holds only the thread that raised it"},
+    {"thread", cmd_thread,
+     "list, select or continue threads held in non-stop mode\n\t"
+     "syntax: thread list | thread select <thread> | "
+     "thread continue [thread|all]"},
+    {"threads", cmd_threads,
+     "show state, cpu time and first frames of every thread, or save the "
+     "raw snapshot\n\tsyntax: threads [save <file>]"},
     {"detach", cmd_detach, "detach from attached process"},
 
     {"reg", cmd_reg,
-     "read or write to registers\n\tsyntax: reg [read|write] <reg> [value]"},
+     "read or write to registers, --all reads every thread\n\t"
+     "syntax: reg read [--all] | reg write <reg> <value>"},
     {"regdbg", cmd_reg_dbg, "read debug registers"},
 
     {"br", cmd_br,
      "list, set or delete a breakpoint by address or index\n\t"
-     "syntax: br set <address> | br delete <address|index> | br list"},
+     "syntax: br set <address|symbol> [if <cond>] | "
+     "br cond <index> [cond] | br delete <address|symbol|index> | br list"},
+    {"trace", cmd_trace,
+     "record registers and memory at an address without stopping\n\t"
+     "syntax: trace set <address> <reg,...> [<reg>+<off>:<len>] | "
+     "trace start <file> | trace stop | trace decode <file>"},
+    {"coverage", cmd_coverage,
+     "one shot breakpoint coverage of an image, exported as drcov\n\t"
+     "syntax: coverage start <func|bb> [image base] | coverage stop | "
+     "coverage export <file> | coverage"},
+    {"sym", cmd_sym,
+     "look up a symbol by address or name, or load another image's "
+     "symbols\n\tsyntax: sym <address|name> | sym load <file|all> [base] | "
+     "sym list | sym cache [clear|on|off]"},
+    {"images", cmd_images,
+     "list the images dyld has loaded, or find the image and segment an "
+     "address is in, or the files reads come from instead\n\tsyntax: "
+     "images [address] | images files [on|off]"},
+    {"index", cmd_index,
+     "index the functions and basic blocks of an image or mach-o file\n\t"
+     "syntax: index build [image base|file] | index lookup <address> | "
+     "index"},
     {"wp", cmd_wp,
      "list, set or delete a watchpoint by address or index\n\t"
-     "syntax: wp set <address> | wp delete <address|index> | wp list"},
-    {"step", cmd_step, "steps to next instruction"},
+     "syntax: wp set <address> <len> [r|w|rw] | wp delete <address|index> | "
+     "wp list"},
+    {"step", cmd_step,
+     "steps to next instruction, or into the next source line\n\t"
+     "syntax: step [line]"},
+    {"next", cmd_next,
+     "steps to the next source line, over calls"},
+    {"line", cmd_line,
+     "show the source line of an address (the pc by default), or the "
+     "images with line tables\n\tsyntax: line [address] | line list"},
 
     {"r64", cmd_r64, "read 64 bits from an address in memory\n\tsyntax: r64 [addr]"},
     {"w64", cmd_w64, "write 64 bits to an address in memory\n\tsyntax: w64 [addr] [bytes]"},
@@ -389,9 +775,17 @@ const builtin_cmd_t builtins[] = {
 
     {"slide", cmd_slide, "print the aslr slide of the attached process"},
     {"autoslide", cmd_autoslide, "enable auto ASLR slide calculation on r/w to target task"},
+    {"excstate", cmd_excstate,
+     "toggle receiving thread state inside exception messages "
+     "(EXCEPTION_STATE_IDENTITY)"},
 
     {"disasm", cmd_disasm, "disassemble from the current pc\n\tsyntax: disasm [bytes]"},
 
+    {"stats", cmd_stats,
+     "print debugger counters\n\t"
+     "syntax: stats cache [reset] | stats trace | stats events | "
+     "stats listener | stats exc [reset]"},
+
     {"q", cmd_exit, "exits the program"},
 
     {NULL, NULL, NULL}};
@@ -446,9 +840,44 @@ static char *read_line(void) {
   return buf;
 }
 
+// render every stop the exception listener queued
+static void drain_events(void) {
+  exc_event_t ev;
+  while (event_queue_pop(&ev))
+    print_stop_event(&ev);
+
+  uint64_t thread = 0;
+  uint64_t lost = event_queue_take_lost(&thread);
+  if (lost)
+    printf("[!] %" PRIu64 " stops lost to a full event queue, the latest "
+           "on thread 0x%" PRIx64 ", they stay stopped until continued "
+           "(thread list shows them in non-stop mode)\n",
+           lost, thread);
+}
+
+// block until a line can be read, rendering stops as they arrive
+static void wait_for_input(void) {
+  int efd = event_queue_fd();
+  for (;;) {
+    struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN},
+                            {.fd = efd, .events = POLLIN}};
+    if (poll(fds, efd >= 0 ? 2 : 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    if (efd >= 0 && (fds[1].revents & POLLIN)) {
+      drain_events();
+      print_prompt();
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+      return;
+  }
+}
+
 void shell_loop(void) {
   char *line;
-  while (print_prompt(), (line = read_line()) != NULL) {
+  while (print_prompt(), wait_for_input(), (line = read_line()) != NULL) {
     char *argv[64];
     int argc = 0;
 
@@ -0,0 +1,659 @@
+#include "mach/file_backing.h"
+#include "mach/image_table.h"
+#include "mach/mach_process.h"
+#include "mach/page_cache.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libkern/OSByteOrder.h>
+#include <mach-o/fat.h>
+#include <mach-o/loader.h>
+#include <mach/mach_vm.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef MH_DYLIB_IN_CACHE
+#define MH_DYLIB_IN_CACHE 0x80000000
+#endif
+
+// dyld_cache_header, only what we use of it
+#define CACHE_MAGIC "dyld_v1"
+#define CACHE_MAPPING_OFFSET 0x10
+#define CACHE_MAPPING_COUNT 0x14
+#define CACHE_UUID 0x58
+#define CACHE_MAX_MAPPINGS 64
+#define CACHE_MAX_SUBCACHES 99
+
+#define BACKED_PAGE_MASK (PAGE_CACHE_PAGE_SIZE - 1)
+
+// dyld_cache_mapping_info
+typedef struct {
+  uint64_t address;
+  uint64_t size;
+  uint64_t file_offset;
+  uint32_t max_prot;
+  uint32_t init_prot;
+} cache_mapping_t;
+
+// where the shared cache lives, the cryptex since macOS 13
+static const char *const cache_paths[] = {
+    "/System/Volumes/Preboot/Cryptexes/OS/System/Library/dyld/"
+    "dyld_shared_cache_arm64e",
+    "/System/Library/dyld/dyld_shared_cache_arm64e",
+    "/System/Volumes/Preboot/Cryptexes/OS/System/Library/dyld/"
+    "dyld_shared_cache_arm64",
+    "/System/Library/dyld/dyld_shared_cache_arm64",
+};
+
+// [start, end) of the task is the bytes at data
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+  const uint8_t *data;
+} backed_range_t;
+
+// a file we mapped
+// - base, uuid - of the image it backs, base is 0 for shared cache files
+// - map        - NULL if the file didn't check out, the entry stays so it
+//                isn't opened again while its image is loaded
+typedef struct {
+  char path[IMAGE_PATH_LEN];
+  uint64_t base;
+  uint8_t uuid[16];
+  uint8_t *map;
+  size_t len;
+  bool used;
+} backed_file_t;
+
+static backed_file_t *files;
+static size_t nfiles;
+static size_t files_cap;
+
+// the shared cache's ranges, found once per attach
+static backed_range_t *shared;
+static size_t nshared;
+static size_t shared_cap;
+static bool shared_tried;
+
+// sorted, never overlapping
+static backed_range_t *ranges;
+static size_t nranges;
+static size_t ranges_cap;
+static bool built;
+static uint64_t built_generation;
+
+// page aligned [start, end) pairs we wrote to or made writable, sorted and
+// merged
+static backed_range_t *dirty;
+static size_t ndirty;
+static size_t dirty_cap;
+
+static atomic_bool disabled;
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static atomic_uint_fast64_t stat_reads;
+static atomic_uint_fast64_t stat_bytes;
+static atomic_uint_fast64_t stat_patched;
+static uint64_t stat_rebuilds;
+
+static int _grow(void **v, size_t *cap, size_t need, size_t elem) {
+  if (need <= *cap)
+    return 0;
+  size_t c = *cap ? *cap * 2 : 64;
+  while (c < need)
+    c *= 2;
+  void *tmp = realloc(*v, c * elem);
+  if (!tmp)
+    return -1; // allocation err
+  *v = tmp;
+  *cap = c;
+  return 0;
+}
+
+static int _add_range(backed_range_t **v, size_t *n, size_t *cap,
+                      uint64_t start, uint64_t len, const uint8_t *data) {
+  if (len == 0 || start + len < start)
+    return 0;
+  if (_grow((void **)v, cap, *n + 1, sizeof(**v)) != 0)
+    return -1;
+  (*v)[(*n)++] = (backed_range_t){.start = start, .end = start + len,
+                                  .data = data};
+  return 0;
+}
+
+static int _map(const char *path, uint8_t **map, size_t *len) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct stat sb;
+  void *p = MAP_FAILED;
+  if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0)
+    p = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return -1;
+  *map = p;
+  *len = (size_t)sb.st_size;
+  return 0;
+}
+
+// range_read_fn style, straight to the kernel, we sit below mach_read
+static int _read_task(uint64_t addr, void *out, size_t size) {
+  vm_size_t got = 0;
+  kern_return_t kr =
+      vm_read_overwrite(mach_get_task(), (vm_address_t)addr, (vm_size_t)size,
+                        (vm_address_t)out, &got);
+  return kr == KERN_SUCCESS && got == size ? 0 : -1;
+}
+
+// images on disk
+
+// the arm64 slice of a universal file, or all of a thin one
+static int _slice(const uint8_t *map, size_t len, uint64_t *off,
+                  uint64_t *size) {
+  struct fat_header fh;
+  *off = 0;
+  *size = len;
+  if (len < sizeof(fh))
+    return -1;
+  memcpy(&fh, map, sizeof(fh));
+  if (OSSwapBigToHostInt32(fh.magic) != FAT_MAGIC)
+    return 0; // thin
+
+  uint32_t n = OSSwapBigToHostInt32(fh.nfat_arch);
+  for (uint32_t i = 0; i < n; i++) {
+    struct fat_arch fa;
+    size_t at = sizeof(fh) + (size_t)i * sizeof(fa);
+    if (at + sizeof(fa) > len)
+      return -1;
+    memcpy(&fa, map + at, sizeof(fa));
+    if ((cpu_type_t)OSSwapBigToHostInt32(fa.cputype) != CPU_TYPE_ARM64)
+      continue;
+    *off = OSSwapBigToHostInt32(fa.offset);
+    *size = OSSwapBigToHostInt32(fa.size);
+    return *off <= len && *size <= len - *off ? 0 : -1;
+  }
+  return -1;
+}
+
+// whether the slice's LC_UUID is uuid
+static bool _same_uuid(const uint8_t *mo, uint64_t size,
+                       const uint8_t uuid[16]) {
+  struct mach_header_64 mh;
+  if (size < sizeof(mh))
+    return false;
+  memcpy(&mh, mo, sizeof(mh));
+  if (mh.magic != MH_MAGIC_64 || mh.sizeofcmds > size - sizeof(mh))
+    return false;
+
+  const uint8_t *cmds = mo + sizeof(mh);
+  uint32_t off = 0;
+  for (uint32_t i = 0; i < mh.ncmds; i++) {
+    struct load_command lc;
+    if (off + sizeof(lc) > mh.sizeofcmds)
+      break;
+    memcpy(&lc, cmds + off, sizeof(lc));
+    if (lc.cmdsize < sizeof(lc) || lc.cmdsize > mh.sizeofcmds - off)
+      break;
+    if (lc.cmd == LC_UUID && lc.cmdsize >= sizeof(struct uuid_command)) {
+      struct uuid_command uc;
+      memcpy(&uc, cmds + off, sizeof(uc));
+      return memcmp(uc.uuid, uuid, sizeof(uc.uuid)) == 0;
+    }
+    off += lc.cmdsize;
+  }
+  return false;
+}
+
+// the file of a loaded image, mapped the first time it is asked for
+static backed_file_t *_image_file(const loaded_image_t *img) {
+  for (size_t i = 0; i < nfiles; i++) {
+    backed_file_t *f = &files[i];
+    if (f->base == img->base &&
+        memcmp(f->uuid, img->uuid, sizeof(f->uuid)) == 0 &&
+        strcmp(f->path, img->path) == 0)
+      return f;
+  }
+
+  if (_grow((void **)&files, &files_cap, nfiles + 1, sizeof(*files)) != 0)
+    return NULL;
+  backed_file_t *f = &files[nfiles++];
+  memset(f, 0, sizeof(*f));
+  snprintf(f->path, sizeof(f->path), "%s", img->path);
+  f->base = img->base;
+  memcpy(f->uuid, img->uuid, sizeof(f->uuid));
+
+  uint64_t off, size;
+  if (_map(img->path, &f->map, &f->len) != 0)
+    return f;
+  if (_slice(f->map, f->len, &off, &size) != 0 ||
+      !_same_uuid(f->map + off, size, img->uuid)) {
+    munmap(f->map, f->len);
+    f->map = NULL;
+  }
+  return f;
+}
+
+// the segments of img that are still what the file holds
+static int _image_ranges(const loaded_image_t *img, const backed_file_t *f) {
+  uint64_t off, size;
+  if (_slice(f->map, f->len, &off, &size) != 0)
+    return 0;
+  for (uint32_t i = 0; i < img->nsegments; i++) {
+    const image_segment_t *seg = &img->segments[i];
+    if ((seg->initprot | seg->maxprot) & VM_PROT_WRITE)
+      continue;
+    // past filesize the segment is zero fill
+    uint64_t len = seg->filesize < seg->vmsize ? seg->filesize : seg->vmsize;
+    if (seg->fileoff > size || len > size - seg->fileoff)
+      continue;
+    if (_add_range(&ranges, &nranges, &ranges_cap, seg->vmaddr + img->slide,
+                   len, f->map + off + seg->fileoff) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// the shared cache
+
+// header uuid of a mapped cache file, NULL if it isn't one
+static const uint8_t *_cache_uuid(const backed_file_t *f) {
+  if (f->len < CACHE_UUID + 16 ||
+      memcmp(f->map, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1) != 0)
+    return NULL;
+  return f->map + CACHE_UUID;
+}
+
+// every mapping of one cache file the task can't have written to, after
+// checking the task maps this very file, its header sits at the start of
+// the mapping at file offset 0 and carries the file's uuid
+static int _cache_ranges(const backed_file_t *f, uint64_t slide) {
+  const uint8_t *uuid = _cache_uuid(f);
+  if (!uuid)
+    return -1;
+  uint32_t moff, mcount;
+  memcpy(&moff, f->map + CACHE_MAPPING_OFFSET, sizeof(moff));
+  memcpy(&mcount, f->map + CACHE_MAPPING_COUNT, sizeof(mcount));
+  if (mcount > CACHE_MAX_MAPPINGS || moff > f->len ||
+      (size_t)mcount * sizeof(cache_mapping_t) > f->len - moff)
+    return -1;
+
+  cache_mapping_t m[CACHE_MAX_MAPPINGS];
+  memcpy(m, f->map + moff, mcount * sizeof(*m));
+  bool checked = false;
+  for (uint32_t i = 0; i < mcount && !checked; i++) {
+    uint8_t live[16];
+    if (m[i].file_offset != 0 || m[i].size < CACHE_UUID + sizeof(live))
+      continue;
+    if (_read_task(m[i].address + slide + CACHE_UUID, live, sizeof(live)) !=
+            0 ||
+        memcmp(live, uuid, sizeof(live)) != 0)
+      return -1;
+    checked = true;
+  }
+  if (!checked)
+    return -1;
+
+  for (uint32_t i = 0; i < mcount; i++) {
+    if ((m[i].init_prot | m[i].max_prot) & VM_PROT_WRITE)
+      continue;
+    if (m[i].file_offset > f->len || m[i].size > f->len - m[i].file_offset)
+      continue;
+    if (_add_range(&shared, &nshared, &shared_cap, m[i].address + slide,
+                   m[i].size, f->map + m[i].file_offset) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// maps path as a shared cache file, kept if it is a cache with want_uuid
+// (any uuid for NULL) that the task has mapped
+static bool _cache_file(const char *path, uint64_t slide,
+                        const uint8_t *want_uuid) {
+  if (_grow((void **)&files, &files_cap, nfiles + 1, sizeof(*files)) != 0)
+    return false;
+  backed_file_t *f = &files[nfiles];
+  memset(f, 0, sizeof(*f));
+  snprintf(f->path, sizeof(f->path), "%s", path);
+  if (_map(path, &f->map, &f->len) != 0)
+    return false;
+
+  const uint8_t *uuid = _cache_uuid(f);
+  size_t before = nshared;
+  if (!uuid || (want_uuid && memcmp(uuid, want_uuid, 16) != 0) ||
+      _cache_ranges(f, slide) != 0) {
+    nshared = before;
+    munmap(f->map, f->len);
+    return false;
+  }
+  memcpy(f->uuid, uuid, sizeof(f->uuid));
+  nfiles++;
+  return true;
+}
+
+// the main cache file with the uuid dyld reports, then its subcaches, .01
+// to .99 on current systems and .1 to .99 on older ones, until one is
+// missing
+static void _load_shared_cache(uint64_t slide, const uint8_t uuid[16]) {
+  for (size_t i = 0; i < sizeof(cache_paths) / sizeof(*cache_paths); i++) {
+    if (!_cache_file(cache_paths[i], slide, uuid))
+      continue;
+
+    static const char *const suffixes[] = {"%s.%02u", "%s.%u"};
+    for (size_t s = 0; s < sizeof(suffixes) / sizeof(*suffixes); s++) {
+      unsigned n = 1;
+      for (; n <= CACHE_MAX_SUBCACHES; n++) {
+        char sub[IMAGE_PATH_LEN];
+        snprintf(sub, sizeof(sub), suffixes[s], cache_paths[i], n);
+        if (access(sub, R_OK) != 0)
+          break;
+        _cache_file(sub, slide, NULL);
+      }
+      if (n > 1)
+        break;
+    }
+    return;
+  }
+}
+
+// the ranges
+
+static int _cmp_range(const void *a, const void *b) {
+  uint64_t x = ((const backed_range_t *)a)->start;
+  uint64_t y = ((const backed_range_t *)b)->start;
+  return (x > y) - (x < y);
+}
+
+// how many intervals of v start at or below addr
+static size_t _upper(const backed_range_t *v, size_t n, uint64_t addr) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (v[mid].start <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// the caller holds lock for writing
+static void _mark_dirty(uint64_t addr, uint64_t size) {
+  if (size == 0)
+    return;
+  uint64_t start = addr & ~BACKED_PAGE_MASK;
+  uint64_t end = (addr + size + BACKED_PAGE_MASK) & ~BACKED_PAGE_MASK;
+  if (end <= start)
+    end = UINT64_MAX & ~BACKED_PAGE_MASK;
+
+  // [i, j) are the intervals touching [start, end), merged into one
+  size_t j = _upper(dirty, ndirty, end);
+  size_t i = j;
+  while (i > 0 && dirty[i - 1].end >= start)
+    i--;
+  if (i < j) {
+    if (dirty[i].start < start)
+      start = dirty[i].start;
+    if (dirty[j - 1].end > end)
+      end = dirty[j - 1].end;
+  }
+  size_t after = ndirty - j;
+  if (i == j && _grow((void **)&dirty, &dirty_cap, ndirty + 1,
+                      sizeof(*dirty)) != 0) {
+    // can't remember it, stop trusting files altogether
+    atomic_store_explicit(&disabled, true, memory_order_relaxed);
+    return;
+  }
+  memmove(&dirty[i + 1], &dirty[j], after * sizeof(*dirty));
+  dirty[i] = (backed_range_t){.start = start, .end = end};
+  ndirty = i + 1 + after;
+}
+
+// the file says a range is read only, the task may not agree, a region
+// that is writable now or has pages copied out of the file (a target that
+// vm_protect'ed its own code and patched it) goes to the task from now on,
+// the caller holds lock for writing
+static void _mark_touched(const backed_range_t *r) {
+  mach_vm_address_t at = r->start;
+  natural_t depth = 0;
+  while (at < r->end) {
+    mach_vm_address_t addr = at;
+    mach_vm_size_t len = 0;
+    vm_region_submap_info_data_64_t info;
+    mach_msg_type_number_t count = VM_REGION_SUBMAP_INFO_COUNT_64;
+    if (mach_vm_region_recurse(mach_get_task(), &addr, &len, &depth,
+                               (vm_region_recurse_info_t)&info,
+                               &count) != KERN_SUCCESS ||
+        len == 0)
+      return;
+    // the shared cache sits in a submap, look inside it
+    if (info.is_submap) {
+      depth++;
+      continue;
+    }
+    if (addr >= r->end)
+      return;
+    if ((info.protection & VM_PROT_WRITE) || info.pages_shared_now_private ||
+        info.share_mode == SM_PRIVATE || info.share_mode == SM_PRIVATE_ALIASED)
+      _mark_dirty(addr, len);
+    at = addr + len;
+  }
+}
+
+// the caller holds lock for writing
+static void _rebuild(void) {
+  uint64_t gen = image_table_generation();
+
+  uint64_t slide;
+  uint8_t uuid[16];
+  if (!shared_tried && image_table_shared_cache(&slide, uuid)) {
+    shared_tried = true;
+    _load_shared_cache(slide, uuid);
+  }
+
+  size_t n = image_table_images(NULL, 0);
+  loaded_image_t *all = malloc((n ? n : 1) * sizeof(*all));
+  if (!all)
+    return; // allocation err, tried again next read
+  n = image_table_images(all, n);
+
+  for (size_t i = 0; i < nfiles; i++)
+    files[i].used = files[i].base == 0;
+
+  nranges = 0;
+  int err = 0;
+  for (size_t i = 0; i < nshared && !err; i++)
+    err = _add_range(&ranges, &nranges, &ranges_cap, shared[i].start,
+                     shared[i].end - shared[i].start, shared[i].data);
+
+  static const uint8_t zero[16];
+  for (size_t i = 0; i < n && !err; i++) {
+    // images in the shared cache differ from their files on disk, and the
+    // uuid is all we go by
+    if ((all[i].flags & MH_DYLIB_IN_CACHE) || !all[i].path[0] ||
+        memcmp(all[i].uuid, zero, sizeof(zero)) == 0)
+      continue;
+    backed_file_t *f = _image_file(&all[i]);
+    if (!f) {
+      err = -1;
+      break;
+    }
+    f->used = true;
+    if (f->map)
+      err = _image_ranges(&all[i], f);
+  }
+  free(all);
+
+  // files of images that went away
+  size_t m = 0;
+  for (size_t i = 0; i < nfiles; i++) {
+    if (files[i].used)
+      files[m++] = files[i];
+    else if (files[i].map)
+      munmap(files[i].map, files[i].len);
+  }
+  nfiles = m;
+
+  if (err) {
+    nranges = 0;
+    return;
+  }
+
+  // first claim wins where anything overlaps
+  qsort(ranges, nranges, sizeof(*ranges), _cmp_range);
+  m = 0;
+  for (size_t i = 0; i < nranges; i++) {
+    if (m && ranges[m - 1].end > ranges[i].start)
+      continue;
+    ranges[m++] = ranges[i];
+  }
+  nranges = m;
+  for (size_t i = 0; i < nranges; i++)
+    _mark_touched(&ranges[i]);
+
+  built = true;
+  built_generation = gen;
+  stat_rebuilds++;
+}
+
+static const backed_range_t *_find(uint64_t addr) {
+  size_t i = _upper(ranges, nranges, addr);
+  if (i == 0 || addr >= ranges[i - 1].end)
+    return NULL;
+  return &ranges[i - 1];
+}
+
+static bool _is_dirty(uint64_t start, uint64_t end) {
+  size_t i = _upper(dirty, ndirty, end - 1);
+  return i && dirty[i - 1].end > start;
+}
+
+// the caller holds lock for reading
+static int _read(uint64_t addr, void *out, size_t size) {
+  uint64_t end = addr + size;
+  if (size == 0 || end < addr)
+    return -1;
+
+  uint8_t *dst = out;
+  for (uint64_t at = addr; at < end;) {
+    const backed_range_t *r = _find(at);
+    if (!r)
+      return -1;
+    uint64_t stop = r->end < end ? r->end : end;
+    memcpy(dst + (at - addr), r->data + (at - r->start), stop - at);
+    at = stop;
+  }
+
+  if (_is_dirty(addr, end)) {
+    atomic_fetch_add_explicit(&stat_patched, 1, memory_order_relaxed);
+    return -1;
+  }
+  atomic_fetch_add_explicit(&stat_reads, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stat_bytes, size, memory_order_relaxed);
+  return 0;
+}
+
+int file_backing_read(uint64_t addr, void *out, size_t size) {
+  if (atomic_load_explicit(&disabled, memory_order_relaxed))
+    return -1;
+
+  uint64_t gen = image_table_generation();
+  pthread_rwlock_rdlock(&lock);
+  if (!built || built_generation != gen) {
+    pthread_rwlock_unlock(&lock);
+    pthread_rwlock_wrlock(&lock);
+    if (!built || built_generation != gen)
+      _rebuild();
+    pthread_rwlock_unlock(&lock);
+    pthread_rwlock_rdlock(&lock);
+  }
+  int ret = _read(addr, out, size);
+  pthread_rwlock_unlock(&lock);
+  return ret;
+}
+
+void file_backing_mark_dirty(uint64_t addr, size_t size) {
+  pthread_rwlock_wrlock(&lock);
+  _mark_dirty(addr, size);
+  pthread_rwlock_unlock(&lock);
+}
+
+void file_backing_reset(void) {
+  pthread_rwlock_wrlock(&lock);
+  for (size_t i = 0; i < nfiles; i++) {
+    if (files[i].map)
+      munmap(files[i].map, files[i].len);
+  }
+  nfiles = 0;
+  nshared = 0;
+  shared_tried = false;
+  nranges = 0;
+  built = false;
+  ndirty = 0;
+  pthread_rwlock_unlock(&lock);
+}
+
+void file_backing_set_enabled(bool enabled) {
+  atomic_store_explicit(&disabled, !enabled, memory_order_relaxed);
+}
+
+bool file_backing_enabled(void) {
+  return !atomic_load_explicit(&disabled, memory_order_relaxed);
+}
+
+void file_backing_print(void) {
+  pthread_rwlock_rdlock(&lock);
+  size_t mapped = 0;
+  for (size_t i = 0; i < nfiles; i++)
+    mapped += files[i].map != NULL;
+  printf("[i] reads from files %s, %zu files mapped, %zu ranges, %zu patched "
+         "ranges\n",
+         file_backing_enabled() ? "on" : "off", mapped, nranges, ndirty);
+
+  for (size_t i = 0; i < nfiles; i++) {
+    const backed_file_t *f = &files[i];
+    if (!f->map) {
+      printf("  %11s  %s (missing, or another uuid)\n", "-", f->path);
+      continue;
+    }
+    uint64_t bytes = 0;
+    for (size_t r = 0; r < nranges; r++) {
+      if (ranges[r].data >= f->map && ranges[r].data < f->map + f->len)
+        bytes += ranges[r].end - ranges[r].start;
+    }
+    printf("  %7" PRIu64 " KiB  %s\n", bytes / 1024, f->path);
+  }
+  pthread_rwlock_unlock(&lock);
+}
+
+void file_backing_get_stats(file_backing_stats_t *out) {
+  out->reads = atomic_load_explicit(&stat_reads, memory_order_relaxed);
+  out->bytes = atomic_load_explicit(&stat_bytes, memory_order_relaxed);
+  out->patched = atomic_load_explicit(&stat_patched, memory_order_relaxed);
+
+  pthread_rwlock_rdlock(&lock);
+  out->rebuilds = stat_rebuilds;
+  out->files = 0;
+  for (size_t i = 0; i < nfiles; i++)
+    out->files += files[i].map != NULL;
+  out->ranges = nranges;
+  out->dirty_pages = 0;
+  for (size_t i = 0; i < ndirty; i++)
+    out->dirty_pages += (dirty[i].end - dirty[i].start) / PAGE_CACHE_PAGE_SIZE;
+  pthread_rwlock_unlock(&lock);
+}
+
+void file_backing_reset_stats(void) {
+  atomic_store_explicit(&stat_reads, 0, memory_order_relaxed);
+  atomic_store_explicit(&stat_bytes, 0, memory_order_relaxed);
+  atomic_store_explicit(&stat_patched, 0, memory_order_relaxed);
+  pthread_rwlock_wrlock(&lock);
+  stat_rebuilds = 0;
+  pthread_rwlock_unlock(&lock);
+}
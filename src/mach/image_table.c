@@ -0,0 +1,602 @@
+#include "mach/image_table.h"
+#include "mach/mach_process.h"
+#include "mach/page_cache.h"
+#include "target/coalesce.h"
+#include <mach-o/dyld_images.h>
+#include <mach-o/loader.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// user addresses fit in 47 bits, on arm64e the notifier pointer dyld
+// stores carries a pointer authentication signature above that
+#define IMAGE_ADDR_MASK ((1ULL << 47) - 1)
+
+// more load commands than this is not a mach header
+#define IMAGE_MAX_CMDS 0x10000
+// dyld never hands its notifier anywhere near this many images at once
+#define IMAGE_MAX_BATCH 0x10000
+
+// first guess at a path's length, the few that don't fit are read again a
+// chunk at a time
+#define IMAGE_PATH_GUESS 160
+
+#define IMAGE_DYLD_PATH "/usr/lib/dyld"
+
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+  const loaded_image_t *img;
+} interval_t;
+
+// sorted by start, never overlapping
+typedef struct {
+  interval_t *v;
+  size_t n;
+  size_t cap;
+} interval_set_t;
+
+// one allocation per image so intervals can point at them, in the order
+// they were loaded
+static loaded_image_t **images;
+static size_t nimages;
+static size_t images_cap;
+
+static interval_set_t loaded;
+static interval_set_t unslid;
+static uint64_t notifier;
+static uint64_t generation;
+
+static bool have_shared_cache;
+static uint64_t shared_cache_slide;
+static uint8_t shared_cache_uuid[16];
+
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// range_read_fn, straight to the kernel, the page cache and read stats
+// belong to the shell thread and the listener updates the table too
+static int _read_range(uint64_t addr, void *out, size_t size) {
+  vm_size_t got = 0;
+  kern_return_t kr =
+      vm_read_overwrite(mach_get_task(), (vm_address_t)addr, (vm_size_t)size,
+                        (vm_address_t)out, &got);
+  if (kr == KERN_SUCCESS && got != size)
+    return KERN_FAILURE;
+  return kr;
+}
+
+static void _read_batch(target_iovec_t *iov, size_t n) {
+  target_read_coalesced(iov, n, PAGE_CACHE_PAGE_SIZE, _read_range, NULL);
+}
+
+// a path the first guess didn't cover, chunks never cross a page so the
+// end of a mapping can't fail the read
+static void _read_path(uint64_t addr, char *path, size_t len) {
+  path[0] = '\0';
+  size_t got = 0;
+  while (addr && got + 1 < len) {
+    char chunk[64];
+    uint64_t at = addr + got;
+    size_t want = sizeof(chunk) < len - got - 1 ? sizeof(chunk)
+                                                : len - got - 1;
+    size_t room = PAGE_CACHE_PAGE_SIZE - (at & (PAGE_CACHE_PAGE_SIZE - 1));
+    if (want > room)
+      want = room;
+    if (_read_range(at, chunk, want) != KERN_SUCCESS)
+      break;
+    size_t n = strnlen(chunk, want);
+    memcpy(path + got, chunk, n);
+    got += n;
+    path[got] = '\0';
+    if (n < want)
+      break;
+  }
+}
+
+// the segments, uuid and slide from an image's load commands, false if it
+// has no __TEXT to take the slide from
+static bool _parse(loaded_image_t *img, const struct mach_header_64 *mh,
+                   const uint8_t *cmds) {
+  img->filetype = mh->filetype;
+  img->flags = mh->flags;
+
+  bool have_text = false;
+  uint64_t text_vmaddr = 0;
+  size_t off = 0;
+  for (uint32_t i = 0; i < mh->ncmds; i++) {
+    struct load_command lc;
+    if (off + sizeof(lc) > mh->sizeofcmds)
+      break;
+    memcpy(&lc, cmds + off, sizeof(lc));
+    if (lc.cmdsize < sizeof(lc) || off + lc.cmdsize > mh->sizeofcmds)
+      break;
+
+    if (lc.cmd == LC_SEGMENT_64 &&
+        lc.cmdsize >= sizeof(struct segment_command_64)) {
+      struct segment_command_64 seg;
+      memcpy(&seg, cmds + off, sizeof(seg));
+      if (strncmp(seg.segname, SEG_TEXT, sizeof(seg.segname)) == 0) {
+        text_vmaddr = seg.vmaddr;
+        have_text = true;
+      }
+      bool skip =
+          seg.vmsize == 0 ||
+          strncmp(seg.segname, SEG_PAGEZERO, sizeof(seg.segname)) == 0 ||
+          strncmp(seg.segname, SEG_LINKEDIT, sizeof(seg.segname)) == 0;
+      if (!skip && img->nsegments < IMAGE_MAX_SEGMENTS) {
+        image_segment_t *s = &img->segments[img->nsegments++];
+        memcpy(s->name, seg.segname, sizeof(s->name));
+        s->vmaddr = seg.vmaddr;
+        s->vmsize = seg.vmsize;
+        s->fileoff = seg.fileoff;
+        s->filesize = seg.filesize;
+        s->initprot = seg.initprot;
+        s->maxprot = seg.maxprot;
+      }
+    } else if (lc.cmd == LC_UUID && lc.cmdsize >= sizeof(struct uuid_command)) {
+      struct uuid_command uc;
+      memcpy(&uc, cmds + off, sizeof(uc));
+      memcpy(img->uuid, uc.uuid, sizeof(img->uuid));
+    }
+    off += lc.cmdsize;
+  }
+
+  if (!have_text)
+    return false;
+  img->slide = img->base - text_vmaddr;
+  return true;
+}
+
+// what one entry of a batch needs between the reads
+typedef struct {
+  struct mach_header_64 mh;
+  uint8_t *cmds;
+  loaded_image_t *img;
+} pending_t;
+
+// an image for every entry of info with a readable 64 bit mach header,
+// three batched reads however many there are, headers, load commands and
+// paths, out has room for n and keeps the order of info, returns how many
+static size_t _read_images(const struct dyld_image_info *info, size_t n,
+                           loaded_image_t **out) {
+  size_t built = 0;
+  pending_t *p = calloc(n, sizeof(*p));
+  target_iovec_t *iov = calloc(n, sizeof(*iov));
+  size_t *which = calloc(n, sizeof(*which));
+  if (!p || !iov || !which)
+    goto out; // allocation err
+
+  for (size_t i = 0; i < n; i++)
+    iov[i] = (target_iovec_t){.addr = (uint64_t)info[i].imageLoadAddress,
+                              .buf = &p[i].mh,
+                              .size = sizeof(p[i].mh)};
+  _read_batch(iov, n);
+
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (iov[i].status != 0 || p[i].mh.magic != MH_MAGIC_64 ||
+        p[i].mh.sizeofcmds == 0 || p[i].mh.sizeofcmds > IMAGE_MAX_CMDS)
+      continue;
+    p[i].cmds = malloc(p[i].mh.sizeofcmds);
+    if (!p[i].cmds)
+      continue;
+    which[m] = i;
+    iov[m++] = (target_iovec_t){
+        .addr = (uint64_t)info[i].imageLoadAddress + sizeof(p[i].mh),
+        .buf = p[i].cmds,
+        .size = p[i].mh.sizeofcmds};
+  }
+  _read_batch(iov, m);
+
+  size_t k = 0;
+  for (size_t j = 0; j < m; j++) {
+    size_t i = which[j];
+    if (iov[j].status != 0)
+      continue;
+    loaded_image_t *img = calloc(1, sizeof(*img));
+    if (!img)
+      continue;
+    img->base = (uint64_t)info[i].imageLoadAddress;
+    if (!_parse(img, &p[i].mh, p[i].cmds)) {
+      free(img);
+      continue;
+    }
+    p[i].img = img;
+    if (info[i].imageFilePath) {
+      which[k] = i;
+      iov[k++] = (target_iovec_t){.addr = (uint64_t)info[i].imageFilePath,
+                                  .buf = img->path,
+                                  .size = IMAGE_PATH_GUESS};
+    }
+  }
+  _read_batch(iov, k);
+
+  for (size_t j = 0; j < k; j++) {
+    size_t i = which[j];
+    char *path = p[i].img->path;
+    if (iov[j].status != 0 || !memchr(path, '\0', IMAGE_PATH_GUESS))
+      _read_path((uint64_t)info[i].imageFilePath, path, IMAGE_PATH_LEN);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (p[i].img)
+      out[built++] = p[i].img;
+  }
+
+out:
+  if (p) {
+    for (size_t i = 0; i < n; i++)
+      free(p[i].cmds);
+  }
+  free(p);
+  free(iov);
+  free(which);
+  return built;
+}
+
+// intervals
+
+static int _cmp_interval(const void *a, const void *b) {
+  uint64_t x = ((const interval_t *)a)->start;
+  uint64_t y = ((const interval_t *)b)->start;
+  return (x > y) - (x < y);
+}
+
+// how many intervals start below addr (or at it, with inclusive)
+static size_t _bound(const interval_set_t *set, uint64_t addr,
+                     bool inclusive) {
+  size_t lo = 0, hi = set->n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    uint64_t s = set->v[mid].start;
+    if (s < addr || (inclusive && s == addr))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static const interval_t *_find(const interval_set_t *set, uint64_t addr) {
+  size_t i = _bound(set, addr, true);
+  if (i == 0 || addr >= set->v[i - 1].end)
+    return NULL;
+  return &set->v[i - 1];
+}
+
+// the set never overlaps itself, so only the last interval starting
+// below end can reach into [start, end)
+static bool _overlaps(const interval_set_t *set, uint64_t start,
+                      uint64_t end) {
+  size_t i = _bound(set, end, false);
+  return i && set->v[i - 1].end > start;
+}
+
+// sorts add and merges it in, anything overlapping an interval already
+// there or an earlier one of add is dropped, first claim wins
+static int _merge(interval_set_t *set, interval_t *add, size_t n) {
+  qsort(add, n, sizeof(*add), _cmp_interval);
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (_overlaps(set, add[i].start, add[i].end) ||
+        (m && add[m - 1].end > add[i].start))
+      continue;
+    add[m++] = add[i];
+  }
+
+  if (set->n + m > set->cap) {
+    size_t cap = set->cap ? set->cap * 2 : 256;
+    while (cap < set->n + m)
+      cap *= 2;
+    interval_t *tmp = realloc(set->v, cap * sizeof(*tmp));
+    if (!tmp)
+      return -1; // allocation err
+    set->v = tmp;
+    set->cap = cap;
+  }
+
+  // from the back, nothing is overwritten before it has moved
+  size_t i = set->n, j = m, k = set->n + m;
+  while (j > 0) {
+    if (i > 0 && set->v[i - 1].start > add[j - 1].start)
+      set->v[--k] = set->v[--i];
+    else
+      set->v[--k] = add[--j];
+  }
+  set->n += m;
+  return 0;
+}
+
+static void _drop(interval_set_t *set, const loaded_image_t *img) {
+  size_t m = 0;
+  for (size_t i = 0; i < set->n; i++) {
+    if (set->v[i].img != img)
+      set->v[m++] = set->v[i];
+  }
+  set->n = m;
+}
+
+// the table
+
+// the caller holds table_lock for writing
+static loaded_image_t *_find_base(uint64_t base) {
+  const interval_t *iv = _find(&loaded, base);
+  return iv && iv->img->base == base ? (loaded_image_t *)iv->img : NULL;
+}
+
+// takes ownership of add, images already in the table are dropped, the
+// caller holds table_lock for writing
+static kern_return_t _insert(loaded_image_t **add, size_t n) {
+  if (nimages + n > images_cap) {
+    size_t cap = images_cap ? images_cap * 2 : 64;
+    while (cap < nimages + n)
+      cap *= 2;
+    loaded_image_t **tmp = realloc(images, cap * sizeof(*tmp));
+    if (!tmp)
+      goto fail;
+    images = tmp;
+    images_cap = cap;
+  }
+
+  size_t nseg = 0;
+  for (size_t i = 0; i < n; i++)
+    nseg += add[i]->nsegments;
+  interval_t *a = malloc((nseg ? nseg : 1) * sizeof(*a));
+  interval_t *b = malloc((nseg ? nseg : 1) * sizeof(*b));
+  if (!a || !b) {
+    free(a);
+    free(b);
+    goto fail;
+  }
+
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++) {
+    loaded_image_t *img = add[i];
+    if (_find_base(img->base)) {
+      free(img);
+      continue;
+    }
+    for (uint32_t s = 0; s < img->nsegments; s++) {
+      const image_segment_t *seg = &img->segments[s];
+      a[k] = (interval_t){.start = seg->vmaddr + img->slide,
+                          .end = seg->vmaddr + img->slide + seg->vmsize,
+                          .img = img};
+      b[k++] = (interval_t){
+          .start = seg->vmaddr, .end = seg->vmaddr + seg->vmsize, .img = img};
+    }
+    images[nimages++] = img;
+  }
+
+  int err = _merge(&loaded, a, k) | _merge(&unslid, b, k);
+  generation++;
+  free(a);
+  free(b);
+  return err ? KERN_RESOURCE_SHORTAGE : KERN_SUCCESS;
+
+fail:
+  for (size_t i = 0; i < n; i++)
+    free(add[i]);
+  return KERN_RESOURCE_SHORTAGE;
+}
+
+// the caller holds table_lock for writing
+static void _remove(uint64_t base) {
+  loaded_image_t *img = _find_base(base);
+  if (!img)
+    return;
+  _drop(&loaded, img);
+  _drop(&unslid, img);
+  for (size_t i = 0; i < nimages; i++) {
+    if (images[i] == img) {
+      memmove(&images[i], &images[i + 1],
+              (nimages - i - 1) * sizeof(*images));
+      nimages--;
+      break;
+    }
+  }
+  free(img);
+  generation++;
+}
+
+// the caller holds table_lock for writing
+static void _clear(void) {
+  for (size_t i = 0; i < nimages; i++)
+    free(images[i]);
+  nimages = 0;
+  loaded.n = 0;
+  unslid.n = 0;
+  notifier = 0;
+  have_shared_cache = false;
+  generation++;
+}
+
+void image_table_clear(void) {
+  pthread_rwlock_wrlock(&table_lock);
+  _clear();
+  pthread_rwlock_unlock(&table_lock);
+}
+
+kern_return_t image_table_refresh(void) {
+  struct dyld_all_image_infos infos;
+  kern_return_t kr = mach_get_all_image_infos(&infos);
+  if (kr != KERN_SUCCESS)
+    return kr;
+  // dyld clears infoArray while it edits the array
+  if (!infos.infoArray && infos.infoArrayCount)
+    return KERN_FAILURE;
+
+  // dyld doesn't list itself, it goes on the end
+  size_t n = infos.infoArrayCount;
+  struct dyld_image_info *info = calloc(n + 1, sizeof(*info));
+  loaded_image_t **built = calloc(n + 1, sizeof(*built));
+  if (!info || !built) {
+    free(info);
+    free(built);
+    return KERN_RESOURCE_SHORTAGE;
+  }
+  if (n)
+    kr = _read_range((uint64_t)infos.infoArray, info, n * sizeof(*info));
+  if (kr != KERN_SUCCESS) {
+    free(info);
+    free(built);
+    return kr;
+  }
+  info[n++].imageLoadAddress = infos.dyldImageLoadAddress;
+
+  size_t nbuilt = _read_images(info, n, built);
+  for (size_t i = 0; i < nbuilt; i++) {
+    if (built[i]->base == (uint64_t)infos.dyldImageLoadAddress &&
+        !built[i]->path[0])
+      snprintf(built[i]->path, sizeof(built[i]->path), "%s",
+               IMAGE_DYLD_PATH);
+  }
+
+  pthread_rwlock_wrlock(&table_lock);
+  _clear();
+  notifier = (uint64_t)infos.notification & IMAGE_ADDR_MASK;
+  // the shared cache fields came with version 15
+  have_shared_cache = infos.version >= 15 &&
+                      !infos.processDetachedFromSharedRegion &&
+                      infos.sharedCacheBaseAddress;
+  if (have_shared_cache) {
+    shared_cache_slide = infos.sharedCacheSlide;
+    memcpy(shared_cache_uuid, infos.sharedCacheUUID,
+           sizeof(shared_cache_uuid));
+  }
+  kr = _insert(built, nbuilt);
+  pthread_rwlock_unlock(&table_lock);
+
+  free(info);
+  free(built);
+  return kr;
+}
+
+kern_return_t image_table_update(image_mode_t mode, uint64_t info_addr,
+                                 uint32_t count) {
+  if (count == 0)
+    return KERN_SUCCESS;
+  if (count > IMAGE_MAX_BATCH ||
+      (mode != IMAGE_ADDING && mode != IMAGE_REMOVING))
+    return KERN_INVALID_ARGUMENT;
+
+  struct dyld_image_info *info = calloc(count, sizeof(*info));
+  loaded_image_t **built = calloc(count, sizeof(*built));
+  kern_return_t kr = KERN_RESOURCE_SHORTAGE;
+  if (!info || !built)
+    goto out;
+  kr = _read_range(info_addr, info, count * sizeof(*info));
+  if (kr != KERN_SUCCESS)
+    goto out;
+
+  if (mode == IMAGE_REMOVING) {
+    pthread_rwlock_wrlock(&table_lock);
+    for (uint32_t i = 0; i < count; i++)
+      _remove((uint64_t)info[i].imageLoadAddress);
+    pthread_rwlock_unlock(&table_lock);
+    goto out;
+  }
+
+  size_t nbuilt = _read_images(info, count, built);
+  pthread_rwlock_wrlock(&table_lock);
+  kr = _insert(built, nbuilt);
+  pthread_rwlock_unlock(&table_lock);
+
+out:
+  free(info);
+  free(built);
+  return kr;
+}
+
+uint64_t image_table_notifier(void) {
+  pthread_rwlock_rdlock(&table_lock);
+  uint64_t addr = notifier;
+  pthread_rwlock_unlock(&table_lock);
+  return addr;
+}
+
+bool image_table_lookup(uint64_t addr, loaded_image_t *out, uint64_t *off) {
+  pthread_rwlock_rdlock(&table_lock);
+  const interval_t *iv = _find(&loaded, addr);
+  if (iv) {
+    if (out)
+      *out = *iv->img;
+    if (off)
+      *off = addr - iv->img->base;
+  }
+  pthread_rwlock_unlock(&table_lock);
+  return iv != NULL;
+}
+
+bool image_table_main(loaded_image_t *out) {
+  bool found = false;
+  pthread_rwlock_rdlock(&table_lock);
+  for (size_t i = 0; i < nimages && !found; i++) {
+    if (images[i]->filetype == MH_EXECUTE) {
+      *out = *images[i];
+      found = true;
+    }
+  }
+  pthread_rwlock_unlock(&table_lock);
+  return found;
+}
+
+uint64_t image_table_generation(void) {
+  pthread_rwlock_rdlock(&table_lock);
+  uint64_t gen = generation;
+  pthread_rwlock_unlock(&table_lock);
+  return gen;
+}
+
+bool image_table_shared_cache(uint64_t *slide, uint8_t uuid[16]) {
+  pthread_rwlock_rdlock(&table_lock);
+  bool have = have_shared_cache;
+  if (have) {
+    *slide = shared_cache_slide;
+    memcpy(uuid, shared_cache_uuid, sizeof(shared_cache_uuid));
+  }
+  pthread_rwlock_unlock(&table_lock);
+  return have;
+}
+
+static bool _slide_of(const interval_set_t *set, uint64_t addr,
+                      uint64_t *slide) {
+  pthread_rwlock_rdlock(&table_lock);
+  const interval_t *iv = _find(set, addr);
+  if (iv)
+    *slide = iv->img->slide;
+  pthread_rwlock_unlock(&table_lock);
+  return iv != NULL;
+}
+
+bool image_table_slide_loaded(uint64_t addr, uint64_t *slide) {
+  return _slide_of(&loaded, addr, slide);
+}
+
+bool image_table_slide_unslid(uint64_t addr, uint64_t *slide) {
+  return _slide_of(&unslid, addr, slide);
+}
+
+static int _cmp_base(const void *a, const void *b) {
+  uint64_t x = (*(loaded_image_t *const *)a)->base;
+  uint64_t y = (*(loaded_image_t *const *)b)->base;
+  return (x > y) - (x < y);
+}
+
+size_t image_table_images(loaded_image_t *out, size_t max) {
+  pthread_rwlock_rdlock(&table_lock);
+  size_t n = nimages;
+  loaded_image_t **sorted = NULL;
+  if (out && max && n) {
+    sorted = malloc(n * sizeof(*sorted));
+    if (sorted) {
+      memcpy(sorted, images, n * sizeof(*sorted));
+      qsort(sorted, n, sizeof(*sorted), _cmp_base);
+      for (size_t i = 0; i < n && i < max; i++)
+        out[i] = *sorted[i];
+    }
+  }
+  pthread_rwlock_unlock(&table_lock);
+  free(sorted);
+  return n;
+}
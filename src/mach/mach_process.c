@@ -1,5 +1,11 @@
 #include "mach/mach_process.h"
 #include "exc/exception_listener.h"
+#include "mach/file_backing.h"
+#include "mach/image_table.h"
+#include "mach/page_cache.h"
+#include "mach/reg_cache.h"
+#include "target/coalesce.h"
+#include "target/target.h"
 #include <inttypes.h>
 #include <mach-o/dyld_images.h>
 #include <mach/arm/thread_status.h>
@@ -7,8 +13,10 @@
 #include <mach/mach_types.h>
 #include <mach/vm_map.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #ifndef ARM_DEBUG_REG_MAX
@@ -23,13 +31,44 @@ static exception_mask_t old_masks[EXC_TYPES_COUNT];
 static exception_behavior_t old_behaviors[EXC_TYPES_COUNT];
 static thread_state_flavor_t old_flavors[EXC_TYPES_COUNT];
 
-// for restoring after vm_write
-static vm_prot_t old_protections = 0;
+// exceptions the debugger takes over
+static const exception_mask_t exc_mask =
+    EXC_MASK_BAD_ACCESS | EXC_MASK_BREAKPOINT | EXC_MASK_BAD_INSTRUCTION |
+    EXC_MASK_ARITHMETIC | EXC_MASK_SOFTWARE | EXC_MASK_SYSCALL;
+
+// false: EXCEPTION_DEFAULT, handlers fetch registers themselves
+// true:  EXCEPTION_STATE_IDENTITY, the kernel sends ARM_THREAD_STATE64 with
+//        every exception and takes the state back with the reply, the
+//        kernel applies it when the thread next runs, so the replies of
+//        stopped threads are held until resume and carry the register
+//        cache's state then, reg writes made while stopped survive
+static bool exc_state_identity = false;
 
 // target task handle
 // - the task port for the attached task
 static task_t target_task;
 
+// true between a successful suspend and the next resume, memory is only
+// cached while the task cannot change it under us
+static bool task_stopped = false;
+
+// set by the exception handler, cleared on resume
+static thread_act_t stopped_thread = MACH_PORT_NULL;
+static uint64_t stopped_pc = 0;
+
+// stops hold only the faulting thread, see mach_thread_hold
+static bool nonstop = false;
+static held_thread_t *held = NULL;
+static size_t held_count = 0;
+static size_t held_cap = 0;
+static pthread_mutex_t held_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// all-stop, the threads that stopped in the current stop's batch, under
+// held_lock as well
+static held_thread_t *batch_stopped = NULL;
+static size_t batch_stopped_count = 0;
+static size_t batch_stopped_cap = 0;
+
 // struct for thread arr
 typedef struct {
   thread_act_port_array_t threads;
@@ -47,6 +86,24 @@ static ThreadList _get_thread_list(mach_port_t task) {
   return tl;
 }
 
+// first thread task_threads reported, looked up once per attach
+static thread_act_t main_thread = MACH_PORT_NULL;
+
+// the thread register commands act on, the one we are stopped on (or
+// selected in non-stop mode), otherwise the main thread
+static thread_act_t _current_thread(void) {
+  if (stopped_thread != MACH_PORT_NULL)
+    return stopped_thread;
+  if (main_thread == MACH_PORT_NULL) {
+    ThreadList tl = _get_thread_list(target_task);
+    if (tl.count)
+      main_thread = tl.threads[0];
+    vm_deallocate(mach_task_self(), (vm_address_t)tl.threads,
+                  tl.count * sizeof(thread_t));
+  }
+  return main_thread;
+}
+
 // helper: get ARM_THREAD_STATE64
 // print general registers
 static kern_return_t _get_thread_state64(thread_act_t thread,
@@ -76,6 +133,38 @@ static kern_return_t _set_thread_state64(thread_act_t thread,
   return kr;
 }
 
+static bool _is_held(thread_act_t thread) {
+  pthread_mutex_lock(&held_lock);
+  bool found = false;
+  for (size_t i = 0; i < held_count && !found; i++)
+    found = held[i].thread == thread;
+  pthread_mutex_unlock(&held_lock);
+  return found;
+}
+
+// a thread's registers can only be cached while it cannot run, the whole
+// task is stopped or the thread is held in non-stop mode
+static bool _regs_stable(thread_act_t thread) {
+  return task_stopped || _is_held(thread);
+}
+
+// register access for everything above the raw helpers, served from and
+// written into the register cache while the thread is stable, the writes
+// then reach the thread in mach_resume or mach_thread_release
+static kern_return_t _thread_get_regs(thread_act_t thread,
+                                      arm_thread_state64_t *out) {
+  if (_regs_stable(thread))
+    return reg_cache_get(thread, out, _get_thread_state64);
+  return _get_thread_state64(thread, out);
+}
+
+static kern_return_t _thread_set_regs(thread_act_t thread,
+                                      const arm_thread_state64_t *in) {
+  if (_regs_stable(thread))
+    return reg_cache_put(thread, in, _set_thread_state64);
+  return _set_thread_state64(thread, in);
+}
+
 // helper: get ARM_DEBUG_STATE64
 // debug reg print
 static kern_return_t _get_thread_debug_state64(thread_act_t thread,
@@ -140,11 +229,66 @@ kern_return_t mach_suspend(void) {
             mach_error_string(kr), kr);
     return kr;
   }
-  printf("[+] Task [%d] suspended\n", target_task);
+  page_cache_invalidate();
+  task_stopped = true;
   return KERN_SUCCESS;
 }
 
-kern_return_t mach_resume(void) { return task_resume(target_task); }
+kern_return_t mach_resume(void) {
+  // breakpoint and watchpoint edits made while stopped go out now, this
+  // also hands the current state to threads created since the last stop
+  mach_debug_state_flush();
+  // register writes made while stopped, one thread_set_state per thread,
+  // and the held state identity replies, which would undo them otherwise
+  reg_cache_flush(_set_thread_state64);
+  exception_release_replies(MACH_PORT_NULL);
+
+  // the stop epoch ends here, whatever we cached may change from now on
+  task_stopped = false;
+  // held threads stay held across a task resume and keep the selection
+  if (!nonstop)
+    stopped_thread = MACH_PORT_NULL;
+  pthread_mutex_lock(&held_lock);
+  batch_stopped_count = 0;
+  pthread_mutex_unlock(&held_lock);
+  page_cache_invalidate();
+  reg_cache_invalidate();
+  return task_resume(target_task);
+}
+
+// point the task's exceptions at exc_port with the current behavior
+static kern_return_t _register_exception_port(void) {
+  exception_behavior_t behavior = EXCEPTION_DEFAULT;
+  thread_state_flavor_t flavor = THREAD_STATE_NONE;
+  if (exc_state_identity) {
+    behavior = EXCEPTION_STATE_IDENTITY;
+    flavor = ARM_THREAD_STATE64;
+  }
+
+  kern_return_t kr =
+      task_set_exception_ports(target_task, exc_mask, exc_port,
+                               behavior | MACH_EXCEPTION_CODES, flavor);
+  if (kr != KERN_SUCCESS) {
+    fprintf(stderr, "[-] task_set_exception_ports failed: %s (0x%x)\n",
+            mach_error_string(kr), kr);
+  }
+  return kr;
+}
+
+kern_return_t mach_set_exception_state_mode(bool state_identity) {
+  bool old = exc_state_identity;
+  exc_state_identity = state_identity;
+  // not attached yet, setup_exception_port picks it up
+  if (exc_port == MACH_PORT_NULL)
+    return KERN_SUCCESS;
+
+  kern_return_t kr = _register_exception_port();
+  if (kr != KERN_SUCCESS)
+    exc_state_identity = old;
+  return kr;
+}
+
+bool mach_exception_state_mode(void) { return exc_state_identity; }
 
 // setup exception port
 kern_return_t setup_exception_port(pid_t pid) {
@@ -154,13 +298,9 @@ kern_return_t setup_exception_port(pid_t pid) {
 
   mach_suspend();
 
-  exception_mask_t mask = EXC_MASK_BAD_ACCESS | EXC_MASK_BREAKPOINT |
-                          EXC_MASK_BAD_INSTRUCTION | EXC_MASK_ARITHMETIC |
-                          EXC_MASK_SOFTWARE | EXC_MASK_SYSCALL;
-
   mach_msg_type_number_t count = EXC_TYPES_COUNT;
-  kr = task_get_exception_ports(target_task, mask, &old_masks[0], old_ports,
-                                &count, old_behaviors, old_flavors);
+  kr = task_get_exception_ports(target_task, exc_mask, &old_masks[0],
+                                old_ports, &count, old_behaviors, old_flavors);
   if (kr != KERN_SUCCESS) {
     saved_exc_count = count;
     fprintf(stderr, "[-] task_get_exception_ports failed: %s (0x%x)\n",
@@ -178,9 +318,7 @@ kern_return_t setup_exception_port(pid_t pid) {
   if (kr != KERN_SUCCESS)
     return kr;
 
-  kr = task_set_exception_ports(target_task, mask, exc_port,
-                                EXCEPTION_DEFAULT | MACH_EXCEPTION_CODES,
-                                THREAD_STATE_NONE);
+  kr = _register_exception_port();
   if (kr != KERN_SUCCESS)
     return kr;
 
@@ -205,6 +343,20 @@ kern_return_t mach_detach(void) {
     }
   }
   saved_exc_count = 0;
+
+  // never leave a thread frozen behind us, a thread still waiting for its
+  // exception reply included
+  exception_release_replies(MACH_PORT_NULL);
+  pthread_mutex_lock(&held_lock);
+  for (size_t i = 0; i < held_count; i++)
+    thread_resume(held[i].thread);
+  held_count = 0;
+  batch_stopped_count = 0;
+  stopped_thread = MACH_PORT_NULL;
+  pthread_mutex_unlock(&held_lock);
+  main_thread = MACH_PORT_NULL;
+  reg_cache_invalidate();
+
   if (exc_port != MACH_PORT_NULL) {
     mach_port_destroy(mach_task_self(), exc_port);
     exc_port = MACH_PORT_NULL;
@@ -212,16 +364,201 @@ kern_return_t mach_detach(void) {
   return KERN_SUCCESS;
 }
 
+kern_return_t mach_thread_get_pc(thread_act_t thread, uint64_t *pc) {
+  arm_thread_state64_t state64;
+  kern_return_t kr = _thread_get_regs(thread, &state64);
+  if (kr != KERN_SUCCESS)
+    return kr;
+
+  *pc = state64.__pc;
+  return KERN_SUCCESS;
+}
+
+// the thread that raised the exception we are stopped on
+void mach_set_stopped_thread(thread_act_t thread, uint64_t pc) {
+  stopped_thread = thread;
+  stopped_pc = pc;
+}
+
+thread_act_t mach_get_stopped_thread(uint64_t *pc) {
+  if (pc)
+    *pc = stopped_pc;
+  return stopped_thread;
+}
+
+bool mach_task_is_stopped(void) { return task_stopped; }
+
+task_t mach_get_task(void) { return target_task; }
+
+// non-stop mode
+// a stop holds only the thread that raised it, with thread_suspend before
+// the reply goes out, the rest of the task keeps running, held threads are
+// kept here so the shell can list, select and release them one by one, the
+// selected one is stopped_thread
+kern_return_t mach_set_nonstop(bool enabled) {
+  pthread_mutex_lock(&held_lock);
+  size_t n = held_count;
+  pthread_mutex_unlock(&held_lock);
+  if (n) {
+    fprintf(stderr, "[-] %zu threads are still held, continue them first\n",
+            n);
+    return KERN_FAILURE;
+  }
+  nonstop = enabled;
+  return KERN_SUCCESS;
+}
+
+bool mach_nonstop_mode(void) { return nonstop; }
+
+kern_return_t mach_thread_hold(thread_act_t thread, uint64_t pc) {
+  kern_return_t kr = thread_suspend(thread);
+  if (kr != KERN_SUCCESS) {
+    fprintf(stderr, "[-] thread_suspend(0x%x) failed: %s\n", thread,
+            mach_error_string(kr));
+    return kr;
+  }
+
+  pthread_mutex_lock(&held_lock);
+  if (held_count == held_cap) {
+    size_t cap = held_cap ? held_cap * 2 : 16;
+    held_thread_t *grown = realloc(held, cap * sizeof(*held));
+    if (!grown) {
+      pthread_mutex_unlock(&held_lock);
+      thread_resume(thread);
+      return KERN_RESOURCE_SHORTAGE;
+    }
+    held = grown;
+    held_cap = cap;
+  }
+  held[held_count++] = (held_thread_t){.thread = thread, .pc = pc};
+  // the first stop gets the shell's attention, later ones wait their turn
+  if (stopped_thread == MACH_PORT_NULL)
+    mach_set_stopped_thread(thread, pc);
+  pthread_mutex_unlock(&held_lock);
+  return KERN_SUCCESS;
+}
+
+kern_return_t mach_thread_release(thread_act_t thread) {
+  pthread_mutex_lock(&held_lock);
+  size_t i = 0;
+  while (i < held_count && held[i].thread != thread)
+    i++;
+  if (i == held_count) {
+    pthread_mutex_unlock(&held_lock);
+    return KERN_INVALID_ARGUMENT;
+  }
+  memmove(&held[i], &held[i + 1], (held_count - i - 1) * sizeof(*held));
+  held_count--;
+
+  // hand the selection to the longest held thread
+  if (stopped_thread == thread) {
+    if (held_count)
+      mach_set_stopped_thread(held[0].thread, held[0].pc);
+    else
+      mach_set_stopped_thread(MACH_PORT_NULL, 0);
+  }
+  pthread_mutex_unlock(&held_lock);
+
+  reg_cache_flush_thread(thread, _set_thread_state64);
+  exception_release_replies(thread);
+  page_cache_invalidate();
+  return thread_resume(thread);
+}
+
+void mach_add_stopped_thread(thread_act_t thread, uint64_t pc) {
+  pthread_mutex_lock(&held_lock);
+  if (batch_stopped_count == batch_stopped_cap) {
+    size_t cap = batch_stopped_cap ? batch_stopped_cap * 2 : 8;
+    held_thread_t *grown =
+        realloc(batch_stopped, cap * sizeof(*batch_stopped));
+    if (!grown) {
+      pthread_mutex_unlock(&held_lock);
+      return; // allocation err, it traps again on resume
+    }
+    batch_stopped = grown;
+    batch_stopped_cap = cap;
+  }
+  batch_stopped[batch_stopped_count++] =
+      (held_thread_t){.thread = thread, .pc = pc};
+  pthread_mutex_unlock(&held_lock);
+}
+
+size_t mach_stopped_threads(held_thread_t *out, size_t max) {
+  pthread_mutex_lock(&held_lock);
+  size_t n = batch_stopped_count;
+  if (out)
+    memcpy(out, batch_stopped, (n < max ? n : max) * sizeof(*out));
+  pthread_mutex_unlock(&held_lock);
+  return n;
+}
+
+size_t mach_held_threads(held_thread_t *out, size_t max) {
+  pthread_mutex_lock(&held_lock);
+  size_t n = held_count;
+  if (out)
+    memcpy(out, held, (n < max ? n : max) * sizeof(*held));
+  pthread_mutex_unlock(&held_lock);
+  return n;
+}
+
+kern_return_t mach_select_thread(thread_act_t thread) {
+  pthread_mutex_lock(&held_lock);
+  kern_return_t kr = KERN_INVALID_ARGUMENT;
+  for (size_t i = 0; i < held_count; i++) {
+    if (held[i].thread == thread) {
+      mach_set_stopped_thread(thread, held[i].pc);
+      kr = KERN_SUCCESS;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&held_lock);
+  return kr;
+}
+
+kern_return_t mach_thread_park(thread_act_t thread) {
+  kern_return_t kr = thread_suspend(thread);
+  if (kr != KERN_SUCCESS)
+    fprintf(stderr, "[-] thread_suspend(0x%x) failed: %s\n", thread,
+            mach_error_string(kr));
+  return kr;
+}
+
+kern_return_t mach_thread_unpark(thread_act_t thread) {
+  return thread_resume(thread);
+}
+
 kern_return_t mach_get_pc(uintptr_t *pc) {
-  ThreadList tl = _get_thread_list(target_task);
   arm_thread_state64_t state64;
-  if (_get_thread_state64(tl.threads[0], &state64) != KERN_SUCCESS)
+  if (_thread_get_regs(_current_thread(), &state64) != KERN_SUCCESS)
     return 1;
 
   *pc = state64.__pc;
   return KERN_SUCCESS;
 }
 
+kern_return_t mach_thread_get_state(thread_act_t thread,
+                                    arm_thread_state64_t *out) {
+  return _thread_get_regs(thread, out);
+}
+
+kern_return_t mach_thread_read_state(thread_act_t thread,
+                                     arm_thread_state64_t *out) {
+  if (_regs_stable(thread) && reg_cache_peek(thread, out))
+    return KERN_SUCCESS;
+  return _get_thread_state64(thread, out);
+}
+
+kern_return_t mach_thread_set_state(thread_act_t thread,
+                                    const arm_thread_state64_t *in) {
+  return _thread_set_regs(thread, in);
+}
+
+void mach_thread_seed_state(thread_act_t thread,
+                            const arm_thread_state64_t *state) {
+  if (_regs_stable(thread))
+    reg_cache_seed(thread, state);
+}
+
 // print the debug registers for the first thread
 // CHORE: decide if we need this
 kern_return_t mach_register_debug_print(void) {
@@ -268,16 +605,12 @@ kern_return_t mach_register_exception_print(void) {
   return KERN_SUCCESS;
 }
 
-// print general purpose registers for the main thread
+// print general purpose registers for the current thread
 // thanks lyla.c -- by billy ellis
 kern_return_t mach_register_print(void) {
-  ThreadList tl = _get_thread_list(target_task);
   arm_thread_state64_t state;
-  if (_get_thread_state64(tl.threads[0], &state) != KERN_SUCCESS) {
-    vm_deallocate(mach_task_self(), (vm_address_t)tl.threads,
-                  tl.count * sizeof(thread_t));
+  if (_thread_get_regs(_current_thread(), &state) != KERN_SUCCESS)
     return KERN_FAILURE;
-  }
 
   printf("\n\033[1mRegister dump (ARM64):\x1b[0m\n\n");
   for (int i = 0; i <= 28; ++i) {
@@ -289,22 +622,15 @@ kern_return_t mach_register_print(void) {
   printf(" SP: 0x%016" PRIx64 " PC: 0x%016" PRIx64 "\n", state.__sp,
          state.__pc);
   printf(" CPSR: 0x%016" PRIx32 "\n\n", state.__cpsr);
-
-  vm_deallocate(mach_task_self(), (vm_address_t)tl.threads,
-                tl.count * sizeof(thread_t));
   return KERN_SUCCESS;
 }
 
-// write to a specific register on the main thread
-// TODO: allow a specific thread to be selected
+// write to a specific register on the current thread
 kern_return_t mach_register_write(const char reg[], uint64_t value) {
-  ThreadList tl = _get_thread_list(target_task);
+  thread_act_t thread = _current_thread();
   arm_thread_state64_t state;
-  if (_get_thread_state64(tl.threads[0], &state) != KERN_SUCCESS) {
-    vm_deallocate(mach_task_self(), (vm_address_t)tl.threads,
-                  tl.count * sizeof(thread_t));
+  if (_thread_get_regs(thread, &state) != KERN_SUCCESS)
     return KERN_FAILURE;
-  }
 
   if (strncmp(reg, "X", 1) == 0) {
     int idx = atoi(reg + 1);
@@ -327,153 +653,315 @@ kern_return_t mach_register_write(const char reg[], uint64_t value) {
   else
     fprintf(stderr, "Invalid register name: %s\n", reg);
 
-  _set_thread_state64(tl.threads[0], &state);
+  // while stopped this only marks the thread dirty, it is written back
+  // once when the task resumes
+  kern_return_t kr = _thread_set_regs(thread, &state);
+  if (kr != KERN_SUCCESS)
+    return kr;
   printf("Register %s set to 0x%016" PRIx64 "\n", reg, value);
-
-  vm_deallocate(mach_task_self(), (vm_address_t)tl.threads,
-                tl.count * sizeof(thread_t));
   return KERN_SUCCESS;
 }
 
-// to set hardware breakpoint across all threads
-kern_return_t mach_set_breakpoint(int index, uint64_t addr) {
-  if (slide_enabled)
-    addr = addr + slide;
+// staged debug state
+// breakpoint and watchpoint edits only change desired_dbg and bump
+// dbg_generation, the registers then reach the threads in one pass with a
+// single get/set per thread, when the task resumes if it is stopped or
+// straight away if it is running, threads that already carry the current
+// generation are skipped and threads created since the last pass get it
+//
+// we never deallocate the thread ports task_threads hands us, so a port
+// name is never reused for another thread and can key the table
+typedef struct {
+  thread_act_t thread;
+  uint64_t generation;
+} thread_gen_t;
+
+static arm_debug_state64_t desired_dbg;
+static uint64_t dbg_generation = 1;
+static thread_gen_t *thread_gens = NULL;
+static size_t thread_gens_count = 0;
+static pthread_mutex_t dbg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int _cmp_thread_gen(const void *a, const void *b) {
+  thread_act_t x = ((const thread_gen_t *)a)->thread;
+  thread_act_t y = ((const thread_gen_t *)b)->thread;
+  return (x > y) - (x < y);
+}
+
+static void _apply_desired(arm_debug_state64_t *dbg) {
+  memcpy(dbg->__bvr, desired_dbg.__bvr, sizeof(dbg->__bvr));
+  memcpy(dbg->__bcr, desired_dbg.__bcr, sizeof(dbg->__bcr));
+  memcpy(dbg->__wvr, desired_dbg.__wvr, sizeof(dbg->__wvr));
+  memcpy(dbg->__wcr, desired_dbg.__wcr, sizeof(dbg->__wcr));
+}
 
+// push desired_dbg to every thread that is behind, single_step also sets
+// mdscr ss on every thread, the caller holds dbg_lock
+static kern_return_t _debug_state_flush(bool single_step) {
   ThreadList tl = _get_thread_list(target_task);
 
   if (tl.count == 0 || tl.threads == NULL)
     return KERN_FAILURE;
 
-  bool did_step = false;
+  thread_gen_t *next = calloc(tl.count, sizeof(*next));
+  if (!next) {
+    vm_deallocate(mach_task_self(), (vm_address_t)tl.threads,
+                  tl.count * sizeof(thread_t));
+    return KERN_RESOURCE_SHORTAGE;
+  }
 
-  // some weird thing got to do with privledges
-  const uint64_t ENABLE = (1ULL << 0);
-  const uint64_t PRIV_USR_ONLY = (1ULL << 3) | (1ULL << 2);
-  const uint64_t MATCH_EXECUTE = (0b00ULL << 1);
-  const uint64_t SIZE_4_BYTES = (0b11ULL << 5);
-  uint64_t bcr_value = ENABLE | PRIV_USR_ONLY | MATCH_EXECUTE | SIZE_4_BYTES;
+  bool did_set = false;
+  for (mach_msg_type_number_t i = 0; i < tl.count; i++) {
+    thread_gen_t key = {.thread = tl.threads[i]};
+    thread_gen_t *prev =
+        thread_gens ? bsearch(&key, thread_gens, thread_gens_count,
+                              sizeof(key), _cmp_thread_gen)
+                    : NULL;
+    next[i].thread = tl.threads[i];
+    next[i].generation = prev ? prev->generation : 0;
+    if (next[i].generation == dbg_generation && !single_step) {
+      did_set = true;
+      continue;
+    }
 
-  // loop through each thread, set the hardware breakpoint
-  for (mach_msg_type_number_t i = 0; i < tl.count; ++i) {
+    // read first, mdscr may carry a step over in progress
     arm_debug_state64_t dbg;
     if (_get_thread_debug_state64(tl.threads[i], &dbg) != KERN_SUCCESS)
       continue;
-    dbg.__bvr[index] = addr;
-    dbg.__bcr[index] = bcr_value;
+    _apply_desired(&dbg);
+    if (single_step)
+      dbg.__mdscr_el1 |= (1ULL << 0);
+
     if (_set_thread_debug_state64(tl.threads[i], &dbg) == KERN_SUCCESS) {
-      did_step = true;
+      next[i].generation = dbg_generation;
+      did_set = true;
     }
   }
 
-  // safety
+  qsort(next, tl.count, sizeof(*next), _cmp_thread_gen);
+  free(thread_gens);
+  thread_gens = next;
+  thread_gens_count = tl.count;
+
   vm_deallocate(mach_task_self(), (vm_address_t)tl.threads,
                 tl.count * sizeof(thread_t));
 
-  printf("Requested breakpoint %d at 0x%016" PRIx64 " on %u threads\n", index,
-         addr, tl.count);
-
-  return did_step ? KERN_SUCCESS : KERN_FAILURE;
+  return did_set ? KERN_SUCCESS : KERN_FAILURE;
 }
 
-kern_return_t mach_step(void) {
-  ThreadList tl = _get_thread_list(target_task);
+// an edit to desired_dbg was made, the caller holds dbg_lock
+static kern_return_t _debug_state_staged(void) {
+  dbg_generation++;
+  if (task_stopped)
+    return KERN_SUCCESS; // goes out with the resume
+  return _debug_state_flush(false);
+}
 
-  if (tl.count == 0 || tl.threads == NULL) {
-    return KERN_FAILURE;
-  }
+kern_return_t mach_debug_state_flush(void) {
+  pthread_mutex_lock(&dbg_lock);
+  kern_return_t kr = _debug_state_flush(false);
+  pthread_mutex_unlock(&dbg_lock);
+  return kr;
+}
 
-  bool did_step = false;
+// to set hardware breakpoint across all threads, addr is absolute
+kern_return_t mach_set_breakpoint(int index, uint64_t addr) {
+  // some weird thing got to do with privledges
+  const uint64_t ENABLE = (1ULL << 0);
+  const uint64_t PRIV_USR_ONLY = (1ULL << 3) | (1ULL << 2);
+  const uint64_t MATCH_EXECUTE = (0b00ULL << 1);
+  const uint64_t SIZE_4_BYTES = (0b11ULL << 5);
+  uint64_t bcr_value = ENABLE | PRIV_USR_ONLY | MATCH_EXECUTE | SIZE_4_BYTES;
 
-  for (mach_msg_type_number_t i = 0; i < tl.count; i++) {
-    arm_debug_state64_t dbg;
+  pthread_mutex_lock(&dbg_lock);
+  desired_dbg.__bvr[index] = addr;
+  desired_dbg.__bcr[index] = bcr_value;
+  kern_return_t kr = _debug_state_staged();
+  pthread_mutex_unlock(&dbg_lock);
 
-    if (_get_thread_debug_state64(tl.threads[i], &dbg) != KERN_SUCCESS)
-      continue;
-    // set single step bit to 1
-    dbg.__mdscr_el1 |= (1ULL << 0);
+  printf("Requested breakpoint %d at 0x%016" PRIx64 "\n", index, addr);
+  return kr;
+}
 
-    if (_set_thread_debug_state64(tl.threads[i], &dbg) == KERN_SUCCESS) {
-      did_step = true;
-    }
-  }
+kern_return_t mach_remove_breakpoint(int idx) {
+  pthread_mutex_lock(&dbg_lock);
+  desired_dbg.__bvr[idx] = 0x0000000000000000ULL;
+  desired_dbg.__bcr[idx] = 0x0000000000000000ULL;
+  kern_return_t kr = _debug_state_staged();
+  pthread_mutex_unlock(&dbg_lock);
+  return kr;
+}
 
-  vm_deallocate(mach_task_self(), (vm_address_t)tl.threads,
-                tl.count * sizeof(thread_t));
+// to set a hardware watchpoint across all threads, addr is doubleword
+// aligned, bas selects bytes within it and mask (3-31) instead watches an
+// aligned 2^mask byte block, load/store pick what traps
+kern_return_t mach_set_watchpoint(int index, uint64_t addr, uint32_t bas,
+                                  uint32_t mask, bool load, bool store) {
+  const uint64_t ENABLE = (1ULL << 0);
+  const uint64_t PRIV_USR_ONLY = (0b10ULL << 1);
+  const uint64_t LSC = ((load ? 1ULL : 0ULL) | (store ? 2ULL : 0ULL)) << 3;
+  const uint64_t BAS = (uint64_t)(bas & 0xff) << 5;
+  const uint64_t MASK = (uint64_t)(mask & 0x1f) << 24;
+  uint64_t wcr_value = ENABLE | PRIV_USR_ONLY | LSC | BAS | MASK;
+
+  pthread_mutex_lock(&dbg_lock);
+  desired_dbg.__wvr[index] = addr;
+  desired_dbg.__wcr[index] = wcr_value;
+  kern_return_t kr = _debug_state_staged();
+  pthread_mutex_unlock(&dbg_lock);
+  return kr;
+}
 
-  return did_step ? KERN_SUCCESS : KERN_FAILURE;
+kern_return_t mach_remove_watchpoint(int idx) {
+  pthread_mutex_lock(&dbg_lock);
+  desired_dbg.__wvr[idx] = 0x0000000000000000ULL;
+  desired_dbg.__wcr[idx] = 0x0000000000000000ULL;
+  kern_return_t kr = _debug_state_staged();
+  pthread_mutex_unlock(&dbg_lock);
+  return kr;
 }
 
-kern_return_t mach_remove_breakpoint(int idx) {
-  ThreadList tl = _get_thread_list(target_task);
+kern_return_t mach_step(void) {
+  page_cache_invalidate();
 
-  if (tl.count == 0 || tl.threads == NULL)
-    return KERN_FAILURE;
+  // pending edits and the step bit go out in the same pass
+  pthread_mutex_lock(&dbg_lock);
+  kern_return_t kr = _debug_state_flush(true);
+  pthread_mutex_unlock(&dbg_lock);
+  return kr;
+}
 
-  bool did_step = false;
+// step over, one thread only
+// begin sets ss on thread and disables the given slots on it alone, so
+// every other thread keeps trapping on them, end puts the thread back on
+// desired_dbg, each is a single get/set
+kern_return_t mach_thread_begin_step_over(thread_act_t thread, int bp_slot,
+                                          const int *wp_slots, int nwp) {
+  arm_debug_state64_t dbg;
+  kern_return_t kr = _get_thread_debug_state64(thread, &dbg);
+  if (kr != KERN_SUCCESS)
+    return kr;
 
-  for (mach_msg_type_number_t i = 0; i < tl.count; i++) {
-    arm_debug_state64_t dbg;
-    if (_get_thread_debug_state64(tl.threads[i], &dbg) == KERN_SUCCESS)
-      continue;
-    dbg.__bvr[idx] = 0x0000000000000000ULL;
-    dbg.__bcr[idx] = 0x0000000000000000ULL;
+  dbg.__mdscr_el1 |= (1ULL << 0);
+  if (bp_slot >= 0)
+    dbg.__bcr[bp_slot] = 0;
+  for (int i = 0; i < nwp; i++)
+    dbg.__wcr[wp_slots[i]] = 0;
 
-    if (_set_thread_debug_state64(tl.threads[i], &dbg) == KERN_SUCCESS) {
-      did_step = true;
-    }
-  }
+  return _set_thread_debug_state64(thread, &dbg);
+}
 
-  vm_deallocate(mach_task_self(), (vm_address_t)tl.threads,
-                tl.count * sizeof(thread_t));
+kern_return_t mach_thread_end_step_over(thread_act_t thread, bool keep_step) {
+  arm_debug_state64_t dbg;
+  kern_return_t kr = _get_thread_debug_state64(thread, &dbg);
+  if (kr != KERN_SUCCESS)
+    return kr;
+
+  pthread_mutex_lock(&dbg_lock);
+  _apply_desired(&dbg);
+  pthread_mutex_unlock(&dbg_lock);
+  if (!keep_step)
+    dbg.__mdscr_el1 &= ~(1ULL << 0);
 
-  return did_step ? KERN_SUCCESS : KERN_FAILURE;
+  return _set_thread_debug_state64(thread, &dbg);
 }
 
-// read helper
-kern_return_t mach_read(uintptr_t addr, void *out, size_t size, bool aslr) {
-  if (slide & aslr)
-    addr = addr + slide;
+// the faulting address of the exception the thread is stopped on, and
+// whether it was a write (esr wnr bit)
+kern_return_t mach_thread_get_fault(thread_act_t thread, uint64_t *far,
+                                    bool *write) {
+  arm_exception_state64_t exc;
+  kern_return_t kr = _get_thread_exception_state64(thread, &exc);
+  if (kr != KERN_SUCCESS)
+    return kr;
+  *far = exc.__far;
+  *write = (exc.__esr & (1U << 6)) != 0;
+  return KERN_SUCCESS;
+}
 
-  if (out == NULL) {
-    return KERN_INVALID_ARGUMENT;
+// one vm_read_overwrite, quiet so the page cache can probe pages that
+// turn out to be only partially mapped, unless a file we mapped holds the
+// same bytes
+static kern_return_t _mach_read_raw(uintptr_t addr, void *out, size_t size,
+                                    vm_size_t *bytes_read) {
+  *bytes_read = 0;
+  if (file_backing_read(addr, out, size) == 0) {
+    *bytes_read = size;
+    return KERN_SUCCESS;
   }
+  return vm_read_overwrite(target_task, (vm_address_t)addr, (vm_size_t)size,
+                           (vm_address_t)out, bytes_read);
+}
+
+// page_fill_fn for the page cache
+static int _mach_fill_page(uintptr_t page_addr, void *out, size_t size) {
+  vm_size_t bytes_read;
+  kern_return_t kr = _mach_read_raw(page_addr, out, size, &bytes_read);
+  if (kr == KERN_SUCCESS && bytes_read != size)
+    return KERN_FAILURE;
+  return kr;
+}
+
+// range_read_fn for target_read_coalesced
+// while the task is stopped reads go through the page cache, so repeated
+// inspections of the same page cost a single vm_read_overwrite
+static int _mach_read_range(uint64_t addr, void *out, size_t size) {
+  if (task_stopped && page_cache_read(addr, out, size, _mach_fill_page) == 0)
+    return KERN_SUCCESS;
 
   vm_size_t bytes_read = 0;
+  kern_return_t kr = _mach_read_raw(addr, out, size, &bytes_read);
+  if (kr == KERN_SUCCESS && bytes_read != size)
+    return KERN_FAILURE;
+  return kr;
+}
 
-  kern_return_t kr =
-      vm_read_overwrite(target_task, (vm_address_t)addr, (vm_size_t)size,
-                        (vm_address_t)out, &bytes_read);
+// the shell, the listener and the trace drain all read at once, each call
+// counts into its own stats and adds them here
+static atomic_size_t stat_entries;
+static atomic_size_t stat_ranges;
+static atomic_size_t stat_retries;
 
-  if (kr != KERN_SUCCESS) {
-    fprintf(stderr, "mach_read: vm_read_overwrite failed: %s\n",
-            mach_error_string(kr));
-  }
+// scatter/gather read, addresses are absolute (no slide)
+kern_return_t mach_read_vectored(target_iovec_t *iov, size_t count) {
+  if (iov == NULL)
+    return KERN_INVALID_ARGUMENT;
 
-  if (bytes_read != size) {
-    fprintf(stderr, "vm_read_overwrite read only %zu bytes instead of %zu\n",
-            (size_t)bytes_read, size);
-    return KERN_FAILURE;
-  }
+  coalesce_stats_t cs = {0};
+  int err = target_read_coalesced(iov, count, PAGE_CACHE_PAGE_SIZE,
+                                  _mach_read_range, &cs);
+  atomic_fetch_add_explicit(&stat_entries, cs.entries, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stat_ranges, cs.ranges, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stat_retries, cs.retries, memory_order_relaxed);
+  return err ? KERN_FAILURE : KERN_SUCCESS;
+}
 
-  return KERN_SUCCESS;
+void mach_get_read_stats(coalesce_stats_t *out) {
+  out->entries = atomic_load_explicit(&stat_entries, memory_order_relaxed);
+  out->ranges = atomic_load_explicit(&stat_ranges, memory_order_relaxed);
+  out->retries = atomic_load_explicit(&stat_retries, memory_order_relaxed);
 }
 
-typedef struct {
-  uintptr_t aligned_addr;
-  size_t aligned_size;
-} Page;
+// read helper
+kern_return_t mach_read(uintptr_t addr, void *out, size_t size, bool aslr) {
+  if (aslr)
+    addr = mach_slide_address(addr);
 
-static Page _get_aligned_page(mach_vm_address_t addr, size_t size) {
-  Page p;
+  if (out == NULL) {
+    return KERN_INVALID_ARGUMENT;
+  }
 
-  uintptr_t page_size = getpagesize();
-  p.aligned_addr = ((uintptr_t)addr) & ~(page_size - 1);
-  p.aligned_size = ((size + page_size - 1) / page_size) * page_size;
+  target_iovec_t iov = {.addr = addr, .buf = out, .size = size};
+  kern_return_t kr = mach_read_vectored(&iov, 1);
+  if (kr != KERN_SUCCESS) {
+    fprintf(stderr, "mach_read: failed to read %zu bytes at 0x%" PRIxPTR ": %s\n",
+            size, addr, mach_error_string(iov.status));
+  }
 
-  return p;
+  return kr;
 }
 
+#ifdef DEV
 static void _print_protections(vm_prot_t protections) {
   fprintf(stderr, "Protections: ");
   if (protections & VM_PROT_READ) {
@@ -493,19 +981,23 @@ static void _print_protections(vm_prot_t protections) {
   }
   fprintf(stderr, "\n");
 }
+#endif
 
+// look up the region containing addr, its bounds let the caller reuse the
+// answer for every other page in the same region
 static kern_return_t _mach_get_region_protections(mach_vm_address_t addr,
+                                                  mach_vm_address_t *start,
+                                                  mach_vm_size_t *size,
                                                   vm_prot_t *protections) {
   kern_return_t kr;
-  mach_vm_size_t region_size;
-  mach_vm_address_t region_addr = addr;
+  vm_address_t region_addr = (vm_address_t)addr;
+  vm_size_t region_size = 0;
   vm_region_flavor_t flavor = VM_REGION_BASIC_INFO_64;
   vm_region_basic_info_data_64_t info;
   mach_msg_type_number_t info_count = VM_REGION_BASIC_INFO_COUNT_64;
   mach_port_t object_name;
 
-  kr = vm_region_64(target_task, (vm_address_t *)&region_addr,
-                    (vm_address_t *)&region_size, flavor,
+  kr = vm_region_64(target_task, &region_addr, &region_size, flavor,
                     (vm_region_info_t)&info, &info_count, &object_name);
 
   if (kr != KERN_SUCCESS) {
@@ -514,127 +1006,365 @@ static kern_return_t _mach_get_region_protections(mach_vm_address_t addr,
     return KERN_FAILURE;
   }
 
-  *protections = info.protection;
-
   if (object_name != MACH_PORT_NULL) {
     mach_port_deallocate(mach_task_self(), object_name);
   }
 
+  // vm_region skips forward to the next mapping if addr is unmapped
+  if (region_addr > addr) {
+    fprintf(stderr, "_mach_get_region_protections: 0x%llx is not mapped\n",
+            (unsigned long long)addr);
+    return KERN_INVALID_ADDRESS;
+  }
+
+  *start = region_addr;
+  *size = region_size;
+  *protections = info.protection;
+
   return KERN_SUCCESS;
 }
 
-// this is needed as we cannot just write anywhere in memory, for example
-// in the future if we want to add software breakpoints, we need read and write
-// access to the __TEXT segment, the __TEXT segment in a MachO binary holds
-// instructions that the cpu can execute, the protections for this reason
-// as i believe currently, are set to r/x, we cannot write to this segment
-// as we will get an KERN_INVALID_ADDRESS if we call vm_write in this segment
-//
-// the steps are as follow
-// - see the protections of the page we are writing to
-// _mach_get_region_protections->vm_region
-// - if current_protections == new_protections throw a KERN_SUCCESS obv ..
-// - we cant just protect individual bytes or arbitrary ranges in memory, we
-// need to protect entire pages
-//   so using the address we want to write to, we find the base address of the
-//   page this piece of memory is in
-// - then we do a vm_protect with our new_protections
-static kern_return_t _mach_set_region_protections(mach_vm_address_t addr,
-                                                  mach_vm_size_t size,
-                                                  vm_prot_t new_protections) {
+kern_return_t mach_get_protection(uintptr_t addr, vm_prot_t *prot) {
+  mach_vm_address_t start;
+  mach_vm_size_t size;
+  return _mach_get_region_protections(addr, &start, &size, prot);
+}
 
-  kern_return_t kr;
-  vm_prot_t current_protections;
-  kr = _mach_get_region_protections(addr, &current_protections);
+// plain vm_protect, addr and size are page aligned by the caller
+kern_return_t mach_protect(uintptr_t addr, size_t size, vm_prot_t prot) {
+  // the task can write these itself from now on
+  if (prot & VM_PROT_WRITE)
+    file_backing_mark_dirty(addr, size);
+  kern_return_t kr = vm_protect(target_task, addr, size, FALSE, prot);
   if (kr != KERN_SUCCESS) {
-    fprintf(stderr,
-            "_mach_set_region_proections: _mach_get_region_protections: "
-            "failed: %s\n",
+    fprintf(stderr, "mach_protect: vm_protect(0x%lx) failed: %s\n", addr,
             mach_error_string(kr));
-    return KERN_FAILURE;
   }
+  return kr;
+}
 
-  old_protections = current_protections;
-
-  if (current_protections == new_protections) {
-    return KERN_SUCCESS;
+// first fit over the holes between regions from near - range up, vm_region
+// skips forward to the next mapping so each call steps over one hole
+kern_return_t mach_allocate_near(uint64_t near, uint64_t range, size_t size,
+                                 uint64_t *out) {
+  uint64_t mask = vm_page_size - 1;
+  uint64_t lo = near > range ? near - range : vm_page_size;
+  uint64_t hi = near + range;
+  uint64_t cursor = (lo + mask) & ~mask;
+
+  while (cursor + size <= hi) {
+    vm_address_t region_addr = (vm_address_t)cursor;
+    vm_size_t region_size = 0;
+    vm_region_basic_info_data_64_t info;
+    mach_msg_type_number_t info_count = VM_REGION_BASIC_INFO_COUNT_64;
+    mach_port_t object_name = MACH_PORT_NULL;
+    kern_return_t kr =
+        vm_region_64(target_task, &region_addr, &region_size,
+                     VM_REGION_BASIC_INFO_64, (vm_region_info_t)&info,
+                     &info_count, &object_name);
+    if (object_name != MACH_PORT_NULL)
+      mach_port_deallocate(mach_task_self(), object_name);
+
+    // nothing mapped above cursor at all, or a hole big enough under the
+    // next region
+    uint64_t hole_end = kr == KERN_SUCCESS ? region_addr : hi;
+    if (hole_end >= cursor + size) {
+      vm_address_t at = (vm_address_t)cursor;
+      if (vm_allocate(target_task, &at, size, VM_FLAGS_FIXED) ==
+          KERN_SUCCESS) {
+        *out = at;
+        return KERN_SUCCESS;
+      }
+    }
+    if (kr != KERN_SUCCESS)
+      break;
+    cursor = (region_addr + region_size + mask) & ~mask;
   }
+  return KERN_NO_SPACE;
+}
 
-  Page p = _get_aligned_page(addr, size);
+// write sessions
+// this is needed as we cannot just write anywhere in memory, software
+// breakpoints for example need write access to the __TEXT segment, which
+// is mapped r-x, a vm_write there fails with KERN_INVALID_ADDRESS
+//
+// protections can only be changed for whole pages, so a session collects
+// writes first and then on commit
+// - merges overlapping or touching writes into contiguous runs, later
+//   writes win where they overlap
+// - looks up the original protection of every page the runs touch, one
+//   vm_region per region rather than per page
+// - flips the pages that are not writable to rw + copy, adjacent pages in
+//   one vm_protect
+// - issues one vm_write per run
+// - restores every flipped page to its own original protection
+void mach_write_session_init(write_session_t *ws) {
+  *ws = (write_session_t){0};
+}
 
-  fprintf(stderr, "[i] Region 0x%lx - 0x%lx (size: 0x%lx) has ", p.aligned_addr,
-          p.aligned_addr + p.aligned_size, p.aligned_size);
-  _print_protections(new_protections);
+void mach_write_session_free(write_session_t *ws) {
+  free(ws->writes);
+  free(ws->pool);
+  *ws = (write_session_t){0};
+}
 
-  kr = vm_protect(target_task, p.aligned_addr, p.aligned_size, FALSE,
-                  new_protections);
+kern_return_t mach_write_session_add(write_session_t *ws, uintptr_t addr,
+                                     const void *bytes, size_t size) {
+  if (bytes == NULL || size == 0)
+    return KERN_INVALID_ARGUMENT;
 
-  if (kr != KERN_SUCCESS) {
-    fprintf(stderr, "_mach_set_region_protections: vm_protect failed: %s\n",
-            mach_error_string(kr));
-    return KERN_FAILURE;
+  if (ws->count == ws->capacity) {
+    size_t new_cap = ws->capacity ? ws->capacity * 2 : 16;
+    pending_write_t *tmp = realloc(ws->writes, new_cap * sizeof(*tmp));
+    if (!tmp)
+      return KERN_RESOURCE_SHORTAGE;
+    ws->writes = tmp;
+    ws->capacity = new_cap;
   }
 
+  if (ws->pool_len + size > ws->pool_cap) {
+    size_t new_cap = ws->pool_cap ? ws->pool_cap * 2 : 256;
+    while (new_cap < ws->pool_len + size)
+      new_cap *= 2;
+    uint8_t *tmp = realloc(ws->pool, new_cap);
+    if (!tmp)
+      return KERN_RESOURCE_SHORTAGE;
+    ws->pool = tmp;
+    ws->pool_cap = new_cap;
+  }
+
+  memcpy(ws->pool + ws->pool_len, bytes, size);
+  ws->writes[ws->count++] = (pending_write_t){
+      .addr = addr, .size = size, .offset = ws->pool_len};
+  ws->pool_len += size;
   return KERN_SUCCESS;
 }
 
-static kern_return_t _mach_set_region_writeable(mach_vm_address_t addr,
-                                                mach_vm_size_t size) {
-  kern_return_t kr = _mach_set_region_protections(
-      addr, size, VM_PROT_WRITE | VM_PROT_READ | VM_PROT_COPY);
+typedef struct {
+  uintptr_t addr;
+  size_t seq; // index into ws->writes, doubles as submission order
+} write_key_t;
+
+static int _cmp_write_addr(const void *a, const void *b) {
+  const write_key_t *x = a, *y = b;
+  if (x->addr != y->addr)
+    return (x->addr > y->addr) - (x->addr < y->addr);
+  return (x->seq > y->seq) - (x->seq < y->seq);
+}
 
-  if (kr != KERN_SUCCESS) {
-    fprintf(
-        stderr,
-        "mach_set_region_writeable: _mach_set_region_protections failed: %s\n",
-        mach_error_string(kr));
-    return KERN_FAILURE;
-  }
+static int _cmp_write_seq(const void *a, const void *b) {
+  const write_key_t *x = a, *y = b;
+  return (x->seq > y->seq) - (x->seq < y->seq);
+}
 
-  return KERN_SUCCESS;
+typedef struct {
+  uintptr_t addr;
+  vm_prot_t prot;
+  bool flipped;
+} page_prot_t;
+
+static void _append_page(page_prot_t *pages, size_t *count, uintptr_t page) {
+  if (*count && pages[*count - 1].addr >= page)
+    return;
+  pages[(*count)++] = (page_prot_t){.addr = page};
 }
 
-static kern_return_t _mach_restore_region(mach_vm_address_t addr,
-                                          mach_vm_size_t size) {
-  kern_return_t kr = _mach_set_region_protections(addr, size, old_protections);
-  if (kr != KERN_SUCCESS) {
-    fprintf(stderr,
-            "mach_restore_region: _mach_set_region_protections failed: %s\n",
-            mach_error_string(kr));
-    return KERN_FAILURE;
+// vm_protect adjacent pages that share a protection in one call
+static kern_return_t _protect_pages(page_prot_t *pages, size_t count,
+                                    uintptr_t page_size, bool restore) {
+  const vm_prot_t rw = VM_PROT_WRITE | VM_PROT_READ | VM_PROT_COPY;
+  kern_return_t ret = KERN_SUCCESS;
+
+  size_t i = 0;
+  while (i < count) {
+    bool want = restore ? pages[i].flipped : !(pages[i].prot & VM_PROT_WRITE);
+    if (!want) {
+      i++;
+      continue;
+    }
+
+    vm_prot_t prot = restore ? pages[i].prot : rw;
+    size_t j = i + 1;
+    while (j < count && pages[j].addr == pages[j - 1].addr + page_size &&
+           (restore ? pages[j].flipped && pages[j].prot == pages[i].prot
+                    : !(pages[j].prot & VM_PROT_WRITE)))
+      j++;
+
+    vm_size_t len = (vm_size_t)((j - i) * page_size);
+#ifdef DEV
+    fprintf(stderr, "[i] Region 0x%lx - 0x%lx (size: 0x%lx) has ",
+            pages[i].addr, pages[i].addr + len, len);
+    _print_protections(prot);
+#endif
+    kern_return_t kr =
+        vm_protect(target_task, pages[i].addr, len, FALSE, prot);
+    if (kr != KERN_SUCCESS) {
+      fprintf(stderr, "_protect_pages: vm_protect(0x%lx) failed: %s\n",
+              pages[i].addr, mach_error_string(kr));
+      ret = kr;
+    } else if (!restore) {
+      for (size_t k = i; k < j; k++)
+        pages[k].flipped = true;
+    }
+    i = j;
   }
 
-  return KERN_SUCCESS;
+  return ret;
 }
 
-// write helper
-kern_return_t mach_write(uintptr_t addr, void *bytes, size_t size) {
-  kern_return_t kr;
+kern_return_t mach_write_session_commit(write_session_t *ws) {
+  return mach_write_session_commit_status(ws, NULL);
+}
 
-  if (slide)
-    addr = addr + slide;
+kern_return_t mach_write_session_commit_status(write_session_t *ws,
+                                               kern_return_t *status) {
+  if (ws->count == 0)
+    return KERN_SUCCESS;
 
-  kr = _mach_set_region_writeable(addr, size);
-  if (kr != KERN_SUCCESS) {
-    fprintf(stderr, "mach_write: _mach_set_region_writeable failed: %s\n",
-            mach_error_string(kr));
-    return kr;
+  kern_return_t ret = KERN_SUCCESS;
+  // nothing is written until a run goes out
+  for (size_t i = 0; status && i < ws->count; i++)
+    status[i] = KERN_FAILURE;
+  const uintptr_t page_size = getpagesize();
+  const uintptr_t mask = ~(page_size - 1);
+
+  write_key_t *keys = malloc(ws->count * sizeof(*keys));
+  // a page list can't be longer than the page span of every write
+  size_t max_pages = 0;
+  for (size_t i = 0; i < ws->count; i++) {
+    const pending_write_t *w = &ws->writes[i];
+    max_pages += ((w->addr + w->size - 1) & mask) / page_size -
+                 (w->addr & mask) / page_size + 1;
+  }
+  page_prot_t *pages = malloc(max_pages * sizeof(*pages));
+  if (!keys || !pages) {
+    free(keys);
+    free(pages);
+    return KERN_RESOURCE_SHORTAGE;
   }
 
-  kr = vm_write(target_task, (vm_address_t)addr, (vm_offset_t)bytes, size);
-  if (kr != KERN_SUCCESS) {
-    fprintf(stderr, "mach_write: vm_write failed: %s\n", mach_error_string(kr));
-    return kr;
+  for (size_t i = 0; i < ws->count; i++)
+    keys[i] = (write_key_t){.addr = ws->writes[i].addr, .seq = i};
+  qsort(keys, ws->count, sizeof(*keys), _cmp_write_addr);
+
+  // 1) every page touched, sorted and unique because keys are sorted
+  size_t page_count = 0;
+  for (size_t i = 0; i < ws->count; i++) {
+    const pending_write_t *w = &ws->writes[keys[i].seq];
+    for (uintptr_t p = w->addr & mask; p < w->addr + w->size; p += page_size)
+      _append_page(pages, &page_count, p);
   }
 
-  kr = _mach_restore_region(addr, size);
-  if (kr != KERN_SUCCESS) {
-    fprintf(stderr, "mach_write: _mach_restore_region failed: %s\n",
-            mach_error_string(kr));
-    return kr;
+  // reads of these pages go to the task from now on, even if a write
+  // below fails halfway
+  for (size_t i = 0; i < ws->count; i++)
+    file_backing_mark_dirty(ws->writes[i].addr, ws->writes[i].size);
+
+  // 2) original protections, one vm_region per region
+  mach_vm_address_t region_start = 0;
+  mach_vm_size_t region_size = 0;
+  vm_prot_t region_prot = VM_PROT_NONE;
+  for (size_t i = 0; i < page_count; i++) {
+    if (pages[i].addr < region_start ||
+        pages[i].addr >= region_start + region_size) {
+      kern_return_t kr = _mach_get_region_protections(
+          pages[i].addr, &region_start, &region_size, &region_prot);
+      if (kr != KERN_SUCCESS) {
+        ret = kr;
+        goto out;
+      }
+    }
+    pages[i].prot = region_prot;
   }
 
-  return KERN_SUCCESS;
+  // 3) make them writable
+  ret = _protect_pages(pages, page_count, page_size, false);
+  if (ret != KERN_SUCCESS)
+    goto restore;
+
+  // 4) one vm_write per contiguous run
+  size_t first = 0;
+  while (first < ws->count) {
+    uintptr_t start = keys[first].addr;
+    uintptr_t end = start + ws->writes[keys[first].seq].size;
+    size_t last = first + 1;
+    while (last < ws->count && keys[last].addr <= end) {
+      uintptr_t e = keys[last].addr + ws->writes[keys[last].seq].size;
+      if (e > end)
+        end = e;
+      last++;
+    }
+
+    size_t len = end - start;
+    uint8_t *run = NULL;
+    const uint8_t *src;
+    if (last - first == 1) {
+      src = ws->pool + ws->writes[keys[first].seq].offset;
+    } else {
+      // overlapping writes land in submission order
+      run = malloc(len);
+      if (!run) {
+        ret = KERN_RESOURCE_SHORTAGE;
+        goto restore;
+      }
+      qsort(&keys[first], last - first, sizeof(*keys), _cmp_write_seq);
+      for (size_t k = first; k < last; k++) {
+        const pending_write_t *w = &ws->writes[keys[k].seq];
+        memcpy(run + (w->addr - start), ws->pool + w->offset, w->size);
+      }
+      src = run;
+    }
+
+    kern_return_t kr = vm_write(target_task, (vm_address_t)start,
+                                (vm_offset_t)src, (mach_msg_type_number_t)len);
+    if (kr != KERN_SUCCESS) {
+      fprintf(stderr, "mach_write: vm_write(0x%lx) failed: %s\n", start,
+              mach_error_string(kr));
+      ret = kr;
+    } else {
+      page_cache_write_through(start, src, len);
+    }
+    for (size_t k = first; status && k < last; k++)
+      status[keys[k].seq] = kr;
+
+    free(run);
+    first = last;
+  }
+
+restore:
+  // 5) put back what each page had before, even after a failure
+  {
+    kern_return_t kr = _protect_pages(pages, page_count, page_size, true);
+    if (kr != KERN_SUCCESS && ret == KERN_SUCCESS)
+      ret = kr;
+  }
+
+out:
+  free(keys);
+  free(pages);
+  ws->count = 0;
+  ws->pool_len = 0;
+  return ret;
+}
+
+// write helper, addr is an absolute target address
+static kern_return_t _mach_write_raw(uintptr_t addr, const void *bytes,
+                                     size_t size) {
+  write_session_t ws;
+  mach_write_session_init(&ws);
+
+  kern_return_t kr = mach_write_session_add(&ws, addr, bytes, size);
+  if (kr == KERN_SUCCESS)
+    kr = mach_write_session_commit(&ws);
+
+  mach_write_session_free(&ws);
+  return kr;
+}
+
+kern_return_t mach_write(uintptr_t addr, void *bytes, size_t size) {
+  addr = mach_slide_address(addr);
+
+  return _mach_write_raw(addr, bytes, size);
 }
 
 kern_return_t mach_read64(uintptr_t addr, uint64_t *out) {
@@ -646,13 +1376,13 @@ kern_return_t mach_read32(uintptr_t addr, uint32_t *out) {
 }
 
 kern_return_t mach_write64(uintptr_t addr, uint64_t bytes) {
-  kern_return_t kr = mach_write(addr, (uint64_t *)bytes, sizeof(uint64_t));
+  kern_return_t kr = mach_write(addr, &bytes, sizeof(uint64_t));
 
   if (kr != KERN_SUCCESS) {
     fprintf(stderr, "mach_write64 failed: %s\n", mach_error_string(kr));
   }
 
-  return KERN_SUCCESS;
+  return kr;
 }
 
 kern_return_t mach_write32(uintptr_t addr, uint32_t bytes) {
@@ -662,52 +1392,112 @@ kern_return_t mach_write32(uintptr_t addr, uint32_t bytes) {
     fprintf(stderr, "mach_write32 failed: %s\n", mach_error_string(kr));
   }
 
-  return KERN_SUCCESS;
+  return kr;
 }
 
-// aslr stuff
-kern_return_t mach_get_aslr_slide(mach_vm_address_t *out_slide) {
+// read the dyld_all_image_infos structure from target process
+kern_return_t
+mach_get_all_image_infos(struct dyld_all_image_infos *image_infos) {
   task_dyld_info_data_t dyld_info;
   mach_msg_type_number_t count = TASK_DYLD_INFO_COUNT;
 
   kern_return_t kr =
       task_info(target_task, TASK_DYLD_INFO, (task_info_t)&dyld_info, &count);
   if (kr != KERN_SUCCESS) {
-    fprintf(stderr, "mach_get_aslr_slide: task_info failed: %s\n",
+    fprintf(stderr, "mach_get_all_image_infos: task_info failed: %s\n",
             mach_error_string(kr));
     return kr;
   }
 
-  // read the dyld_all_image_infos structure from target process
-  struct dyld_all_image_infos image_infos;
-  mach_vm_size_t size = sizeof(image_infos);
-
+  mach_vm_size_t size = sizeof(*image_infos);
   kr = vm_read_overwrite(target_task, dyld_info.all_image_info_addr, size,
-                         (mach_vm_address_t)&image_infos, (vm_size_t *)&size);
+                         (mach_vm_address_t)image_infos, (vm_size_t *)&size);
   if (kr != KERN_SUCCESS) {
-    fprintf(stderr, "mach_get_aslr_slide: mach_vm_read failed: %s\n",
+    fprintf(stderr, "mach_get_all_image_infos: mach_vm_read failed: %s\n",
             mach_error_string(kr));
-    return kr;
   }
+  return kr;
+}
 
-  if (image_infos.infoArrayCount > 0) {
-    // find make excutable
-    struct dyld_image_info main_image;
-    mach_vm_size_t size = sizeof(main_image);
+// load address and path of the main executable, the first image dyld lists
+kern_return_t mach_get_main_image(uint64_t *base, char *path,
+                                  size_t path_len) {
+  struct dyld_all_image_infos image_infos;
+  kern_return_t kr = mach_get_all_image_infos(&image_infos);
+  if (kr != KERN_SUCCESS)
+    return kr;
+  if (image_infos.infoArrayCount == 0)
+    return KERN_FAILURE;
 
-    kr = vm_read_overwrite(
-        target_task, (mach_vm_address_t)image_infos.infoArray, size,
-        (mach_vm_address_t)&main_image, (vm_address_t *)&size);
-    if (kr == KERN_SUCCESS) {
-      *out_slide =
-          (mach_vm_address_t)main_image.imageLoadAddress - 0x100000000ULL;
-    }
+  struct dyld_image_info main_image;
+  vm_size_t size = sizeof(main_image);
+  kr = vm_read_overwrite(target_task, (mach_vm_address_t)image_infos.infoArray,
+                         size, (mach_vm_address_t)&main_image, &size);
+  if (kr != KERN_SUCCESS)
+    return kr;
+  *base = (uint64_t)main_image.imageLoadAddress;
+
+  // the path may straddle a page boundary, read it a chunk at a time
+  path[0] = '\0';
+  size_t got = 0;
+  uint64_t addr = (uint64_t)main_image.imageFilePath;
+  while (addr && got + 1 < path_len) {
+    char chunk[64];
+    size_t want = sizeof(chunk) < path_len - got - 1 ? sizeof(chunk)
+                                                     : path_len - got - 1;
+    vm_size_t n = 0;
+    if (_mach_read_raw(addr + got, chunk, want, &n) != KERN_SUCCESS || n == 0)
+      break;
+    size_t len = strnlen(chunk, n);
+    memcpy(path + got, chunk, len);
+    got += len;
+    path[got] = '\0';
+    if (len < n)
+      break;
   }
+  return KERN_SUCCESS;
+}
 
+// aslr stuff
+// the main executable's load address minus the __TEXT vmaddr its file
+// asked for, out of the image table, read the first time anything asks
+kern_return_t mach_get_aslr_slide(mach_vm_address_t *out_slide) {
+  loaded_image_t main_image;
+  if (!image_table_main(&main_image)) {
+    kern_return_t kr = image_table_refresh();
+    if (kr != KERN_SUCCESS)
+      return kr;
+    if (!image_table_main(&main_image))
+      return KERN_FAILURE;
+  }
+  *out_slide = (mach_vm_address_t)main_image.slide;
   return KERN_SUCCESS;
 }
 
+// a slide the user set by hand applies to every address, the image
+// table's per image slides only apply to an automatic one
+static bool slide_fixed = false;
+
+uint64_t mach_slide_address(uint64_t addr) {
+  if (!slide_enabled)
+    return addr;
+  uint64_t s;
+  if (!slide_fixed && image_table_slide_unslid(addr, &s))
+    return addr + s;
+  return addr + slide;
+}
+
+uint64_t mach_unslide_address(uint64_t addr) {
+  if (!slide_enabled)
+    return addr;
+  uint64_t s;
+  if (!slide_fixed && image_table_slide_loaded(addr, &s))
+    return addr - s;
+  return addr - slide;
+}
+
 kern_return_t mach_set_auto_slide_enabled(bool enabled) {
+  slide_fixed = false;
   if (!enabled) {
     // disable auto aslr slide
     slide = (mach_vm_address_t)0;
@@ -730,7 +1520,143 @@ kern_return_t mach_set_auto_slide_enabled(bool enabled) {
 
 kern_return_t mach_set_slide_value(mach_vm_address_t new_slide) {
   slide = new_slide;
+  slide_fixed = true;
   if (!slide_enabled)
     slide_enabled = !slide_enabled;
   return KERN_SUCCESS;
 }
+
+// target backend
+// thin adapters so the debugger core can drive a mach task through
+// target_backend_t, addresses here are absolute, the aslr slide is applied
+// by the mach_* callers and never by the backend
+static int _mach_backend_attach(pid_t pid) {
+  return setup_exception_port(pid);
+}
+
+static int _mach_backend_detach(void) { return mach_detach(); }
+
+static int _mach_backend_suspend(void) { return mach_suspend(); }
+
+static int _mach_backend_resume(void) { return mach_resume(); }
+
+static int _mach_backend_read(uint64_t addr, void *out, size_t size) {
+  return mach_read((uintptr_t)addr, out, size, false);
+}
+
+static int _mach_backend_read_vectored(target_iovec_t *iov, size_t count) {
+  return mach_read_vectored(iov, count);
+}
+
+static int _mach_backend_write(uint64_t addr, const void *in, size_t size) {
+  return _mach_write_raw((uintptr_t)addr, in, size);
+}
+
+static int _mach_backend_threads(target_thread_t **out, size_t *count) {
+  *out = NULL;
+  *count = 0;
+
+  ThreadList tl = _get_thread_list(target_task);
+  if (tl.count == 0 || tl.threads == NULL)
+    return KERN_FAILURE;
+
+  target_thread_t *list = malloc(tl.count * sizeof(*list));
+  if (list) {
+    for (mach_msg_type_number_t i = 0; i < tl.count; i++)
+      list[i] = (target_thread_t)tl.threads[i];
+  }
+
+  vm_deallocate(mach_task_self(), (vm_address_t)tl.threads,
+                tl.count * sizeof(thread_t));
+  if (!list)
+    return KERN_RESOURCE_SHORTAGE;
+
+  *out = list;
+  *count = tl.count;
+  return KERN_SUCCESS;
+}
+
+void mach_regs_from_state(const arm_thread_state64_t *state,
+                          target_regs_t *out) {
+  memcpy(out->x, state->__x, sizeof(out->x));
+  out->fp = state->__fp;
+  out->lr = state->__lr;
+  out->sp = state->__sp;
+  out->pc = state->__pc;
+  out->cpsr = state->__cpsr;
+}
+
+void mach_regs_to_state(const target_regs_t *in, arm_thread_state64_t *state) {
+  memcpy(state->__x, in->x, sizeof(in->x));
+  state->__fp = in->fp;
+  state->__lr = in->lr;
+  state->__sp = in->sp;
+  state->__pc = in->pc;
+  state->__cpsr = in->cpsr;
+}
+
+static int _mach_backend_get_regs(target_thread_t thread, target_regs_t *out) {
+  arm_thread_state64_t state;
+  kern_return_t kr = _thread_get_regs((thread_act_t)thread, &state);
+  if (kr != KERN_SUCCESS)
+    return kr;
+
+  mach_regs_from_state(&state, out);
+  return KERN_SUCCESS;
+}
+
+static int _mach_backend_set_regs(target_thread_t thread,
+                                  const target_regs_t *in) {
+  arm_thread_state64_t state;
+  kern_return_t kr = _thread_get_regs((thread_act_t)thread, &state);
+  if (kr != KERN_SUCCESS)
+    return kr;
+
+  mach_regs_to_state(in, &state);
+  return _thread_set_regs((thread_act_t)thread, &state);
+}
+
+static int _mach_backend_get_debug_regs(target_thread_t thread,
+                                        target_debug_state_t *out) {
+  arm_debug_state64_t dbg;
+  kern_return_t kr = _get_thread_debug_state64((thread_act_t)thread, &dbg);
+  if (kr != KERN_SUCCESS)
+    return kr;
+
+  memcpy(out->bvr, dbg.__bvr, sizeof(out->bvr));
+  memcpy(out->bcr, dbg.__bcr, sizeof(out->bcr));
+  memcpy(out->wvr, dbg.__wvr, sizeof(out->wvr));
+  memcpy(out->wcr, dbg.__wcr, sizeof(out->wcr));
+  out->mdscr_el1 = dbg.__mdscr_el1;
+  return KERN_SUCCESS;
+}
+
+static int _mach_backend_set_debug_regs(target_thread_t thread,
+                                        const target_debug_state_t *in) {
+  arm_debug_state64_t dbg;
+  memcpy(dbg.__bvr, in->bvr, sizeof(dbg.__bvr));
+  memcpy(dbg.__bcr, in->bcr, sizeof(dbg.__bcr));
+  memcpy(dbg.__wvr, in->wvr, sizeof(dbg.__wvr));
+  memcpy(dbg.__wcr, in->wcr, sizeof(dbg.__wcr));
+  dbg.__mdscr_el1 = in->mdscr_el1;
+  return _set_thread_debug_state64((thread_act_t)thread, &dbg);
+}
+
+// exceptions arrive on exc_port and are consumed by exception_listener,
+// so there is no blocking wait_event for mach
+const target_backend_t mach_backend = {
+    .name = "mach",
+    .attach = _mach_backend_attach,
+    .detach = _mach_backend_detach,
+    .suspend = _mach_backend_suspend,
+    .resume = _mach_backend_resume,
+    .read = _mach_backend_read,
+    .read_vectored = _mach_backend_read_vectored,
+    .write = _mach_backend_write,
+    .threads = _mach_backend_threads,
+    .get_regs = _mach_backend_get_regs,
+    .set_regs = _mach_backend_set_regs,
+    .get_debug_regs = _mach_backend_get_debug_regs,
+    .set_debug_regs = _mach_backend_set_debug_regs,
+    .wait_event = NULL,
+};
@@ -0,0 +1,121 @@
+#include "mach/page_cache.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+// each slot remembers which epoch it was filled in, bumping the global
+// epoch invalidates every slot at once without touching them
+typedef struct {
+  uintptr_t page;
+  uint64_t epoch;
+  uint8_t data[PAGE_CACHE_PAGE_SIZE];
+} page_slot_t;
+
+static page_slot_t slots[PAGE_CACHE_SLOTS];
+// start at 1 so zeroed slots are never valid
+static uint64_t current_epoch = 1;
+static page_cache_stats_t stats;
+// a miss on a slot that still holds a good page of another address fills
+// here first, so a fill that fails doesn't cost the page it would evict
+static uint8_t scratch[PAGE_CACHE_PAGE_SIZE];
+
+// the shell and the exception listener both read memory
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uintptr_t _page_of(uintptr_t addr) {
+  return addr & ~(uintptr_t)(PAGE_CACHE_PAGE_SIZE - 1);
+}
+
+static inline page_slot_t *_slot_for(uintptr_t page) {
+  return &slots[(page / PAGE_CACHE_PAGE_SIZE) % PAGE_CACHE_SLOTS];
+}
+
+static inline bool _slot_valid(const page_slot_t *s, uintptr_t page) {
+  return s->epoch == current_epoch && s->page == page;
+}
+
+int page_cache_read(uintptr_t addr, void *out, size_t size,
+                    page_fill_fn fill) {
+  uint8_t *dst = out;
+  int ret = 0;
+
+  pthread_mutex_lock(&cache_lock);
+  while (size > 0) {
+    uintptr_t page = _page_of(addr);
+    size_t offset = addr - page;
+    size_t chunk = PAGE_CACHE_PAGE_SIZE - offset;
+    if (chunk > size)
+      chunk = size;
+
+    page_slot_t *s = _slot_for(page);
+    if (_slot_valid(s, page)) {
+      stats.hits++;
+    } else {
+      stats.misses++;
+      bool evicts = s->epoch == current_epoch;
+      uint8_t *buf = evicts ? scratch : s->data;
+      if (fill(page, buf, PAGE_CACHE_PAGE_SIZE) != 0) {
+        // partially mapped or guarded page, the slot keeps whatever it
+        // held and the caller reads the exact range itself
+        stats.fills_failed++;
+        if (!evicts)
+          s->epoch = 0;
+        ret = 1;
+        break;
+      }
+      if (evicts)
+        memcpy(s->data, scratch, PAGE_CACHE_PAGE_SIZE);
+      s->page = page;
+      s->epoch = current_epoch;
+    }
+
+    memcpy(dst, s->data + offset, chunk);
+    dst += chunk;
+    addr += chunk;
+    size -= chunk;
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  return ret;
+}
+
+void page_cache_write_through(uintptr_t addr, const void *in, size_t size) {
+  const uint8_t *src = in;
+
+  pthread_mutex_lock(&cache_lock);
+  while (size > 0) {
+    uintptr_t page = _page_of(addr);
+    size_t offset = addr - page;
+    size_t chunk = PAGE_CACHE_PAGE_SIZE - offset;
+    if (chunk > size)
+      chunk = size;
+
+    page_slot_t *s = _slot_for(page);
+    if (_slot_valid(s, page))
+      memcpy(s->data + offset, src, chunk);
+
+    src += chunk;
+    addr += chunk;
+    size -= chunk;
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void page_cache_invalidate(void) {
+  pthread_mutex_lock(&cache_lock);
+  current_epoch++;
+  stats.invalidations++;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void page_cache_get_stats(page_cache_stats_t *out) {
+  pthread_mutex_lock(&cache_lock);
+  *out = stats;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void page_cache_reset_stats(void) {
+  pthread_mutex_lock(&cache_lock);
+  stats = (page_cache_stats_t){0};
+  pthread_mutex_unlock(&cache_lock);
+}
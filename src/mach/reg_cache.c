@@ -0,0 +1,182 @@
+#include "mach/reg_cache.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// same epoch trick as the page cache, a slot is live only if it was filled
+// in the current epoch
+typedef struct {
+  thread_act_t thread;
+  uint64_t epoch;
+  bool dirty;
+  arm_thread_state64_t state;
+} reg_slot_t;
+
+static reg_slot_t slots[REG_CACHE_SLOTS];
+// start at 1 so zeroed slots are never valid
+static uint64_t current_epoch = 1;
+static size_t next_victim = 0;
+static reg_cache_stats_t stats;
+
+// the shell reads and writes, the exception listener seeds
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static reg_slot_t *_find(thread_act_t thread) {
+  for (size_t i = 0; i < REG_CACHE_SLOTS; i++) {
+    if (slots[i].epoch == current_epoch && slots[i].thread == thread)
+      return &slots[i];
+  }
+  return NULL;
+}
+
+// a free slot, else a clean one, else write a dirty one back, NULL if that
+// fails
+static reg_slot_t *_claim(reg_store_fn store) {
+  reg_slot_t *clean = NULL;
+  for (size_t i = 0; i < REG_CACHE_SLOTS; i++) {
+    if (slots[i].epoch != current_epoch)
+      return &slots[i];
+    if (!clean && !slots[i].dirty)
+      clean = &slots[i];
+  }
+  if (clean)
+    return clean;
+
+  reg_slot_t *victim = &slots[next_victim];
+  next_victim = (next_victim + 1) % REG_CACHE_SLOTS;
+  if (!store || store(victim->thread, &victim->state) != KERN_SUCCESS)
+    return NULL;
+  stats.write_backs++;
+  return victim;
+}
+
+// the fill runs without cache_lock, a thread_get_state is far longer than
+// any lookup and other threads' gets shouldn't queue behind it, whatever
+// reached the cache for this thread meanwhile (a seed, a write) wins over
+// what the fill read, and a fill that straddles an invalidate isn't kept
+kern_return_t reg_cache_get(thread_act_t thread, arm_thread_state64_t *out,
+                            reg_fill_fn fill) {
+  pthread_mutex_lock(&cache_lock);
+  reg_slot_t *s = _find(thread);
+  if (s) {
+    stats.hits++;
+    *out = s->state;
+    pthread_mutex_unlock(&cache_lock);
+    return KERN_SUCCESS;
+  }
+  stats.misses++;
+  uint64_t epoch = current_epoch;
+  pthread_mutex_unlock(&cache_lock);
+
+  kern_return_t kr = fill(thread, out);
+  if (kr != KERN_SUCCESS)
+    return kr;
+
+  pthread_mutex_lock(&cache_lock);
+  if (epoch == current_epoch) {
+    s = _find(thread);
+    if (s) {
+      *out = s->state;
+    } else {
+      // only clean slots are taken here, nothing to write back
+      s = _claim(NULL);
+      if (s)
+        *s = (reg_slot_t){
+            .thread = thread, .epoch = current_epoch, .state = *out};
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return KERN_SUCCESS;
+}
+
+bool reg_cache_peek(thread_act_t thread, arm_thread_state64_t *out) {
+  pthread_mutex_lock(&cache_lock);
+  reg_slot_t *s = _find(thread);
+  if (s)
+    *out = s->state;
+  pthread_mutex_unlock(&cache_lock);
+  return s != NULL;
+}
+
+kern_return_t reg_cache_put(thread_act_t thread, const arm_thread_state64_t *in,
+                            reg_store_fn store) {
+  pthread_mutex_lock(&cache_lock);
+  kern_return_t kr = KERN_SUCCESS;
+  reg_slot_t *s = _find(thread);
+  if (!s)
+    s = _claim(store);
+  if (s) {
+    *s = (reg_slot_t){
+        .thread = thread, .epoch = current_epoch, .dirty = true, .state = *in};
+  } else {
+    // no room and nothing could be evicted, write straight through
+    kr = store(thread, in);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return kr;
+}
+
+void reg_cache_seed(thread_act_t thread, const arm_thread_state64_t *in) {
+  pthread_mutex_lock(&cache_lock);
+  reg_slot_t *s = _find(thread);
+  // never clobber a write the user already made
+  if (!s || !s->dirty) {
+    if (!s)
+      s = _claim(NULL);
+    if (s)
+      *s = (reg_slot_t){
+          .thread = thread, .epoch = current_epoch, .state = *in};
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+kern_return_t reg_cache_flush(reg_store_fn store) {
+  kern_return_t ret = KERN_SUCCESS;
+  pthread_mutex_lock(&cache_lock);
+  for (size_t i = 0; i < REG_CACHE_SLOTS; i++) {
+    reg_slot_t *s = &slots[i];
+    if (s->epoch != current_epoch || !s->dirty)
+      continue;
+    kern_return_t kr = store(s->thread, &s->state);
+    if (kr != KERN_SUCCESS)
+      ret = kr;
+    s->dirty = false;
+    stats.write_backs++;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return ret;
+}
+
+kern_return_t reg_cache_flush_thread(thread_act_t thread, reg_store_fn store) {
+  kern_return_t kr = KERN_SUCCESS;
+  pthread_mutex_lock(&cache_lock);
+  reg_slot_t *s = _find(thread);
+  if (s) {
+    if (s->dirty) {
+      kr = store(thread, &s->state);
+      stats.write_backs++;
+    }
+    s->epoch = 0;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return kr;
+}
+
+void reg_cache_invalidate(void) {
+  pthread_mutex_lock(&cache_lock);
+  current_epoch++;
+  stats.invalidations++;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void reg_cache_get_stats(reg_cache_stats_t *out) {
+  pthread_mutex_lock(&cache_lock);
+  *out = stats;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void reg_cache_reset_stats(void) {
+  pthread_mutex_lock(&cache_lock);
+  stats = (reg_cache_stats_t){0};
+  pthread_mutex_unlock(&cache_lock);
+}
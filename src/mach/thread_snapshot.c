@@ -0,0 +1,206 @@
+#include "mach/thread_snapshot.h"
+#include "mach/mach_process.h"
+#include <mach/mach_time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// user addresses on arm64 macOS fit in 47 bits, anything above is a
+// pointer authentication signature on a saved lr
+#define SNAP_ADDR_MASK ((1ULL << 47) - 1)
+
+// threads per worker below which another worker isn't worth starting
+#define SNAP_THREADS_PER_WORKER 64
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t count;
+  uint64_t time; // mach_absolute_time of the capture
+  uint32_t numer;
+  uint32_t denom;
+} snapshot_file_header_t;
+
+// shared by the workers of one capture
+typedef struct {
+  task_t task;
+  const target_thread_t *threads;
+  thread_snapshot_t *snaps;
+  size_t count;
+  _Atomic size_t next;
+} snapshot_job_t;
+
+const char *thread_run_state_name(int run_state) {
+  switch (run_state) {
+  case TH_STATE_RUNNING:
+    return "running";
+  case TH_STATE_STOPPED:
+    return "stopped";
+  case TH_STATE_WAITING:
+    return "waiting";
+  case TH_STATE_UNINTERRUPTIBLE:
+    return "uninterruptible";
+  case TH_STATE_HALTED:
+    return "halted";
+  default:
+    return "unknown";
+  }
+}
+
+// goes straight to vm_read_overwrite, the page cache and read coalescer
+// belong to the shell thread
+static bool _read_frame(task_t task, uint64_t fp, uint64_t out[2]) {
+  vm_size_t got = 0;
+  kern_return_t kr = vm_read_overwrite(task, (vm_address_t)fp, 16,
+                                       (vm_address_t)out, &got);
+  return kr == KERN_SUCCESS && got == 16;
+}
+
+// pc, then walk the frame records, each is {previous fp, saved lr}
+static void _walk_frames(task_t task, thread_snapshot_t *s) {
+  s->frames[s->nframes++] = s->regs.pc;
+
+  uint64_t fp = s->regs.fp;
+  while (s->nframes < SNAP_MAX_FRAMES && fp && (fp & 0xf) == 0) {
+    uint64_t rec[2];
+    if (!_read_frame(task, fp, rec))
+      break;
+    uint64_t ret = rec[1] & SNAP_ADDR_MASK;
+    if (ret == 0)
+      break;
+    s->frames[s->nframes++] = ret;
+    // the stack grows down, a caller's frame always sits above
+    if (rec[0] <= fp)
+      break;
+    fp = rec[0];
+  }
+}
+
+static void _capture_one(task_t task, thread_act_t thread,
+                         thread_snapshot_t *s) {
+  memset(s, 0, sizeof(*s));
+  s->port = thread;
+
+  thread_basic_info_data_t basic;
+  mach_msg_type_number_t n = THREAD_BASIC_INFO_COUNT;
+  if (thread_info(thread, THREAD_BASIC_INFO, (thread_info_t)&basic, &n) ==
+      KERN_SUCCESS) {
+    s->run_state = basic.run_state;
+    s->flags = basic.flags;
+    s->cpu_usage = basic.cpu_usage;
+    s->suspend_count = basic.suspend_count;
+    s->user_us = (uint64_t)basic.user_time.seconds * 1000000 +
+                 basic.user_time.microseconds;
+    s->system_us = (uint64_t)basic.system_time.seconds * 1000000 +
+                   basic.system_time.microseconds;
+  }
+
+  thread_identifier_info_data_t ident;
+  n = THREAD_IDENTIFIER_INFO_COUNT;
+  if (thread_info(thread, THREAD_IDENTIFIER_INFO, (thread_info_t)&ident,
+                  &n) == KERN_SUCCESS)
+    s->thread_id = ident.thread_id;
+
+  thread_extended_info_data_t ext;
+  n = THREAD_EXTENDED_INFO_COUNT;
+  if (thread_info(thread, THREAD_EXTENDED_INFO, (thread_info_t)&ext, &n) ==
+      KERN_SUCCESS)
+    snprintf(s->name, sizeof(s->name), "%s", ext.pth_name);
+
+  arm_thread_state64_t state;
+  // straight from the kernel, the pool's workers would serialize on the
+  // register cache and push the stopped threads' states out of it
+  s->status = mach_thread_read_state(thread, &state);
+  if (s->status != KERN_SUCCESS)
+    return;
+  mach_regs_from_state(&state, &s->regs);
+  _walk_frames(task, s);
+}
+
+static void *_worker(void *arg) {
+  snapshot_job_t *job = arg;
+  for (;;) {
+    size_t i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+    if (i >= job->count)
+      break;
+    _capture_one(job->task, (thread_act_t)job->threads[i], &job->snaps[i]);
+  }
+  return NULL;
+}
+
+kern_return_t thread_snapshot_capture(thread_snapshot_t **out, size_t *count) {
+  *out = NULL;
+  *count = 0;
+
+  target_thread_t *threads = NULL;
+  size_t n = 0;
+  kern_return_t kr = mach_backend.threads(&threads, &n);
+  if (kr != KERN_SUCCESS)
+    return kr;
+
+  thread_snapshot_t *snaps = calloc(n, sizeof(*snaps));
+  if (!snaps) {
+    free(threads);
+    return KERN_RESOURCE_SHORTAGE;
+  }
+
+  snapshot_job_t job = {.task = mach_get_task(),
+                        .threads = threads,
+                        .snaps = snaps,
+                        .count = n};
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = ncpu > 0 ? (size_t)ncpu : 1;
+  if (workers > SNAP_MAX_WORKERS)
+    workers = SNAP_MAX_WORKERS;
+  if (workers > n / SNAP_THREADS_PER_WORKER + 1)
+    workers = n / SNAP_THREADS_PER_WORKER + 1;
+
+  // this thread is worker 0, whatever fails to start is covered by the rest
+  pthread_t pool[SNAP_MAX_WORKERS];
+  size_t started = 0;
+  for (size_t i = 1; i < workers; i++) {
+    if (pthread_create(&pool[started], NULL, _worker, &job) == 0)
+      started++;
+  }
+  _worker(&job);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(pool[i], NULL);
+
+  free(threads);
+  *out = snaps;
+  *count = n;
+  return KERN_SUCCESS;
+}
+
+int thread_snapshot_write(const char *path, const thread_snapshot_t *snaps,
+                          size_t count) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror("[-] fopen");
+    return -1;
+  }
+
+  mach_timebase_info_data_t tb;
+  mach_timebase_info(&tb);
+  snapshot_file_header_t hdr = {.version = SNAP_VERSION,
+                                .record_size = sizeof(thread_snapshot_t),
+                                .count = count,
+                                .time = mach_absolute_time(),
+                                .numer = tb.numer,
+                                .denom = tb.denom};
+  memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+
+  int ret = 0;
+  if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+      fwrite(snaps, sizeof(*snaps), count, f) != count) {
+    perror("[-] fwrite");
+    ret = -1;
+  }
+  fclose(f);
+  return ret;
+}
@@ -0,0 +1,288 @@
+#include "target/a64.h"
+#include <stddef.h>
+
+// user addresses fit in 47 bits, anything above on a branch register is a
+// pointer authentication signature
+#define A64_ADDR_MASK ((1ULL << 47) - 1)
+
+// how the target of an entry is encoded
+typedef enum {
+  IMM_NONE,
+  IMM26,  // b, bl
+  IMM19,  // b.cond, cbz, cbnz, ldr literal
+  IMM14,  // tbz, tbnz
+  IMM_ADR,
+  IMM_ADRP,
+} imm_kind_t;
+
+typedef struct {
+  uint32_t mask;
+  uint32_t value;
+  a64_kind_t kind;
+  imm_kind_t imm;
+} a64_entry_t;
+
+// grouped by the top level op0 field (bits 28:25), each group is a
+// contiguous run of the table below
+static const a64_entry_t table[] = {
+    // data processing, immediate
+    {0x9f000000, 0x10000000, A64_PCREL, IMM_ADR},  // adr
+    {0x9f000000, 0x90000000, A64_PCREL, IMM_ADRP}, // adrp
+
+    // branches, exception generation and system
+    {0x7c000000, 0x14000000, A64_BRANCH, IMM26},     // b, bl (kind fixed up)
+    {0xff000000, 0x54000000, A64_COND_BRANCH, IMM19}, // b.cond, bc.cond
+    {0x7e000000, 0x34000000, A64_COND_BRANCH, IMM19}, // cbz, cbnz
+    {0x7e000000, 0x36000000, A64_COND_BRANCH, IMM14}, // tbz, tbnz
+    {0xfffffc1f, 0xd61f0000, A64_BRANCH_REG, IMM_NONE}, // br
+    {0xfffffc1f, 0xd63f0000, A64_CALL_REG, IMM_NONE},   // blr
+    {0xfffffc1f, 0xd65f0000, A64_RET, IMM_NONE},        // ret
+    {0xfffff81f, 0xd61f081f, A64_BRANCH_REG, IMM_NONE}, // braaz, brabz
+    {0xfffff81f, 0xd63f081f, A64_CALL_REG, IMM_NONE},   // blraaz, blrabz
+    {0xfffffbff, 0xd65f0bff, A64_RET, IMM_NONE},        // retaa, retab
+    {0xfffff800, 0xd71f0800, A64_BRANCH_REG, IMM_NONE}, // braa, brab
+    {0xfffff800, 0xd73f0800, A64_CALL_REG, IMM_NONE},   // blraa, blrab
+    {0xffe0001f, 0xd4000001, A64_EXCEPTION, IMM_NONE},  // svc
+    {0xffe0001f, 0xd4200000, A64_EXCEPTION, IMM_NONE},  // brk
+
+    // loads and stores
+    {0x3b000000, 0x18000000, A64_PCREL, IMM19}, // ldr, ldrsw, prfm literal
+};
+
+enum {
+  GROUP_NONE,
+  GROUP_DP_IMM,
+  GROUP_BRANCH,
+  GROUP_LOAD_LIT,
+  GROUP_COUNT,
+};
+
+// [first, end) into table per group
+static const uint8_t group_range[GROUP_COUNT][2] = {
+    [GROUP_NONE] = {0, 0},
+    [GROUP_DP_IMM] = {0, 2},
+    [GROUP_BRANCH] = {2, 16},
+    [GROUP_LOAD_LIT] = {16, 17},
+};
+
+// op0 -> group, literal loads only live in the two load/store encodings
+// with bit 27 and 28 set
+static const uint8_t group_of_op0[16] = {
+    [0x8] = GROUP_DP_IMM,   [0x9] = GROUP_DP_IMM,   [0xa] = GROUP_BRANCH,
+    [0xb] = GROUP_BRANCH,   [0xc] = GROUP_LOAD_LIT, [0xe] = GROUP_LOAD_LIT,
+};
+
+// bit n of entry cond is set if the condition holds for nzcv == n
+static const uint16_t cond_table[16] = {
+    0xf0f0, // eq
+    0x0f0f, // ne
+    0xcccc, // cs
+    0x3333, // cc
+    0xff00, // mi
+    0x00ff, // pl
+    0xaaaa, // vs
+    0x5555, // vc
+    0x0c0c, // hi
+    0xf3f3, // ls
+    0xaa55, // ge
+    0x55aa, // lt
+    0x0a05, // gt
+    0xf5fa, // le
+    0xffff, // al
+    0xffff, // nv
+};
+
+static inline int64_t _sext(uint64_t v, int bits) {
+  return (int64_t)(v << (64 - bits)) >> (64 - bits);
+}
+
+static uint64_t _target(uint32_t insn, uint64_t pc, imm_kind_t imm) {
+  switch (imm) {
+  case IMM26:
+    return pc + (_sext(insn & 0x3ffffff, 26) << 2);
+  case IMM19:
+    return pc + (_sext((insn >> 5) & 0x7ffff, 19) << 2);
+  case IMM14:
+    return pc + (_sext((insn >> 5) & 0x3fff, 14) << 2);
+  case IMM_ADR:
+    return pc + _sext(((insn >> 5) & 0x7ffff) << 2 | ((insn >> 29) & 0x3), 21);
+  case IMM_ADRP:
+    return (pc & ~0xfffULL) +
+           (_sext(((insn >> 5) & 0x7ffff) << 2 | ((insn >> 29) & 0x3), 21)
+            << 12);
+  default:
+    return 0;
+  }
+}
+
+bool a64_decode(uint32_t insn, uint64_t pc, a64_insn_t *out) {
+  *out = (a64_insn_t){.kind = A64_SEQ};
+
+  const uint8_t *range = group_range[group_of_op0[(insn >> 25) & 0xf]];
+  const a64_entry_t *e = NULL;
+  for (uint8_t i = range[0]; i < range[1]; i++) {
+    if ((insn & table[i].mask) == table[i].value) {
+      e = &table[i];
+      break;
+    }
+  }
+  if (!e)
+    return false;
+
+  out->kind = e->kind;
+  out->target = _target(insn, pc, e->imm);
+  switch (e->kind) {
+  case A64_BRANCH:
+    if (insn & 0x80000000)
+      out->kind = A64_CALL;
+    break;
+  case A64_COND_BRANCH:
+    if (e->imm == IMM14) {
+      out->test = A64_TEST_BIT;
+      out->reg = insn & 0x1f;
+      out->cond = (insn >> 24) & 1;
+      out->bit = ((insn >> 26) & 0x20) | ((insn >> 19) & 0x1f);
+    } else if (insn & 0x20000000) {
+      out->test = A64_TEST_ZERO;
+      out->reg = insn & 0x1f;
+      out->cond = (insn >> 24) & 1;
+      out->bit = insn & 0x80000000 ? 64 : 32;
+    } else {
+      out->test = A64_TEST_FLAGS;
+      out->cond = insn & 0xf;
+    }
+    break;
+  case A64_BRANCH_REG:
+  case A64_CALL_REG:
+  case A64_RET:
+    out->reg = (insn >> 5) & 0x1f;
+    break;
+  case A64_PCREL:
+    out->reg = insn & 0x1f;
+    break;
+  default:
+    break;
+  }
+  return true;
+}
+
+bool a64_cond_holds(uint8_t cond, uint32_t cpsr) {
+  return (cond_table[cond & 0xf] >> (cpsr >> 28)) & 1;
+}
+
+// x0-x28, fp, lr, register 31 reads as zero here (xzr)
+static uint64_t _reg(const target_regs_t *regs, uint8_t reg) {
+  if (reg < 29)
+    return regs->x[reg];
+  if (reg == 29)
+    return regs->fp;
+  if (reg == 30)
+    return regs->lr;
+  return 0;
+}
+
+static bool _taken(const a64_insn_t *d, const target_regs_t *regs) {
+  switch (d->test) {
+  case A64_TEST_FLAGS:
+    return a64_cond_holds(d->cond, regs->cpsr);
+  case A64_TEST_ZERO: {
+    uint64_t v = _reg(regs, d->reg);
+    if (d->bit == 32)
+      v &= 0xffffffff;
+    return (v != 0) == d->cond;
+  }
+  case A64_TEST_BIT:
+    return ((_reg(regs, d->reg) >> d->bit) & 1) == d->cond;
+  default:
+    return false;
+  }
+}
+
+uint64_t a64_next_pc(const a64_insn_t *d, uint64_t pc,
+                     const target_regs_t *regs) {
+  switch (d->kind) {
+  case A64_BRANCH:
+  case A64_CALL:
+    return d->target;
+  case A64_COND_BRANCH:
+    return _taken(d, regs) ? d->target : pc + 4;
+  case A64_BRANCH_REG:
+  case A64_CALL_REG:
+  case A64_RET:
+    return _reg(regs, d->reg) & A64_ADDR_MASK;
+  default:
+    return pc + 4;
+  }
+}
+
+// register 31 is xzr here too, writes to it vanish
+static void _set_reg(target_regs_t *regs, uint8_t reg, uint64_t v) {
+  if (reg < 29)
+    regs->x[reg] = v;
+  else if (reg == 29)
+    regs->fp = v;
+  else if (reg == 30)
+    regs->lr = v;
+}
+
+bool a64_emulate(uint32_t insn, uint64_t pc, target_regs_t *regs,
+                 range_read_fn read) {
+  a64_insn_t d;
+  a64_decode(insn, pc, &d);
+
+  switch (d.kind) {
+  case A64_BRANCH:
+  case A64_COND_BRANCH:
+  case A64_BRANCH_REG:
+  case A64_RET:
+    regs->pc = a64_next_pc(&d, pc, regs);
+    return true;
+  case A64_CALL:
+  case A64_CALL_REG:
+    // blr x30 branches to the old lr
+    regs->pc = a64_next_pc(&d, pc, regs);
+    regs->lr = pc + 4;
+    return true;
+  case A64_PCREL:
+    break;
+  default:
+    return false;
+  }
+
+  if ((insn & 0x1f000000) == 0x10000000) { // adr, adrp
+    _set_reg(regs, d.reg, d.target);
+    regs->pc = pc + 4;
+    return true;
+  }
+
+  // ldr (literal) by opc, bit 26 picks the SIMD registers we don't have
+  if (insn & 0x04000000)
+    return false;
+  switch (insn >> 30) {
+  case 0: { // ldr wt
+    uint32_t v;
+    if (!read || read(d.target, &v, sizeof(v)) != 0)
+      return false;
+    _set_reg(regs, d.reg, v);
+    break;
+  }
+  case 1: { // ldr xt
+    uint64_t v;
+    if (!read || read(d.target, &v, sizeof(v)) != 0)
+      return false;
+    _set_reg(regs, d.reg, v);
+    break;
+  }
+  case 2: { // ldrsw
+    int32_t v;
+    if (!read || read(d.target, &v, sizeof(v)) != 0)
+      return false;
+    _set_reg(regs, d.reg, (uint64_t)(int64_t)v);
+    break;
+  }
+  default: // prfm, a hint
+    break;
+  }
+  regs->pc = pc + 4;
+  return true;
+}
@@ -0,0 +1,131 @@
+#include "target/coalesce.h"
+#include <stdlib.h>
+#include <string.h>
+
+// batches and merged runs up to these sizes stay on the stack, a single
+// read (a listing chunk, a word of a pointer chain) never touches the heap
+#define STACK_ENTRIES 32
+#define STACK_RUN_BYTES 2048
+
+// sort (addr, index) pairs rather than the iovecs, so the caller's order
+// is preserved and nothing global is needed by the comparator
+typedef struct {
+  uint64_t addr;
+  size_t idx;
+} sort_key_t;
+
+static int _cmp_by_addr(const void *a, const void *b) {
+  uint64_t x = ((const sort_key_t *)a)->addr;
+  uint64_t y = ((const sort_key_t *)b)->addr;
+  return (x > y) - (x < y);
+}
+
+// first page boundary at or after the end of an entry
+static inline uint64_t _page_end(const target_iovec_t *e, uint64_t page_size) {
+  return (e->addr + e->size + page_size - 1) & ~(page_size - 1);
+}
+
+// read one merged range and scatter it, or fall back to reading each entry
+// on its own so a single bad entry doesn't fail its neighbours
+static int _read_run(target_iovec_t *iov, const sort_key_t *order,
+                     size_t first, size_t last, uint64_t start, uint64_t end,
+                     range_read_fn read_range, coalesce_stats_t *stats) {
+  int ret = 0;
+  size_t len = (size_t)(end - start);
+
+  // a run of one goes straight into its buffer, a retry would only
+  // repeat the same read
+  if (first == last) {
+    target_iovec_t *e = &iov[order[first].idx];
+    e->status = read_range(e->addr, e->buf, e->size);
+    if (e->status == 0 && stats)
+      stats->ranges++;
+    return e->status != 0;
+  }
+
+  uint8_t stack_buf[STACK_RUN_BYTES];
+  uint8_t *buf = len <= sizeof(stack_buf) ? stack_buf : malloc(len);
+
+  if (buf && read_range(start, buf, len) == 0) {
+    if (stats)
+      stats->ranges++;
+    for (size_t k = first; k <= last; k++) {
+      target_iovec_t *e = &iov[order[k].idx];
+      memcpy(e->buf, buf + (e->addr - start), e->size);
+      e->status = 0;
+    }
+    if (buf != stack_buf)
+      free(buf);
+    return 0;
+  }
+  if (buf != stack_buf)
+    free(buf);
+
+  for (size_t k = first; k <= last; k++) {
+    target_iovec_t *e = &iov[order[k].idx];
+    if (stats)
+      stats->retries++;
+    e->status = read_range(e->addr, e->buf, e->size);
+    if (e->status != 0)
+      ret = 1;
+  }
+  return ret;
+}
+
+int target_read_coalesced(target_iovec_t *iov, size_t count,
+                          uint64_t page_size, range_read_fn read_range,
+                          coalesce_stats_t *stats) {
+  if (stats)
+    stats->entries += count;
+  if (count == 0)
+    return 0;
+
+  sort_key_t stack_order[STACK_ENTRIES];
+  sort_key_t *order = count <= STACK_ENTRIES
+                          ? stack_order
+                          : malloc(count * sizeof(*order));
+  if (!order)
+    return 1;
+  for (size_t i = 0; i < count; i++)
+    order[i] = (sort_key_t){.addr = iov[i].addr, .idx = i};
+
+  qsort(order, count, sizeof(*order), _cmp_by_addr);
+
+  const uint64_t mask = ~(page_size - 1);
+  int ret = 0;
+
+  // entries are merged while they land in the same or the next page, but
+  // a run only reads the bytes between its lowest and highest entry
+  size_t first = 0;
+  const target_iovec_t *e = &iov[order[0].idx];
+  uint64_t start = e->addr;
+  uint64_t end = e->addr + e->size;
+  uint64_t page_end = _page_end(e, page_size);
+
+  for (size_t k = 1; k <= count; k++) {
+    if (k < count) {
+      e = &iov[order[k].idx];
+      if ((e->addr & mask) <= page_end) {
+        if (e->addr + e->size > end)
+          end = e->addr + e->size;
+        if (_page_end(e, page_size) > page_end)
+          page_end = _page_end(e, page_size);
+        continue;
+      }
+    }
+
+    if (_read_run(iov, order, first, k - 1, start, end, read_range, stats))
+      ret = 1;
+
+    if (k < count) {
+      first = k;
+      start = e->addr;
+      end = e->addr + e->size;
+      page_end = _page_end(e, page_size);
+    }
+  }
+
+  if (order != stack_order)
+    free(order);
+  return ret;
+}
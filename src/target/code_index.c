@@ -0,0 +1,238 @@
+#include "target/code_index.h"
+#include "target/a64.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// chunks are whole pages of instructions
+#define CHUNK_ALIGN_WORDS (0x1000 / 4)
+// less code than this per worker isn't worth a thread
+#define MIN_WORDS_PER_WORKER (0x10000 / 4)
+
+typedef struct {
+  uint64_t *v;
+  size_t count;
+  size_t cap;
+} addr_vec_t;
+
+// one worker's share of the section, words [first, last)
+typedef struct {
+  const uint32_t *text;
+  size_t first;
+  size_t last;
+  uint64_t start;
+  uint64_t end;
+  addr_vec_t funcs;
+  addr_vec_t blocks;
+  int err;
+} chunk_t;
+
+static int _push(addr_vec_t *vec, uint64_t addr) {
+  if (vec->count == vec->cap) {
+    size_t cap = vec->cap ? vec->cap * 2 : 1024;
+    uint64_t *tmp = realloc(vec->v, cap * sizeof(*tmp));
+    if (!tmp)
+      return -1; // allocation err
+    vec->v = tmp;
+    vec->cap = cap;
+  }
+  vec->v[vec->count++] = addr;
+  return 0;
+}
+
+static int _cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void *_scan(void *arg) {
+  chunk_t *c = arg;
+  for (size_t i = c->first; i < c->last; i++) {
+    uint64_t pc = c->start + i * 4;
+    a64_insn_t d;
+    if (!a64_decode(c->text[i], pc, &d) || !a64_is_branch(d.kind))
+      continue;
+
+    int err = 0;
+    if (pc + 4 < c->end)
+      err |= _push(&c->blocks, pc + 4);
+    // register branches have no static target
+    if (d.target >= c->start && d.target < c->end) {
+      err |= _push(&c->blocks, d.target);
+      if (d.kind == A64_CALL)
+        err |= _push(&c->funcs, d.target);
+    }
+    if (err) {
+      c->err = -1;
+      return NULL;
+    }
+  }
+  qsort(c->funcs.v, c->funcs.count, sizeof(uint64_t), _cmp_u64);
+  qsort(c->blocks.v, c->blocks.count, sizeof(uint64_t), _cmp_u64);
+  return NULL;
+}
+
+// k way merge of sorted runs, dropping duplicates
+static int _merge(const addr_vec_t *runs, size_t nruns, addr_vec_t *out) {
+  size_t total = 0;
+  for (size_t r = 0; r < nruns; r++)
+    total += runs[r].count;
+  out->v = malloc((total ? total : 1) * sizeof(uint64_t));
+  if (!out->v)
+    return -1; // allocation err
+  out->cap = total;
+  out->count = 0;
+
+  size_t pos[CODE_INDEX_MAX_WORKERS + 2] = {0};
+  for (;;) {
+    size_t best = nruns;
+    for (size_t r = 0; r < nruns; r++) {
+      if (pos[r] < runs[r].count &&
+          (best == nruns || runs[r].v[pos[r]] < runs[best].v[pos[best]]))
+        best = r;
+    }
+    if (best == nruns)
+      break;
+    uint64_t a = runs[best].v[pos[best]++];
+    if (out->count == 0 || out->v[out->count - 1] != a)
+      out->v[out->count++] = a;
+  }
+  return 0;
+}
+
+// the known starts inside [start, end) plus the section start, sorted
+static int _seed_funcs(const uint64_t *known, size_t nknown, uint64_t start,
+                       uint64_t end, addr_vec_t *out) {
+  if (_push(out, start) != 0)
+    return -1;
+  for (size_t i = 0; i < nknown; i++) {
+    if (known[i] >= start && known[i] < end && _push(out, known[i]) != 0)
+      return -1;
+  }
+  qsort(out->v, out->count, sizeof(uint64_t), _cmp_u64);
+  return 0;
+}
+
+int code_index_build(code_index_t *idx, const uint32_t *text, size_t size,
+                     uint64_t addr, const uint64_t *known_funcs,
+                     size_t nknown, unsigned workers) {
+  memset(idx, 0, sizeof(*idx));
+  size_t nwords = size / 4;
+  if (nwords == 0)
+    return -1;
+
+  if (workers == 0) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = ncpu > 0 ? (unsigned)ncpu : 1;
+  }
+  if (workers > CODE_INDEX_MAX_WORKERS)
+    workers = CODE_INDEX_MAX_WORKERS;
+  if (workers > nwords / MIN_WORDS_PER_WORKER + 1)
+    workers = (unsigned)(nwords / MIN_WORDS_PER_WORKER + 1);
+
+  size_t per = (nwords + workers - 1) / workers;
+  per = (per + CHUNK_ALIGN_WORDS - 1) / CHUNK_ALIGN_WORDS * CHUNK_ALIGN_WORDS;
+
+  chunk_t chunks[CODE_INDEX_MAX_WORKERS];
+  pthread_t threads[CODE_INDEX_MAX_WORKERS];
+  bool started[CODE_INDEX_MAX_WORKERS] = {false};
+  size_t nchunks = 0;
+  for (size_t first = 0; first < nwords; first += per) {
+    chunks[nchunks] = (chunk_t){.text = text,
+                                .first = first,
+                                .last = first + per < nwords ? first + per
+                                                             : nwords,
+                                .start = addr,
+                                .end = addr + nwords * 4};
+    nchunks++;
+  }
+
+  // the first chunk runs here, a worker that fails to start runs here too
+  for (size_t i = 1; i < nchunks; i++)
+    started[i] = pthread_create(&threads[i], NULL, _scan, &chunks[i]) == 0;
+  _scan(&chunks[0]);
+  for (size_t i = 1; i < nchunks; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      _scan(&chunks[i]);
+  }
+
+  // runs: every chunk, then the seeded function starts
+  addr_vec_t runs[CODE_INDEX_MAX_WORKERS + 2];
+  addr_vec_t seed = {0}, funcs = {0}, blocks = {0};
+  int err = _seed_funcs(known_funcs, nknown, addr, addr + nwords * 4, &seed);
+  for (size_t i = 0; i < nchunks; i++)
+    err |= chunks[i].err;
+
+  if (err == 0) {
+    for (size_t i = 0; i < nchunks; i++)
+      runs[i] = chunks[i].funcs;
+    runs[nchunks] = seed;
+    err = _merge(runs, nchunks + 1, &funcs);
+  }
+  if (err == 0) {
+    // every function start is a block start
+    for (size_t i = 0; i < nchunks; i++)
+      runs[i] = chunks[i].blocks;
+    runs[nchunks] = funcs;
+    err = _merge(runs, nchunks + 1, &blocks);
+  }
+
+  for (size_t i = 0; i < nchunks; i++) {
+    free(chunks[i].funcs.v);
+    free(chunks[i].blocks.v);
+  }
+  free(seed.v);
+  if (err != 0) {
+    free(funcs.v);
+    free(blocks.v);
+    return -1;
+  }
+
+  idx->start = addr;
+  idx->end = addr + nwords * 4;
+  idx->funcs = funcs.v;
+  idx->nfuncs = funcs.count;
+  idx->blocks = blocks.v;
+  idx->nblocks = blocks.count;
+  idx->insns = nwords;
+  return 0;
+}
+
+void code_index_free(code_index_t *idx) {
+  free(idx->funcs);
+  free(idx->blocks);
+  memset(idx, 0, sizeof(*idx));
+}
+
+// last start <= addr
+static uint64_t _lookup(const code_index_t *idx, const uint64_t *v, size_t n,
+                        uint64_t addr, uint64_t *end) {
+  if (addr < idx->start || addr >= idx->end || n == 0 || addr < v[0])
+    return 0;
+
+  size_t lo = 0, hi = n;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (v[mid] <= addr)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  if (end)
+    *end = lo + 1 < n ? v[lo + 1] : idx->end;
+  return v[lo];
+}
+
+uint64_t code_index_function(const code_index_t *idx, uint64_t addr,
+                             uint64_t *end) {
+  return _lookup(idx, idx->funcs, idx->nfuncs, addr, end);
+}
+
+uint64_t code_index_block(const code_index_t *idx, uint64_t addr,
+                          uint64_t *end) {
+  return _lookup(idx, idx->blocks, idx->nblocks, addr, end);
+}
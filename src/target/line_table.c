@@ -0,0 +1,882 @@
+#include "target/line_table.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the mach-o pieces we read, spelled out so this builds without the apple
+// headers
+#define MO_MH_MAGIC_64 0xfeedfacfU
+#define MO_FAT_MAGIC 0xcafebabeU
+#define MO_FAT_MAGIC_64 0xcafebabfU
+#define MO_CPU_TYPE_ARM64 0x0100000cU
+#define MO_LC_SEGMENT_64 0x19U
+#define MO_LC_UUID 0x1bU
+
+#define MO_HEADER_SIZE 32
+#define MO_SEGMENT_SIZE 72
+#define MO_SECTION_SIZE 80
+
+// line program opcodes
+#define DW_LNS_copy 0x01
+#define DW_LNS_advance_pc 0x02
+#define DW_LNS_advance_line 0x03
+#define DW_LNS_set_file 0x04
+#define DW_LNS_const_add_pc 0x08
+#define DW_LNS_fixed_advance_pc 0x09
+#define DW_LNE_end_sequence 0x01
+#define DW_LNE_set_address 0x02
+
+// what a version 5 directory or file entry holds, and how
+#define DW_LNCT_path 0x1
+#define DW_LNCT_directory_index 0x2
+
+#define DW_FORM_block2 0x03
+#define DW_FORM_block4 0x04
+#define DW_FORM_data2 0x05
+#define DW_FORM_data4 0x06
+#define DW_FORM_data8 0x07
+#define DW_FORM_string 0x08
+#define DW_FORM_block 0x09
+#define DW_FORM_block1 0x0a
+#define DW_FORM_data1 0x0b
+#define DW_FORM_sdata 0x0d
+#define DW_FORM_strp 0x0e
+#define DW_FORM_udata 0x0f
+#define DW_FORM_strx 0x1a
+#define DW_FORM_strp_sup 0x1d
+#define DW_FORM_data16 0x1e
+#define DW_FORM_line_strp 0x1f
+#define DW_FORM_strx1 0x25
+#define DW_FORM_strx2 0x26
+#define DW_FORM_strx3 0x27
+#define DW_FORM_strx4 0x28
+
+// more formats than this per entry is not a line table
+#define LINE_MAX_FORMATS 16
+
+// a cursor that stops at end, every read past it sets bad and returns 0
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+  bool bad;
+} reader_t;
+
+static uint64_t _u(reader_t *r, size_t n) {
+  if (r->bad || (size_t)(r->end - r->p) < n) {
+    r->bad = true;
+    return 0;
+  }
+  uint64_t v = 0;
+  for (size_t i = 0; i < n; i++)
+    v |= (uint64_t)r->p[i] << (8 * i);
+  r->p += n;
+  return v;
+}
+
+static void _skip(reader_t *r, uint64_t n) {
+  if (r->bad || (uint64_t)(r->end - r->p) < n) {
+    r->bad = true;
+    return;
+  }
+  r->p += n;
+}
+
+static uint64_t _uleb(reader_t *r) {
+  uint64_t v = 0;
+  for (int shift = 0; !r->bad; shift += 7) {
+    if (r->p >= r->end || shift >= 64) {
+      r->bad = true;
+      break;
+    }
+    uint8_t b = *r->p++;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return v;
+  }
+  return 0;
+}
+
+static int64_t _sleb(reader_t *r) {
+  uint64_t v = 0;
+  for (int shift = 0; !r->bad; shift += 7) {
+    if (r->p >= r->end || shift >= 64) {
+      r->bad = true;
+      break;
+    }
+    uint8_t b = *r->p++;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      if (shift + 7 < 64 && (b & 0x40))
+        v |= ~0ULL << (shift + 7);
+      return (int64_t)v;
+    }
+  }
+  return 0;
+}
+
+static const char *_cstr(reader_t *r) {
+  if (r->bad)
+    return NULL;
+  const uint8_t *nul = memchr(r->p, '\0', (size_t)(r->end - r->p));
+  if (!nul) {
+    r->bad = true;
+    return NULL;
+  }
+  const char *s = (const char *)r->p;
+  r->p = nul + 1;
+  return s;
+}
+
+// a string at off in one of the string sections
+static const char *_section_str(const uint8_t *sect, size_t size,
+                                uint64_t off) {
+  if (!sect || off >= size || !memchr(sect + off, '\0', size - off))
+    return NULL;
+  return (const char *)sect + off;
+}
+
+// unit headers
+
+typedef struct {
+  uint16_t version;
+  bool dwarf64;
+  uint8_t min_insn;
+  int8_t line_base;
+  uint8_t line_range;
+  uint8_t opcode_base;
+  uint8_t opcode_lengths[256];
+  // directory and file tables, then the program up to the unit's end
+  reader_t tables;
+  reader_t program;
+} unit_header_t;
+
+// the header of the unit at off, *next gets the offset of the one after
+// it, or 0 if the length can't be trusted and the walk has to stop
+static int _header(const line_table_t *lt, uint64_t off, unit_header_t *h,
+                   uint64_t *next) {
+  *next = 0;
+  reader_t r = {.p = lt->line + off, .end = lt->line + lt->line_size};
+  uint64_t len = _u(&r, 4);
+  h->dwarf64 = len == 0xffffffffULL;
+  if (h->dwarf64)
+    len = _u(&r, 8);
+  if (r.bad || len > (uint64_t)(r.end - r.p) || len < 2)
+    return -1;
+  const uint8_t *unit_end = r.p + len;
+  *next = (uint64_t)(unit_end - lt->line);
+  r.end = unit_end;
+
+  h->version = (uint16_t)_u(&r, 2);
+  if (h->version < 2 || h->version > 5)
+    return -1;
+  if (h->version >= 5)
+    _skip(&r, 2); // address_size, segment_selector_size
+  uint64_t header_len = _u(&r, h->dwarf64 ? 8 : 4);
+  if (r.bad || header_len > (uint64_t)(r.end - r.p))
+    return -1;
+  const uint8_t *program = r.p + header_len;
+
+  h->min_insn = (uint8_t)_u(&r, 1);
+  if (h->version >= 4)
+    _skip(&r, 1); // maximum_operations_per_instruction
+  _skip(&r, 1);   // default_is_stmt
+  h->line_base = (int8_t)_u(&r, 1);
+  h->line_range = (uint8_t)_u(&r, 1);
+  h->opcode_base = (uint8_t)_u(&r, 1);
+  if (r.bad || h->line_range == 0 || h->opcode_base == 0)
+    return -1;
+  memset(h->opcode_lengths, 0, sizeof(h->opcode_lengths));
+  for (unsigned i = 1; i < h->opcode_base; i++)
+    h->opcode_lengths[i] = (uint8_t)_u(&r, 1);
+  if (r.bad || r.p > program)
+    return -1;
+
+  h->tables = (reader_t){.p = r.p, .end = program};
+  h->program = (reader_t){.p = program, .end = unit_end};
+  return 0;
+}
+
+// file tables
+
+static int _push_file(line_table_t *lt, const char *dir, const char *name) {
+  if (lt->nfiles == lt->files_cap) {
+    size_t cap = lt->files_cap ? lt->files_cap * 2 : 64;
+    char **tmp = realloc(lt->files, cap * sizeof(*tmp));
+    if (!tmp)
+      return -1; // allocation err
+    lt->files = tmp;
+    lt->files_cap = cap;
+  }
+  if (!name)
+    name = "?";
+  size_t dlen = dir && name[0] != '/' ? strlen(dir) : 0;
+  size_t nlen = strlen(name);
+  char *s = malloc(dlen + 1 + nlen + 1);
+  if (!s)
+    return -1; // allocation err
+  if (dlen) {
+    memcpy(s, dir, dlen);
+    s[dlen] = '/';
+    memcpy(s + dlen + 1, name, nlen + 1);
+  } else {
+    memcpy(s, name, nlen + 1);
+  }
+  lt->files[lt->nfiles++] = s;
+  return 0;
+}
+
+// one attribute of a version 5 entry, strings go to *str, numbers to *num,
+// false for a form we can't skip
+static bool _form(const line_table_t *lt, reader_t *r, uint64_t form,
+                  bool dwarf64, const char **str, uint64_t *num) {
+  *str = NULL;
+  *num = 0;
+  switch (form) {
+  case DW_FORM_string:
+    *str = _cstr(r);
+    break;
+  case DW_FORM_line_strp:
+    *str = _section_str(lt->line_str, lt->line_str_size,
+                        _u(r, dwarf64 ? 8 : 4));
+    break;
+  case DW_FORM_strp:
+    *str = _section_str(lt->str, lt->str_size, _u(r, dwarf64 ? 8 : 4));
+    break;
+  case DW_FORM_strp_sup:
+    _skip(r, dwarf64 ? 8 : 4);
+    break;
+  // string offsets need the unit's .debug_info, the name stays unknown
+  case DW_FORM_strx:
+    _uleb(r);
+    break;
+  case DW_FORM_strx1:
+  case DW_FORM_strx2:
+  case DW_FORM_strx3:
+  case DW_FORM_strx4:
+    _skip(r, form - DW_FORM_strx1 + 1);
+    break;
+  case DW_FORM_udata:
+    *num = _uleb(r);
+    break;
+  case DW_FORM_sdata:
+    *num = (uint64_t)_sleb(r);
+    break;
+  case DW_FORM_data1:
+    *num = _u(r, 1);
+    break;
+  case DW_FORM_data2:
+    *num = _u(r, 2);
+    break;
+  case DW_FORM_data4:
+    *num = _u(r, 4);
+    break;
+  case DW_FORM_data8:
+    *num = _u(r, 8);
+    break;
+  case DW_FORM_data16:
+    _skip(r, 16);
+    break;
+  case DW_FORM_block:
+    _skip(r, _uleb(r));
+    break;
+  case DW_FORM_block1:
+    _skip(r, _u(r, 1));
+    break;
+  case DW_FORM_block2:
+    _skip(r, _u(r, 2));
+    break;
+  case DW_FORM_block4:
+    _skip(r, _u(r, 4));
+    break;
+  default:
+    return false;
+  }
+  return !r->bad;
+}
+
+// a version 5 table, count entries of the formats in front of them,
+// paths[i] and dirs[i] get the path and directory index of entry i
+static int _entries5(const line_table_t *lt, const unit_header_t *h,
+                     reader_t *r, const char ***paths, uint64_t **dirs,
+                     size_t *count) {
+  uint64_t formats[LINE_MAX_FORMATS][2];
+  uint8_t nformats = (uint8_t)_u(r, 1);
+  if (nformats > LINE_MAX_FORMATS)
+    return -1;
+  for (uint8_t i = 0; i < nformats; i++) {
+    formats[i][0] = _uleb(r);
+    formats[i][1] = _uleb(r);
+  }
+  uint64_t n = _uleb(r);
+  // every entry takes at least a byte per format
+  if (r->bad || (nformats && n > (uint64_t)(r->end - r->p)) ||
+      (!nformats && n))
+    return -1;
+
+  *paths = calloc(n ? n : 1, sizeof(**paths));
+  *dirs = calloc(n ? n : 1, sizeof(**dirs));
+  if (!*paths || !*dirs)
+    return -1; // allocation err, the caller frees
+  for (uint64_t e = 0; e < n; e++) {
+    for (uint8_t i = 0; i < nformats; i++) {
+      const char *s;
+      uint64_t v;
+      if (!_form(lt, r, formats[i][1], h->dwarf64, &s, &v))
+        return -1;
+      if (formats[i][0] == DW_LNCT_path)
+        (*paths)[e] = s;
+      else if (formats[i][0] == DW_LNCT_directory_index)
+        (*dirs)[e] = v;
+    }
+  }
+  *count = n;
+  return 0;
+}
+
+// every file of the unit into lt->files, fmap[i] is where dwarf file i
+// went, version 5 numbers files from 0 and earlier versions from 1
+static int _files(line_table_t *lt, const unit_header_t *h, uint32_t **fmap,
+                  size_t *nfmap) {
+  reader_t r = h->tables;
+  const char **dpaths = NULL, **fpaths = NULL;
+  uint64_t *ddirs = NULL, *fdirs = NULL;
+  size_t ndirs = 0, nfiles = 0;
+  int ret = -1;
+
+  if (h->version >= 5) {
+    if (_entries5(lt, h, &r, &dpaths, &ddirs, &ndirs) != 0 ||
+        _entries5(lt, h, &r, &fpaths, &fdirs, &nfiles) != 0)
+      goto out;
+  } else {
+    // the unit's own directory isn't in the header, it is dirs[0]
+    size_t dcap = 16, fcap = 16;
+    dpaths = calloc(dcap, sizeof(*dpaths));
+    fpaths = calloc(fcap, sizeof(*fpaths));
+    fdirs = calloc(fcap, sizeof(*fdirs));
+    if (!dpaths || !fpaths || !fdirs)
+      goto out;
+    ndirs = 1;
+    nfiles = 1;
+    for (;;) {
+      const char *s = _cstr(&r);
+      if (!s || !s[0])
+        break;
+      if (ndirs == dcap) {
+        const char **tmp = realloc(dpaths, dcap * 2 * sizeof(*tmp));
+        if (!tmp)
+          goto out;
+        dpaths = tmp;
+        dcap *= 2;
+      }
+      dpaths[ndirs++] = s;
+    }
+    for (;;) {
+      const char *s = _cstr(&r);
+      if (!s || !s[0])
+        break;
+      uint64_t dir = _uleb(&r);
+      _uleb(&r); // mtime
+      _uleb(&r); // length
+      if (nfiles == fcap) {
+        const char **tp = realloc(fpaths, fcap * 2 * sizeof(*tp));
+        if (!tp)
+          goto out;
+        fpaths = tp;
+        uint64_t *td = realloc(fdirs, fcap * 2 * sizeof(*td));
+        if (!td)
+          goto out;
+        fdirs = td;
+        fcap *= 2;
+      }
+      fpaths[nfiles] = s;
+      fdirs[nfiles++] = dir;
+    }
+    if (r.bad)
+      goto out;
+    // file 0 isn't valid before version 5, point it at the first file
+    if (nfiles > 1) {
+      fpaths[0] = fpaths[1];
+      fdirs[0] = fdirs[1];
+    }
+  }
+
+  *fmap = malloc((nfiles ? nfiles : 1) * sizeof(**fmap));
+  if (!*fmap)
+    goto out;
+  for (size_t i = 0; i < nfiles; i++) {
+    const char *dir = fdirs[i] < ndirs ? dpaths[fdirs[i]] : NULL;
+    (*fmap)[i] = (uint32_t)lt->nfiles;
+    if (_push_file(lt, dir, fpaths[i]) != 0)
+      goto out;
+  }
+  *nfmap = nfiles;
+  ret = 0;
+
+out:
+  free(dpaths);
+  free(ddirs);
+  free(fpaths);
+  free(fdirs);
+  return ret;
+}
+
+// line programs
+
+typedef struct {
+  line_row_t *v;
+  size_t n;
+  size_t cap;
+} row_vec_t;
+
+static int _push_row(row_vec_t *vec, uint64_t addr, uint32_t file,
+                     uint32_t line) {
+  if (vec->n == vec->cap) {
+    size_t cap = vec->cap ? vec->cap * 2 : 256;
+    line_row_t *tmp = realloc(vec->v, cap * sizeof(*tmp));
+    if (!tmp)
+      return -1; // allocation err
+    vec->v = tmp;
+    vec->cap = cap;
+  }
+  vec->v[vec->n++] = (line_row_t){.addr = addr, .file = file, .line = line};
+  return 0;
+}
+
+// addresses the linker gave up on, code that was dead stripped
+static bool _dead(uint64_t addr) {
+  return addr == 0 || addr >= 0xfffffffffffffffeULL;
+}
+
+// runs the unit's program, rows go to out with their file through fmap,
+// without out only the span of the live sequences is worked out
+static int _run(const unit_header_t *h, const uint32_t *fmap, size_t nfmap,
+                uint32_t unknown, row_vec_t *out, uint64_t *lo,
+                uint64_t *hi) {
+  reader_t r = h->program;
+  uint64_t addr = 0, file = 1, line = 1;
+  bool live = false;
+  *lo = UINT64_MAX;
+  *hi = 0;
+
+  while (r.p < r.end && !r.bad) {
+    uint8_t op = (uint8_t)_u(&r, 1);
+    bool emit = false, end_seq = false;
+
+    if (op >= h->opcode_base) {
+      uint8_t adj = op - h->opcode_base;
+      addr += (uint64_t)(adj / h->line_range) * h->min_insn;
+      line += (int64_t)h->line_base + adj % h->line_range;
+      emit = true;
+    } else if (op == 0) {
+      uint64_t len = _uleb(&r);
+      if (r.bad || len == 0 || len > (uint64_t)(r.end - r.p))
+        break;
+      reader_t ext = {.p = r.p, .end = r.p + len};
+      r.p += len;
+      uint8_t sub = (uint8_t)_u(&ext, 1);
+      if (sub == DW_LNE_end_sequence) {
+        end_seq = true;
+      } else if (sub == DW_LNE_set_address && len - 1 <= 8) {
+        addr = _u(&ext, (size_t)(len - 1));
+        live = !_dead(addr);
+      }
+    } else if (op == DW_LNS_copy) {
+      emit = true;
+    } else if (op == DW_LNS_advance_pc) {
+      addr += _uleb(&r) * h->min_insn;
+    } else if (op == DW_LNS_advance_line) {
+      line += (uint64_t)_sleb(&r);
+    } else if (op == DW_LNS_set_file) {
+      file = _uleb(&r);
+    } else if (op == DW_LNS_const_add_pc) {
+      addr += (uint64_t)((255 - h->opcode_base) / h->line_range) * h->min_insn;
+    } else if (op == DW_LNS_fixed_advance_pc) {
+      addr += _u(&r, 2);
+    } else {
+      // column, stmt, basic block, prologue and isa changes don't matter
+      // here, nor does anything newer than we know
+      for (uint8_t i = 0; i < h->opcode_lengths[op]; i++)
+        _uleb(&r);
+    }
+
+    if ((emit || end_seq) && live) {
+      if (addr < *lo)
+        *lo = addr;
+      if (addr > *hi)
+        *hi = addr;
+      if (out) {
+        uint32_t f = file < nfmap ? fmap[file] : unknown;
+        if (_push_row(out, addr, end_seq ? LINE_FILE_END : f,
+                      end_seq ? 0 : (uint32_t)line) != 0)
+          return -1;
+      }
+    }
+    if (end_seq) {
+      addr = 0;
+      file = 1;
+      line = 1;
+      live = false;
+    }
+  }
+  return 0;
+}
+
+// by address, the end of a sequence before a row starting at the same
+// address
+static int _cmp_row(const void *a, const void *b) {
+  const line_row_t *x = a, *y = b;
+  if (x->addr != y->addr)
+    return (x->addr > y->addr) - (x->addr < y->addr);
+  return (y->file == LINE_FILE_END) - (x->file == LINE_FILE_END);
+}
+
+typedef struct {
+  uint64_t addr;
+  size_t first;
+  size_t n;
+} sequence_t;
+
+static int _cmp_sequence(const void *a, const void *b) {
+  uint64_t x = ((const sequence_t *)a)->addr;
+  uint64_t y = ((const sequence_t *)b)->addr;
+  return (x > y) - (x < y);
+}
+
+// a program's sequences may come in any order, the rows inside each are
+// already sorted, so whole sequences are put in address order
+static int _order(row_vec_t *vec) {
+  size_t nseq = 0;
+  for (size_t i = 0; i < vec->n; i++)
+    nseq += vec->v[i].file == LINE_FILE_END || i + 1 == vec->n;
+  sequence_t *seq = malloc(nseq * sizeof(*seq));
+  line_row_t *rows = malloc(vec->n * sizeof(*rows));
+  if (!seq || !rows) {
+    free(seq);
+    free(rows);
+    return -1; // allocation err
+  }
+
+  size_t k = 0, first = 0;
+  for (size_t i = 0; i < vec->n; i++) {
+    if (vec->v[i].file != LINE_FILE_END && i + 1 != vec->n)
+      continue;
+    seq[k++] = (sequence_t){
+        .addr = vec->v[first].addr, .first = first, .n = i + 1 - first};
+    first = i + 1;
+  }
+  qsort(seq, nseq, sizeof(*seq), _cmp_sequence);
+
+  k = 0;
+  for (size_t i = 0; i < nseq; i++) {
+    memcpy(&rows[k], &vec->v[seq[i].first], seq[i].n * sizeof(*rows));
+    k += seq[i].n;
+  }
+  free(seq);
+  free(vec->v);
+  vec->v = rows;
+  vec->cap = vec->n;
+  return 0;
+}
+
+// rows of unit u, merged into the flat array
+static int _decode(line_table_t *lt, size_t u) {
+  lt->units[u].decoded = true;
+  lt->decoded++;
+
+  unit_header_t h;
+  uint64_t next;
+  if (_header(lt, lt->units[u].offset, &h, &next) != 0)
+    return -1;
+  uint32_t *fmap = NULL;
+  size_t nfmap = 0;
+  if (_files(lt, &h, &fmap, &nfmap) != 0) {
+    free(fmap);
+    fmap = NULL;
+    nfmap = 0;
+  }
+  uint32_t unknown = (uint32_t)lt->nfiles;
+  if (_push_file(lt, NULL, "?") != 0) {
+    free(fmap);
+    return -1;
+  }
+
+  row_vec_t vec = {0};
+  uint64_t lo, hi;
+  int ret = _run(&h, fmap, nfmap, unknown, &vec, &lo, &hi);
+  free(fmap);
+  if (ret != 0 || vec.n == 0) {
+    free(vec.v);
+    return ret;
+  }
+
+  if (_order(&vec) != 0) {
+    free(vec.v);
+    return -1;
+  }
+  // of rows at one address the last one holds, then rows that don't
+  // change the file or line go
+  size_t m = 0;
+  for (size_t i = 0; i < vec.n; i++) {
+    const line_row_t *r = &vec.v[i];
+    if (i + 1 < vec.n && vec.v[i + 1].addr == r->addr)
+      continue;
+    if (m && r->file != LINE_FILE_END && vec.v[m - 1].file == r->file &&
+        vec.v[m - 1].line == r->line)
+      continue;
+    vec.v[m++] = *r;
+  }
+
+  line_row_t *rows = malloc((lt->nrows + m) * sizeof(*rows));
+  if (!rows) {
+    free(vec.v);
+    return -1; // allocation err
+  }
+  size_t i = 0, j = 0, k = 0;
+  while (i < lt->nrows || j < m) {
+    if (j == m || (i < lt->nrows && _cmp_row(&lt->rows[i], &vec.v[j]) <= 0))
+      rows[k++] = lt->rows[i++];
+    else
+      rows[k++] = vec.v[j++];
+  }
+  free(vec.v);
+  free(lt->rows);
+  lt->rows = rows;
+  lt->nrows = k;
+  lt->rows_cap = k;
+
+  // nothing left to read from the file
+  if (lt->decoded == lt->nunits && lt->map) {
+    munmap(lt->map, lt->map_size);
+    lt->map = NULL;
+  }
+  return 0;
+}
+
+// the file
+
+static uint32_t _be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static uint64_t _be64(const uint8_t *p) {
+  return (uint64_t)_be32(p) << 32 | _be32(p + 4);
+}
+
+// the arm64 slice of a universal file, or the whole buffer of a thin one
+static int _slice(const uint8_t **data, size_t *size) {
+  if (*size < 8)
+    return -1;
+  uint32_t magic = _be32(*data);
+  if (magic != MO_FAT_MAGIC && magic != MO_FAT_MAGIC_64)
+    return 0;
+
+  bool wide = magic == MO_FAT_MAGIC_64;
+  size_t arch_size = wide ? 32 : 20;
+  uint32_t n = _be32(*data + 4);
+  for (uint32_t i = 0; i < n; i++) {
+    size_t at = 8 + (size_t)i * arch_size;
+    if (at + arch_size > *size)
+      return -1;
+    const uint8_t *fa = *data + at;
+    if (_be32(fa) != MO_CPU_TYPE_ARM64)
+      continue;
+    uint64_t off = wide ? _be64(fa + 8) : _be32(fa + 8);
+    uint64_t len = wide ? _be64(fa + 16) : _be32(fa + 12);
+    if (off > *size || len > *size - off)
+      return -1;
+    *data += off;
+    *size = len;
+    return 0;
+  }
+  return -1;
+}
+
+static uint32_t _le32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t _le64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// the __DWARF sections and LC_UUID of a 64 bit mach-o
+static int _sections(line_table_t *lt, const uint8_t *mo, size_t size) {
+  if (size < MO_HEADER_SIZE || _le32(mo) != MO_MH_MAGIC_64)
+    return -1;
+  uint32_t ncmds = _le32(mo + 16);
+  uint32_t sizeofcmds = _le32(mo + 20);
+  if (sizeofcmds > size - MO_HEADER_SIZE)
+    return -1;
+
+  const uint8_t *cmds = mo + MO_HEADER_SIZE;
+  uint32_t off = 0;
+  for (uint32_t i = 0; i < ncmds && off + 8 <= sizeofcmds; i++) {
+    const uint8_t *lc = cmds + off;
+    uint32_t cmd = _le32(lc), cmdsize = _le32(lc + 4);
+    if (cmdsize < 8 || cmdsize > sizeofcmds - off)
+      break;
+    off += cmdsize;
+
+    if (cmd == MO_LC_UUID && cmdsize >= 24) {
+      memcpy(lt->uuid, lc + 8, sizeof(lt->uuid));
+      continue;
+    }
+    if (cmd != MO_LC_SEGMENT_64 || cmdsize < MO_SEGMENT_SIZE ||
+        strncmp((const char *)lc + 8, "__DWARF", 16) != 0)
+      continue;
+    uint32_t nsects = _le32(lc + 64);
+    if (nsects > (cmdsize - MO_SEGMENT_SIZE) / MO_SECTION_SIZE)
+      continue;
+    for (uint32_t s = 0; s < nsects; s++) {
+      const uint8_t *sect = lc + MO_SEGMENT_SIZE + s * MO_SECTION_SIZE;
+      uint64_t sect_size = _le64(sect + 40);
+      uint32_t sect_off = _le32(sect + 48);
+      if (sect_off > size || sect_size > size - sect_off)
+        continue;
+      const char *name = (const char *)sect;
+      if (strncmp(name, "__debug_line", 16) == 0) {
+        lt->line = mo + sect_off;
+        lt->line_size = sect_size;
+      } else if (strncmp(name, "__debug_line_str", 16) == 0) {
+        lt->line_str = mo + sect_off;
+        lt->line_str_size = sect_size;
+      } else if (strncmp(name, "__debug_str", 16) == 0) {
+        lt->str = mo + sect_off;
+        lt->str_size = sect_size;
+      }
+    }
+  }
+  return lt->line ? 0 : -1;
+}
+
+static int _cmp_unit(const void *a, const void *b) {
+  uint64_t x = ((const line_unit_t *)a)->lo;
+  uint64_t y = ((const line_unit_t *)b)->lo;
+  return (x > y) - (x < y);
+}
+
+// the span of every unit, programs are run but nothing is kept
+static int _scan(line_table_t *lt) {
+  size_t cap = 0;
+  uint64_t off = 0;
+  while (off < lt->line_size) {
+    unit_header_t h;
+    uint64_t next, lo, hi;
+    int ok = _header(lt, off, &h, &next);
+    if (next == 0)
+      break;
+    if (ok == 0 && _run(&h, NULL, 0, 0, NULL, &lo, &hi) == 0 && lo <= hi) {
+      if (lt->nunits == cap) {
+        cap = cap ? cap * 2 : 64;
+        line_unit_t *tmp = realloc(lt->units, cap * sizeof(*tmp));
+        if (!tmp)
+          return -1; // allocation err
+        lt->units = tmp;
+      }
+      lt->units[lt->nunits++] =
+          (line_unit_t){.lo = lo, .hi = hi, .offset = off};
+    }
+    off = next;
+  }
+
+  if (lt->nunits == 0)
+    return -1;
+  qsort(lt->units, lt->nunits, sizeof(*lt->units), _cmp_unit);
+  lt->max_hi = malloc(lt->nunits * sizeof(*lt->max_hi));
+  if (!lt->max_hi)
+    return -1; // allocation err
+  for (size_t i = 0; i < lt->nunits; i++) {
+    uint64_t hi = lt->units[i].hi;
+    lt->max_hi[i] = i && lt->max_hi[i - 1] > hi ? lt->max_hi[i - 1] : hi;
+  }
+  return 0;
+}
+
+int line_table_open(line_table_t *lt, const char *path, uint64_t slide) {
+  memset(lt, 0, sizeof(*lt));
+  lt->slide = slide;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct stat sb;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &sb) == 0 && sb.st_size > 0)
+    map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+  lt->map = map;
+  lt->map_size = (size_t)sb.st_size;
+
+  const uint8_t *mo = map;
+  size_t size = lt->map_size;
+  if (_slice(&mo, &size) != 0 || _sections(lt, mo, size) != 0 ||
+      _scan(lt) != 0) {
+    line_table_free(lt);
+    return -1;
+  }
+  return 0;
+}
+
+void line_table_free(line_table_t *lt) {
+  if (lt->map)
+    munmap(lt->map, lt->map_size);
+  for (size_t i = 0; i < lt->nfiles; i++)
+    free(lt->files[i]);
+  free(lt->files);
+  free(lt->units);
+  free(lt->max_hi);
+  free(lt->rows);
+  memset(lt, 0, sizeof(*lt));
+}
+
+int line_table_lookup(line_table_t *lt, uint64_t addr, line_entry_t *out) {
+  uint64_t a = addr - lt->slide;
+
+  // units starting at or below a, walked back while one of them may still
+  // reach past it
+  size_t lo = 0, hi = lt->nunits;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (lt->units[mid].lo <= a)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (size_t i = lo; i > 0 && lt->max_hi[i - 1] > a; i--) {
+    line_unit_t *u = &lt->units[i - 1];
+    if (!u->decoded && a < u->hi)
+      _decode(lt, i - 1);
+  }
+
+  lo = 0;
+  hi = lt->nrows;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (lt->rows[mid].addr <= a)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0 || lo == lt->nrows)
+    return -1;
+  const line_row_t *row = &lt->rows[lo - 1];
+  if (row->file == LINE_FILE_END || row->file >= lt->nfiles)
+    return -1;
+
+  out->file = lt->files[row->file];
+  out->line = row->line;
+  out->start = row->addr + lt->slide;
+  out->end = lt->rows[lo].addr + lt->slide;
+  return 0;
+}
@@ -0,0 +1,698 @@
+// linux target backend
+// ptrace(PTRACE_SEIZE) for control, process_vm_readv/writev for memory and
+// waitpid for events, this is what lets the shared debugger logic run on
+// our linux ci machines
+#ifdef __linux__
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // process_vm_readv
+#endif
+
+#include "target/target.h"
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __aarch64__
+#include <asm/ptrace.h>
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#ifndef TRAP_HWBKPT
+#define TRAP_HWBKPT 4
+#endif
+
+// older glibc only has the union member
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// interrupts a blocking waitpid once wait_event's timeout is up
+#define WAIT_TIMEOUT_SIGNAL SIGURG
+
+typedef struct {
+  pid_t tid;
+  bool stopped;
+  bool step;        // mdscr_el1.SS was set, resume with PTRACE_SINGLESTEP
+  bool starting;    // cloned, its first PTRACE_EVENT_STOP is not reaped yet
+  bool interrupted; // PTRACE_INTERRUPT sent, its PTRACE_EVENT_STOP is not
+                    // reaped yet
+  int signo;        // signal the thread stopped with, delivered on resume
+} linux_thread_t;
+
+static pid_t target_pid = 0;
+static int mem_fd = -1;
+static linux_thread_t *threads = NULL;
+static size_t thread_count = 0;
+static size_t thread_capacity = 0;
+
+// stops reaped by suspend that were not its interrupt, wait_event reports
+// them before anything new, oldest first
+typedef struct {
+  pid_t tid;
+  int status;
+} pending_stop_t;
+
+static pending_stop_t *pending = NULL;
+static size_t pending_count = 0;
+static size_t pending_capacity = 0;
+
+static linux_thread_t *_find_thread(pid_t tid) {
+  for (size_t i = 0; i < thread_count; i++) {
+    if (threads[i].tid == tid)
+      return &threads[i];
+  }
+  return NULL;
+}
+
+static linux_thread_t *_add_thread(pid_t tid) {
+  linux_thread_t *t = _find_thread(tid);
+  if (t)
+    return t;
+
+  if (thread_count == thread_capacity) {
+    size_t new_cap = thread_capacity ? thread_capacity * 2 : 16;
+    linux_thread_t *tmp = realloc(threads, new_cap * sizeof(*threads));
+    if (!tmp)
+      return NULL;
+    threads = tmp;
+    thread_capacity = new_cap;
+  }
+
+  t = &threads[thread_count++];
+  *t = (linux_thread_t){.tid = tid};
+  return t;
+}
+
+static void _remove_thread(pid_t tid) {
+  for (size_t i = 0; i < thread_count; i++) {
+    if (threads[i].tid == tid) {
+      threads[i] = threads[--thread_count];
+      return;
+    }
+  }
+}
+
+// seize every task currently listed in /proc/<pid>/task, new ones are
+// picked up through PTRACE_O_TRACECLONE
+static int _seize_all(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/task", pid);
+  DIR *dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "[-] linux_attach: opendir(%s): %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+
+  struct dirent *ent;
+  int ret = 0;
+  while ((ent = readdir(dir)) != NULL) {
+    if (ent->d_name[0] == '.')
+      continue;
+    pid_t tid = (pid_t)atoi(ent->d_name);
+    if (_find_thread(tid))
+      continue;
+    if (ptrace(PTRACE_SEIZE, tid, NULL,
+               (void *)(long)(PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXIT)) !=
+        0) {
+      fprintf(stderr, "[-] linux_attach: PTRACE_SEIZE(%d): %s\n", tid,
+              strerror(errno));
+      ret = -1;
+      continue;
+    }
+    if (!_add_thread(tid)) {
+      ret = -1;
+      break;
+    }
+  }
+  closedir(dir);
+  return ret;
+}
+
+static int linux_attach(pid_t pid) {
+  target_pid = pid;
+  thread_count = 0;
+  pending_count = 0;
+
+  if (_seize_all(pid) != 0 && thread_count == 0)
+    return -1;
+
+  // /proc/<pid>/mem is the write path of last resort, it ignores page
+  // protections so it is what lets us patch text
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/mem", pid);
+  mem_fd = open(path, O_RDWR | O_CLOEXEC);
+  if (mem_fd < 0) {
+    fprintf(stderr, "[!] linux_attach: open(%s): %s\n", path,
+            strerror(errno));
+  }
+
+  printf("[+] Seized %zu threads of PID %d\n", thread_count, pid);
+  return 0;
+}
+
+static int _queue_pending(pid_t tid, int status) {
+  if (pending_count == pending_capacity) {
+    size_t new_cap = pending_capacity ? pending_capacity * 2 : 16;
+    pending_stop_t *tmp = realloc(pending, new_cap * sizeof(*pending));
+    if (!tmp)
+      return -1;
+    pending = tmp;
+    pending_capacity = new_cap;
+  }
+  pending[pending_count++] = (pending_stop_t){.tid = tid, .status = status};
+  return 0;
+}
+
+// reap the stop for one tid after PTRACE_INTERRUPT
+// - its PTRACE_EVENT_STOP is the interrupt, the thread is stopped
+// - anything else (a signal, a breakpoint, a clone or exit event) got
+//   there first, the thread is stopped in that stop instead and the
+//   interrupt only surfaces once it runs again, so the status is queued
+//   for wait_event and the interrupt stop is swallowed when it comes
+static int _wait_stopped(pid_t tid) {
+  for (;;) {
+    int status;
+    pid_t got = waitpid(tid, &status, __WALL);
+    if (got < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      _remove_thread(got);
+      return -1;
+    }
+    if (!WIFSTOPPED(status))
+      continue;
+
+    linux_thread_t *t = _find_thread(got);
+    if (t) {
+      t->stopped = true;
+      t->starting = false;
+    }
+    if (status >> 16 == PTRACE_EVENT_STOP) {
+      if (t)
+        t->interrupted = false;
+      return 0;
+    }
+    if (_queue_pending(got, status) != 0)
+      return -1;
+    return 0;
+  }
+}
+
+static int linux_suspend(void) {
+  int ret = 0;
+  for (size_t i = 0; i < thread_count; i++) {
+    if (threads[i].stopped)
+      continue;
+    if (ptrace(PTRACE_INTERRUPT, threads[i].tid, NULL, NULL) != 0) {
+      ret = -1;
+      continue;
+    }
+    threads[i].interrupted = true;
+  }
+  for (size_t i = 0; i < thread_count;) {
+    pid_t tid = threads[i].tid;
+    if (!threads[i].stopped && _wait_stopped(tid) != 0)
+      ret = -1;
+    // a thread that exited meanwhile was swapped for the last one
+    if (i < thread_count && threads[i].tid == tid)
+      i++;
+  }
+  return ret;
+}
+
+// a thread has to be in a ptrace stop to be detached, PTRACE_DETACH on a
+// running one fails with ESRCH and leaves it traced, so everything is
+// interrupted first
+static int linux_detach(void) {
+  int ret = 0;
+  // threads that exit meanwhile drop out of the list
+  linux_suspend();
+  for (size_t i = 0; i < thread_count; i++) {
+    if (ptrace(PTRACE_DETACH, threads[i].tid, NULL, NULL) != 0) {
+      fprintf(stderr, "[-] linux_detach: PTRACE_DETACH(%d): %s\n",
+              threads[i].tid, strerror(errno));
+      ret = -1;
+    }
+  }
+  thread_count = 0;
+  pending_count = 0;
+  if (mem_fd >= 0) {
+    close(mem_fd);
+    mem_fd = -1;
+  }
+  target_pid = 0;
+  return ret;
+}
+
+static int linux_resume(void) {
+  int ret = 0;
+  for (size_t i = 0; i < thread_count; i++) {
+    linux_thread_t *t = &threads[i];
+    if (!t->stopped)
+      continue;
+    long req = t->step ? PTRACE_SINGLESTEP : PTRACE_CONT;
+    if (ptrace(req, t->tid, NULL, (void *)(long)t->signo) != 0) {
+      fprintf(stderr, "[-] linux_resume: ptrace(%d): %s\n", t->tid,
+              strerror(errno));
+      ret = -1;
+      continue;
+    }
+    t->stopped = false;
+    t->signo = 0;
+  }
+  return ret;
+}
+
+// read_vectored
+// the whole request goes to the kernel as one process_vm_readv per
+// IOV_MAX entries, the kernel stops at the first bad remote range so on a
+// short read we mark that entry failed and carry on from the next one
+static int linux_read_vectored(target_iovec_t *iov, size_t count) {
+  struct iovec local[IOV_MAX];
+  struct iovec remote[IOV_MAX];
+  int ret = 0;
+
+  size_t i = 0;
+  while (i < count) {
+    size_t n = count - i;
+    if (n > IOV_MAX)
+      n = IOV_MAX;
+
+    for (size_t j = 0; j < n; j++) {
+      local[j].iov_base = iov[i + j].buf;
+      local[j].iov_len = iov[i + j].size;
+      remote[j].iov_base = (void *)(uintptr_t)iov[i + j].addr;
+      remote[j].iov_len = iov[i + j].size;
+    }
+
+    ssize_t got = process_vm_readv(target_pid, local, n, remote, n, 0);
+    size_t done = got > 0 ? (size_t)got : 0;
+
+    // walk the batch, every entry fully inside `done` succeeded
+    size_t j = 0;
+    for (; j < n && done >= iov[i + j].size; j++) {
+      iov[i + j].status = 0;
+      done -= iov[i + j].size;
+    }
+
+    if (j == n) {
+      i += n;
+      continue;
+    }
+
+    // entry j is where the kernel gave up
+    iov[i + j].status = -1;
+    ret = -1;
+    i += j + 1;
+  }
+
+  return ret;
+}
+
+static int linux_read(uint64_t addr, void *out, size_t size) {
+  target_iovec_t iov = {.addr = addr, .buf = out, .size = size};
+  return linux_read_vectored(&iov, 1);
+}
+
+// process_vm_writev respects page protections, so text writes (software
+// breakpoints) fall back to /proc/<pid>/mem which does not
+static int linux_write(uint64_t addr, const void *in, size_t size) {
+  struct iovec local = {.iov_base = (void *)in, .iov_len = size};
+  struct iovec remote = {.iov_base = (void *)(uintptr_t)addr,
+                         .iov_len = size};
+
+  ssize_t wrote = process_vm_writev(target_pid, &local, 1, &remote, 1, 0);
+  if (wrote == (ssize_t)size)
+    return 0;
+
+  if (mem_fd < 0)
+    return -1;
+
+  wrote = pwrite(mem_fd, in, size, (off_t)addr);
+  if (wrote != (ssize_t)size) {
+    fprintf(stderr, "[-] linux_write: 0x%llx: %s\n", (unsigned long long)addr,
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int linux_threads(target_thread_t **out, size_t *count) {
+  *out = NULL;
+  *count = 0;
+  if (thread_count == 0)
+    return -1;
+
+  target_thread_t *list = malloc(thread_count * sizeof(*list));
+  if (!list)
+    return -1;
+  for (size_t i = 0; i < thread_count; i++)
+    list[i] = (target_thread_t)threads[i].tid;
+
+  *out = list;
+  *count = thread_count;
+  return 0;
+}
+
+#ifdef __aarch64__
+
+static int linux_get_regs(target_thread_t thread, target_regs_t *out) {
+  struct user_pt_regs regs;
+  struct iovec io = {.iov_base = &regs, .iov_len = sizeof(regs)};
+  if (ptrace(PTRACE_GETREGSET, (pid_t)thread, (void *)NT_PRSTATUS, &io) != 0)
+    return -1;
+
+  memcpy(out->x, regs.regs, sizeof(out->x));
+  out->fp = regs.regs[29];
+  out->lr = regs.regs[30];
+  out->sp = regs.sp;
+  out->pc = regs.pc;
+  out->cpsr = (uint32_t)regs.pstate;
+  return 0;
+}
+
+static int linux_set_regs(target_thread_t thread, const target_regs_t *in) {
+  struct user_pt_regs regs;
+  struct iovec io = {.iov_base = &regs, .iov_len = sizeof(regs)};
+  if (ptrace(PTRACE_GETREGSET, (pid_t)thread, (void *)NT_PRSTATUS, &io) != 0)
+    return -1;
+
+  memcpy(regs.regs, in->x, sizeof(in->x));
+  regs.regs[29] = in->fp;
+  regs.regs[30] = in->lr;
+  regs.sp = in->sp;
+  regs.pc = in->pc;
+  regs.pstate = in->cpsr;
+  return ptrace(PTRACE_SETREGSET, (pid_t)thread, (void *)NT_PRSTATUS, &io);
+}
+
+// linux splits the debug registers into two regsets and keeps the control
+// word 32 bits wide, the low bits line up with BCR/WCR so we pass them on
+static int _get_hwdebug(pid_t tid, int type, uint64_t *vr, uint64_t *cr) {
+  struct user_hwdebug_state st;
+  struct iovec io = {.iov_base = &st, .iov_len = sizeof(st)};
+  if (ptrace(PTRACE_GETREGSET, tid, (void *)(long)type, &io) != 0)
+    return -1;
+
+  unsigned slots = st.dbg_info & 0xff;
+  for (unsigned i = 0; i < TARGET_DEBUG_REG_MAX; i++) {
+    vr[i] = i < slots ? st.dbg_regs[i].addr : 0;
+    cr[i] = i < slots ? st.dbg_regs[i].ctrl : 0;
+  }
+  return 0;
+}
+
+static int _set_hwdebug(pid_t tid, int type, const uint64_t *vr,
+                        const uint64_t *cr) {
+  struct user_hwdebug_state st;
+  struct iovec io = {.iov_base = &st, .iov_len = sizeof(st)};
+  if (ptrace(PTRACE_GETREGSET, tid, (void *)(long)type, &io) != 0)
+    return -1;
+
+  unsigned slots = st.dbg_info & 0xff;
+  for (unsigned i = 0; i < slots && i < TARGET_DEBUG_REG_MAX; i++) {
+    st.dbg_regs[i].addr = vr[i];
+    st.dbg_regs[i].ctrl = (uint32_t)cr[i];
+  }
+  io.iov_len = offsetof(struct user_hwdebug_state, dbg_regs) +
+               slots * sizeof(st.dbg_regs[0]);
+  return ptrace(PTRACE_SETREGSET, tid, (void *)(long)type, &io);
+}
+
+static int linux_get_debug_regs(target_thread_t thread,
+                                target_debug_state_t *out) {
+  *out = (target_debug_state_t){0};
+  if (_get_hwdebug((pid_t)thread, NT_ARM_HW_BREAK, out->bvr, out->bcr) != 0)
+    return -1;
+  if (_get_hwdebug((pid_t)thread, NT_ARM_HW_WATCH, out->wvr, out->wcr) != 0)
+    return -1;
+
+  linux_thread_t *t = _find_thread((pid_t)thread);
+  if (t && t->step)
+    out->mdscr_el1 |= 1ULL;
+  return 0;
+}
+
+static int linux_set_debug_regs(target_thread_t thread,
+                                const target_debug_state_t *in) {
+  if (_set_hwdebug((pid_t)thread, NT_ARM_HW_BREAK, in->bvr, in->bcr) != 0)
+    return -1;
+  if (_set_hwdebug((pid_t)thread, NT_ARM_HW_WATCH, in->wvr, in->wcr) != 0)
+    return -1;
+
+  // userspace cannot touch mdscr_el1, the single step bit becomes a
+  // PTRACE_SINGLESTEP on the next resume instead
+  linux_thread_t *t = _find_thread((pid_t)thread);
+  if (t)
+    t->step = (in->mdscr_el1 & 1ULL) != 0;
+  return 0;
+}
+
+#else
+
+// the debugger only understands arm64 register state, on other hosts the
+// memory and control paths still work which is enough for benchmarking
+static int linux_get_regs(target_thread_t thread, target_regs_t *out) {
+  (void)thread;
+  (void)out;
+  errno = ENOSYS;
+  return -1;
+}
+
+static int linux_set_regs(target_thread_t thread, const target_regs_t *in) {
+  (void)thread;
+  (void)in;
+  errno = ENOSYS;
+  return -1;
+}
+
+static int linux_get_debug_regs(target_thread_t thread,
+                                target_debug_state_t *out) {
+  (void)thread;
+  (void)out;
+  errno = ENOSYS;
+  return -1;
+}
+
+static int linux_set_debug_regs(target_thread_t thread,
+                                const target_debug_state_t *in) {
+  (void)thread;
+  (void)in;
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
+
+static target_event_kind_t _classify_trap(pid_t tid) {
+  siginfo_t si;
+  if (ptrace(PTRACE_GETSIGINFO, tid, NULL, &si) != 0)
+    return TARGET_EVENT_SIGNAL;
+  switch (si.si_code) {
+  case TRAP_BRKPT:
+  case TRAP_HWBKPT:
+    return TARGET_EVENT_BREAKPOINT;
+  case TRAP_TRACE:
+    return TARGET_EVENT_STEP;
+  default:
+    return TARGET_EVENT_SIGNAL;
+  }
+}
+
+// wait_event's timeout
+// waitpid has none, so a timer aimed at the waiting thread interrupts it,
+// the handler does nothing and is installed without SA_RESTART, the timer
+// keeps firing every millisecond after the deadline in case the first one
+// lands just before waitpid blocks
+static __thread volatile sig_atomic_t timed_out;
+
+static void _on_wait_timeout(int sig) {
+  (void)sig;
+  timed_out = 1;
+}
+
+static int _arm_timeout(timer_t *timer, int timeout_ms) {
+  static bool installed = false;
+  if (!installed) {
+    struct sigaction sa = {.sa_handler = _on_wait_timeout};
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(WAIT_TIMEOUT_SIGNAL, &sa, NULL) != 0)
+      return -1;
+    installed = true;
+  }
+
+  struct sigevent sev = {.sigev_notify = SIGEV_THREAD_ID,
+                         .sigev_signo = WAIT_TIMEOUT_SIGNAL};
+  sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+  if (timer_create(CLOCK_MONOTONIC, &sev, timer) != 0)
+    return -1;
+
+  struct itimerspec its = {
+      .it_value = {.tv_sec = timeout_ms / 1000,
+                   .tv_nsec = (long)(timeout_ms % 1000) * 1000000},
+      .it_interval = {.tv_sec = 0, .tv_nsec = 1000000},
+  };
+  if (timer_settime(*timer, 0, &its, NULL) != 0) {
+    timer_delete(*timer);
+    return -1;
+  }
+  return 0;
+}
+
+// what one waitpid status means, 0 with out filled in if it is an event
+// to report, 1 if it was dealt with here
+static int _on_status(pid_t tid, int status, target_event_t *out) {
+  *out = (target_event_t){.thread = (target_thread_t)tid};
+
+  if (WIFEXITED(status) || WIFSIGNALED(status)) {
+    _remove_thread(tid);
+    if (tid != target_pid)
+      return 1;
+    out->kind = TARGET_EVENT_EXITED;
+    out->status = status;
+    return 0;
+  }
+
+  if (!WIFSTOPPED(status))
+    return 1;
+
+  int event = status >> 16;
+  linux_thread_t *t = _find_thread(tid);
+  // a new thread's first stop, it can arrive before or after the clone
+  // event that announces it, either way it just runs, and so does the
+  // late interrupt stop of a thread suspend found in another stop
+  if (event == PTRACE_EVENT_STOP && (!t || t->starting || t->interrupted)) {
+    if (!t)
+      t = _add_thread(tid);
+    long req = PTRACE_CONT;
+    if (t) {
+      t->starting = false;
+      t->interrupted = false;
+      if (t->step)
+        req = PTRACE_SINGLESTEP;
+    }
+    ptrace(req, tid, NULL, NULL);
+    return 1;
+  }
+
+  if (!t)
+    t = _add_thread(tid);
+  if (t)
+    t->stopped = true;
+
+  if (event == PTRACE_EVENT_CLONE) {
+    // the new thread starts seized with a stop of its own still to
+    // come, it is continued when that is reaped above, the parent
+    // carries on now
+    unsigned long new_tid = 0;
+    ptrace(PTRACE_GETEVENTMSG, tid, NULL, &new_tid);
+    if (!_find_thread((pid_t)new_tid)) {
+      linux_thread_t *nt = _add_thread((pid_t)new_tid);
+      if (nt)
+        nt->starting = true;
+      t = _find_thread(tid); // _add_thread may have moved it
+    }
+    long req = t && t->step ? PTRACE_SINGLESTEP : PTRACE_CONT;
+    ptrace(req, tid, NULL, NULL);
+    if (t)
+      t->stopped = false;
+    return 1;
+  }
+
+  out->signo = WSTOPSIG(status);
+  if (out->signo == SIGTRAP && event == 0)
+    out->kind = _classify_trap(tid);
+  else
+    out->kind = TARGET_EVENT_SIGNAL;
+  // a signal delivery stop holds the signal back, it goes to the thread
+  // with the resume rather than being dropped
+  if (t && event == 0 && out->signo != SIGTRAP)
+    t->signo = out->signo;
+
+  target_regs_t regs;
+  if (linux_get_regs(out->thread, &regs) == 0)
+    out->pc = regs.pc;
+  return 0;
+}
+
+static int _wait_event(target_event_t *out, int flags) {
+  // what suspend reaped in place of its interrupts goes first
+  while (pending_count) {
+    pending_stop_t p = pending[0];
+    memmove(&pending[0], &pending[1], (pending_count - 1) * sizeof(*pending));
+    pending_count--;
+    if (_on_status(p.tid, p.status, out) == 0)
+      return 0;
+  }
+
+  // a busy target can keep waitpid returning events we swallow
+  while (!timed_out) {
+    int status;
+    pid_t tid = waitpid(-1, &status, flags);
+    if (tid < 0) {
+      if (errno == EINTR && !timed_out)
+        continue;
+      return -1;
+    }
+    if (tid == 0)
+      return -1; // WNOHANG and nothing pending
+    if (_on_status(tid, status, out) == 0)
+      return 0;
+  }
+  return -1;
+}
+
+// one blocking waitpid, no polling
+static int linux_wait_event(target_event_t *out, int timeout_ms) {
+  timed_out = 0;
+  if (timeout_ms == 0)
+    return _wait_event(out, __WALL | WNOHANG);
+  if (timeout_ms < 0)
+    return _wait_event(out, __WALL);
+
+  timer_t timer;
+  if (_arm_timeout(&timer, timeout_ms) != 0)
+    return -1;
+  int ret = _wait_event(out, __WALL);
+  timer_delete(timer);
+  return ret;
+}
+
+const target_backend_t linux_backend = {
+    .name = "linux",
+    .attach = linux_attach,
+    .detach = linux_detach,
+    .suspend = linux_suspend,
+    .resume = linux_resume,
+    .read = linux_read,
+    .read_vectored = linux_read_vectored,
+    .write = linux_write,
+    .threads = linux_threads,
+    .get_regs = linux_get_regs,
+    .set_regs = linux_set_regs,
+    .get_debug_regs = linux_get_debug_regs,
+    .set_debug_regs = linux_set_debug_regs,
+    .wait_event = linux_wait_event,
+};
+
+#endif
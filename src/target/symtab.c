@@ -0,0 +1,990 @@
+#include "target/symtab.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// just the mach-o pieces we read, spelled out so this builds without the
+// apple headers
+#define MO_MH_MAGIC_64 0xfeedfacfU
+#define MO_FAT_MAGIC 0xcafebabeU
+#define MO_FAT_MAGIC_64 0xcafebabfU
+#define MO_CPU_TYPE_ARM64 0x0100000cU
+
+#define MO_LC_SYMTAB 0x2U
+#define MO_LC_DYSYMTAB 0xbU
+#define MO_LC_UUID 0x1bU
+#define MO_LC_SEGMENT_64 0x19U
+#define MO_LC_DYLD_INFO 0x22U
+#define MO_LC_DYLD_INFO_ONLY 0x80000022U
+#define MO_LC_DYLD_EXPORTS_TRIE 0x80000033U
+
+#define MO_N_STAB 0xe0
+#define MO_N_TYPE 0x0e
+#define MO_N_SECT 0x0e
+
+#define MO_EXPORT_KIND_MASK 0x03
+#define MO_EXPORT_KIND_REGULAR 0x00
+#define MO_EXPORT_REEXPORT 0x08
+
+typedef struct {
+  uint32_t magic;
+  int32_t cputype;
+  int32_t cpusubtype;
+  uint32_t filetype;
+  uint32_t ncmds;
+  uint32_t sizeofcmds;
+  uint32_t flags;
+  uint32_t reserved;
+} mo_header_t;
+
+typedef struct {
+  uint32_t cmd;
+  uint32_t cmdsize;
+} mo_load_command_t;
+
+typedef struct {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  char segname[16];
+  uint64_t vmaddr;
+  uint64_t vmsize;
+  uint64_t fileoff;
+  uint64_t filesize;
+  int32_t maxprot;
+  int32_t initprot;
+  uint32_t nsects;
+  uint32_t flags;
+} mo_segment_t;
+
+typedef struct {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  uint32_t symoff;
+  uint32_t nsyms;
+  uint32_t stroff;
+  uint32_t strsize;
+} mo_symtab_t;
+
+// only the leading fields of dysymtab_command
+typedef struct {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  uint32_t ilocalsym;
+  uint32_t nlocalsym;
+  uint32_t iextdefsym;
+  uint32_t nextdefsym;
+} mo_dysymtab_t;
+
+typedef struct {
+  uint32_t n_strx;
+  uint8_t n_type;
+  uint8_t n_sect;
+  uint16_t n_desc;
+  uint64_t n_value;
+} mo_nlist_t;
+
+// blocks the export trie names are copied into, never moved once handed
+// out
+#define ARENA_BLOCK 0x10000
+
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t used;
+  char data[ARENA_BLOCK];
+} arena_block_t;
+
+// - off - where the name lands in the pool
+typedef struct {
+  uint64_t addr;
+  const char *name;
+  size_t order;
+  uint32_t off;
+} entry_t;
+
+typedef struct {
+  entry_t *v;
+  size_t count;
+  size_t cap;
+} entry_vec_t;
+
+// what the load commands told us
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  uint64_t text_vmaddr;
+  bool have_text;
+  uint64_t linkedit_vmaddr;
+  uint64_t linkedit_fileoff;
+  bool have_linkedit;
+  uint64_t start;
+  uint64_t end;
+  uint8_t uuid[16];
+  const mo_symtab_t *symtab;
+  mo_dysymtab_t dysymtab;
+  bool have_dysymtab;
+  uint32_t trie_off;
+  uint32_t trie_size;
+  // where trie_off sits in the load commands
+  const uint8_t *trie_field;
+} image_t;
+
+static int _push(entry_vec_t *vec, uint64_t addr, const char *name) {
+  if (vec->count == vec->cap) {
+    size_t cap = vec->cap ? vec->cap * 2 : 1024;
+    entry_t *tmp = realloc(vec->v, cap * sizeof(*tmp));
+    if (!tmp)
+      return -1; // allocation err
+    vec->v = tmp;
+    vec->cap = cap;
+  }
+  vec->v[vec->count] =
+      (entry_t){.addr = addr, .name = name, .order = vec->count};
+  vec->count++;
+  return 0;
+}
+
+static const char *_arena_copy(arena_block_t **arena, const char *s,
+                               size_t len) {
+  arena_block_t *b = *arena;
+  if (len + 1 > ARENA_BLOCK)
+    return NULL;
+  if (!b || b->used + len + 1 > ARENA_BLOCK) {
+    b = malloc(sizeof(*b));
+    if (!b)
+      return NULL; // allocation err
+    b->next = *arena;
+    b->used = 0;
+    *arena = b;
+  }
+  char *out = b->data + b->used;
+  memcpy(out, s, len);
+  out[len] = '\0';
+  b->used += len + 1;
+  return out;
+}
+
+static uint32_t _be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static uint64_t _be64(const uint8_t *p) {
+  return (uint64_t)_be32(p) << 32 | _be32(p + 4);
+}
+
+// the arm64 slice of a universal file, or the whole buffer of a thin one
+static int _slice(const uint8_t **data, size_t *size) {
+  if (*size < 8)
+    return -1;
+  uint32_t magic = _be32(*data);
+  if (magic != MO_FAT_MAGIC && magic != MO_FAT_MAGIC_64)
+    return 0;
+
+  bool wide = magic == MO_FAT_MAGIC_64;
+  size_t arch_size = wide ? 32 : 20;
+  uint32_t n = _be32(*data + 4);
+  for (uint32_t i = 0; i < n; i++) {
+    size_t at = 8 + (size_t)i * arch_size;
+    if (at + arch_size > *size)
+      return -1;
+    const uint8_t *fa = *data + at;
+    if (_be32(fa) != MO_CPU_TYPE_ARM64)
+      continue;
+    uint64_t off = wide ? _be64(fa + 8) : _be32(fa + 8);
+    uint64_t len = wide ? _be64(fa + 16) : _be32(fa + 12);
+    if (off > *size || len > *size - off)
+      return -1;
+    *data += off;
+    *size = len;
+    return 0;
+  }
+  return -1;
+}
+
+static int _parse(image_t *img) {
+  mo_header_t mh;
+  if (img->size < sizeof(mh))
+    return -1;
+  memcpy(&mh, img->data, sizeof(mh));
+  if (mh.magic != MO_MH_MAGIC_64 || mh.sizeofcmds > img->size - sizeof(mh))
+    return -1;
+
+  img->start = UINT64_MAX;
+  const uint8_t *cmds = img->data + sizeof(mh);
+  uint32_t off = 0;
+  for (uint32_t i = 0; i < mh.ncmds; i++) {
+    mo_load_command_t lc;
+    if (off + sizeof(lc) > mh.sizeofcmds)
+      break;
+    memcpy(&lc, cmds + off, sizeof(lc));
+    if (lc.cmdsize < sizeof(lc) || lc.cmdsize > mh.sizeofcmds - off)
+      break;
+    const uint8_t *p = cmds + off;
+
+    if (lc.cmd == MO_LC_SEGMENT_64 && lc.cmdsize >= sizeof(mo_segment_t)) {
+      mo_segment_t seg;
+      memcpy(&seg, p, sizeof(seg));
+      if (strncmp(seg.segname, "__TEXT", 16) == 0) {
+        img->text_vmaddr = seg.vmaddr;
+        img->have_text = true;
+      } else if (strncmp(seg.segname, "__LINKEDIT", 16) == 0) {
+        img->linkedit_vmaddr = seg.vmaddr;
+        img->linkedit_fileoff = seg.fileoff;
+        img->have_linkedit = true;
+      }
+      // __PAGEZERO maps nothing and __LINKEDIT holds no code or data
+      if (seg.initprot != 0 && strncmp(seg.segname, "__LINKEDIT", 16) != 0) {
+        if (seg.vmaddr < img->start)
+          img->start = seg.vmaddr;
+        if (seg.vmaddr + seg.vmsize > img->end)
+          img->end = seg.vmaddr + seg.vmsize;
+      }
+    } else if (lc.cmd == MO_LC_UUID && lc.cmdsize >= 24) {
+      memcpy(img->uuid, p + 8, sizeof(img->uuid));
+    } else if (lc.cmd == MO_LC_SYMTAB && lc.cmdsize >= sizeof(mo_symtab_t)) {
+      img->symtab = (const mo_symtab_t *)p;
+    } else if (lc.cmd == MO_LC_DYSYMTAB &&
+               lc.cmdsize >= sizeof(mo_dysymtab_t)) {
+      memcpy(&img->dysymtab, p, sizeof(img->dysymtab));
+      img->have_dysymtab = true;
+    } else if ((lc.cmd == MO_LC_DYLD_INFO ||
+                lc.cmd == MO_LC_DYLD_INFO_ONLY) &&
+               lc.cmdsize >= 48) {
+      // export_off and export_size close out dyld_info_command
+      memcpy(&img->trie_off, p + 40, 4);
+      memcpy(&img->trie_size, p + 44, 4);
+      img->trie_field = p + 40;
+    } else if (lc.cmd == MO_LC_DYLD_EXPORTS_TRIE && lc.cmdsize >= 16) {
+      memcpy(&img->trie_off, p + 8, 4);
+      memcpy(&img->trie_size, p + 12, 4);
+      img->trie_field = p + 8;
+    }
+    off += lc.cmdsize;
+  }
+
+  if (!img->have_text || img->start >= img->end)
+    return -1;
+  return 0;
+}
+
+// nlist entries [first, first + n) that define something in a section
+static int _add_nlist(const image_t *img, uint32_t first, uint32_t n,
+                      entry_vec_t *out) {
+  mo_symtab_t sc;
+  memcpy(&sc, img->symtab, sizeof(sc));
+  if (sc.symoff > img->size || sc.stroff > img->size ||
+      sc.strsize > img->size - sc.stroff)
+    return -1;
+  if (sc.nsyms > (img->size - sc.symoff) / sizeof(mo_nlist_t))
+    sc.nsyms = (uint32_t)((img->size - sc.symoff) / sizeof(mo_nlist_t));
+  if (first > sc.nsyms)
+    return 0;
+  if (n > sc.nsyms - first)
+    n = sc.nsyms - first;
+
+  const char *strtab = (const char *)img->data + sc.stroff;
+  for (uint32_t i = first; i < first + n; i++) {
+    mo_nlist_t nl;
+    memcpy(&nl, img->data + sc.symoff + (size_t)i * sizeof(nl), sizeof(nl));
+    if ((nl.n_type & MO_N_STAB) || (nl.n_type & MO_N_TYPE) != MO_N_SECT)
+      continue;
+    if (nl.n_strx == 0 || nl.n_strx >= sc.strsize)
+      continue;
+    const char *name = strtab + nl.n_strx;
+    // a name running off the end of the string table is corrupt
+    if (!memchr(name, '\0', sc.strsize - nl.n_strx))
+      continue;
+    if (_push(out, nl.n_value, name) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+static bool _uleb(const uint8_t **p, const uint8_t *end, uint64_t *out) {
+  uint64_t v = 0;
+  int shift = 0;
+  while (*p < end && shift < 64) {
+    uint8_t b = *(*p)++;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    shift += 7;
+    if (!(b & 0x80)) {
+      *out = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+// starting sizes, both grow with the trie, a wide node leaves many
+// siblings on the stack and c++ names run long
+#define TRIE_NAME_INIT 1024
+#define TRIE_STACK_INIT 128
+
+typedef struct {
+  uint64_t node;
+  size_t parent_len;
+  const char *edge;
+  size_t edge_len;
+} trie_frame_t;
+
+// depth first over the export trie, a terminal node's name is every edge
+// label on the way down, fails rather than leave exports out
+static int _walk_trie(arena_block_t **arena, const image_t *img,
+                      uint64_t base, entry_vec_t *out) {
+  const uint8_t *trie = img->data + img->trie_off;
+  const uint8_t *end = trie + img->trie_size;
+
+  // a node's edge is written into name behind its parent's prefix when it
+  // is popped, everything popped in between belongs to later siblings and
+  // only writes past that prefix
+  size_t cap = TRIE_STACK_INIT, name_cap = TRIE_NAME_INIT;
+  trie_frame_t *stack = malloc(cap * sizeof(*stack));
+  char *name = malloc(name_cap);
+  int err = -1;
+  if (!stack || !name)
+    goto out;
+  size_t depth = 0;
+  stack[depth++] = (trie_frame_t){0};
+
+  // a loop in a corrupt trie ends here
+  size_t visits = 0;
+  while (depth > 0 && visits++ < img->trie_size) {
+    depth--;
+    uint64_t node = stack[depth].node;
+    size_t len = stack[depth].parent_len + stack[depth].edge_len;
+    // edges on a real path are distinct bytes of the trie, a longer name
+    // only comes from a loop
+    if (len > img->trie_size)
+      continue;
+    if (len > name_cap) {
+      size_t grown = name_cap;
+      while (grown < len)
+        grown *= 2;
+      char *tmp = realloc(name, grown);
+      if (!tmp)
+        goto out;
+      name = tmp;
+      name_cap = grown;
+    }
+    if (stack[depth].edge_len)
+      memcpy(name + stack[depth].parent_len, stack[depth].edge,
+             stack[depth].edge_len);
+    if (node >= img->trie_size)
+      continue;
+
+    const uint8_t *p = trie + node;
+    uint64_t term_size;
+    if (!_uleb(&p, end, &term_size) || term_size > (uint64_t)(end - p))
+      continue;
+    const uint8_t *children = p + term_size;
+
+    uint64_t flags, addr;
+    if (term_size && _uleb(&p, children, &flags) &&
+        !(flags & MO_EXPORT_REEXPORT) &&
+        (flags & MO_EXPORT_KIND_MASK) == MO_EXPORT_KIND_REGULAR &&
+        _uleb(&p, children, &addr)) {
+      // a resolver's stub address comes first, that's where callers land
+      const char *copy = _arena_copy(arena, name, len);
+      if (!copy || _push(out, base + addr, copy) != 0)
+        goto out;
+    }
+
+    p = children;
+    if (p >= end)
+      continue;
+    uint8_t nchildren = *p++;
+    for (uint8_t c = 0; c < nchildren; c++) {
+      const char *edge = (const char *)p;
+      const uint8_t *nul = memchr(p, '\0', (size_t)(end - p));
+      if (!nul)
+        break;
+      size_t edge_len = (size_t)(nul - p);
+      p = nul + 1;
+      uint64_t child;
+      if (!_uleb(&p, end, &child))
+        break;
+      if (depth == cap) {
+        trie_frame_t *tmp = realloc(stack, cap * 2 * sizeof(*stack));
+        if (!tmp)
+          goto out;
+        stack = tmp;
+        cap *= 2;
+      }
+      stack[depth++] = (trie_frame_t){.node = child,
+                                      .parent_len = len,
+                                      .edge = edge,
+                                      .edge_len = edge_len};
+    }
+  }
+  err = 0;
+out:
+  free(stack);
+  free(name);
+  return err;
+}
+
+
+static void _arena_free(arena_block_t *b) {
+  while (b) {
+    arena_block_t *next = b->next;
+    free(b);
+    b = next;
+  }
+}
+
+static uint64_t _hash(const char *name) {
+  if (name[0] == '_')
+    name++;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *name; name++)
+    h = (h ^ (uint8_t)*name) * 0x100000001b3ULL;
+  return h;
+}
+
+static bool _same(const char *a, const char *b) {
+  if (a[0] == '_')
+    a++;
+  if (b[0] == '_')
+    b++;
+  return strcmp(a, b) == 0;
+}
+
+static int _cmp_entry(const void *a, const void *b) {
+  const entry_t *x = a, *y = b;
+  if (x->addr != y->addr)
+    return (x->addr > y->addr) - (x->addr < y->addr);
+  // keep the order they were added in, external names before locals
+  return (x->order > y->order) - (x->order < y->order);
+}
+
+// the block, a cache file is exactly this, offsets are from the header
+// - file_size   - of the mach-o it was built from
+// - start/end   - unslid
+// - total_size  - of the whole block, names come last
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint8_t uuid[16];
+  uint64_t file_size;
+  uint64_t text_vmaddr;
+  uint64_t start;
+  uint64_t end;
+  uint64_t count;
+  uint64_t hash_size;
+  uint64_t pool_size;
+  uint64_t hash_off;
+  uint64_t pool_off;
+  uint64_t addrs_off;
+  uint64_t names_off;
+  uint64_t total_size;
+} symtab_header_t;
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+// point st into a block and check everything the lookups index with,
+// a few comparisons, nothing scales with the symbol count
+static int _attach(symtab_t *st, void *data, size_t size, uint64_t base) {
+  symtab_header_t h;
+  if (size < sizeof(h))
+    return -1;
+  memcpy(&h, data, sizeof(h));
+  if (memcmp(h.magic, SYMTAB_CACHE_MAGIC, sizeof(SYMTAB_CACHE_MAGIC)) != 0 ||
+      h.version != SYMTAB_CACHE_VERSION || h.header_size != sizeof(h) ||
+      h.total_size != size)
+    return -1;
+
+  // each part inside the block, aligned and not overlapping the next
+  if (h.hash_size == 0 || (h.hash_size & (h.hash_size - 1)) ||
+      h.hash_size > size / sizeof(symtab_slot_t) || h.count > size / 12 ||
+      h.pool_size == 0 || h.pool_size > size || h.hash_off > size ||
+      h.pool_off > size || h.addrs_off > size || h.names_off > size)
+    return -1;
+  uint64_t hash_end = h.hash_off + h.hash_size * sizeof(symtab_slot_t);
+  uint64_t pool_end = h.pool_off + h.pool_size;
+  uint64_t addrs_end = h.addrs_off + h.count * sizeof(uint64_t);
+  uint64_t names_end = h.names_off + h.count * sizeof(uint32_t);
+  if (h.hash_off < sizeof(h) || (h.hash_off & 7) || hash_end > h.pool_off ||
+      pool_end > h.addrs_off || (h.addrs_off & 7) ||
+      addrs_end > h.names_off || names_end > size)
+    return -1;
+
+  const uint8_t *p = data;
+  // names are offsets into the pool, it has to end in a terminator
+  if (p[h.pool_off] != '\0' || p[pool_end - 1] != '\0')
+    return -1;
+
+  st->data = data;
+  st->size = size;
+  memcpy(st->uuid, h.uuid, sizeof(st->uuid));
+  st->file_size = h.file_size;
+  st->slide = base ? base - h.text_vmaddr : 0;
+  st->start = h.start + st->slide;
+  st->end = h.end + st->slide;
+  st->hash = (const symtab_slot_t *)(p + h.hash_off);
+  st->hash_size = h.hash_size;
+  st->pool = (const char *)(p + h.pool_off);
+  st->pool_size = h.pool_size;
+  st->addrs = (const uint64_t *)(p + h.addrs_off);
+  st->names = (const uint32_t *)(p + h.names_off);
+  st->count = h.count;
+  return 0;
+}
+
+// lays the entries out as a block, every name copied into the pool, the
+// hash filled in the order they were added so the first definition of a
+// name wins, then sorted for the address table
+static void *_build(const image_t *img, entry_vec_t *all, uint64_t file_size,
+                    size_t *size_out) {
+  uint64_t pool_size = 1;
+  for (size_t i = 0; i < all->count; i++)
+    pool_size += strlen(all->v[i].name) + 1;
+  if (pool_size > UINT32_MAX)
+    return NULL;
+
+  uint64_t hash_size = 16;
+  while (hash_size < all->count * 2)
+    hash_size *= 2;
+
+  symtab_header_t h = {.version = SYMTAB_CACHE_VERSION,
+                       .header_size = sizeof(h),
+                       .file_size = file_size,
+                       .text_vmaddr = img->text_vmaddr,
+                       .start = img->start,
+                       .end = img->end,
+                       .hash_size = hash_size,
+                       .pool_size = pool_size};
+  memcpy(h.magic, SYMTAB_CACHE_MAGIC, sizeof(SYMTAB_CACHE_MAGIC));
+  memcpy(h.uuid, img->uuid, sizeof(h.uuid));
+  h.hash_off = ALIGN8(sizeof(h));
+  h.pool_off = h.hash_off + hash_size * sizeof(symtab_slot_t);
+  h.addrs_off = ALIGN8(h.pool_off + pool_size);
+  // room for every entry, shrunk once aliases are folded
+  h.names_off = h.addrs_off + all->count * sizeof(uint64_t);
+  h.total_size = h.names_off + all->count * sizeof(uint32_t);
+
+  uint8_t *block = calloc(1, h.total_size);
+  if (!block)
+    return NULL; // allocation err
+
+  char *pool = (char *)block + h.pool_off;
+  symtab_slot_t *hash = (symtab_slot_t *)(block + h.hash_off);
+  uint32_t used = 1;
+  for (size_t i = 0; i < all->count; i++) {
+    entry_t *e = &all->v[i];
+    size_t len = strlen(e->name);
+    memcpy(pool + used, e->name, len + 1);
+    e->off = used;
+    used += (uint32_t)len + 1;
+
+    size_t slot = _hash(e->name) & (hash_size - 1);
+    while (hash[slot].name && !_same(pool + hash[slot].name, e->name))
+      slot = (slot + 1) & (hash_size - 1);
+    if (!hash[slot].name)
+      hash[slot] = (symtab_slot_t){.addr = e->addr, .name = e->off};
+  }
+
+  // one name per address for address lookups, the first one added
+  if (all->count)
+    qsort(all->v, all->count, sizeof(*all->v), _cmp_entry);
+  uint64_t *addrs = (uint64_t *)(block + h.addrs_off);
+  size_t n = 0;
+  for (size_t i = 0; i < all->count; i++) {
+    if (n && addrs[n - 1] == all->v[i].addr)
+      continue;
+    addrs[n] = all->v[i].addr;
+    all->v[n].off = all->v[i].off;
+    n++;
+  }
+  h.count = n;
+  h.names_off = h.addrs_off + n * sizeof(uint64_t);
+  h.total_size = h.names_off + n * sizeof(uint32_t);
+  uint32_t *names = (uint32_t *)(block + h.names_off);
+  for (size_t i = 0; i < n; i++)
+    names[i] = all->v[i].off;
+  memcpy(block, &h, sizeof(h));
+
+  *size_out = h.total_size;
+  return block;
+}
+
+int symtab_load_buffer(symtab_t *st, const void *data, size_t size,
+                       uint64_t base) {
+  memset(st, 0, sizeof(*st));
+  image_t img = {.data = data, .size = size};
+  if (_slice(&img.data, &img.size) != 0 || _parse(&img) != 0)
+    return -1;
+
+  entry_vec_t all = {0};
+  arena_block_t *arena = NULL;
+  int err = 0;
+  if (img.symtab) {
+    if (img.have_dysymtab) {
+      err |= _add_nlist(&img, img.dysymtab.iextdefsym, img.dysymtab.nextdefsym,
+                        &all);
+      err |= _add_nlist(&img, img.dysymtab.ilocalsym, img.dysymtab.nlocalsym,
+                        &all);
+    } else {
+      err |= _add_nlist(&img, 0, UINT32_MAX, &all);
+    }
+  }
+  // the trie covers stripped images, its addresses are from the header
+  if (!err && img.trie_size && img.trie_off <= img.size &&
+      img.trie_size <= img.size - img.trie_off)
+    err |= _walk_trie(&arena, &img, img.text_vmaddr, &all);
+
+  size_t block_size = 0;
+  void *block = err ? NULL : _build(&img, &all, size, &block_size);
+  free(all.v);
+  _arena_free(arena);
+  if (!block)
+    return -1;
+
+  if (_attach(st, block, block_size, base) != 0) {
+    free(block);
+    memset(st, 0, sizeof(*st));
+    return -1;
+  }
+  return 0;
+}
+
+// a read only private mapping of a whole file
+static void *_map(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat sb;
+  if (fstat(fd, &sb) != 0 || sb.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  void *map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+  *size = (size_t)sb.st_size;
+  return map;
+}
+
+int symtab_load_file(symtab_t *st, const char *path, uint64_t base) {
+  memset(st, 0, sizeof(*st));
+  size_t size;
+  void *map = _map(path, &size);
+  if (!map)
+    return -1;
+  // names are copied out, the file isn't needed once the table is built
+  int ret = symtab_load_buffer(st, map, size, base);
+  munmap(map, size);
+  return ret;
+}
+
+int symtab_file_identity(const char *path, uint8_t uuid[16],
+                         uint64_t *file_size) {
+  size_t size;
+  void *map = _map(path, &size);
+  if (!map)
+    return -1;
+  image_t img = {.data = map, .size = size};
+  static const uint8_t zero[16];
+  int ret = -1;
+  if (_slice(&img.data, &img.size) == 0 && _parse(&img) == 0 &&
+      memcmp(img.uuid, zero, sizeof(zero)) != 0) {
+    memcpy(uuid, img.uuid, sizeof(img.uuid));
+    *file_size = size;
+    ret = 0;
+  }
+  munmap(map, size);
+  return ret;
+}
+
+// load commands and nlist entries of an image in memory are read up to
+// these
+#define IMAGE_MAX_CMDS (1u << 20)
+#define IMAGE_MAX_SYMS (1u << 24)
+// how far past the start of the last name in a run of the string table is
+// read, a longer name comes out cut short
+#define IMAGE_NAME_WINDOW 4096
+
+// a name an image's nlist entry points at, index is the entry
+typedef struct {
+  uint32_t strx;
+  uint32_t index;
+} name_ref_t;
+
+static int _cmp_ref(const void *a, const void *b) {
+  const name_ref_t *x = a, *y = b;
+  return (x->strx > y->strx) - (x->strx < y->strx);
+}
+
+// where a file offset inside __LINKEDIT was loaded
+static bool _linkedit_addr(const image_t *img, uint64_t slide, uint64_t off,
+                           uint64_t *out) {
+  if (!img->have_linkedit || off < img->linkedit_fileoff)
+    return false;
+  *out = img->linkedit_vmaddr + slide + (off - img->linkedit_fileoff);
+  return true;
+}
+
+// is nlist entry i one _add_nlist would take
+static bool _wanted(const image_t *img, const mo_symtab_t *sc,
+                    const mo_nlist_t *nl, uint32_t i) {
+  if ((nl->n_type & MO_N_STAB) || (nl->n_type & MO_N_TYPE) != MO_N_SECT ||
+      nl->n_strx == 0 || nl->n_strx >= sc->strsize)
+    return false;
+  if (!img->have_dysymtab)
+    return true;
+  const mo_dysymtab_t *d = &img->dysymtab;
+  return (i >= d->iextdefsym && i - d->iextdefsym < d->nextdefsym) ||
+         (i >= d->ilocalsym && i - d->ilocalsym < d->nlocalsym);
+}
+
+// the image's own nlist entries and the names they use, the rest of the
+// entries lose their name so nothing reads past what was copied, the
+// names go into strings in runs, each ending in a terminator, the string
+// table of a shared cache image is the pool of the whole cache
+static int _read_names(const image_t *img, uint64_t slide, range_read_fn read,
+                       mo_nlist_t *syms, uint32_t nsyms, char **strings,
+                       size_t *strings_len) {
+  mo_symtab_t sc;
+  memcpy(&sc, img->symtab, sizeof(sc));
+  name_ref_t *refs = malloc((nsyms ? nsyms : 1) * sizeof(*refs));
+  if (!refs)
+    return -1; // allocation err
+  size_t nrefs = 0;
+  for (uint32_t i = 0; i < nsyms; i++) {
+    if (_wanted(img, &sc, &syms[i], i))
+      refs[nrefs++] = (name_ref_t){.strx = syms[i].n_strx, .index = i};
+    else
+      syms[i].n_strx = 0;
+  }
+  qsort(refs, nrefs, sizeof(*refs), _cmp_ref);
+
+  // offset 0 stays the empty name
+  size_t cap = 1, len = 1;
+  char *out = malloc(cap);
+  int err = out ? 0 : -1;
+  for (size_t r = 0; !err && r < nrefs;) {
+    uint32_t first = refs[r].strx;
+    uint64_t end = first;
+    size_t at = len;
+    for (; r < nrefs && refs[r].strx <= end; r++) {
+      uint64_t want = (uint64_t)refs[r].strx + IMAGE_NAME_WINDOW;
+      if (want > sc.strsize)
+        want = sc.strsize;
+      if (want > end)
+        end = want;
+      syms[refs[r].index].n_strx = (uint32_t)(at + refs[r].strx - first);
+    }
+
+    size_t run = (size_t)(end - first);
+    if (len + run + 1 > UINT32_MAX) {
+      err = -1;
+      break;
+    }
+    if (len + run + 1 > cap) {
+      while (cap < len + run + 1)
+        cap *= 2;
+      char *grown = realloc(out, cap);
+      if (!grown) {
+        err = -1; // allocation err
+        break;
+      }
+      out = grown;
+    }
+    uint64_t addr;
+    if (!_linkedit_addr(img, slide, (uint64_t)sc.stroff + first, &addr) ||
+        read(addr, out + len, run) != 0)
+      err = -1;
+    len += run;
+    out[len++] = '\0';
+  }
+  free(refs);
+  if (err) {
+    free(out);
+    return -1;
+  }
+  out[0] = '\0';
+  *strings = out;
+  *strings_len = len;
+  return 0;
+}
+
+int symtab_load_image(symtab_t *st, range_read_fn read, uint64_t base) {
+  memset(st, 0, sizeof(*st));
+  mo_header_t mh;
+  if (read(base, &mh, sizeof(mh)) != 0 || mh.magic != MO_MH_MAGIC_64 ||
+      mh.sizeofcmds > IMAGE_MAX_CMDS)
+    return -1;
+  size_t head = sizeof(mh) + mh.sizeofcmds;
+  uint8_t *cmds = malloc(head);
+  if (!cmds)
+    return -1; // allocation err
+  image_t img = {.data = cmds, .size = head};
+  if (read(base, cmds, head) != 0 || _parse(&img) != 0 ||
+      !img.have_linkedit) {
+    free(cmds);
+    return -1;
+  }
+  uint64_t slide = base - img.text_vmaddr;
+
+  mo_symtab_t sc = {0};
+  if (img.symtab)
+    memcpy(&sc, img.symtab, sizeof(sc));
+  // far more than any image has, a corrupt count
+  if (sc.nsyms > IMAGE_MAX_SYMS) {
+    free(cmds);
+    return -1;
+  }
+  mo_nlist_t *syms = malloc((sc.nsyms ? sc.nsyms : 1) * sizeof(*syms));
+  uint8_t *trie = malloc(img.trie_size ? img.trie_size : 1);
+  char *strings = NULL;
+  size_t strings_len = 0;
+  uint8_t *buf = NULL;
+  int ret = -1;
+  uint64_t addr;
+  if (!syms || !trie)
+    goto out; // allocation err
+  if (sc.nsyms &&
+      (!_linkedit_addr(&img, slide, sc.symoff, &addr) ||
+       read(addr, syms, (size_t)sc.nsyms * sizeof(*syms)) != 0 ||
+       _read_names(&img, slide, read, syms, sc.nsyms, &strings,
+                   &strings_len) != 0))
+    goto out;
+  if (img.trie_size &&
+      (!_linkedit_addr(&img, slide, img.trie_off, &addr) ||
+       read(addr, trie, img.trie_size) != 0))
+    goto out;
+
+  // laid out like a file, the load commands then what they point at, and
+  // built like one
+  size_t syms_size = (size_t)sc.nsyms * sizeof(*syms);
+  size_t total = head + syms_size + strings_len + img.trie_size;
+  if (total > UINT32_MAX || !(buf = malloc(total)))
+    goto out;
+  memcpy(buf, cmds, head);
+  memcpy(buf + head, syms, syms_size);
+  if (strings_len)
+    memcpy(buf + head + syms_size, strings, strings_len);
+  memcpy(buf + head + syms_size + strings_len, trie, img.trie_size);
+  if (img.symtab) {
+    mo_symtab_t fixed = sc;
+    fixed.symoff = (uint32_t)head;
+    fixed.stroff = (uint32_t)(head + syms_size);
+    fixed.strsize = (uint32_t)strings_len;
+    memcpy(buf + ((const uint8_t *)img.symtab - cmds), &fixed, sizeof(fixed));
+  }
+  if (img.trie_field) {
+    uint32_t trie_off = (uint32_t)(head + syms_size + strings_len);
+    memcpy(buf + (img.trie_field - cmds), &trie_off, sizeof(trie_off));
+  }
+  ret = symtab_load_buffer(st, buf, total, base);
+  if (ret == 0) {
+    // no file behind it, a cache entry goes by the uuid alone
+    st->file_size = 0;
+    memset((uint8_t *)st->data + offsetof(symtab_header_t, file_size), 0,
+           sizeof(uint64_t));
+  }
+
+out:
+  free(cmds);
+  free(syms);
+  free(trie);
+  free(strings);
+  free(buf);
+  return ret;
+}
+
+int symtab_save_cache(const symtab_t *st, const char *path) {
+  char tmp[1024];
+  if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid()) >=
+      (int)sizeof(tmp))
+    return -1;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -1;
+
+  const uint8_t *p = st->data;
+  size_t left = st->size;
+  while (left) {
+    ssize_t n = write(fd, p, left);
+    if (n <= 0)
+      break;
+    p += n;
+    left -= (size_t)n;
+  }
+  if (close(fd) != 0 || left || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+int symtab_load_cache(symtab_t *st, const char *path, const uint8_t uuid[16],
+                      uint64_t file_size, uint64_t base) {
+  memset(st, 0, sizeof(*st));
+  size_t size;
+  void *map = _map(path, &size);
+  if (!map)
+    return -1;
+  if (_attach(st, map, size, base) != 0 ||
+      memcmp(st->uuid, uuid, sizeof(st->uuid)) != 0 ||
+      st->file_size != file_size) {
+    munmap(map, size);
+    memset(st, 0, sizeof(*st));
+    return -1;
+  }
+  st->mapped = true;
+  return 0;
+}
+
+void symtab_free(symtab_t *st) {
+  if (st->mapped)
+    munmap(st->data, st->size);
+  else
+    free(st->data);
+  memset(st, 0, sizeof(*st));
+}
+
+const char *symtab_lookup_addr(const symtab_t *st, uint64_t addr,
+                               uint64_t *off) {
+  if (addr < st->start || addr >= st->end || st->count == 0)
+    return NULL;
+  uint64_t a = addr - st->slide;
+  if (a < st->addrs[0])
+    return NULL;
+
+  size_t lo = 0, hi = st->count;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (st->addrs[mid] <= a)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  // a damaged cache file can't point outside the pool
+  if (st->names[lo] >= st->pool_size)
+    return NULL;
+  if (off)
+    *off = a - st->addrs[lo];
+  return st->pool + st->names[lo];
+}
+
+uint64_t symtab_lookup_name(const symtab_t *st, const char *name) {
+  if (!st->hash_size)
+    return 0;
+  size_t slot = _hash(name) & (st->hash_size - 1);
+  // bounded, a damaged cache file may have no empty slot left
+  for (size_t i = 0; i < st->hash_size && st->hash[slot].name; i++) {
+    uint32_t at = st->hash[slot].name;
+    if (at < st->pool_size && _same(st->pool + at, name))
+      return st->hash[slot].addr + st->slide;
+    slot = (slot + 1) & (st->hash_size - 1);
+  }
+  return 0;
+}
@@ -0,0 +1,20 @@
+#include "target/target.h"
+#include <stddef.h>
+
+static const target_backend_t *current = NULL;
+
+const target_backend_t *target_default_backend(void) {
+#if defined(__APPLE__)
+  return &mach_backend;
+#elif defined(__linux__)
+  return &linux_backend;
+#else
+  return NULL;
+#endif
+}
+
+const target_backend_t *target_backend(void) {
+  return current ? current : target_default_backend();
+}
+
+void target_set_backend(const target_backend_t *backend) { current = backend; }
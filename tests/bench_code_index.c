@@ -0,0 +1,110 @@
+#include "target/code_index.h"
+#include "test.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+// code_index_build over a generated 16MB text section, one worker against
+// one per cpu, then lookups into what it built
+//
+// the words mimic compiled code, about one in six a branch, one in sixty
+// a bl to an earlier or later function and functions of a few dozen
+// instructions ending in ret
+
+#define TEXT_ADDR 0x100004000ull
+#define TEXT_SIZE (16u << 20)
+#define LOOKUPS 1000000
+
+static uint32_t *text;
+static size_t nwords;
+
+static uint64_t rng = 0x9e3779b97f4a7c15ull;
+
+static uint32_t _next(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return (uint32_t)(rng >> 16);
+}
+
+static void _generate(void) {
+  nwords = TEXT_SIZE / sizeof(uint32_t);
+  text = malloc(TEXT_SIZE);
+  if (!text)
+    return;
+  for (size_t i = 0; i < nwords; i++) {
+    uint32_t r = _next() % 60;
+    int32_t off = (int32_t)(_next() % 64) - 32; // words, a short jump
+    if (r == 0) {
+      int32_t far = (int32_t)(_next() % (1u << 20)) - (1 << 19);
+      text[i] = 0x94000000 | ((uint32_t)far & 0x3ffffff); // bl
+    } else if (r == 1) {
+      text[i] = 0xd65f03c0; // ret
+    } else if (r < 6) {
+      text[i] = 0x54000000 | (((uint32_t)off & 0x7ffff) << 5) | (r & 0xf);
+    } else if (r < 8) {
+      text[i] = 0xb4000000 | (((uint32_t)off & 0x7ffff) << 5) | (r & 0x1f);
+    } else if (r < 10) {
+      text[i] = 0x14000000 | ((uint32_t)off & 0x3ffffff); // b
+    } else {
+      text[i] = 0x8b020020; // add x0, x1, x2
+    }
+  }
+}
+
+static uint64_t _build(unsigned workers, code_index_t *out) {
+  uint64_t best = UINT64_MAX;
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    code_index_t idx;
+    uint64_t t0 = bench_now_ns();
+    if (code_index_build(&idx, text, TEXT_SIZE, TEXT_ADDR, NULL, 0,
+                         workers) != 0) {
+      printf("[-] code_index_build failed\n");
+      return 0;
+    }
+    uint64_t ns = bench_now_ns() - t0;
+    best = ns < best ? ns : best;
+    if (run == BENCH_RUNS - 1 && out)
+      *out = idx;
+    else
+      code_index_free(&idx);
+  }
+  return best;
+}
+
+int main(void) {
+  _generate();
+  if (!text)
+    return 1;
+
+  uint64_t one = _build(1, NULL);
+  code_index_t idx;
+  uint64_t all = _build(0, &idx);
+  if (!one || !all) {
+    free(text);
+    return 1;
+  }
+  bench_report("index 16MB, 1 worker", one, nwords, TEXT_SIZE);
+  bench_report("index 16MB, a worker per cpu", all, nwords, TEXT_SIZE);
+  printf("  %zu functions, %zu blocks, %.1fx on %ld cpus\n", idx.nfuncs,
+         idx.nblocks, (double)one / (double)all,
+         sysconf(_SC_NPROCESSORS_ONLN));
+
+  static uint64_t addrs[LOOKUPS];
+  for (size_t i = 0; i < LOOKUPS; i++)
+    addrs[i] = TEXT_ADDR + (uint64_t)(_next() % nwords) * 4;
+  uint64_t best = UINT64_MAX, sink = 0;
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    uint64_t t0 = bench_now_ns();
+    for (size_t i = 0; i < LOOKUPS; i++)
+      sink += code_index_block(&idx, addrs[i], NULL);
+    uint64_t ns = bench_now_ns() - t0;
+    best = ns < best ? ns : best;
+  }
+  bench_report("block lookup", best, LOOKUPS, 0);
+  if (!sink)
+    printf("[-] no block found\n");
+
+  code_index_free(&idx);
+  free(text);
+  return 0;
+}
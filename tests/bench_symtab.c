@@ -0,0 +1,156 @@
+#include "target/symtab.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// building a symbol table from a mach-o against mapping its cache file,
+// over a generated image with SYMBOLS defined functions, the way an
+// attach sees every loaded image
+// - build   - symtab_load_file, read and parse the nlist
+// - cached  - symtab_file_identity then symtab_load_cache, what a later
+//             attach to the same build does
+// both are timed per image, then name and address lookups in the mapped
+// table
+
+#define SYMBOLS 200000
+#define LOOKUPS 1000000
+#define TEXT 0x100000000ull
+#define LINKEDIT 0x1000
+
+static uint8_t *_image(size_t *size) {
+  size_t nlist = (size_t)SYMBOLS * 16;
+  size_t strsize = 1 + (size_t)SYMBOLS * 16;
+  *size = LINKEDIT + nlist + strsize;
+  uint8_t *img = calloc(1, *size);
+  if (!img)
+    return NULL;
+
+  uint32_t hdr[8] = {0xfeedfacf, 0x0100000c, 0, 2, 4, 72 * 2 + 24 + 24};
+  memcpy(img, hdr, sizeof(hdr));
+  uint8_t *p = img + sizeof(hdr);
+  static const char *const names[] = {"__TEXT", "__LINKEDIT"};
+  uint64_t vm[2][4] = {{TEXT, 0x10000000, 0, LINKEDIT},
+                       {TEXT + 0x10000000, 0x1000000, LINKEDIT,
+                        *size - LINKEDIT}};
+  for (int s = 0; s < 2; s++, p += 72) {
+    uint32_t cmd[2] = {0x19, 72};
+    uint32_t prot[2] = {s ? 1 : 5, s ? 1 : 5};
+    memcpy(p, cmd, 8);
+    strncpy((char *)p + 8, names[s], 16);
+    memcpy(p + 24, vm[s], sizeof(vm[s]));
+    memcpy(p + 56, prot, sizeof(prot));
+  }
+  uint32_t uuid[6] = {0x1b, 24, 0x12345678, 0x9abcdef0, 0x0fedcba9, 1};
+  memcpy(p, uuid, sizeof(uuid));
+  p += sizeof(uuid);
+  uint32_t symtab[6] = {0x2,
+                        24,
+                        LINKEDIT,
+                        SYMBOLS,
+                        (uint32_t)(LINKEDIT + nlist),
+                        (uint32_t)strsize};
+  memcpy(p, symtab, sizeof(symtab));
+
+  // _fn_<n>, sixteen bytes each with the nul, 0x40 apart in __text
+  char *str = (char *)img + LINKEDIT + nlist;
+  uint8_t *sym = img + LINKEDIT;
+  for (uint32_t i = 0; i < SYMBOLS; i++, sym += 16) {
+    uint32_t strx = 1 + i * 16;
+    snprintf(str + strx, 16, "_fn_%u", i);
+    uint64_t addr = TEXT + 0x1000 + (uint64_t)i * 0x40;
+    memcpy(sym, &strx, 4);
+    sym[4] = 0x0f; // N_SECT | N_EXT
+    sym[5] = 1;
+    memcpy(sym + 8, &addr, 8);
+  }
+  return img;
+}
+
+int main(void) {
+  size_t size;
+  uint8_t *img = _image(&size);
+  char path[] = "/tmp/bench_symtab.XXXXXX";
+  int fd = mkstemp(path);
+  if (!img || fd < 0 || write(fd, img, size) != (ssize_t)size) {
+    printf("[-] cannot write the image\n");
+    return 1;
+  }
+  close(fd);
+  free(img);
+  char cache[sizeof(path) + 6];
+  snprintf(cache, sizeof(cache), "%s.syms", path);
+
+  symtab_t st;
+  uint64_t best = UINT64_MAX;
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    uint64_t t0 = bench_now_ns();
+    if (symtab_load_file(&st, path, 0) != 0) {
+      printf("[-] symtab_load_file failed\n");
+      goto out;
+    }
+    uint64_t ns = bench_now_ns() - t0;
+    best = ns < best ? ns : best;
+    if (run == 0 && symtab_save_cache(&st, cache) != 0)
+      printf("[-] symtab_save_cache failed\n");
+    symtab_free(&st);
+  }
+  bench_report("build, 200K symbols", best, 1, size);
+  uint64_t build = best;
+
+  best = UINT64_MAX;
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    uint8_t uuid[16];
+    uint64_t file_size;
+    uint64_t t0 = bench_now_ns();
+    if (symtab_file_identity(path, uuid, &file_size) != 0 ||
+        symtab_load_cache(&st, cache, uuid, file_size, 0) != 0) {
+      printf("[-] cannot load the cache\n");
+      goto out;
+    }
+    uint64_t ns = bench_now_ns() - t0;
+    best = ns < best ? ns : best;
+    symtab_free(&st);
+  }
+  bench_report("cached, 200K symbols", best, 1, 0);
+  printf("  cache %.0fx faster than a build\n", (double)build / (double)best);
+
+  uint8_t uuid[16];
+  uint64_t file_size;
+  if (symtab_file_identity(path, uuid, &file_size) != 0 ||
+      symtab_load_cache(&st, cache, uuid, file_size, 0) != 0)
+    goto out;
+  static char names[1024][16];
+  for (int i = 0; i < 1024; i++)
+    snprintf(names[i], sizeof(names[i]), "fn_%u", i * 193 % SYMBOLS);
+  uint64_t sink = 0;
+  best = UINT64_MAX;
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    uint64_t t0 = bench_now_ns();
+    for (size_t i = 0; i < LOOKUPS; i++)
+      sink += symtab_lookup_name(&st, names[i & 1023]);
+    uint64_t ns = bench_now_ns() - t0;
+    best = ns < best ? ns : best;
+  }
+  bench_report("lookup by name", best, LOOKUPS, 0);
+  best = UINT64_MAX;
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    uint64_t t0 = bench_now_ns();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+      uint64_t off;
+      uint64_t addr = TEXT + 0x1000 + (i * 7919 % SYMBOLS) * 0x40 + 8;
+      sink += symtab_lookup_addr(&st, addr, &off) != NULL;
+    }
+    uint64_t ns = bench_now_ns() - t0;
+    best = ns < best ? ns : best;
+  }
+  bench_report("lookup by address", best, LOOKUPS, 0);
+  if (!sink)
+    printf("[-] nothing found\n");
+  symtab_free(&st);
+
+out:
+  unlink(cache);
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,152 @@
+#include "target/target.h"
+#include "test.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// the backend against a live process, a forked copy of this program that
+// the linux backend seizes, so it only runs there
+// - bulk reads of a large buffer in chunks
+// - scattered small reads in one read_vectored
+// - breakpoint round trips, the child traps in a loop and every trap is
+//   waited for and resumed the way the debugger answers a brk
+
+#ifdef __linux__
+
+#define BUF_SIZE (16u << 20)
+#define CHUNK (64u << 10)
+#define SCATTER 4096
+#define TRAPS 2000
+
+static uint8_t *buf;
+
+static void _trap_loop(void) {
+  for (;;) {
+#if defined(__aarch64__)
+    __asm__ volatile("brk #0");
+#elif defined(__x86_64__) || defined(__i386__)
+    __asm__ volatile("int3");
+#else
+    raise(SIGTRAP);
+#endif
+  }
+}
+
+static void _bench_reads(const target_backend_t *b) {
+  uint8_t *out = malloc(CHUNK);
+  uint64_t best = UINT64_MAX;
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    uint64_t t0 = bench_now_ns();
+    for (size_t off = 0; off < BUF_SIZE; off += CHUNK) {
+      if (b->read((uint64_t)(uintptr_t)buf + off, out, CHUNK) != 0) {
+        printf("[-] read failed at +0x%zx\n", off);
+        free(out);
+        return;
+      }
+    }
+    uint64_t ns = bench_now_ns() - t0;
+    best = ns < best ? ns : best;
+  }
+  bench_report("read 64K chunks", best, BUF_SIZE / CHUNK, BUF_SIZE);
+  free(out);
+
+  // 8 bytes from every 4K page, what a page table or list walk looks like
+  static uint64_t words[SCATTER];
+  static target_iovec_t iov[SCATTER];
+  for (size_t i = 0; i < SCATTER; i++)
+    iov[i] = (target_iovec_t){.addr = (uint64_t)(uintptr_t)buf + i * 4096,
+                              .buf = &words[i],
+                              .size = sizeof(words[i])};
+  best = UINT64_MAX;
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    uint64_t t0 = bench_now_ns();
+    b->read_vectored(iov, SCATTER);
+    uint64_t ns = bench_now_ns() - t0;
+    best = ns < best ? ns : best;
+  }
+  bench_report("read_vectored 8B x 4096", best, SCATTER,
+               SCATTER * sizeof(uint64_t));
+}
+
+static void _bench_traps(const target_backend_t *b) {
+  uint64_t best = UINT64_MAX;
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    uint64_t t0 = bench_now_ns();
+    for (int i = 0; i < TRAPS; i++) {
+      target_event_t ev;
+      if (b->wait_event(&ev, 1000) != 0) {
+        printf("[-] no trap from the child\n");
+        return;
+      }
+#if defined(__aarch64__)
+      // brk leaves pc on itself
+      target_regs_t regs;
+      if (b->get_regs(ev.thread, &regs) == 0) {
+        regs.pc += 4;
+        b->set_regs(ev.thread, &regs);
+      }
+#endif
+      b->resume();
+    }
+    uint64_t ns = bench_now_ns() - t0;
+    best = ns < best ? ns : best;
+  }
+  bench_report("breakpoint round trip", best, TRAPS, 0);
+}
+
+static pid_t _spawn(void (*body)(void)) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    body();
+    _exit(0);
+  }
+  return pid;
+}
+
+static void _idle(void) {
+  for (;;)
+    pause();
+}
+
+int main(void) {
+  const target_backend_t *b = target_backend();
+  buf = malloc(BUF_SIZE);
+  if (!buf)
+    return 1;
+  // the child inherits the buffer at the same address
+  for (size_t i = 0; i < BUF_SIZE; i++)
+    buf[i] = (uint8_t)i;
+
+  pid_t pid = _spawn(_idle);
+  if (b->attach(pid) != 0) {
+    printf("bench_target: cannot attach, skipped\n");
+    kill(pid, SIGKILL);
+    return 0;
+  }
+  _bench_reads(b);
+  b->detach();
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+
+  // seized while it runs, the first trap is already on its way
+  pid = _spawn(_trap_loop);
+  if (b->attach(pid) == 0) {
+    _bench_traps(b);
+    b->detach();
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  free(buf);
+  return 0;
+}
+
+#else
+
+int main(void) {
+  printf("bench_target: needs the linux backend, skipped\n");
+  return 0;
+}
+
+#endif
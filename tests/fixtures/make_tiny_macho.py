@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+# writes tiny.macho, the arm64 mach-o test_symtab reads, no code in it,
+# just the load commands, symbols and export trie symtab.c looks at
+#
+#   __TEXT   0x100000000-0x100004000  _main 0x300 (alias _alias_main),
+#                                     _helper 0x400 (local),
+#                                     _exported_only 0x500 (trie only)
+#   __DATA   0x100004000-0x100008000  _data_var 0x100004010
+#   a stab, an undefined _printf and a re-exported _reexp that must not
+#   show up
+import struct
+import sys
+
+TEXT = 0x100000000
+
+
+def uleb(v):
+    out = bytearray()
+    while True:
+        b = v & 0x7F
+        v >>= 7
+        out.append(b | (0x80 if v else 0))
+        if not v:
+            return bytes(out)
+
+
+def segment(name, vmaddr, vmsize, fileoff, filesize, prot):
+    return struct.pack("<II16sQQQQiiII", 0x19, 72, name.encode(), vmaddr,
+                       vmsize, fileoff, filesize, prot, prot, 0, 0)
+
+
+def trie():
+    # root -> "_" -> {"main", "exported_only", "reexp"}, offsets are fixed
+    # point iterated since they are uleb encoded
+    def node(term, children):
+        return term, children
+
+    leaves = {
+        "main": uleb(0) + uleb(0x300),
+        "exported_only": uleb(0) + uleb(0x500),
+        "reexp": uleb(0x08) + uleb(1) + b"\0",
+    }
+    offs = {"root": 0, "_": 0}
+    offs.update({k: 0 for k in leaves})
+    for _ in range(4):
+        root = b"\0" + b"\1" + b"_\0" + uleb(offs["_"])
+        under = b"\0" + bytes([len(leaves)])
+        for k in leaves:
+            under += k.encode() + b"\0" + uleb(offs[k])
+        blob = root
+        offs["_"] = len(blob)
+        blob += under
+        for k, term in leaves.items():
+            offs[k] = len(blob)
+            blob += uleb(len(term)) + term + b"\0"
+    while len(blob) % 8:
+        blob += b"\0"
+    return blob
+
+
+def main(path):
+    strings = [b"", b"_helper", b"stabby", b"_main", b"_alias_main",
+               b"_data_var", b"_printf"]
+    strtab = b"\0"
+    strx = {}
+    for s in strings[1:]:
+        strx[s] = len(strtab)
+        strtab += s + b"\0"
+    while len(strtab) % 8:
+        strtab += b"\0"
+
+    # locals, then external definitions, then undefined, as ld lays out
+    syms = [
+        (strx[b"_helper"], 0x0E, 1, 0, TEXT + 0x400),
+        (strx[b"stabby"], 0x24, 1, 0, TEXT + 0x600),  # N_FUN stab
+        (strx[b"_main"], 0x0F, 1, 0, TEXT + 0x300),
+        (strx[b"_alias_main"], 0x0F, 1, 0, TEXT + 0x300),
+        (strx[b"_data_var"], 0x0F, 2, 0, TEXT + 0x4010),
+        (strx[b"_printf"], 0x01, 0, 0x100, 0),
+    ]
+    symtab = b"".join(struct.pack("<IBBHQ", *s) for s in syms)
+    exports = trie()
+
+    ncmds = 8
+    sizeofcmds = 72 * 4 + 24 + 24 + 80 + 16
+    linkedit = 0x1000
+    symoff = linkedit
+    stroff = symoff + len(symtab)
+    trieoff = stroff + len(strtab)
+    end = trieoff + len(exports)
+
+    cmds = b"".join([
+        segment("__PAGEZERO", 0, TEXT, 0, 0, 0),
+        segment("__TEXT", TEXT, 0x4000, 0, linkedit, 5),
+        segment("__DATA", TEXT + 0x4000, 0x4000, 0, 0, 3),
+        segment("__LINKEDIT", TEXT + 0x8000, 0x4000, linkedit,
+                end - linkedit, 1),
+        struct.pack("<II16s", 0x1B, 24, bytes(range(0x10, 0x20))),
+        struct.pack("<IIIIII", 0x2, 24, symoff, len(syms), stroff,
+                    len(strtab)),
+        struct.pack("<II18I", 0xB, 80, 0, 2, 2, 3, 5, 1, *([0] * 12)),
+        struct.pack("<IIII", 0x80000033, 16, trieoff, len(exports)),
+    ])
+    assert len(cmds) == sizeofcmds
+    header = struct.pack("<IiiIIIII", 0xFEEDFACF, 0x0100000C, 0, 2, ncmds,
+                         sizeofcmds, 0, 0)
+    body = header + cmds
+    body += b"\0" * (linkedit - len(body))
+    body += symtab + strtab + exports
+    with open(path, "wb") as f:
+        f.write(body)
+
+
+if __name__ == "__main__":
+    main(sys.argv[1] if len(sys.argv) > 1 else "tiny.macho")
@@ -0,0 +1,55 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// a minimal test harness
+// every tests/test_*.c is its own program, CHECK records a failure and
+// carries on so one run shows everything that broke, main ends with
+// return test_done(), non-zero when anything failed
+//
+// tests/bench_*.c are built the same way and run by make bench, each
+// times its loops with bench_now_ns and prints a line per measurement
+
+static int test_failures;
+
+#define CHECK(expr)                                                            \
+  do {                                                                         \
+    if (!(expr)) {                                                             \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__,        \
+              #expr);                                                          \
+      test_failures++;                                                         \
+    }                                                                          \
+  } while (0)
+
+static inline int test_done(const char *name) {
+  printf("%-24s %s\n", name, test_failures ? "FAIL" : "ok");
+  return test_failures != 0;
+}
+
+// benchmarks keep the best of BENCH_RUNS runs, a busy machine only ever
+// makes a run slower
+#define BENCH_RUNS 5
+
+static inline uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// ops done in ns, bytes moved by them or 0
+static inline void bench_report(const char *name, uint64_t ns, size_t ops,
+                                size_t bytes) {
+  if (ns == 0)
+    ns = 1;
+  printf("%-36s %10.1f ns/op %12.0f op/s", name, (double)ns / (double)ops,
+         (double)ops * 1e9 / (double)ns);
+  if (bytes)
+    printf(" %9.1f MB/s", (double)bytes * 1e3 / (double)ns);
+  printf("\n");
+}
+
+#endif
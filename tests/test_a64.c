@@ -0,0 +1,331 @@
+#include "target/a64.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+// the a64 decoder against hand encoded instructions, and where capstone
+// is installed against capstone over a generated corpus, every word both
+// of them decode has to agree on kind, target and condition
+
+#define PC 0x100004000ull
+
+typedef struct {
+  uint32_t insn;
+  a64_kind_t kind;
+  uint64_t target; // absolute, 0 for none
+} known_t;
+
+static const known_t known[] = {
+    {0x14000002, A64_BRANCH, PC + 8},              // b +8
+    {0x17ffffff, A64_BRANCH, PC - 4},              // b -4
+    {0x94000040, A64_CALL, PC + 0x100},            // bl +0x100
+    {0x54000040, A64_COND_BRANCH, PC + 8},         // b.eq +8
+    {0x54ffffc1, A64_COND_BRANCH, PC - 8},         // b.ne -8
+    {0xb4000060, A64_COND_BRANCH, PC + 12},        // cbz x0, +12
+    {0x35000083, A64_COND_BRANCH, PC + 16},        // cbnz w3, +16
+    {0x36180041, A64_COND_BRANCH, PC + 8},         // tbz w1, #3, +8
+    {0xb7080082, A64_COND_BRANCH, PC + 16},        // tbnz x2, #33, +16
+    {0xd61f0200, A64_BRANCH_REG, 0},               // br x16
+    {0xd61f083f, A64_BRANCH_REG, 0},               // braaz x1
+    {0xd63f0100, A64_CALL_REG, 0},                 // blr x8
+    {0xd73f0864, A64_CALL_REG, 0},                 // blraa x3, x4
+    {0xd65f03c0, A64_RET, 0},                      // ret
+    {0xd65f0bff, A64_RET, 0},                      // retaa
+    {0xd4001001, A64_EXCEPTION, 0},                // svc #0x80
+    {0xd4200000, A64_EXCEPTION, 0},                // brk #0
+    {0x10000080, A64_PCREL, PC + 0x10},            // adr x0, +0x10
+    {0xd0000001, A64_PCREL, (PC & ~0xfffull) + 0x2000}, // adrp x1, +2 pages
+    {0x58000042, A64_PCREL, PC + 8},               // ldr x2, +8
+    {0xd503201f, A64_SEQ, 0},                      // nop
+    {0x8b020020, A64_SEQ, 0},                      // add x0, x1, x2
+    {0xf9400020, A64_SEQ, 0},                      // ldr x0, [x1]
+    {0x910003fd, A64_SEQ, 0},                      // mov x29, sp
+    {0xd69f03e0, A64_SEQ, 0},                      // eret
+};
+
+static void _check_known(void) {
+  for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+    a64_insn_t d;
+    bool cf = a64_decode(known[i].insn, PC, &d);
+    if (cf != (known[i].kind != A64_SEQ) || d.kind != known[i].kind ||
+        (known[i].target && d.target != known[i].target)) {
+      fprintf(stderr, "0x%08x: kind %d target 0x%llx, want %d 0x%llx\n",
+              known[i].insn, d.kind, (unsigned long long)d.target,
+              known[i].kind, (unsigned long long)known[i].target);
+      test_failures++;
+    }
+  }
+
+  // operands of the conditional forms
+  a64_insn_t d;
+  a64_decode(0x54ffffc1, PC, &d);
+  CHECK(d.test == A64_TEST_FLAGS && d.cond == 1);
+  a64_decode(0x35000083, PC, &d);
+  CHECK(d.test == A64_TEST_ZERO && d.reg == 3 && d.cond == 1 && d.bit == 32);
+  a64_decode(0xb4000060, PC, &d);
+  CHECK(d.test == A64_TEST_ZERO && d.reg == 0 && d.cond == 0 && d.bit == 64);
+  a64_decode(0xb7080082, PC, &d);
+  CHECK(d.test == A64_TEST_BIT && d.reg == 2 && d.cond == 1 && d.bit == 33);
+  a64_decode(0xd73f0864, PC, &d);
+  CHECK(d.reg == 3);
+}
+
+static void _check_next_pc(void) {
+  target_regs_t regs = {0};
+  a64_insn_t d;
+
+  a64_decode(0x54000040, PC, &d); // b.eq
+  regs.cpsr = 0x40000000;         // z
+  CHECK(a64_next_pc(&d, PC, &regs) == PC + 8);
+  regs.cpsr = 0;
+  CHECK(a64_next_pc(&d, PC, &regs) == PC + 4);
+
+  a64_decode(0x35000083, PC, &d); // cbnz w3, only the low half counts
+  regs.x[3] = 0x100000000ull;
+  CHECK(a64_next_pc(&d, PC, &regs) == PC + 4);
+  regs.x[3] = 1;
+  CHECK(a64_next_pc(&d, PC, &regs) == PC + 16);
+
+  a64_decode(0xb7080082, PC, &d); // tbnz x2, #33
+  regs.x[2] = 1ull << 33;
+  CHECK(a64_next_pc(&d, PC, &regs) == PC + 16);
+  regs.x[2] = 0;
+  CHECK(a64_next_pc(&d, PC, &regs) == PC + 4);
+
+  // pointer authentication bits are stripped off register targets
+  a64_decode(0xd61f0200, PC, &d); // br x16
+  regs.x[16] = 0x002d000100008000ull;
+  CHECK(a64_next_pc(&d, PC, &regs) == 0x100008000ull);
+  a64_decode(0xd65f03c0, PC, &d); // ret
+  regs.lr = 0x100004444ull;
+  CHECK(a64_next_pc(&d, PC, &regs) == 0x100004444ull);
+
+  // gt needs z clear and n == v, le is its opposite
+  CHECK(a64_cond_holds(12, 0x00000000));
+  CHECK(!a64_cond_holds(12, 0x40000000));
+  CHECK(!a64_cond_holds(12, 0x80000000));
+  CHECK(a64_cond_holds(12, 0x90000000));
+  CHECK(a64_cond_holds(13, 0x80000000));
+  CHECK(a64_cond_holds(14, 0xf0000000));
+}
+
+// the literal pool the emulated loads read, one word past PC + 8
+static int _read_literal(uint64_t addr, void *out, size_t size) {
+  static const uint8_t pool[8] = {0xf0, 0xff, 0xff, 0xff,
+                                  0x11, 0x22, 0x33, 0x44};
+  if (addr != PC + 8 || size > sizeof(pool))
+    return -1;
+  memcpy(out, pool, size);
+  return 0;
+}
+
+static void _check_emulate(void) {
+  target_regs_t regs = {.pc = PC};
+
+  CHECK(a64_emulate(0x94000040, PC, &regs, NULL)); // bl +0x100
+  CHECK(regs.pc == PC + 0x100 && regs.lr == PC + 4);
+  regs.lr = 0x100008000ull;
+  CHECK(a64_emulate(0xd63f03c0, PC, &regs, NULL)); // blr x30
+  CHECK(regs.pc == 0x100008000ull && regs.lr == PC + 4);
+  regs.cpsr = 0;
+  CHECK(a64_emulate(0x54000040, PC, &regs, NULL)); // b.eq, not taken
+  CHECK(regs.pc == PC + 4);
+
+  CHECK(a64_emulate(0x10000080, PC, &regs, NULL)); // adr x0, +0x10
+  CHECK(regs.x[0] == PC + 0x10 && regs.pc == PC + 4);
+  CHECK(a64_emulate(0xd0000001, PC, &regs, NULL)); // adrp x1, +2 pages
+  CHECK(regs.x[1] == (PC & ~0xfffull) + 0x2000);
+
+  CHECK(a64_emulate(0x58000042, PC, &regs, _read_literal)); // ldr x2
+  CHECK(regs.x[2] == 0x44332211fffffff0ull);
+  CHECK(a64_emulate(0x18000042, PC, &regs, _read_literal)); // ldr w2
+  CHECK(regs.x[2] == 0xfffffff0ull);
+  CHECK(a64_emulate(0x98000042, PC, &regs, _read_literal)); // ldrsw x2
+  CHECK(regs.x[2] == 0xfffffffffffffff0ull && regs.pc == PC + 4);
+
+  // nothing to emulate, or nothing to emulate it with, leaves regs alone
+  regs.pc = PC;
+  CHECK(!a64_emulate(0x58000062, PC, &regs, _read_literal)); // ldr, +12
+  CHECK(!a64_emulate(0x58000042, PC, &regs, NULL));
+  CHECK(!a64_emulate(0x1c000042, PC, &regs, _read_literal)); // ldr s2
+  CHECK(!a64_emulate(0x8b020020, PC, &regs, NULL));          // add
+  CHECK(!a64_emulate(0xd4001001, PC, &regs, NULL));          // svc
+  CHECK(regs.pc == PC && regs.x[2] == 0xfffffffffffffff0ull);
+}
+
+#ifdef HAVE_CAPSTONE
+#include <capstone/capstone.h>
+
+#define CORPUS_RANDOM 1000000
+#define CORPUS_PER_CLASS 50000
+#define MISMATCHES_SHOWN 10
+
+// the encoding spaces the decoder cares about, random bits are filled in
+// around the fixed ones so every class is covered densely
+static const struct {
+  uint32_t mask;
+  uint32_t value;
+} classes[] = {
+    {0x1f000000, 0x10000000}, // adr, adrp
+    {0x7c000000, 0x14000000}, // b, bl
+    {0xff000000, 0x54000000}, // b.cond
+    {0x7e000000, 0x34000000}, // cbz, cbnz
+    {0x7e000000, 0x36000000}, // tbz, tbnz
+    {0xfe000000, 0xd6000000}, // unconditional branch (register)
+    {0xff000000, 0xd4000000}, // exception generation
+    {0x3b000000, 0x18000000}, // load literal
+};
+
+static const char *const cond_names[16][2] = {
+    {"eq", NULL}, {"ne", NULL}, {"hs", "cs"}, {"lo", "cc"},
+    {"mi", NULL}, {"pl", NULL}, {"vs", NULL}, {"vc", NULL},
+    {"hi", NULL}, {"ls", NULL}, {"ge", NULL}, {"lt", NULL},
+    {"gt", NULL}, {"le", NULL}, {"al", NULL}, {"nv", NULL},
+};
+
+static bool _is(const char *m, const char *const *names) {
+  for (; *names; names++) {
+    if (strcmp(m, *names) == 0)
+      return true;
+  }
+  return false;
+}
+
+// capstone's view of an instruction, from its text so it does not depend
+// on the detail layout of one capstone version
+static a64_kind_t _cs_kind(const cs_insn *insn, uint64_t *target,
+                           int *cond) {
+  static const char *const branch_reg[] = {"br",    "braa",  "brab",
+                                           "braaz", "brabz", NULL};
+  static const char *const call_reg[] = {"blr",    "blraa",  "blrab",
+                                         "blraaz", "blrabz", NULL};
+  static const char *const ret[] = {"ret", "retaa", "retab", NULL};
+  static const char *const zero_bit[] = {"cbz", "cbnz", "tbz", "tbnz", NULL};
+  static const char *const literal[] = {"ldr", "ldrsw", "prfm", NULL};
+
+  const char *m = insn->mnemonic;
+  const char *imm = strrchr(insn->op_str, '#');
+  *target = imm ? strtoull(imm + 1, NULL, 0) : 0;
+  *cond = -1;
+
+  if (strcmp(m, "b") == 0)
+    return A64_BRANCH;
+  if (strcmp(m, "bl") == 0)
+    return A64_CALL;
+  if (strncmp(m, "b.", 2) == 0 || strncmp(m, "bc.", 3) == 0) {
+    const char *cc = strchr(m, '.') + 1;
+    for (int i = 0; i < 16; i++) {
+      if (strcmp(cc, cond_names[i][0]) == 0 ||
+          (cond_names[i][1] && strcmp(cc, cond_names[i][1]) == 0))
+        *cond = i;
+    }
+    return A64_COND_BRANCH;
+  }
+  if (_is(m, zero_bit))
+    return A64_COND_BRANCH;
+  if (_is(m, branch_reg))
+    return A64_BRANCH_REG;
+  if (_is(m, call_reg))
+    return A64_CALL_REG;
+  if (_is(m, ret))
+    return A64_RET;
+  if (strcmp(m, "svc") == 0 || strcmp(m, "brk") == 0)
+    return A64_EXCEPTION;
+  if (strcmp(m, "adr") == 0 || strcmp(m, "adrp") == 0)
+    return A64_PCREL;
+  // the literal forms have no base register
+  if (_is(m, literal) && imm && !strchr(insn->op_str, '['))
+    return A64_PCREL;
+  *target = 0;
+  return A64_SEQ;
+}
+
+static uint64_t rng = 0x9e3779b97f4a7c15ull;
+
+static uint32_t _next(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return (uint32_t)(rng >> 16);
+}
+
+static size_t compared, skipped, mismatched;
+
+static void _compare(csh handle, cs_insn *insn, uint32_t word) {
+  const uint8_t *code = (const uint8_t *)&word;
+  size_t size = sizeof(word);
+  uint64_t address = PC;
+  // a word capstone does not know (an extension newer than it, or
+  // unallocated) says nothing about the decoder
+  if (!cs_disasm_iter(handle, &code, &size, &address, insn)) {
+    skipped++;
+    return;
+  }
+  compared++;
+
+  uint64_t target;
+  int cond;
+  a64_kind_t want = _cs_kind(insn, &target, &cond);
+  a64_insn_t d;
+  a64_decode(word, PC, &d);
+
+  bool same = d.kind == want;
+  if (same && target && want != A64_SEQ && want != A64_EXCEPTION)
+    same = d.target == target;
+  if (same && cond >= 0)
+    same = d.test == A64_TEST_FLAGS && d.cond == cond;
+  if (same)
+    return;
+
+  if (mismatched++ < MISMATCHES_SHOWN)
+    fprintf(stderr,
+            "0x%08x  %s %s: capstone %d 0x%llx, a64 %d 0x%llx cond %d\n",
+            word, insn->mnemonic, insn->op_str, want,
+            (unsigned long long)target, d.kind, (unsigned long long)d.target,
+            d.cond);
+}
+
+static void _check_capstone(void) {
+  csh handle;
+  if (cs_open(CS_ARCH_ARM64, CS_MODE_ARM, &handle) != CS_ERR_OK) {
+    fprintf(stderr, "capstone error: cs_open failed\n");
+    test_failures++;
+    return;
+  }
+  cs_insn *insn = cs_malloc(handle);
+
+  for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++)
+    _compare(handle, insn, known[i].insn);
+  for (size_t c = 0; c < sizeof(classes) / sizeof(classes[0]); c++) {
+    for (size_t i = 0; i < CORPUS_PER_CLASS; i++)
+      _compare(handle, insn,
+               classes[c].value | (_next() & ~classes[c].mask));
+  }
+  for (size_t i = 0; i < CORPUS_RANDOM; i++)
+    _compare(handle, insn, _next());
+
+  cs_free(insn, 1);
+  cs_close(&handle);
+
+  printf("a64 vs capstone: %zu compared, %zu unknown to capstone, %zu "
+         "mismatched\n",
+         compared, skipped, mismatched);
+  if (mismatched)
+    test_failures++;
+}
+
+#else
+
+static void _check_capstone(void) {
+  printf("a64 vs capstone: capstone not found, skipped\n");
+}
+
+#endif
+
+int main(void) {
+  _check_known();
+  _check_next_pc();
+  _check_emulate();
+  _check_capstone();
+  return test_done("a64");
+}
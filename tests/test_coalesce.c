@@ -0,0 +1,144 @@
+#include "target/coalesce.h"
+#include "test.h"
+#include <string.h>
+
+// target_read_coalesced over fake target memory, 16 pages at 0x10000 with
+// the fifth one unmapped, every read_range call is logged
+
+#define PAGE 0x1000ull
+#define MEM_BASE 0x10000ull
+#define MEM_PAGES 16
+#define HOLE (MEM_BASE + 4 * PAGE)
+
+static uint8_t mem[MEM_PAGES * PAGE];
+
+static struct {
+  uint64_t addr;
+  size_t size;
+} calls[64];
+static size_t ncalls;
+
+static int _read_range(uint64_t addr, void *out, size_t size) {
+  if (ncalls < sizeof(calls) / sizeof(calls[0]))
+    calls[ncalls] = (typeof(calls[0])){addr, size};
+  ncalls++;
+  if (addr < MEM_BASE || addr + size > MEM_BASE + sizeof(mem) ||
+      (addr < HOLE + PAGE && addr + size > HOLE))
+    return -1;
+  memcpy(out, mem + (addr - MEM_BASE), size);
+  return 0;
+}
+
+static bool _holds(const target_iovec_t *e) {
+  return memcmp(e->buf, mem + (e->addr - MEM_BASE), e->size) == 0;
+}
+
+static void _reset(target_iovec_t *iov, size_t n, uint8_t (*bufs)[64]) {
+  ncalls = 0;
+  for (size_t i = 0; i < n; i++) {
+    memset(bufs[i], 0xee, sizeof(bufs[i]));
+    iov[i].buf = bufs[i];
+    iov[i].status = -2;
+  }
+}
+
+static void _check_merge(void) {
+  uint8_t bufs[6][64];
+  // out of order, two on page 0, one on page 1, an overlapping pair on
+  // page 9 and one on page 12
+  target_iovec_t iov[6] = {
+      {.addr = MEM_BASE + 9 * PAGE + 0x10, .size = 16},
+      {.addr = MEM_BASE + 0x800, .size = 8},
+      {.addr = MEM_BASE + 12 * PAGE + 0xff8, .size = 8},
+      {.addr = MEM_BASE + 0x40, .size = 8},
+      {.addr = MEM_BASE + PAGE + 0x100, .size = 32},
+      {.addr = MEM_BASE + 9 * PAGE + 0x18, .size = 16},
+  };
+  coalesce_stats_t stats = {0};
+  _reset(iov, 6, bufs);
+  CHECK(target_read_coalesced(iov, 6, PAGE, _read_range, &stats) == 0);
+  for (size_t i = 0; i < 6; i++)
+    CHECK(iov[i].status == 0 && _holds(&iov[i]));
+  // each run is only read from its lowest to its highest byte
+  CHECK(ncalls == 3 && stats.ranges == 3 && stats.retries == 0);
+  CHECK(stats.entries == 6);
+  CHECK(calls[0].addr == MEM_BASE + 0x40 &&
+        calls[0].size == PAGE + 0x120 - 0x40);
+  CHECK(calls[1].addr == MEM_BASE + 9 * PAGE + 0x10 && calls[1].size == 24);
+  CHECK(calls[2].addr == MEM_BASE + 12 * PAGE + 0xff8 && calls[2].size == 8);
+
+  // an entry crossing into the next page pulls that page's entries in
+  target_iovec_t cross[3] = {
+      {.addr = MEM_BASE + 2 * PAGE + 0xffc, .size = 8},
+      {.addr = MEM_BASE + 3 * PAGE + 0x20, .size = 8},
+      {.addr = MEM_BASE + 2 * PAGE, .size = 4},
+  };
+  _reset(cross, 3, bufs);
+  CHECK(target_read_coalesced(cross, 3, PAGE, _read_range, NULL) == 0);
+  CHECK(ncalls == 1);
+  for (size_t i = 0; i < 3; i++)
+    CHECK(cross[i].status == 0 && _holds(&cross[i]));
+
+  // one entry, and nothing at all
+  _reset(iov, 1, bufs);
+  CHECK(target_read_coalesced(iov, 1, PAGE, _read_range, NULL) == 0);
+  CHECK(ncalls == 1 && iov[0].status == 0 && _holds(&iov[0]));
+  _reset(iov, 1, bufs);
+  CHECK(target_read_coalesced(iov, 0, PAGE, _read_range, NULL) == 0);
+  CHECK(ncalls == 0);
+}
+
+static void _check_failures(void) {
+  uint8_t bufs[5][64];
+  // a run spanning pages 3 to 5 goes through the hole on page 4, its
+  // entries are read again one by one and only the one in the hole fails
+  target_iovec_t iov[5] = {
+      {.addr = MEM_BASE + 3 * PAGE + 0xf00, .size = 8},
+      {.addr = HOLE + 0x10, .size = 8},
+      {.addr = MEM_BASE + 5 * PAGE + 0x20, .size = 8},
+      {.addr = MEM_BASE + 8 * PAGE, .size = 8},
+      {.addr = MEM_BASE + MEM_PAGES * PAGE - 4, .size = 8}, // off the end
+  };
+  coalesce_stats_t stats = {0};
+  _reset(iov, 5, bufs);
+  CHECK(target_read_coalesced(iov, 5, PAGE, _read_range, &stats) != 0);
+  CHECK(iov[0].status == 0 && _holds(&iov[0]));
+  CHECK(iov[1].status != 0);
+  CHECK(iov[2].status == 0 && _holds(&iov[2]));
+  CHECK(iov[3].status == 0 && _holds(&iov[3]));
+  CHECK(iov[4].status != 0);
+  // the run and its three retries, page 8 and the last one are runs of
+  // one read straight into their buffers, a failure isn't read twice
+  CHECK(stats.ranges == 1 && stats.retries == 3 && ncalls == 6);
+}
+
+// more entries than fit the stack, a word from every other page
+static void _check_large(void) {
+  static uint64_t words[MEM_PAGES / 2 * 5];
+  static target_iovec_t iov[MEM_PAGES / 2 * 5];
+  size_t n = 0;
+  for (size_t p = 0; p < MEM_PAGES; p += 2) {
+    if (MEM_BASE + p * PAGE == HOLE)
+      continue;
+    for (size_t k = 0; k < 5; k++, n++)
+      iov[n] = (target_iovec_t){.addr = MEM_BASE + p * PAGE + k * 0x300,
+                                .buf = &words[n],
+                                .size = sizeof(words[n]),
+                                .status = -2};
+  }
+  ncalls = 0;
+  CHECK(n > 32);
+  CHECK(target_read_coalesced(iov, n, PAGE, _read_range, NULL) == 0);
+  CHECK(ncalls == n / 5);
+  for (size_t i = 0; i < n; i++)
+    CHECK(iov[i].status == 0 && _holds(&iov[i]));
+}
+
+int main(void) {
+  for (size_t i = 0; i < sizeof(mem); i++)
+    mem[i] = (uint8_t)(i * 7 ^ i >> 8);
+  _check_merge();
+  _check_failures();
+  _check_large();
+  return test_done("coalesce");
+}
@@ -0,0 +1,127 @@
+#include "dbg/cond.h"
+#include "test.h"
+#include <stdint.h>
+#include <string.h>
+
+// 64 bytes of fake target memory at 0x1000, word i holds i * 0x10
+#define MEM_BASE 0x1000
+static uint64_t mem[8];
+
+static int _read(uint64_t addr, void *out, size_t size) {
+  if (addr < MEM_BASE || addr + size > MEM_BASE + sizeof(mem))
+    return -1;
+  memcpy(out, (uint8_t *)mem + (addr - MEM_BASE), size);
+  return 0;
+}
+
+static target_regs_t regs;
+
+// compile and run src, -1 if either fails
+static int _eval(const char *src, uint64_t *out) {
+  char err[96];
+  cond_t *cond = cond_compile(src, err, sizeof(err));
+  if (!cond)
+    return -1;
+  int ret = cond_eval(cond, &regs, _read, out) == 0 ? 0 : -1;
+  cond_free(cond);
+  return ret;
+}
+
+static uint64_t _value(const char *src) {
+  uint64_t v = 0xdeadbeef;
+  if (_eval(src, &v) != 0) {
+    fprintf(stderr, "'%s' did not evaluate\n", src);
+    test_failures++;
+  }
+  return v;
+}
+
+static bool _rejects(const char *src) {
+  char err[96] = "";
+  cond_t *cond = cond_compile(src, err, sizeof(err));
+  cond_free(cond);
+  return cond == NULL && err[0] != '\0';
+}
+
+int main(void) {
+  for (size_t i = 0; i < 8; i++)
+    mem[i] = i * 0x10;
+  for (int i = 0; i < 29; i++)
+    regs.x[i] = (uint64_t)i;
+  regs.fp = 0x2000;
+  regs.lr = 0x3000;
+  regs.sp = MEM_BASE;
+  regs.pc = 0x100004000;
+  regs.cpsr = 0x60000000;
+
+  // numbers, both immediate encodings
+  CHECK(_value("42") == 42);
+  CHECK(_value("0x100004000") == 0x100004000);
+  CHECK(_value("0xffffffffffffffff") == UINT64_MAX);
+
+  // precedence and associativity follow c
+  CHECK(_value("2 + 3 * 4") == 14);
+  CHECK(_value("(2 + 3) * 4") == 20);
+  CHECK(_value("10 - 3 - 2") == 5);
+  CHECK(_value("1 << 4 + 1") == 32);
+  CHECK(_value("1 | 2 ^ 3 & 6") == 1);
+  CHECK(_value("1 < 2 == 1") == 1);
+  CHECK(_value("0 || 1 && 0") == 0);
+  CHECK(_value("!0 + ~0") == 0);
+  CHECK(_value("-1") == UINT64_MAX);
+  CHECK(_value("1 << 64") == 0);
+  CHECK(_value("3 <= 3") == 1 && _value("3 >= 4") == 0);
+  CHECK(_value("3 != 4") == 1);
+
+  // registers by any spelling
+  CHECK(_value("x5") == 5);
+  CHECK(_value("X28 + x0") == 28);
+  CHECK(_value("x29 == fp") == 1);
+  CHECK(_value("x30 == lr") == 1);
+  CHECK(_value("pc") == 0x100004000);
+  CHECK(_value("CPSR >> 28") == 6);
+
+  // memory operands read 64 bits through the callback
+  CHECK(_value("[sp]") == 0);
+  CHECK(_value("[sp + 8]") == 0x10);
+  CHECK(_value("[sp + 8 * 3] == 0x30") == 1);
+  CHECK(_value("[[sp + 8] + 0xff8]") == 0x10);
+  uint64_t v;
+  CHECK(_eval("[0]", &v) == -1);
+  CHECK(_eval("x0 == 0 && [8]", &v) == -1);
+
+  // errors name what went wrong instead of compiling something else
+  CHECK(_rejects(""));
+  CHECK(_rejects("x31"));
+  CHECK(_rejects("foo == 1"));
+  CHECK(_rejects("(1 + 2"));
+  CHECK(_rejects("[sp"));
+  CHECK(_rejects("1 +"));
+  CHECK(_rejects("1 2"));
+  CHECK(_rejects("1 = 2"));
+
+  // nesting and length are bounded, not overflowed
+  char deep[256] = "";
+  for (int i = 0; i < 40; i++)
+    strcat(deep, "(1+");
+  strcat(deep, "1");
+  for (int i = 0; i < 40; i++)
+    strcat(deep, ")");
+  CHECK(_rejects(deep));
+  char longsrc[512] = "0";
+  for (int i = 0; i < 30; i++)
+    strcat(longsrc, "+0x10000");
+  CHECK(_rejects(longsrc));
+
+  // the source is kept for listing
+  char err[96];
+  cond_t *cond = cond_compile("x0 == 1", err, sizeof(err));
+  CHECK(cond && strcmp(cond->source, "x0 == 1") == 0);
+  cond_free(cond);
+
+  CHECK(cond_reg_index("lr", 2) == 30 && cond_reg_index("x3", 2) == 3);
+  CHECK(strcmp(cond_reg_name(31), "sp") == 0);
+  CHECK(strcmp(cond_reg_name(99), "?") == 0);
+
+  return test_done("cond");
+}
@@ -0,0 +1,56 @@
+#include "exc/event_queue.h"
+#include "test.h"
+#include <poll.h>
+
+// the stop queue filled past its size, every push after that is a stop
+// the shell has to be told about
+
+static bool _readable(int fd) {
+  struct pollfd p = {.fd = fd, .events = POLLIN};
+  return poll(&p, 1, 0) == 1 && (p.revents & POLLIN);
+}
+
+int main(void) {
+  int fd = event_queue_fd();
+  CHECK(fd >= 0);
+  CHECK(!_readable(fd));
+
+  exc_event_t ev = {.kind = EV_BREAKPOINT};
+  for (int i = 0; i < EVENT_QUEUE_SIZE; i++) {
+    ev.thread = 0x100 + i;
+    CHECK(event_queue_push(&ev));
+  }
+  CHECK(_readable(fd));
+  CHECK(event_queue_take_lost(NULL) == 0);
+
+  for (int i = 0; i < 3; i++) {
+    ev.thread = 0x900 + i;
+    CHECK(!event_queue_push(&ev));
+  }
+
+  exc_event_t out;
+  for (int i = 0; i < EVENT_QUEUE_SIZE; i++)
+    CHECK(event_queue_pop(&out) && out.thread == (uint64_t)(0x100 + i));
+  CHECK(!event_queue_pop(&out));
+  CHECK(!_readable(fd));
+
+  uint64_t thread = 0;
+  CHECK(event_queue_take_lost(&thread) == 3 && thread == 0x902);
+  CHECK(event_queue_take_lost(&thread) == 0);
+
+  // a drop still wakes a consumer that emptied the queue in between
+  for (int i = 0; i < EVENT_QUEUE_SIZE; i++)
+    event_queue_push(&ev);
+  while (event_queue_pop(&out))
+    ;
+  CHECK(!_readable(fd));
+  for (int i = 0; i < EVENT_QUEUE_SIZE + 1; i++)
+    event_queue_push(&ev);
+  CHECK(_readable(fd));
+  CHECK(event_queue_take_lost(NULL) == 1);
+
+  event_queue_stats_t stats;
+  event_queue_get_stats(&stats);
+  CHECK(stats.dropped == 4 && stats.max_depth == EVENT_QUEUE_SIZE);
+  return test_done("event_queue");
+}
@@ -0,0 +1,333 @@
+#include "target/symtab.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// symbol tables out of tests/fixtures/tiny.macho, the file
+// make_tiny_macho.py next to it describes and writes, read as a file, a
+// buffer and an image loaded in a target, and the cache file round trip
+// of what they build
+
+#define FIXTURE "tests/fixtures/tiny.macho"
+#define TEXT 0x100000000ull
+#define SLIDE 0x4000000ull
+
+static uint8_t *_slurp(const char *path, size_t *size) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  *size = (size_t)ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *data = malloc(*size);
+  if (data && fread(data, 1, *size, f) != *size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  return data;
+}
+
+static bool _at(const symtab_t *st, uint64_t addr, const char *name,
+                uint64_t off) {
+  uint64_t got = ~0ull;
+  const char *s = symtab_lookup_addr(st, addr, &got);
+  return s && strcmp(s, name) == 0 && got == off;
+}
+
+// everything the fixture defines, slid by slide
+static void _check_lookups(const symtab_t *st, uint64_t slide) {
+  // _alias_main shares _main's address entry, the first name added wins
+  CHECK(st->count == 4);
+  CHECK(st->start == TEXT + slide && st->end == TEXT + 0x8000 + slide);
+
+  CHECK(_at(st, TEXT + 0x300 + slide, "_main", 0));
+  CHECK(_at(st, TEXT + 0x310 + slide, "_main", 0x10));
+  CHECK(_at(st, TEXT + 0x400 + slide, "_helper", 0));
+  CHECK(_at(st, TEXT + 0x500 + slide, "_exported_only", 0));
+  // the stab at 0x600 isn't a symbol, the one before it covers it
+  CHECK(_at(st, TEXT + 0x600 + slide, "_exported_only", 0x100));
+  CHECK(_at(st, TEXT + 0x4010 + slide, "_data_var", 0));
+  // below the first symbol, past the last segment
+  CHECK(!symtab_lookup_addr(st, TEXT + 0x2ff + slide, NULL));
+  CHECK(!symtab_lookup_addr(st, TEXT + 0x8000 + slide, NULL));
+  CHECK(!symtab_lookup_addr(st, 0x1000, NULL));
+
+  CHECK(symtab_lookup_name(st, "main") == TEXT + 0x300 + slide);
+  CHECK(symtab_lookup_name(st, "_main") == TEXT + 0x300 + slide);
+  CHECK(symtab_lookup_name(st, "alias_main") == TEXT + 0x300 + slide);
+  CHECK(symtab_lookup_name(st, "helper") == TEXT + 0x400 + slide);
+  CHECK(symtab_lookup_name(st, "exported_only") == TEXT + 0x500 + slide);
+  CHECK(symtab_lookup_name(st, "data_var") == TEXT + 0x4010 + slide);
+  CHECK(symtab_lookup_name(st, "stabby") == 0);
+  CHECK(symtab_lookup_name(st, "printf") == 0);
+  CHECK(symtab_lookup_name(st, "reexp") == 0);
+  CHECK(symtab_lookup_name(st, "mai") == 0);
+}
+
+static void _check_file(void) {
+  symtab_t st;
+  if (symtab_load_file(&st, FIXTURE, 0) != 0) {
+    fprintf(stderr, "cannot load %s, run from the repo root\n", FIXTURE);
+    test_failures++;
+    return;
+  }
+  CHECK(!st.mapped);
+  _check_lookups(&st, 0);
+  symtab_free(&st);
+
+  CHECK(symtab_load_file(&st, FIXTURE, TEXT + SLIDE) == 0);
+  CHECK(st.slide == SLIDE);
+  _check_lookups(&st, SLIDE);
+  symtab_free(&st);
+
+  uint8_t uuid[16], want[16];
+  uint64_t size = 0;
+  for (int i = 0; i < 16; i++)
+    want[i] = (uint8_t)(0x10 + i);
+  CHECK(symtab_file_identity(FIXTURE, uuid, &size) == 0);
+  CHECK(memcmp(uuid, want, sizeof(want)) == 0 && size == 4304);
+  CHECK(symtab_load_file(&st, "tests/fixtures/missing", 0) != 0);
+}
+
+static void _check_buffers(void) {
+  size_t size;
+  uint8_t *data = _slurp(FIXTURE, &size);
+  if (!data) {
+    test_failures++;
+    return;
+  }
+  symtab_t st;
+
+  // a universal file with the arm64 slice at 0x1000, big endian header
+  size_t fat_size = 0x1000 + size;
+  uint8_t *fat = calloc(1, fat_size);
+  static const uint8_t head[] = {
+      0xca, 0xfe, 0xba, 0xbe, 0, 0, 0, 1,  // magic, one arch
+      0x01, 0, 0, 0x0c, 0, 0, 0, 0,        // arm64, all subtypes
+      0, 0, 0x10, 0,                       // offset
+  };
+  memcpy(fat, head, sizeof(head));
+  uint32_t be = __builtin_bswap32((uint32_t)size);
+  memcpy(fat + sizeof(head), &be, sizeof(be));
+  fat[sizeof(head) + 7] = 14; // align
+  memcpy(fat + 0x1000, data, size);
+  CHECK(symtab_load_buffer(&st, fat, fat_size, 0) == 0);
+  _check_lookups(&st, 0);
+  symtab_free(&st);
+  free(fat);
+
+  // cut short anywhere, a load fails cleanly or builds from what's left
+  for (size_t n = 0; n < size; n += 7) {
+    if (symtab_load_buffer(&st, data, n, 0) == 0)
+      symtab_free(&st);
+  }
+  // not a 64 bit mach-o
+  data[0] ^= 1;
+  CHECK(symtab_load_buffer(&st, data, size, 0) != 0);
+  free(data);
+}
+
+// the fixture as an image loaded at TEXT + SLIDE, the header page and
+// __LINKEDIT where the load commands put them, nothing else is mapped
+static uint8_t *image_file;
+static size_t image_size;
+
+static int _image_read(uint64_t addr, void *out, size_t size) {
+  uint64_t base = TEXT + SLIDE, linkedit = TEXT + 0x8000 + SLIDE;
+  uint64_t off;
+  if (addr >= base && addr + size <= base + 0x1000)
+    off = addr - base;
+  else if (addr >= linkedit && addr + size <= linkedit + image_size - 0x1000)
+    off = addr - linkedit + 0x1000;
+  else
+    return -1;
+  memcpy(out, image_file + off, size);
+  return 0;
+}
+
+static void _check_image(void) {
+  image_file = _slurp(FIXTURE, &image_size);
+  if (!image_file) {
+    test_failures++;
+    return;
+  }
+  symtab_t st;
+  CHECK(symtab_load_image(&st, _image_read, TEXT + SLIDE) == 0);
+  CHECK(st.slide == SLIDE && st.file_size == 0);
+  _check_lookups(&st, SLIDE);
+
+  // its cache entry matches on the uuid with no file size
+  char path[] = "/tmp/test_symtab.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd >= 0) {
+    close(fd);
+    symtab_t cached;
+    CHECK(symtab_save_cache(&st, path) == 0);
+    CHECK(symtab_load_cache(&cached, path, st.uuid, 0, TEXT + SLIDE) == 0);
+    _check_lookups(&cached, SLIDE);
+    symtab_free(&cached);
+    unlink(path);
+  } else {
+    test_failures++;
+  }
+  symtab_free(&st);
+
+  // nothing mapped there
+  CHECK(symtab_load_image(&st, _image_read, TEXT) != 0);
+  free(image_file);
+}
+
+// uleb128 in two bytes whatever v is, so offsets can be laid out before
+// they are known, v below 1 << 14
+static uint8_t *_uleb2(uint8_t *p, uint32_t v) {
+  *p++ = (uint8_t)(0x80 | (v & 0x7f));
+  *p++ = (uint8_t)(v >> 7);
+  return p;
+}
+
+#define WIDE 200
+#define LONG_NAME 1500
+
+// the fixture's export trie swapped for one whose root has more children
+// than fit the walk's first stack, and one name longer than its first name
+// buffer, every export has to come out
+static void _check_wide_trie(void) {
+  size_t size;
+  uint8_t *data = _slurp(FIXTURE, &size);
+  if (!data) {
+    test_failures++;
+    return;
+  }
+  // root: no terminal, WIDE + 1 edges each with a two byte child offset
+  size_t root = 2 + WIDE * (6 + 2) + (1 + LONG_NAME + 1 + 2);
+  size_t trie_size = root + (WIDE + 1) * 5;
+  uint8_t *buf = calloc(1, size + trie_size);
+  uint8_t *trie = buf + size;
+  memcpy(buf, data, size);
+
+  uint8_t *p = trie;
+  *p++ = 0;
+  *p++ = WIDE + 1;
+  uint8_t *leaf = trie + root;
+  for (uint32_t i = 0; i <= WIDE; i++) {
+    if (i < WIDE) {
+      p += sprintf((char *)p, "_w%03u", i) + 1;
+    } else {
+      *p++ = '_';
+      memset(p, 'x', LONG_NAME);
+      p += LONG_NAME + 1;
+    }
+    p = _uleb2(p, (uint32_t)(leaf - trie));
+    // terminal: regular export, address, no children
+    *leaf++ = 3;
+    *leaf++ = 0;
+    leaf = _uleb2(leaf, 0x1000 + i * 4);
+    *leaf++ = 0;
+  }
+  CHECK(p == trie + root && leaf == trie + trie_size);
+
+  // point LC_DYLD_EXPORTS_TRIE at it
+  uint32_t ncmds;
+  memcpy(&ncmds, buf + 16, sizeof(ncmds));
+  uint8_t *cmd = buf + 32;
+  bool patched = false;
+  for (uint32_t i = 0; i < ncmds; i++) {
+    uint32_t kind, cmdsize;
+    memcpy(&kind, cmd, sizeof(kind));
+    memcpy(&cmdsize, cmd + 4, sizeof(cmdsize));
+    if (kind == 0x80000033) {
+      uint32_t off = (uint32_t)size, len = (uint32_t)trie_size;
+      memcpy(cmd + 8, &off, sizeof(off));
+      memcpy(cmd + 12, &len, sizeof(len));
+      patched = true;
+    }
+    cmd += cmdsize;
+  }
+  CHECK(patched);
+
+  symtab_t st;
+  CHECK(symtab_load_buffer(&st, buf, size + trie_size, 0) == 0);
+  size_t found = 0;
+  char name[16];
+  for (uint32_t i = 0; i < WIDE; i++) {
+    snprintf(name, sizeof(name), "w%03u", i);
+    found += symtab_lookup_name(&st, name) == TEXT + 0x1000 + i * 4;
+  }
+  CHECK(found == WIDE);
+  char *long_name = malloc(LONG_NAME + 1);
+  memset(long_name, 'x', LONG_NAME);
+  long_name[LONG_NAME] = '\0';
+  CHECK(symtab_lookup_name(&st, long_name) == TEXT + 0x1000 + WIDE * 4);
+  free(long_name);
+  symtab_free(&st);
+  free(buf);
+  free(data);
+}
+
+static void _check_cache(void) {
+  char path[] = "/tmp/test_symtab.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    test_failures++;
+    return;
+  }
+  close(fd);
+
+  symtab_t built, st;
+  if (symtab_load_file(&built, FIXTURE, 0) != 0) {
+    test_failures++;
+    unlink(path);
+    return;
+  }
+  CHECK(symtab_save_cache(&built, path) == 0);
+
+  CHECK(symtab_load_cache(&st, path, built.uuid, built.file_size,
+                          TEXT + SLIDE) == 0);
+  CHECK(st.mapped);
+  _check_lookups(&st, SLIDE);
+  symtab_free(&st);
+
+  // another build of the image
+  uint8_t uuid[16];
+  memcpy(uuid, built.uuid, sizeof(uuid));
+  uuid[15] ^= 1;
+  CHECK(symtab_load_cache(&st, path, uuid, built.file_size, 0) != 0);
+  CHECK(symtab_load_cache(&st, path, built.uuid, built.file_size + 1, 0) !=
+        0);
+
+  // a damaged file, cut off and then with a bad magic
+  size_t size;
+  uint8_t *data = _slurp(path, &size);
+  FILE *f = fopen(path, "wb");
+  if (data && f) {
+    fwrite(data, 1, size - 8, f);
+    fclose(f);
+    CHECK(symtab_load_cache(&st, path, built.uuid, built.file_size, 0) != 0);
+    f = fopen(path, "wb");
+    data[0] ^= 0xff;
+    fwrite(data, 1, size, f);
+    fclose(f);
+    CHECK(symtab_load_cache(&st, path, built.uuid, built.file_size, 0) != 0);
+  } else {
+    test_failures++;
+    if (f)
+      fclose(f);
+  }
+  free(data);
+  CHECK(symtab_load_cache(&st, "/tmp/test_symtab.missing", built.uuid,
+                          built.file_size, 0) != 0);
+
+  symtab_free(&built);
+  unlink(path);
+}
+
+int main(void) {
+  _check_file();
+  _check_buffers();
+  _check_wide_trie();
+  _check_cache();
+  _check_image();
+  return test_done("symtab");
+}